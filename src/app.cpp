@@ -1,5 +1,6 @@
 #include "app.h"
 
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
 #include <iostream>
@@ -7,6 +8,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+#include "constants.h"
+
 namespace {
 static App *g_App = nullptr;
 }
@@ -15,7 +18,14 @@ constexpr uint32_t kWidth = 1920;
 constexpr uint32_t kHeight = 1080;
 constexpr double kPi = 3.14159;
 
-App::App() {
+// Radians per second the dragonfly circles the pedestal at.
+constexpr float kDragonflyOrbitSpeed = 0.3f;
+
+// Indexed by ShadowFilter.
+const char *const kShadowFilterNames[kShadowFilterCount] = {
+    "5x5 PCF", "hardware PCF, 8 Poisson taps", "EVSM"};
+
+App::App(vk::Format shadow_format) {
   g_App = this;
 
   if (!glfwInit()) {
@@ -36,8 +46,10 @@ App::App() {
 
   glfwSetScrollCallback(window_, scroll_callback);
 
+  job_system_ = std::make_unique<JobSystem>();
   device_ = std::make_unique<Device>(window_);
-  renderer_ = std::make_unique<Renderer>();
+  renderer_ =
+      std::make_unique<Renderer>(kDefaultFramesInFlight, shadow_format);
 
   LoadScene();
 }
@@ -57,6 +69,7 @@ void App::LoadScene() {
   auto brick = renderer_->AddMaterial(std::make_unique<OpaqueMaterial>(
       "../../../assets/brick_color_map.png",
       "../../../assets/brick_normal_map.png", 1.2f, 0.55f, 0.0f));
+  materials_ = {tile, blue_marble, brick};
 
   auto plane = renderer_->AddMesh("../../../assets/plane.obj");
   auto teapot = renderer_->AddMesh("../../../assets/teapot_low.obj");
@@ -64,25 +77,49 @@ void App::LoadScene() {
   auto pedestal = renderer_->AddMesh("../../../assets/pedestal.obj");
   auto dragonfly = renderer_->AddMesh("../../../assets/dragonfly.obj");
 
-  auto floor = renderer_->AddObject(plane, tile);
+  // The centerpiece never moves, so its shadows are cached.
+  ObjectHandle floor_handle = renderer_->AddObject(plane, tile);
+  ObjectHandle planet_handle = renderer_->AddObject(sphere, blue_marble);
+  ObjectHandle pedestal_handle = renderer_->AddObject(pedestal, brick);
+  for (ObjectHandle handle : {floor_handle, planet_handle, pedestal_handle}) {
+    renderer_->SetObjectStatic(handle, true);
+  }
+
+  auto floor = renderer_->object(floor_handle);
   floor->position() = glm::vec3(0.0f, -1.0f, 0.0f);
 
-  auto planet = renderer_->AddObject(sphere, blue_marble);
+  auto planet = renderer_->object(planet_handle);
   planet->scale() = glm::vec3(0.25f);
 
-  auto pedestal_object = renderer_->AddObject(pedestal, brick);
+  auto pedestal_object = renderer_->object(pedestal_handle);
   pedestal_object->scale() = glm::vec3(0.25f);
   pedestal_object->position() = glm::vec3(0.0f, -0.5f, 0.0f);
 
-  auto dragonfly_object = renderer_->AddObject(dragonfly, blue_marble);
-  dragonfly_object->position() = glm::vec3(1.5f, 1.0f, 0.0f);
-  dragonfly_object->rotation() = glm::quat(glm::vec3(0.0f, 0.0f, 0.0f));
+  // The dragonfly rides a pivot at the origin, facing it, so spinning the
+  // pivot carries it around the pedestal.
+  TransformStore &transforms = renderer_->transforms();
+  dragonfly_pivot_ = transforms.Allocate();
+  dragonfly_ = renderer_->AddObject(dragonfly, blue_marble);
+  auto dragonfly_object = renderer_->object(dragonfly_);
+  glm::vec3 dragonfly_position(1.5f, 1.0f, 0.0f);
+  dragonfly_object->position() = dragonfly_position;
+  dragonfly_object->rotation() =
+      glm::quatLookAt(-glm::normalize(dragonfly_position),
+                      glm::vec3(0.0f, 1.0f, 0.0f)) *
+      glm::quat(glm::vec3(0.0f, 3.14159f / 2.0f, 0.0f));
   dragonfly_object->scale() = glm::vec3(0.03f);
-  satellites_.push_back(dragonfly_object);
-
-  for (size_t i = 0; i < 9001; i++) {
+  renderer_->hierarchy().Attach(dragonfly_object->transform(),
+                                dragonfly_pivot_, transforms);
+
+  // Even satellites are tiled and odd ones brick.
+  constexpr size_t kSatellites = 9001;
+  std::vector<ObjectHandle> tiled =
+      renderer_->AddObjects((kSatellites + 1) / 2, teapot, tile);
+  std::vector<ObjectHandle> bricked =
+      renderer_->AddObjects(kSatellites / 2, teapot, brick);
+  for (size_t i = 0; i < kSatellites; i++) {
     auto satellite =
-        renderer_->AddObject(teapot, i % 2 == 0 ? tile : brick);
+        renderer_->object(i % 2 == 0 ? tiled[i / 2] : bricked[i / 2]);
     float r = (std::rand() & 8191) / 8191.0f;
     r = 0.3f + (6.0f * r);
     float x = glm::cos(i * 0.95f);
@@ -91,7 +128,7 @@ void App::LoadScene() {
     satellite->position() = glm::vec3(x, 0.0f, z) * r;
     satellite->rotation() = glm::vec3(0.0f, r + i, 0.0f);
 
-    satellites_.push_back(satellite);
+    satellites_.Add(renderer_->transforms(), satellite->transform());
   }
 }
 
@@ -109,10 +146,174 @@ void App::Run() {
   }
 }
 
+void App::RunDrawBenchmark(size_t mesh_count) {
+  constexpr uint32_t kFrames = 300;
+
+  // Every copy is its own Mesh, so each object lands in a bucket of its own.
+  for (size_t i = 0; i < mesh_count; i++) {
+    auto mesh = renderer_->AddMesh("../../../assets/pedestal.obj");
+    auto object = renderer_->object(
+        renderer_->AddObject(mesh, materials_[i % materials_.size()]));
+    float angle = i * 2.0f * static_cast<float>(kPi) / mesh_count;
+    object->scale() = glm::vec3(0.05f);
+    object->position() =
+        glm::vec3(glm::cos(angle), -0.75f, glm::sin(angle)) * 2.5f;
+  }
+
+  struct Path {
+    const char *name;
+    bool gpu_culling;
+    bool multi_draw_indirect;
+  };
+  const Path paths[] = {
+      {"CPU cull, draw per bucket", false, false},
+      {"CPU cull, multi-draw-indirect", false, true},
+      {"GPU cull, drawIndexedIndirect per bucket", true, false},
+      {"GPU cull, multi-draw-indirect", true, true},
+  };
+
+  std::cout << "Draw benchmark: " << mesh_count << " extra meshes, "
+            << kFrames << " frames per path" << std::endl;
+  for (const Path &path : paths) {
+    renderer_->set_gpu_culling(path.gpu_culling);
+    renderer_->set_multi_draw_indirect(path.multi_draw_indirect);
+    if (renderer_->gpu_culling() != path.gpu_culling ||
+        renderer_->multi_draw_indirect() != path.multi_draw_indirect) {
+      std::cout << "  " << path.name << ": not supported" << std::endl;
+      continue;
+    }
+
+    // Let the first frames absorb instance rebuilds and buffer growth.
+    for (uint32_t i = 0; i < kFrames / 10; i++) {
+      Render();
+      glfwPollEvents();
+    }
+
+    uint64_t draw_calls = 0;
+    double record_ms = 0.0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (uint32_t i = 0; i < kFrames; i++) {
+      Render();
+      glfwPollEvents();
+      draw_calls += renderer_->draw_calls();
+      record_ms += renderer_->draw_record_ms();
+    }
+    std::chrono::duration<double, std::milli> total =
+        std::chrono::high_resolution_clock::now() - start;
+
+    std::cout << "  " << path.name << ": " << draw_calls / kFrames
+              << " draw calls, " << record_ms / kFrames << " ms recording, "
+              << total.count() / kFrames << " ms per frame" << std::endl;
+  }
+
+  // Draw order and the depth prepass only change how much of basic.frag
+  // runs, so compare the opaque pass's fragment shader invocations and its
+  // GPU time.
+  struct Shading {
+    const char *name;
+    bool sort_draws;
+    bool depth_prepass;
+  };
+  const Shading shadings[] = {
+      {"unsorted", false, false},
+      {"front to back", true, false},
+      {"front to back, depth prepass", true, true},
+  };
+  renderer_->set_gpu_culling(false);
+  renderer_->set_multi_draw_indirect(false);
+  for (const Shading &shading : shadings) {
+    renderer_->set_sort_draws(shading.sort_draws);
+    renderer_->set_depth_prepass(shading.depth_prepass);
+    uint64_t invocations = 0;
+    double gpu_ms = 0.0;
+    // Queries lag by the frames in flight, so skip a few first.
+    for (uint32_t i = 0; i < kFrames / 10 + kFrames; i++) {
+      Render();
+      glfwPollEvents();
+      if (i >= kFrames / 10) {
+        invocations += renderer_->fragment_invocations();
+        gpu_ms += renderer_->opaque_pass_gpu_ms();
+      }
+    }
+    std::cout << "  " << shading.name << ": " << invocations / kFrames
+              << " fragment shader invocations, " << gpu_ms / kFrames
+              << " ms opaque pass on the GPU" << std::endl;
+  }
+  renderer_->set_depth_prepass(false);
+
+  // Shadow filters trade basic.frag's lookups against EVSM's prefilter, so
+  // compare both sides on the GPU.
+  for (uint32_t f = 0; f < kShadowFilterCount; f++) {
+    renderer_->set_shadow_filter(static_cast<ShadowFilter>(f));
+    double opaque_ms = 0.0;
+    double shadow_ms = 0.0;
+    for (uint32_t i = 0; i < kFrames / 10 + kFrames; i++) {
+      Render();
+      glfwPollEvents();
+      if (i >= kFrames / 10) {
+        opaque_ms += renderer_->opaque_pass_gpu_ms();
+        shadow_ms += renderer_->shadow_gpu_ms();
+      }
+    }
+    std::cout << "  " << kShadowFilterNames[f] << ": " << opaque_ms / kFrames
+              << " ms opaque pass, " << shadow_ms / kFrames
+              << " ms shadows on the GPU" << std::endl;
+  }
+  renderer_->set_shadow_filter(ShadowFilter::Pcf);
+}
+
 void App::Update(double dt) {
   elapsed_ += dt;
   if (elapsed_ >= 1.0) {
     std::cout << "FPS: " << 1.0 / dt << std::endl;
+    std::cout << "Instances rewritten: " << renderer_->instances_rewritten()
+              << std::endl;
+    if (renderer_->gpu_culling()) {
+      std::cout << "Culling on the GPU" << std::endl;
+    } else {
+      std::cout << "Visible instances: " << renderer_->visible_instances()
+                << std::endl;
+      std::cout << "Triangles: " << renderer_->triangles()
+                << (renderer_->mesh_lods() ? " (mesh LODs on)" : "")
+                << std::endl;
+    }
+    std::cout << "Fragment shader invocations: "
+              << renderer_->fragment_invocations()
+              << (renderer_->sort_draws() && !renderer_->gpu_culling()
+                      ? " (front to back)"
+                      : "")
+              << std::endl;
+    std::cout << "Opaque pass GPU time: " << renderer_->opaque_pass_gpu_ms()
+              << " ms" << (renderer_->depth_prepass() ? " (depth prepass)" : "")
+              << std::endl;
+    std::cout << "Draw calls: " << renderer_->draw_calls() << " ("
+              << renderer_->draw_record_ms() << " ms to record)"
+              << (renderer_->multi_draw_indirect() ? ", multi-draw-indirect"
+                                                   : "")
+              << std::endl;
+    std::cout << "Shadows: " << kShadowFilterNames[static_cast<uint32_t>(
+                                        renderer_->shadow_filter())]
+              << ", " << renderer_->shadow_gpu_ms() << " ms on the GPU, "
+              << renderer_->shadow_lights_drawn() << " of " << NUM_LIGHTS
+              << " lights drawn"
+              << (renderer_->shadow_fitting() ? "" : " (fitting off)")
+              << std::endl;
+    std::cout << "Shadow tiles:";
+    for (uint32_t i = 0; i < NUM_LIGHTS; i++) {
+      std::cout << " " << renderer_->shadow_tile_size(i);
+    }
+    std::cout << " of " << kShadowAtlasSize << std::endl;
+    std::cout << "Static shadow renders: "
+              << renderer_->static_shadow_renders()
+              << (renderer_->shadow_caching() ? "" : " (caching off)")
+              << std::endl;
+    std::vector<ObjectHandle> nearby;
+    renderer_->ObjectsInSphere(renderer_->object(dragonfly_)->position(), 0.5f,
+                               nearby);
+    std::cout << "Objects near the dragonfly: "
+              << std::count_if(nearby.begin(), nearby.end(),
+                               [this](ObjectHandle o) { return o != dragonfly_; })
+              << std::endl;
     std::cout << "Camera Position: x=" << renderer_->camera().position.x
               << ", y=" << renderer_->camera().position.y
               << ", z=" << renderer_->camera().position.z << std::endl;
@@ -122,27 +323,18 @@ void App::Update(double dt) {
   float dt_phys = glm::min((float)dt, 1.0f / 60);
 
   // Update satellites
-  for (int i = 0; i < satellites_.size(); i++) {
-    auto satellite = satellites_[i];
-
-    auto old_pos = satellite->position();
-    glm::vec3 velocity = glm::vec3(old_pos.z, 0.0f, -old_pos.x);
-    velocity = 0.5f * velocity / (1.0f + glm::length(velocity) * glm::length(velocity));
-
-    if (i == 0)
-      velocity *= 2.0f;
-
-    auto new_pos = old_pos + velocity * (float)dt_phys;
-    satellite->position() = new_pos;
-    if (i > 0) {
-      satellite->rotation() *= glm::quat(glm::vec3(0.0f, dt_phys * (i % 9), 0.0f));
-    } else {
-      auto q = glm::quatLookAt(-satellite->position(), glm::vec3(0.0f, 1.0f, 0.0f));
-      satellite->rotation() = q * glm::quat(glm::vec3(0.0f, 3.14159f / 2.0f, 0.0f));
-    }
-  }
-
-
+  TransformStore &transforms = renderer_->transforms();
+  glm::quat &pivot = transforms.rotation(dragonfly_pivot_);
+  pivot = glm::normalize(glm::angleAxis(kDragonflyOrbitSpeed * dt_phys,
+                                        glm::vec3(0.0f, 1.0f, 0.0f)) *
+                         pivot);
+  transforms.MarkDirty(dragonfly_pivot_);
+
+  satellites_.BeginStep(dt_phys);
+  job_system_->ParallelFor(0, satellites_.size(), kInstanceGrain,
+                           [&](size_t begin, size_t end, uint32_t) {
+                             satellites_.Step(transforms, begin, end);
+                           });
 
   double cursor_x, cursor_y;
   glfwGetCursorPos(window_, &cursor_x, &cursor_y);
@@ -154,13 +346,104 @@ void App::Update(double dt) {
                                  -delta.x * kPi / kWidth);
   }
 
+  // Right-clicking an object cycles its material.
+  bool pick_button_down =
+      glfwGetMouseButton(window_, GLFW_MOUSE_BUTTON_2) == GLFW_PRESS;
+  if (pick_button_down && !pick_button_down_) {
+    glm::vec2 ndc = 2.0f * cursor_pos / glm::vec2(kWidth, kHeight) - 1.0f;
+    ObjectHandle handle = renderer_->Pick(ndc);
+    if (Object *picked = renderer_->object(handle)) {
+      auto it = std::find(materials_.begin(), materials_.end(),
+                          picked->material());
+      size_t next = it == materials_.end() ? 0 : it - materials_.begin() + 1;
+      renderer_->SetObjectMaterial(handle,
+                                   materials_[next % materials_.size()]);
+      glm::vec3 position =
+          renderer_->transforms().position(picked->transform());
+      std::cout << "Picked object at x=" << position.x << ", y=" << position.y
+                << ", z=" << position.z << std::endl;
+    }
+  }
+  pick_button_down_ = pick_button_down;
+
+  // G toggles GPU-driven culling.
+  bool gpu_culling_key_down = glfwGetKey(window_, GLFW_KEY_G) == GLFW_PRESS;
+  if (gpu_culling_key_down && !gpu_culling_key_down_) {
+    renderer_->set_gpu_culling(!renderer_->gpu_culling());
+  }
+  gpu_culling_key_down_ = gpu_culling_key_down;
+
+  // M toggles multi-draw-indirect submission.
+  bool multi_draw_key_down = glfwGetKey(window_, GLFW_KEY_M) == GLFW_PRESS;
+  if (multi_draw_key_down && !multi_draw_key_down_) {
+    renderer_->set_multi_draw_indirect(!renderer_->multi_draw_indirect());
+  }
+  multi_draw_key_down_ = multi_draw_key_down;
+
+  // L toggles mesh LODs.
+  bool lod_key_down = glfwGetKey(window_, GLFW_KEY_L) == GLFW_PRESS;
+  if (lod_key_down && !lod_key_down_) {
+    renderer_->set_mesh_lods(!renderer_->mesh_lods());
+  }
+  lod_key_down_ = lod_key_down;
+
+  // I switches between TRS and matrix instance uploads.
+  bool instance_key_down = glfwGetKey(window_, GLFW_KEY_I) == GLFW_PRESS;
+  if (instance_key_down && !instance_key_down_) {
+    renderer_->set_instance_format(
+        renderer_->instance_format() == InstanceFormat::Trs
+            ? InstanceFormat::Matrices
+            : InstanceFormat::Trs);
+  }
+  instance_key_down_ = instance_key_down;
+
+  // F toggles front-to-back draw sorting.
+  bool sort_key_down = glfwGetKey(window_, GLFW_KEY_F) == GLFW_PRESS;
+  if (sort_key_down && !sort_key_down_) {
+    renderer_->set_sort_draws(!renderer_->sort_draws());
+  }
+  sort_key_down_ = sort_key_down;
+
+  // P toggles the depth prepass.
+  bool prepass_key_down = glfwGetKey(window_, GLFW_KEY_P) == GLFW_PRESS;
+  if (prepass_key_down && !prepass_key_down_) {
+    renderer_->set_depth_prepass(!renderer_->depth_prepass());
+  }
+  prepass_key_down_ = prepass_key_down;
+
+  // C toggles static shadow caching.
+  bool shadow_cache_key_down = glfwGetKey(window_, GLFW_KEY_C) == GLFW_PRESS;
+  if (shadow_cache_key_down && !shadow_cache_key_down_) {
+    renderer_->set_shadow_caching(!renderer_->shadow_caching());
+  }
+  shadow_cache_key_down_ = shadow_cache_key_down;
+
+  // V cycles through the shadow filters.
+  bool shadow_filter_key_down = glfwGetKey(window_, GLFW_KEY_V) == GLFW_PRESS;
+  if (shadow_filter_key_down && !shadow_filter_key_down_) {
+    renderer_->set_shadow_filter(static_cast<ShadowFilter>(
+        (static_cast<uint32_t>(renderer_->shadow_filter()) + 1) %
+        kShadowFilterCount));
+  }
+  shadow_filter_key_down_ = shadow_filter_key_down;
+
+  // T toggles fitting the shadow frusta to the view.
+  bool shadow_fit_key_down = glfwGetKey(window_, GLFW_KEY_T) == GLFW_PRESS;
+  if (shadow_fit_key_down && !shadow_fit_key_down_) {
+    renderer_->set_shadow_fitting(!renderer_->shadow_fitting());
+  }
+  shadow_fit_key_down_ = shadow_fit_key_down;
+
   renderer_->camera().position *= 1.0f + (scroll_offset_ * 0.1f);
   scroll_offset_ = 0.0;
 
   previous_cursor_pos_ = cursor_pos;
 }
 
-void App::Render() { renderer_->Render(); }
+void App::Render() {
+  renderer_->Render();
+  job_system_->ResetScratch();
+}
 
 void App::scroll_callback(GLFWwindow *window, double xoffset, double yoffset) {
   g_App->scroll_offset_ += yoffset;
@@ -8,15 +8,27 @@
 #include <glm/glm.hpp>
 
 #include "device.h"
+#include "job_system.h"
 #include "renderer.h"
+#include "satellites.h"
 
 class App {
 public:
-    App();
+    // shadow_format is passed on to the Renderer.
+    explicit App(vk::Format shadow_format = vk::Format::eD32Sfloat);
     ~App();
 
     void Run();
 
+    // Adds mesh_count single-object buckets to the scene, then renders a
+    // fixed number of frames with each draw submission path and prints the
+    // draw calls and CPU record time per frame of each. Then compares the
+    // opaque pass's fragment shader invocations and GPU time unsorted,
+    // sorted front to back, and with the depth prepass. Last, compares the
+    // GPU time of the opaque pass and of the shadow work with each shadow
+    // filter.
+    void RunDrawBenchmark(size_t mesh_count);
+
 private:
     void LoadScene();
 
@@ -25,14 +37,31 @@ private:
 
     static void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 
+    std::unique_ptr<JobSystem> job_system_;
     std::unique_ptr<Device> device_;
     std::unique_ptr<Renderer> renderer_;
 
-    std::vector<Object*> satellites_;
+    std::vector<Material*> materials_;
+    ObjectHandle dragonfly_;
+    // Transform the dragonfly is attached to. It has no object of its own.
+    uint32_t dragonfly_pivot_ = 0;
+    // The orbiting teapots. Spin speeds start at 1 since the dragonfly used
+    // to be satellite 0.
+    SatelliteIntegrator satellites_{1};
 
     double elapsed_ = 0.0;
     glm::vec2 previous_cursor_pos_ = glm::vec2(0.0f);
     double scroll_offset_ = 0.0;
+    bool gpu_culling_key_down_ = false;
+    bool multi_draw_key_down_ = false;
+    bool lod_key_down_ = false;
+    bool instance_key_down_ = false;
+    bool sort_key_down_ = false;
+    bool prepass_key_down_ = false;
+    bool shadow_cache_key_down_ = false;
+    bool shadow_filter_key_down_ = false;
+    bool shadow_fit_key_down_ = false;
+    bool pick_button_down_ = false;
     GLFWwindow* window_ = nullptr;
 };
 
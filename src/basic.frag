@@ -7,6 +7,8 @@ struct Light {
     vec4 direction_angle;
     vec3 intensity;
     vec3 position;
+    vec2 shadow_range;
+    vec4 shadow_tile;
 };
 
 layout (set=0, binding=0) uniform Scene {
@@ -14,8 +16,23 @@ layout (set=0, binding=0) uniform Scene {
     Light lights[NUM_LIGHTS];
 } scene;
 layout (set=0, binding=1) uniform sampler2D environment_map;
-layout (set=0, binding=2) uniform sampler2D shadow_maps[NUM_LIGHTS];
+// One tile per light, all in a single atlas.
+layout (set=0, binding=2) uniform sampler2D shadow_maps;
 layout (set=0, binding=3) uniform sampler2D irradiance_map;
+// The same atlas through a comparison sampler, and the lights' EVSM moments,
+// one layer each.
+layout (set=0, binding=7) uniform sampler2DShadow shadow_compare;
+layout (set=0, binding=8) uniform sampler2DArray shadow_moments;
+
+// How shadows are filtered; mirrors ShadowFilter.
+layout(constant_id = 3) const uint SHADOW_FILTER = 0;
+#define SHADOW_FILTER_HARDWARE 1
+#define SHADOW_FILTER_EVSM 2
+
+// Mirror kShadowNear, kShadowFar and kEvsmExponent.
+#define SHADOW_NEAR 0.5
+#define SHADOW_FAR 10.0
+#define EVSM_EXPONENT 5.54
 
 layout (set=1, binding=0) uniform Material {
     float ior;
@@ -32,6 +49,7 @@ layout(location = 3) in mat3 in_tan2world;
 
 layout(location = 0) out vec4 outColor;
 
+// Mirrors kSpotSmoothing.
 const float kSmoothing = 0.1;
 
 #define PI 3.14159265358979323846
@@ -109,6 +127,102 @@ float CookTorrance(vec3 N, vec3 H, vec3 V, vec3 L) {
     return (D * F * G) / (PI * v_dot_n * l_dot_n);
 }
 
+const float kShadowBias = 0.00025;
+
+// kShadowBias is in depth units of the full SHADOW_NEAR to SHADOW_FAR range.
+// Depth spans fewer units per distance as a light's fitted range narrows,
+// so this scales it to cover the same distance in range's depth.
+float ShadowBias(vec2 range) {
+    float full = SHADOW_FAR * SHADOW_NEAR / (SHADOW_FAR - SHADOW_NEAR);
+    float fitted = range.y * range.x / (range.y - range.x);
+    return kShadowBias * fitted / full;
+}
+
+// A light's shadow map position to where it lands in the atlas.
+vec2 AtlasUv(vec3 shadow_map_pos, vec4 tile) {
+    return tile.xy + (shadow_map_pos.xy + 1.0) * 0.5 * tile.zw;
+}
+
+// Holds a filter tap half a texel inside the tile, so it never reads a
+// neighbor's depth.
+vec2 ClampToTile(vec2 uv, vec4 tile, vec2 texel) {
+    return clamp(uv, tile.xy + 0.5 * texel, tile.xy + tile.zw - 0.5 * texel);
+}
+
+// 5x5 nearest taps half a texel apart, compared one by one.
+float PcfVisibility(vec3 shadow_map_pos, vec4 tile, float bias) {
+    vec2 texel = 1.0 / vec2(textureSize(shadow_maps, 0));
+    float visibility = 0.0;
+    vec2 shadow_map_uv = AtlasUv(shadow_map_pos, tile);
+    for (int j = -2; j <= 2; j++) {
+        for (int k = -2; k <= 2; k++) {
+            vec2 uv = ClampToTile(shadow_map_uv + 0.5 * vec2(j, k) * texel, tile, texel);
+            float depth = texture(shadow_maps, uv).x + bias;
+            if (depth > shadow_map_pos.z) {
+                visibility += 1.0;
+            }
+        }
+    }
+    return visibility / 25.0;
+}
+
+// A Poisson disk of radius 1, in texels scaled by kPoissonRadius.
+const vec2 kPoisson[8] = vec2[](
+    vec2(-0.613392, 0.617481), vec2(0.170019, -0.040254),
+    vec2(-0.299417, 0.791925), vec2(0.645680, 0.493210),
+    vec2(-0.651784, 0.717887), vec2(0.421003, 0.027070),
+    vec2(-0.817194, -0.271096), vec2(0.977050, -0.108615));
+const float kPoissonRadius = 1.5;
+
+// Each tap is a bilinear 2x2 compare in the sampler.
+float HardwareVisibility(vec3 shadow_map_pos, vec4 tile, float bias) {
+    vec2 shadow_map_uv = AtlasUv(shadow_map_pos, tile);
+    vec2 texel = 1.0 / vec2(textureSize(shadow_compare, 0));
+    float visibility = 0.0;
+    for (int j = 0; j < 8; j++) {
+        vec2 uv = ClampToTile(shadow_map_uv + kPoissonRadius * kPoisson[j] * texel,
+                              tile, texel);
+        visibility += texture(shadow_compare, vec3(uv, shadow_map_pos.z - bias));
+    }
+    return visibility / 8.0;
+}
+
+// Matches evsm_blur.comp.
+float LinearShadowDepth(float depth, vec2 range) {
+    float n = range.x, f = range.y;
+    float d = f * n / (f - depth * (f - n));
+    return clamp((d - n) / (f - n), 0.0, 1.0);
+}
+
+// Upper bound on the fraction of the filter region at least mean away.
+// Cutting off its low end trades softness for less light bleeding.
+float Chebyshev(vec2 moments, float mean, float min_variance) {
+    const float kBleedReduction = 0.2;
+    if (mean <= moments.x) {
+        return 1.0;
+    }
+    float variance = max(moments.y - moments.x * moments.x, min_variance);
+    float d = mean - moments.x;
+    float p_max = variance / (variance + d * d);
+    return clamp((p_max - kBleedReduction) / (1.0 - kBleedReduction), 0.0, 1.0);
+}
+
+// One trilinear fetch of the prefiltered moments, whose layer covers the
+// light's whole tile.
+float EvsmVisibility(vec3 shadow_map_pos, int layer, vec2 range) {
+    vec2 shadow_map_uv = (shadow_map_pos.xy + 1.0) * 0.5;
+    vec4 moments = texture(shadow_moments, vec3(shadow_map_uv, layer));
+    float d = 2.0 * LinearShadowDepth(shadow_map_pos.z, range) - 1.0;
+    float positive = exp(EVSM_EXPONENT * d);
+    float negative = -exp(-EVSM_EXPONENT * d);
+    // The variance floor, scaled by each warp's slope.
+    const float kDepthEpsilon = 0.0001;
+    float positive_epsilon = kDepthEpsilon * EVSM_EXPONENT * positive;
+    float negative_epsilon = kDepthEpsilon * EVSM_EXPONENT * negative;
+    return min(Chebyshev(moments.xy, positive, positive_epsilon * positive_epsilon),
+               Chebyshev(moments.zw, negative, negative_epsilon * negative_epsilon));
+}
+
 vec3 BRDF(vec3 L, vec3 V, vec3 N, vec3 R, vec3 diffuse_color, vec3 specular_color) {
     vec3 H = normalize(V + L);
 
@@ -162,21 +276,22 @@ void main() {
         intensity *= spot_attenuation * distance_attenuation;
 
         // Shadow visibility calculation
-        const float pcf_step_size = 2048;
-        float visibility = 0.0;
         vec4 light_space_ndc = scene.lights[i].world2light * vec4(in_position, 1.0);
         vec3 shadow_map_pos = light_space_ndc.xyz / light_space_ndc.w;
-        vec2 shadow_map_uv = (shadow_map_pos.xy + 1.0) * 0.5;
-        for (int j = -2; j <= 2; j++) {
-            for (int k = -2; k <= 2; k++) {
-                vec2 offset = vec2(j,k) / pcf_step_size;
-                float depth = texture(shadow_maps[i], shadow_map_uv + offset).x + 0.0005;
-                if (depth > shadow_map_pos.z) {
-                    visibility += 1.0;
-                }
-            }
+        vec2 shadow_range = scene.lights[i].shadow_range;
+        vec4 shadow_tile = scene.lights[i].shadow_tile;
+        // Nothing outside the light's frustum is in its shadow, and nothing
+        // at all while it has no tile.
+        float visibility;
+        if (shadow_tile.z <= 0.0 || any(greaterThan(abs(shadow_map_pos.xy), vec2(1.0)))) {
+            visibility = 1.0;
+        } else if (SHADOW_FILTER == SHADOW_FILTER_EVSM) {
+            visibility = EvsmVisibility(shadow_map_pos, i, shadow_range);
+        } else if (SHADOW_FILTER == SHADOW_FILTER_HARDWARE) {
+            visibility = HardwareVisibility(shadow_map_pos, shadow_tile, ShadowBias(shadow_range));
+        } else {
+            visibility = PcfVisibility(shadow_map_pos, shadow_tile, ShadowBias(shadow_range));
         }
-        visibility = visibility / 25.0;
 
         vec3 L = normalize(light_pos - in_position);
         radiance += visibility * intensity * BRDF(L, V, N, R, diffuse_color, specular_color);
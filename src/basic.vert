@@ -7,6 +7,8 @@ struct Light {
     vec4 direction_angle;
     vec3 intensity;
     vec3 position;
+    vec2 shadow_range;
+    vec4 shadow_tile;
 };
 
 layout (set=0, binding=0) uniform Scene {
@@ -19,30 +21,144 @@ layout(push_constant) uniform View {
     mat4 view_proj;
 } view;
 
-// Vertex data
+// How vertices are encoded; mirrors VertexFormat.
+layout(constant_id = 0) const uint VERTEX_FORMAT = 0;
+#define VERTEX_FORMAT_COMPACT 1
+
+// Vertex data. Compact vertices store the position as unorm16 within the
+// mesh bounds, normal and tangent as octahedral snorm16 pairs in xy, and the
+// texcoord as half floats.
 layout(location = 0) in vec3 in_position;
 layout(location = 1) in vec3 in_normal;
 layout(location = 2) in vec3 in_tangent;
 layout(location = 3) in vec2 in_texcoord;
 
-// Instance data
-layout(location = 4) in mat4 in_obj2world;
-layout(location = 8) in mat3 in_obj2world_normal;
+// Instance data, fetched by the instance-rate id of each visible instance.
+// InstanceData is a tightly packed mat4 + mat3, i.e. 25 floats; InstanceTrs
+// is a position, scale and rotation quaternion, i.e. 10 floats.
+layout(constant_id = 1) const uint INSTANCE_FORMAT = 0;
+#define INSTANCE_FORMAT_TRS 1
+#define INSTANCE_FLOATS 25
+#define INSTANCE_TRS_FLOATS 10
+
+layout(std430, set=0, binding=4) readonly buffer Instances {
+    float instances[];
+};
+
+layout(location = 4) in uint in_instance;
+
+// Each instance's bucket, and the box each bucket's mesh is quantized to.
+struct PositionQuantization {
+    vec4 offset;
+    vec4 scale;
+};
+
+layout(std430, set=0, binding=5) readonly buffer InstanceBuckets {
+    uint instance_buckets[];
+};
+
+layout(std430, set=0, binding=6) readonly buffer BucketQuantization {
+    PositionQuantization quantization[];
+};
+
+vec3 DecodePosition() {
+    if (VERTEX_FORMAT != VERTEX_FORMAT_COMPACT) {
+        return in_position;
+    }
+    PositionQuantization q = quantization[instance_buckets[in_instance]];
+    return q.offset.xyz + q.scale.xyz * in_position;
+}
+
+vec3 DecodeDirection(vec3 v) {
+    if (VERTEX_FORMAT != VERTEX_FORMAT_COMPACT) {
+        return v;
+    }
+    vec3 n = vec3(v.xy, 1.0 - abs(v.x) - abs(v.y));
+    float t = max(-n.z, 0.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+mat4 InstanceObj2World(uint base) {
+    return mat4(
+        instances[base + 0], instances[base + 1], instances[base + 2], instances[base + 3],
+        instances[base + 4], instances[base + 5], instances[base + 6], instances[base + 7],
+        instances[base + 8], instances[base + 9], instances[base + 10], instances[base + 11],
+        instances[base + 12], instances[base + 13], instances[base + 14], instances[base + 15]);
+}
+
+mat3 InstanceObj2WorldNormal(uint base) {
+    return mat3(
+        instances[base + 16], instances[base + 17], instances[base + 18],
+        instances[base + 19], instances[base + 20], instances[base + 21],
+        instances[base + 22], instances[base + 23], instances[base + 24]);
+}
+
+// Rotation matrix of a unit quaternion (x, y, z, w).
+mat3 QuatToMat3(vec4 q) {
+    float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+    return mat3(
+        1.0 - 2.0 * (yy + zz), 2.0 * (xy + wz), 2.0 * (xz - wy),
+        2.0 * (xy - wz), 1.0 - 2.0 * (xx + zz), 2.0 * (yz + wx),
+        2.0 * (xz + wy), 2.0 * (yz - wx), 1.0 - 2.0 * (xx + yy));
+}
+
+// Columns of R * S, and the translation, of an InstanceTrs.
+void InstanceTrsColumns(uint base, out mat3 rotation_scale, out vec3 scale,
+                        out vec3 translation) {
+    translation = vec3(instances[base + 0], instances[base + 1], instances[base + 2]);
+    scale = vec3(instances[base + 3], instances[base + 4], instances[base + 5]);
+    vec4 q = vec4(instances[base + 6], instances[base + 7], instances[base + 8], instances[base + 9]);
+    mat3 r = QuatToMat3(q);
+    rotation_scale = mat3(r[0] * scale.x, r[1] * scale.y, r[2] * scale.z);
+}
+
+void LoadInstance(uint id, out mat4 obj2world, out mat3 obj2world_normal) {
+    if (INSTANCE_FORMAT == INSTANCE_FORMAT_TRS) {
+        mat3 rotation_scale;
+        vec3 scale, translation;
+        InstanceTrsColumns(id * INSTANCE_TRS_FLOATS, rotation_scale, scale,
+                           translation);
+        obj2world = mat4(vec4(rotation_scale[0], 0.0),
+                         vec4(rotation_scale[1], 0.0),
+                         vec4(rotation_scale[2], 0.0), vec4(translation, 1.0));
+        // R * S^-1, the inverse-transpose of R * S.
+        vec3 inverse_scale_squared = 1.0 / (scale * scale);
+        obj2world_normal = mat3(rotation_scale[0] * inverse_scale_squared.x,
+                                rotation_scale[1] * inverse_scale_squared.y,
+                                rotation_scale[2] * inverse_scale_squared.z);
+        return;
+    }
+    uint base = id * INSTANCE_FLOATS;
+    obj2world = InstanceObj2World(base);
+    obj2world_normal = InstanceObj2WorldNormal(base);
+}
 
 layout(location = 0) out vec3 out_position;
 layout(location = 1) out vec3 out_normal;
 layout(location = 2) out vec2 out_texcoord;
 layout(location = 3) out mat3 out_tan2world;
 
+// The depth prepass draws with shadow.vert and the shaded pass then tests
+// for equal depth, so both must compute gl_Position identically.
+invariant gl_Position;
+
 void main() {
-    vec4 world_position = in_obj2world * vec4(in_position, 1.0);
+    mat4 obj2world;
+    mat3 obj2world_normal;
+    LoadInstance(in_instance, obj2world, obj2world_normal);
+
+    vec4 world_position = obj2world * vec4(DecodePosition(), 1.0);
     
     gl_Position = view.view_proj * world_position;
     out_position = world_position.xyz;
-    out_normal = in_obj2world_normal * in_normal;
+    out_normal = obj2world_normal * DecodeDirection(in_normal);
     out_texcoord = in_texcoord;
 
-    vec3 tangent = normalize(in_obj2world_normal * in_tangent);
+    vec3 tangent = normalize(obj2world_normal * DecodeDirection(in_tangent));
     vec3 bitangent = normalize(cross(out_normal, tangent));
     vec3 normal = normalize(cross(tangent, bitangent));
     out_tan2world = mat3(tangent, bitangent, normal);
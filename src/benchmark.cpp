@@ -0,0 +1,485 @@
+#include "benchmark.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "bvh.h"
+#include "constants.h"
+#include "culling.h"
+#include "draw_sort.h"
+#include "job_system.h"
+#include "mesh.h"
+#include "mesh_optimizer.h"
+#include "satellites.h"
+#include "structures.h"
+#include "transform_hierarchy.h"
+#include "transform_store.h"
+
+namespace {
+
+constexpr int kWarmupFrames = 10;
+constexpr int kFrames = 200;
+
+struct FrameTimes {
+  double update_ms;
+  double compose_ms;
+  // Gathering the same dirty transforms as TRS instead.
+  double trs_ms;
+};
+
+FrameTimes TimeFrames(TransformStore &transforms,
+                      SatelliteIntegrator &satellites,
+                      std::vector<InstanceData> &instances,
+                      std::vector<InstanceTrs> &instance_trs) {
+  using Clock = std::chrono::high_resolution_clock;
+  JobSystem *jobs = JobSystem::Get();
+  std::chrono::duration<double, std::milli> update(0.0), compose(0.0),
+      trs(0.0);
+
+  for (int frame = 0; frame < kWarmupFrames + kFrames; frame++) {
+    auto start = Clock::now();
+    satellites.BeginStep(1.0f / 60);
+    jobs->ParallelFor(0, satellites.size(), kInstanceGrain,
+                      [&](size_t begin, size_t end, uint32_t) {
+                        satellites.Step(transforms, begin, end);
+                      });
+    auto updated = Clock::now();
+
+    const uint32_t *dirty = transforms.dirty_handles();
+    jobs->ParallelFor(0, transforms.dirty_count(), kInstanceGrain,
+                      [&](size_t begin, size_t end, uint32_t) {
+                        ComposeInstanceData(transforms, dirty + begin,
+                                            end - begin,
+                                            instances.data() + begin);
+                      });
+    auto composed = Clock::now();
+    jobs->ParallelFor(0, transforms.dirty_count(), kInstanceGrain,
+                      [&](size_t begin, size_t end, uint32_t) {
+                        GatherInstanceTrs(transforms, dirty + begin,
+                                          end - begin,
+                                          instance_trs.data() + begin);
+                      });
+    transforms.ClearDirty();
+    auto gathered = Clock::now();
+
+    if (frame >= kWarmupFrames) {
+      update += updated - start;
+      compose += composed - updated;
+      trs += gathered - composed;
+    }
+  }
+  return {update.count() / kFrames, compose.count() / kFrames,
+          trs.count() / kFrames};
+}
+
+void AddSatellites(TransformStore &transforms, SatelliteIntegrator &satellites,
+                   size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    uint32_t handle = transforms.Allocate();
+    float r = 0.3f + 6.0f * ((std::rand() & 8191) / 8191.0f);
+    transforms.scale(handle) = glm::vec3(0.04f);
+    transforms.position(handle) =
+        glm::vec3(glm::cos(i * 0.95f), 0.0f, glm::sin(i * 0.95f)) * r;
+    transforms.rotation(handle) = glm::quat(glm::vec3(0.0f, r + i, 0.0f));
+    satellites.Add(transforms, handle);
+  }
+  transforms.ClearDirty();
+}
+
+} // namespace
+
+void RunJobBenchmark(size_t satellite_count) {
+  TransformStore transforms;
+  SatelliteIntegrator satellites;
+  AddSatellites(transforms, satellites, satellite_count);
+  std::vector<InstanceData> instances(satellite_count);
+  std::vector<InstanceTrs> instance_trs(satellite_count);
+
+  uint32_t max_workers = std::max(1u, std::thread::hardware_concurrency());
+  std::cout << satellite_count << " satellites, " << kFrames << " frames"
+            << std::endl;
+  std::cout << "upload per frame: matrices="
+            << InstanceSize(InstanceFormat::Matrices) * satellite_count
+            << "B trs=" << InstanceSize(InstanceFormat::Trs) * satellite_count
+            << "B" << std::endl;
+
+  std::vector<uint32_t> worker_counts;
+  for (uint32_t workers = 1; workers < max_workers; workers *= 2) {
+    worker_counts.push_back(workers);
+  }
+  worker_counts.push_back(max_workers);
+
+  double baseline = 0.0;
+  for (uint32_t workers : worker_counts) {
+    JobSystem jobs(workers);
+    FrameTimes times =
+        TimeFrames(transforms, satellites, instances, instance_trs);
+    double total = times.update_ms + times.compose_ms;
+    if (workers == 1) {
+      baseline = total;
+    }
+    std::cout << "workers=" << workers << " update=" << times.update_ms
+              << "ms compose=" << times.compose_ms << "ms total=" << total
+              << "ms speedup=" << baseline / total << "x trs=" << times.trs_ms
+              << "ms" << std::endl;
+  }
+}
+
+void RunBvhBenchmark(size_t max_satellites) {
+  using Clock = std::chrono::high_resolution_clock;
+  using Ms = std::chrono::duration<double, std::milli>;
+  JobSystem jobs;
+
+  // A camera looking at part of the ring, plus three wide views standing in
+  // for the lights.
+  const glm::vec3 up(0.0f, 1.0f, 0.0f);
+  glm::mat4 light_proj =
+      glm::perspective(glm::radians(90.0f), 1.0f, 0.2f, 100.0f);
+  glm::mat4 camera_proj =
+      glm::perspective(glm::radians(30.0f), 16.0f / 9, 0.2f, 100.0f);
+  Frustum views[4] = {
+      ExtractFrustum(light_proj *
+                     glm::lookAt(glm::vec3(-3, 3, -3), glm::vec3(0), up)),
+      ExtractFrustum(light_proj *
+                     glm::lookAt(glm::vec3(-3, 3, 3), glm::vec3(0), up)),
+      ExtractFrustum(light_proj *
+                     glm::lookAt(glm::vec3(3, 1.5f, 3), glm::vec3(0), up)),
+      ExtractFrustum(camera_proj * glm::lookAt(glm::vec3(0, 2, -8),
+                                               glm::vec3(3, 0, 0), up)),
+  };
+  // Roughly the teapot's object-space box and sphere.
+  const Aabb local_box = {glm::vec3(-1.5f, 0.0f, -1.0f),
+                          glm::vec3(1.7f, 1.6f, 1.0f)};
+  const glm::vec4 local_sphere(0.1f, 0.8f, 0.0f, 1.8f);
+
+  std::cout << kFrames << " frames, " << jobs.worker_count() << " workers"
+            << std::endl;
+  for (size_t count = 1000; count <= max_satellites; count *= 10) {
+    TransformStore transforms;
+    SatelliteIntegrator satellites;
+    AddSatellites(transforms, satellites, count);
+
+    Bvh bvh;
+    std::vector<uint32_t> handles(count), proxies(count);
+    std::vector<glm::vec4> spheres(count, local_sphere);
+    for (uint32_t h = 0; h < count; h++) {
+      handles[h] = h;
+      proxies[h] = bvh.Insert(TransformAabb(local_box, transforms.position(h),
+                                            transforms.rotation(h),
+                                            transforms.scale(h)),
+                              h);
+    }
+    auto rebuild_start = Clock::now();
+    bvh.Rebuild();
+    Ms rebuild = Clock::now() - rebuild_start;
+
+    std::vector<uint8_t> masks(count);
+    Ms refit(0.0), flat(0.0), tree(0.0);
+    size_t visible = 0;
+    for (int frame = 0; frame < kWarmupFrames + kFrames; frame++) {
+      satellites.BeginStep(1.0f / 60);
+      jobs.ParallelFor(0, satellites.size(), kInstanceGrain,
+                       [&](size_t begin, size_t end, uint32_t) {
+                         satellites.Step(transforms, begin, end);
+                       });
+
+      auto start = Clock::now();
+      const uint32_t *dirty = transforms.dirty_handles();
+      size_t dirty_count = transforms.dirty_count();
+      jobs.ParallelFor(0, dirty_count, kInstanceGrain,
+                       [&](size_t begin, size_t end, uint32_t) {
+                         for (size_t i = begin; i < end; i++) {
+                           uint32_t h = dirty[i];
+                           bvh.SetBounds(proxies[h],
+                                         TransformAabb(local_box,
+                                                       transforms.position(h),
+                                                       transforms.rotation(h),
+                                                       transforms.scale(h)));
+                         }
+                       });
+      for (size_t i = 0; i < dirty_count; i++) {
+        handles[i] = proxies[dirty[i]];
+      }
+      bvh.Refit(handles.data(), dirty_count);
+      transforms.ClearDirty();
+      if (frame % kBvhRebuildInterval == 0) {
+        bvh.Rebuild();
+      }
+      auto refitted = Clock::now();
+
+      jobs.ParallelFor(0, count, kInstanceGrain,
+                       [&](size_t begin, size_t end, uint32_t) {
+                         std::vector<uint32_t> range(end - begin);
+                         for (size_t i = begin; i < end; i++) {
+                           range[i - begin] = static_cast<uint32_t>(i);
+                         }
+                         CullSpheres(transforms, range.data(),
+                                     spheres.data() + begin, end - begin,
+                                     views, 4, masks.data() + begin);
+                       });
+      auto flat_done = Clock::now();
+
+      std::atomic<size_t> camera_visible{0};
+      bvh.QueryFrustums(views, 4, [&](uint32_t, uint8_t mask) {
+        if (mask & 8) {
+          camera_visible.fetch_add(1, std::memory_order_relaxed);
+        }
+      });
+      auto tree_done = Clock::now();
+
+      if (frame >= kWarmupFrames) {
+        refit += refitted - start;
+        flat += flat_done - refitted;
+        tree += tree_done - flat_done;
+        visible = camera_visible;
+      }
+    }
+
+    // Picking rays from the camera into the ring, through the tree and
+    // against every box.
+    constexpr int kRays = 1000;
+    const glm::vec3 eye(0.0f, 2.0f, -8.0f);
+    std::vector<glm::vec3> directions(kRays);
+    for (glm::vec3 &direction : directions) {
+      float r = 6.3f * ((std::rand() & 8191) / 8191.0f);
+      float a = 6.2832f * ((std::rand() & 8191) / 8191.0f);
+      direction = glm::normalize(glm::vec3(r * glm::cos(a), 0.0f,
+                                           r * glm::sin(a)) - eye);
+    }
+    auto rays_start = Clock::now();
+    size_t hits = 0;
+    for (const glm::vec3 &direction : directions) {
+      uint32_t hit;
+      float t;
+      hits += bvh.Raycast(eye, direction, 100.0f, &hit, &t);
+    }
+    auto tree_rays = Clock::now();
+    size_t flat_hits = 0;
+    for (const glm::vec3 &direction : directions) {
+      glm::vec3 inv = 1.0f / direction;
+      float best = 100.0f;
+      bool hit = false;
+      for (uint32_t proxy : proxies) {
+        const Aabb &box = bvh.bounds(proxy);
+        glm::vec3 t0 = (box.min - eye) * inv, t1 = (box.max - eye) * inv;
+        glm::vec3 near = glm::min(t0, t1), far = glm::max(t0, t1);
+        float enter = std::max({near.x, near.y, near.z, 0.0f});
+        float exit = std::min({far.x, far.y, far.z, best});
+        if (enter <= exit) {
+          best = enter;
+          hit = true;
+        }
+      }
+      flat_hits += hit;
+    }
+    auto flat_rays = Clock::now();
+    Ms tree_ray = tree_rays - rays_start, flat_ray = flat_rays - tree_rays;
+
+    std::cout << "satellites=" << count << " rebuild=" << rebuild.count()
+              << "ms refit=" << refit.count() / kFrames
+              << "ms flat_cull=" << flat.count() / kFrames
+              << "ms bvh_cull=" << tree.count() / kFrames
+              << "ms camera_visible=" << visible
+              << " flat_ray=" << 1000.0 * flat_ray.count() / kRays
+              << "us bvh_ray=" << 1000.0 * tree_ray.count() / kRays
+              << "us hits=" << hits << "/" << flat_hits << std::endl;
+  }
+}
+
+void RunMeshBenchmark() {
+  const char *const kMeshes[] = {"dragonfly", "monkey", "pedestal", "plane",
+                                 "sphere",    "teapot", "teapot_low"};
+
+  std::cout << "ACMR with a " << kVertexCacheSize
+            << "-entry FIFO cache; memory is vertices plus indices"
+            << std::endl;
+  for (const char *name : kMeshes) {
+    std::vector<Vertex> soup =
+        LoadMeshVertices(std::string("../../../assets/") + name + ".obj");
+    size_t soup_bytes = sizeof(Vertex) * soup.size();
+
+    IndexedMesh mesh = DeduplicateVertices(soup.data(), soup.size());
+    float deduplicated_acmr = ComputeAcmr(
+        mesh.indices.data(), mesh.indices.size(), mesh.vertices.size());
+    OptimizeVertexCache(mesh.indices.data(), mesh.indices.size(),
+                        mesh.vertices.size());
+    float cache_acmr = ComputeAcmr(mesh.indices.data(), mesh.indices.size(),
+                                   mesh.vertices.size());
+    OptimizeMesh(mesh);
+    float optimized_acmr = ComputeAcmr(
+        mesh.indices.data(), mesh.indices.size(), mesh.vertices.size());
+    size_t indexed_bytes = sizeof(Vertex) * mesh.vertices.size() +
+                           sizeof(uint32_t) * mesh.indices.size();
+
+    std::cout << name << ": triangles=" << soup.size() / 3
+              << " vertices=" << soup.size() << "->" << mesh.vertices.size()
+              << " memory=" << soup_bytes << "->" << indexed_bytes
+              << "B acmr=3->" << deduplicated_acmr << " (deduplicated)->"
+              << cache_acmr << " (vertex cache)->" << optimized_acmr
+              << " (overdraw, fetch)" << std::endl;
+
+    // Every cache miss fetches one whole vertex, so fetch bytes scale with
+    // the stride.
+    glm::vec3 aabb_min = mesh.vertices[0].position;
+    glm::vec3 aabb_max = aabb_min;
+    for (const Vertex &vertex : mesh.vertices) {
+      aabb_min = glm::min(aabb_min, vertex.position);
+      aabb_max = glm::max(aabb_max, vertex.position);
+    }
+    PositionQuantization quantization = {glm::vec4(aabb_min, 0.0f),
+                                         glm::vec4(aabb_max - aabb_min, 0.0f)};
+    float position_error = 0.0f;
+    float normal_error = 0.0f;
+    float texcoord_error = 0.0f;
+    for (const Vertex &vertex : mesh.vertices) {
+      Vertex decoded = DecompressVertex(CompressVertex(vertex, quantization),
+                                        quantization);
+      position_error = std::max(
+          position_error, glm::length(decoded.position - vertex.position));
+      normal_error = std::max(
+          normal_error,
+          glm::degrees(glm::acos(glm::clamp(
+              glm::dot(decoded.normal, glm::normalize(vertex.normal)), -1.0f,
+              1.0f))));
+      glm::vec2 texcoord_delta = glm::abs(decoded.texcoord - vertex.texcoord);
+      texcoord_error = std::max(
+          texcoord_error, std::max(texcoord_delta.x, texcoord_delta.y));
+    }
+    double fetches = optimized_acmr * (mesh.indices.size() / 3);
+    std::cout << "  compact: stride=" << sizeof(Vertex) << "->"
+              << sizeof(CompactVertex) << "B fetch="
+              << static_cast<size_t>(fetches * sizeof(Vertex)) << "->"
+              << static_cast<size_t>(fetches * sizeof(CompactVertex))
+              << "B per draw, shadow fetch="
+              << static_cast<size_t>(fetches * sizeof(glm::vec3)) << "->"
+              << static_cast<size_t>(fetches * sizeof(glm::u16vec4))
+              << "B per draw, max error position="
+              << position_error / glm::length(aabb_max - aabb_min)
+              << " (of the diagonal) normal=" << normal_error
+              << "deg texcoord=" << texcoord_error << std::endl;
+  }
+}
+
+void RunHierarchyBenchmark(size_t child_count) {
+  using Clock = std::chrono::high_resolution_clock;
+  using Ms = std::chrono::duration<double, std::milli>;
+  constexpr size_t kSmallTrees = 1000;
+  constexpr size_t kSmallTreeChildren = 10;
+  JobSystem jobs;
+
+  // One parent with child_count children, next to many small trees that
+  // never move.
+  TransformStore transforms;
+  TransformHierarchy hierarchy;
+  uint32_t parent = transforms.Allocate();
+  std::vector<uint32_t> children(child_count);
+  for (size_t i = 0; i < child_count; i++) {
+    children[i] = transforms.Allocate();
+    transforms.position(children[i]) =
+        glm::vec3(glm::cos(i * 0.95f), 0.0f, glm::sin(i * 0.95f));
+  }
+  hierarchy.Attach(children.data(), child_count, parent, transforms);
+  std::vector<uint32_t> roots(kSmallTrees);
+  for (size_t t = 0; t < kSmallTrees; t++) {
+    roots[t] = transforms.Allocate();
+    std::vector<uint32_t> leaves(kSmallTreeChildren);
+    for (uint32_t &leaf : leaves) {
+      leaf = transforms.Allocate();
+    }
+    hierarchy.Attach(leaves.data(), leaves.size(), roots[t], transforms);
+  }
+  hierarchy.Update(transforms);
+  transforms.ClearDirty();
+
+  std::cout << hierarchy.size() << " nodes, " << kFrames << " frames, "
+            << jobs.worker_count() << " workers" << std::endl;
+
+  struct Case {
+    const char *name;
+    std::function<void(int frame)> move;
+  };
+  const Case cases[] = {
+      {"move one child", [&](int frame) {
+         hierarchy.local_position(children[frame % child_count]).y += 0.01f;
+       }},
+      {"move the big parent", [&](int frame) {
+         transforms.rotation(parent) = glm::quat(glm::vec3(0.0f, frame, 0.0f));
+         transforms.MarkDirty(parent);
+       }},
+      {"move every root", [&](int) {
+         transforms.MarkDirty(parent);
+         transforms.MarkDirty(roots.data(), roots.size());
+       }},
+  };
+  for (const Case &c : cases) {
+    Ms total(0.0);
+    size_t nodes = 0;
+    for (int frame = 0; frame < kWarmupFrames + kFrames; frame++) {
+      c.move(frame);
+      auto start = Clock::now();
+      hierarchy.Update(transforms);
+      auto end = Clock::now();
+      transforms.ClearDirty();
+      if (frame >= kWarmupFrames) {
+        total += end - start;
+        nodes += hierarchy.nodes_updated();
+      }
+    }
+    std::cout << c.name << ": " << nodes / kFrames << " nodes in "
+              << total.count() / kFrames << "ms" << std::endl;
+  }
+}
+
+void RunSortBenchmark(size_t max_instances) {
+  using Clock = std::chrono::high_resolution_clock;
+  using Ms = std::chrono::duration<double, std::milli>;
+  // Roughly the demo scene: a few dozen buckets with a handful of LODs.
+  constexpr uint32_t kBuckets = 48;
+  JobSystem jobs;
+  DrawSortScratch scratch;
+
+  std::cout << kFrames << " sorts per count, " << jobs.worker_count()
+            << " workers" << std::endl;
+  for (size_t count = 1000; count <= max_instances; count *= 10) {
+    std::vector<uint64_t> source(count);
+    for (size_t i = 0; i < count; i++) {
+      float depth = 0.2f + 20.0f * ((std::rand() & 8191) / 8191.0f);
+      source[i] = MakeDrawKey(RenderPass::Opaque, std::rand() % kBuckets,
+                              std::rand() % kMaxMeshLods, depth);
+    }
+
+    std::vector<uint64_t> keys(count);
+    std::vector<uint32_t> ids(count);
+    Ms radix(0.0), comparison(0.0);
+    for (int frame = 0; frame < kFrames; frame++) {
+      keys = source;
+      for (size_t i = 0; i < count; i++) {
+        ids[i] = static_cast<uint32_t>(i);
+      }
+      auto start = Clock::now();
+      RadixSortDrawKeys(keys.data(), ids.data(), count, scratch);
+      radix += Clock::now() - start;
+
+      // The same key-value sort through std::stable_sort, for reference.
+      for (size_t i = 0; i < count; i++) {
+        ids[i] = static_cast<uint32_t>(i);
+      }
+      start = Clock::now();
+      std::stable_sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b) {
+        return source[a] < source[b];
+      });
+      comparison += Clock::now() - start;
+    }
+    std::cout << "instances=" << count << " radix=" << radix.count() / kFrames
+              << "ms std::stable_sort=" << comparison.count() / kFrames << "ms"
+              << std::endl;
+  }
+}
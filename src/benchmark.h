@@ -0,0 +1,33 @@
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+#include <cstddef>
+
+// Times the satellite update and instance build on a headless copy of the
+// satellite scene, once per worker count from 1 up to the hardware
+// concurrency, and prints the per-frame cost and speedup of each.
+void RunJobBenchmark(size_t satellite_count);
+
+// Refits a BVH over the moving satellites each frame and compares culling
+// four views and casting picking rays through it against testing every
+// instance, for satellite counts growing tenfold from 1000 up to
+// max_satellites.
+void RunBvhBenchmark(size_t max_satellites);
+
+// Loads every mesh in assets/ and prints its memory and ACMR as a triangle
+// soup, once deduplicated into an indexed mesh, and after each
+// optimization pass, then the vertex fetch saved by CompactVertex and the
+// worst error it introduces.
+void RunMeshBenchmark();
+
+// Builds one parent with child_count children beside a thousand small
+// trees, then times hierarchy updates after moving one child, the parent,
+// and every root.
+void RunHierarchyBenchmark(size_t child_count);
+
+// Times RadixSortDrawKeys against std::stable_sort on draw keys spread over
+// a few dozen buckets, for instance counts growing tenfold from 1000 up to
+// max_instances.
+void RunSortBenchmark(size_t max_instances);
+
+#endif // BENCHMARK_H_
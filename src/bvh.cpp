@@ -0,0 +1,584 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "job_system.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BVH_SSE 1
+#endif
+
+namespace {
+
+constexpr int kSahBins = 16;
+// Subtrees at least this big are built as separate jobs.
+constexpr size_t kParallelBuildSize = 4096;
+
+Aabb Union(const Aabb &a, const Aabb &b) {
+  return {glm::min(a.min, b.min), glm::max(a.max, b.max)};
+}
+
+// Half the surface area, which is all SAH comparisons need.
+float Area(const Aabb &box) {
+  glm::vec3 d = box.max - box.min;
+  return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+Aabb EmptyAabb() {
+  return {glm::vec3(std::numeric_limits<float>::max()),
+          glm::vec3(std::numeric_limits<float>::lowest())};
+}
+
+// A view's six planes as structure-of-arrays, padded to eight lanes with
+// planes every box is inside of, with the absolute normals precomputed.
+struct ViewPlanes {
+  alignas(16) float nx[8], ny[8], nz[8], w[8];
+  alignas(16) float ax[8], ay[8], az[8];
+};
+
+ViewPlanes ToViewPlanes(const Frustum &frustum) {
+  ViewPlanes planes = {};
+  for (int p = 0; p < 8; p++) {
+    glm::vec4 plane = p < 6 ? frustum.planes[p] : glm::vec4(0, 0, 0, 1);
+    planes.nx[p] = plane.x;
+    planes.ny[p] = plane.y;
+    planes.nz[p] = plane.z;
+    planes.w[p] = plane.w;
+    planes.ax[p] = std::abs(plane.x);
+    planes.ay[p] = std::abs(plane.y);
+    planes.az[p] = std::abs(plane.z);
+  }
+  return planes;
+}
+
+// Which views a subtree may still touch, and which of those it lies
+// entirely inside of, so its descendants needn't be tested against them.
+struct CullState {
+  uint32_t node;
+  uint8_t views;
+  uint8_t inside;
+};
+
+// Narrows state to box, returning false once no view is left.
+bool Classify(const Aabb &box, const ViewPlanes *views, uint32_t view_count,
+              CullState &state) {
+  glm::vec3 center = 0.5f * (box.min + box.max);
+  glm::vec3 extent = 0.5f * (box.max - box.min);
+  for (uint32_t v = 0; v < view_count; v++) {
+    uint8_t bit = static_cast<uint8_t>(1u << v);
+    if (!(state.views & bit) || (state.inside & bit)) {
+      continue;
+    }
+
+    const ViewPlanes &planes = views[v];
+    int outside = 0, inside = 0;
+#if BVH_SSE
+    __m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y),
+           cz = _mm_set1_ps(center.z);
+    __m128 ex = _mm_set1_ps(extent.x), ey = _mm_set1_ps(extent.y),
+           ez = _mm_set1_ps(extent.z);
+    const __m128 zero = _mm_setzero_ps();
+    for (int half = 0; half < 2; half++) {
+      int p = 4 * half;
+      __m128 d = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_load_ps(planes.nx + p), cx),
+                     _mm_mul_ps(_mm_load_ps(planes.ny + p), cy)),
+          _mm_add_ps(_mm_mul_ps(_mm_load_ps(planes.nz + p), cz),
+                     _mm_load_ps(planes.w + p)));
+      __m128 r = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(_mm_load_ps(planes.ax + p), ex),
+                     _mm_mul_ps(_mm_load_ps(planes.ay + p), ey)),
+          _mm_mul_ps(_mm_load_ps(planes.az + p), ez));
+      outside |= _mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(d, r), zero)) << p;
+      inside |= _mm_movemask_ps(_mm_cmpge_ps(_mm_sub_ps(d, r), zero)) << p;
+    }
+#else
+    for (int p = 0; p < 8; p++) {
+      float d = planes.nx[p] * center.x + planes.ny[p] * center.y +
+                planes.nz[p] * center.z + planes.w[p];
+      float r = planes.ax[p] * extent.x + planes.ay[p] * extent.y +
+                planes.az[p] * extent.z;
+      outside |= (d + r < 0.0f) << p;
+      inside |= (d - r >= 0.0f) << p;
+    }
+#endif
+    if (outside) {
+      state.views &= ~bit;
+    } else if (inside == 0xff) {
+      state.inside |= bit;
+    }
+  }
+  return state.views != 0;
+}
+
+bool IntersectRay(const Aabb &box, const glm::vec3 &origin,
+                  const glm::vec3 &inv_direction, float max_t, float *t) {
+  glm::vec3 t0 = (box.min - origin) * inv_direction;
+  glm::vec3 t1 = (box.max - origin) * inv_direction;
+  glm::vec3 near = glm::min(t0, t1);
+  glm::vec3 far = glm::max(t0, t1);
+  float enter = std::max({near.x, near.y, near.z, 0.0f});
+  float exit = std::min({far.x, far.y, far.z, max_t});
+  *t = enter;
+  return enter <= exit;
+}
+
+} // namespace
+
+Aabb TransformAabb(const Aabb &local, const glm::vec3 &t, const glm::quat &q,
+                   const glm::vec3 &s) {
+  glm::mat3 m = glm::mat3_cast(q);
+  m[0] *= s.x;
+  m[1] *= s.y;
+  m[2] *= s.z;
+
+  glm::vec3 center = t + m * (0.5f * (local.min + local.max));
+  glm::vec3 half = 0.5f * (local.max - local.min);
+  glm::vec3 extent = glm::abs(m[0]) * half.x + glm::abs(m[1]) * half.y +
+                     glm::abs(m[2]) * half.z;
+  return {center - extent, center + extent};
+}
+
+uint32_t Bvh::Insert(const Aabb &bounds, uint32_t user_data) {
+  uint32_t leaf = AllocateNode();
+  nodes_[leaf].bounds = bounds;
+  nodes_[leaf].user_data = user_data;
+  leaf_count_++;
+
+  if (root_ == kNull) {
+    root_ = leaf;
+    return leaf;
+  }
+
+  // Branch and bound for the sibling that adds the least area to the tree.
+  // Descending costs every ancestor its growth, which bounds whole subtrees.
+  float leaf_area = Area(bounds);
+  uint32_t best = root_;
+  float best_cost = Area(Union(nodes_[root_].bounds, bounds));
+  std::vector<std::pair<uint32_t, float>> stack = {{root_, 0.0f}};
+  while (!stack.empty()) {
+    auto [node, inherited] = stack.back();
+    stack.pop_back();
+
+    const Node &n = nodes_[node];
+    float direct = Area(Union(n.bounds, bounds));
+    float cost = direct + inherited;
+    if (cost < best_cost) {
+      best = node;
+      best_cost = cost;
+    }
+
+    float child_inherited = inherited + direct - Area(n.bounds);
+    if (!n.leaf() && leaf_area + child_inherited < best_cost) {
+      stack.push_back({n.left, child_inherited});
+      stack.push_back({n.right, child_inherited});
+    }
+  }
+
+  uint32_t old_parent = nodes_[best].parent;
+  uint32_t parent = AllocateNode();
+  nodes_[parent].parent = old_parent;
+  nodes_[parent].left = best;
+  nodes_[parent].right = leaf;
+  nodes_[best].parent = parent;
+  nodes_[leaf].parent = parent;
+  if (old_parent == kNull) {
+    root_ = parent;
+  } else if (nodes_[old_parent].left == best) {
+    nodes_[old_parent].left = parent;
+  } else {
+    nodes_[old_parent].right = parent;
+  }
+  RefitAncestors(parent);
+  return leaf;
+}
+
+void Bvh::Remove(uint32_t proxy) {
+  leaf_count_--;
+  uint32_t parent = nodes_[proxy].parent;
+  FreeNode(proxy);
+  if (parent == kNull) {
+    root_ = kNull;
+    return;
+  }
+
+  // The sibling takes the parent's place.
+  uint32_t sibling = nodes_[parent].left == proxy ? nodes_[parent].right
+                                                  : nodes_[parent].left;
+  uint32_t grandparent = nodes_[parent].parent;
+  nodes_[sibling].parent = grandparent;
+  FreeNode(parent);
+  if (grandparent == kNull) {
+    root_ = sibling;
+    return;
+  }
+  if (nodes_[grandparent].left == parent) {
+    nodes_[grandparent].left = sibling;
+  } else {
+    nodes_[grandparent].right = sibling;
+  }
+  RefitAncestors(grandparent);
+}
+
+void Bvh::Refit(const uint32_t *proxies, size_t count) {
+  refit_.resize(nodes_.size(), 0);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t node = nodes_[proxies[i]].parent;
+    while (node != kNull && !refit_[node]) {
+      refit_[node] = 1;
+      node = nodes_[node].parent;
+    }
+  }
+  if (root_ == kNull || !refit_[root_]) {
+    return;
+  }
+
+  // Peel off the top of the flagged region until there are enough subtrees
+  // to go around, refit those in parallel, then finish the top serially.
+  JobSystem *jobs = JobSystem::Get();
+  size_t target = 4 * jobs->worker_count();
+  std::vector<uint32_t> top;
+  std::vector<uint32_t> frontier = {root_};
+  while (!frontier.empty() && frontier.size() < target) {
+    std::vector<uint32_t> next;
+    for (uint32_t node : frontier) {
+      top.push_back(node);
+      for (uint32_t child : {nodes_[node].left, nodes_[node].right}) {
+        if (!nodes_[child].leaf() && refit_[child]) {
+          next.push_back(child);
+        }
+      }
+    }
+    frontier.swap(next);
+  }
+
+  jobs->ParallelFor(0, frontier.size(), 1,
+                    [&](size_t begin, size_t end, uint32_t) {
+                      for (size_t i = begin; i < end; i++) {
+                        RefitSubtree(frontier[i]);
+                      }
+                    });
+
+  for (auto it = top.rbegin(); it != top.rend(); ++it) {
+    Node &n = nodes_[*it];
+    n.bounds = Union(nodes_[n.left].bounds, nodes_[n.right].bounds);
+    refit_[*it] = 0;
+  }
+}
+
+void Bvh::Rebuild() {
+  if (root_ == kNull) {
+    return;
+  }
+
+  // A tree over n leaves always has n - 1 internal nodes, so the old ones
+  // are recycled wholesale.
+  std::vector<BuildItem> items;
+  std::vector<uint32_t> internal;
+  items.reserve(leaf_count_);
+  internal.reserve(leaf_count_);
+  std::vector<uint32_t> stack = {root_};
+  while (!stack.empty()) {
+    uint32_t node = stack.back();
+    stack.pop_back();
+    const Node &n = nodes_[node];
+    if (n.leaf()) {
+      items.push_back({n.bounds, 0.5f * (n.bounds.min + n.bounds.max), node});
+    } else {
+      stack.push_back(n.left);
+      stack.push_back(n.right);
+      internal.push_back(node);
+    }
+  }
+
+  // Handing the nodes out in index order lays each subtree out contiguously.
+  std::sort(internal.begin(), internal.end());
+  root_ = Build(items.data(), items.size(), internal.data());
+  nodes_[root_].parent = kNull;
+}
+
+uint32_t Bvh::Build(BuildItem *items, size_t count, const uint32_t *internal) {
+  if (count == 1) {
+    return items[0].leaf;
+  }
+
+  size_t mid = count / 2;
+  if (count > 2) {
+    Aabb centroid_bounds = {items[0].centroid, items[0].centroid};
+    for (size_t i = 1; i < count; i++) {
+      centroid_bounds.min = glm::min(centroid_bounds.min, items[i].centroid);
+      centroid_bounds.max = glm::max(centroid_bounds.max, items[i].centroid);
+    }
+    glm::vec3 extent = centroid_bounds.max - centroid_bounds.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                                   : (extent.y > extent.z ? 1 : 2);
+    if (extent[axis] > 0.0f) {
+      // Small nodes don't need many bins to find a good split.
+      int bins = static_cast<int>(std::min<size_t>(count, kSahBins));
+      mid = SplitSah(items, count, axis, bins, centroid_bounds.min[axis],
+                     bins / extent[axis]);
+    }
+  }
+
+  // Every split position is used by exactly one node, which makes it that
+  // node's index into internal and lets the halves build concurrently.
+  uint32_t left, right;
+  if (count >= kParallelBuildSize) {
+    JobSystem *jobs = JobSystem::Get();
+    auto left_job = jobs->Schedule(
+        [&](uint32_t) { left = Build(items, mid, internal); });
+    right = Build(items + mid, count - mid, internal + mid);
+    jobs->Wait(left_job);
+  } else {
+    left = Build(items, mid, internal);
+    right = Build(items + mid, count - mid, internal + mid);
+  }
+
+  uint32_t node = internal[mid - 1];
+  nodes_[node] = Node();
+  nodes_[node].left = left;
+  nodes_[node].right = right;
+  nodes_[node].bounds = Union(nodes_[left].bounds, nodes_[right].bounds);
+  nodes_[left].parent = node;
+  nodes_[right].parent = node;
+  return node;
+}
+
+size_t Bvh::SplitSah(BuildItem *items, size_t count, int axis, int bin_count,
+                     float origin, float scale) {
+  auto bin_of = [&](const BuildItem &item) {
+    int bin = static_cast<int>((item.centroid[axis] - origin) * scale);
+    return std::min(bin, bin_count - 1);
+  };
+
+  Aabb bins[kSahBins];
+  size_t bin_counts[kSahBins] = {};
+  std::fill(bins, bins + bin_count, EmptyAabb());
+  for (size_t i = 0; i < count; i++) {
+    int bin = bin_of(items[i]);
+    bins[bin] = Union(bins[bin], items[i].bounds);
+    bin_counts[bin]++;
+  }
+
+  // Sweep from the right for the suffix costs, then from the left to pick
+  // the cheapest split.
+  float right_costs[kSahBins];
+  Aabb right = EmptyAabb();
+  size_t right_count = 0;
+  for (int b = bin_count - 1; b > 0; b--) {
+    right = Union(right, bins[b]);
+    right_count += bin_counts[b];
+    right_costs[b] = right_count ? Area(right) * right_count : 0.0f;
+  }
+  Aabb left = EmptyAabb();
+  size_t left_count = 0;
+  float best_cost = std::numeric_limits<float>::max();
+  int best_split = 0;
+  for (int b = 1; b < bin_count; b++) {
+    left = Union(left, bins[b - 1]);
+    left_count += bin_counts[b - 1];
+    float cost =
+        (left_count ? Area(left) * left_count : 0.0f) + right_costs[b];
+    if (left_count && left_count < count && cost < best_cost) {
+      best_cost = cost;
+      best_split = b;
+    }
+  }
+  if (best_split == 0) {
+    return count / 2;
+  }
+
+  BuildItem *mid =
+      std::partition(items, items + count, [&](const BuildItem &item) {
+        return bin_of(item) < best_split;
+      });
+  return mid - items;
+}
+
+void Bvh::QueryFrustums(const Frustum *views, uint32_t view_count,
+                        const FrustumFunction &fn) const {
+  if (root_ == kNull) {
+    return;
+  }
+
+  ViewPlanes planes[8];
+  for (uint32_t v = 0; v < view_count; v++) {
+    planes[v] = ToViewPlanes(views[v]);
+  }
+  CullState root = {root_, static_cast<uint8_t>((1u << view_count) - 1), 0};
+
+  // Same split as Refit: walk the top serially, then hand out subtrees.
+  JobSystem *jobs = JobSystem::Get();
+  size_t target = 4 * jobs->worker_count();
+  std::vector<CullState> frontier = {root};
+  while (!frontier.empty() && frontier.size() < target) {
+    std::vector<CullState> next;
+    bool split = false;
+    for (CullState state : frontier) {
+      const Node &n = nodes_[state.node];
+      if (n.leaf()) {
+        next.push_back(state);
+        continue;
+      }
+      if (!Classify(n.bounds, planes, view_count, state)) {
+        continue;
+      }
+      split = true;
+      for (uint32_t child : {n.left, n.right}) {
+        state.node = child;
+        next.push_back(state);
+      }
+    }
+    frontier.swap(next);
+    if (!split) {
+      break;
+    }
+  }
+
+  jobs->ParallelFor(
+      0, frontier.size(), 1, [&](size_t begin, size_t end, uint32_t) {
+        std::vector<CullState> stack(frontier.begin() + begin,
+                                     frontier.begin() + end);
+        while (!stack.empty()) {
+          CullState state = stack.back();
+          stack.pop_back();
+          const Node &n = nodes_[state.node];
+          if (!Classify(n.bounds, planes, view_count, state)) {
+            continue;
+          }
+          if (n.leaf()) {
+            fn(n.user_data, state.views);
+            continue;
+          }
+          state.node = n.left;
+          stack.push_back(state);
+          state.node = n.right;
+          stack.push_back(state);
+        }
+      });
+}
+
+void Bvh::QuerySphere(const glm::vec3 &center, float radius,
+                      std::vector<uint32_t> &out) const {
+  if (root_ == kNull) {
+    return;
+  }
+
+  std::vector<uint32_t> stack = {root_};
+  while (!stack.empty()) {
+    const Node &n = nodes_[stack.back()];
+    stack.pop_back();
+
+    glm::vec3 closest = glm::clamp(center, n.bounds.min, n.bounds.max);
+    glm::vec3 offset = closest - center;
+    if (glm::dot(offset, offset) > radius * radius) {
+      continue;
+    }
+    if (n.leaf()) {
+      out.push_back(n.user_data);
+    } else {
+      stack.push_back(n.left);
+      stack.push_back(n.right);
+    }
+  }
+}
+
+bool Bvh::Raycast(const glm::vec3 &origin, const glm::vec3 &direction,
+                  float max_t, uint32_t *user_data, float *t) const {
+  if (root_ == kNull) {
+    return false;
+  }
+
+  glm::vec3 inv_direction = 1.0f / direction;
+  bool hit = false;
+  float entry;
+  if (!IntersectRay(nodes_[root_].bounds, origin, inv_direction, max_t,
+                    &entry)) {
+    return false;
+  }
+
+  // Nearer children are visited first, and max_t shrinks with every hit.
+  std::vector<std::pair<uint32_t, float>> stack = {{root_, entry}};
+  while (!stack.empty()) {
+    auto [node, node_entry] = stack.back();
+    stack.pop_back();
+    if (node_entry > max_t) {
+      continue;
+    }
+
+    const Node &n = nodes_[node];
+    if (n.leaf()) {
+      max_t = node_entry;
+      *user_data = n.user_data;
+      *t = node_entry;
+      hit = true;
+      continue;
+    }
+
+    float left_t, right_t;
+    bool left_hit = IntersectRay(nodes_[n.left].bounds, origin, inv_direction,
+                                 max_t, &left_t);
+    bool right_hit = IntersectRay(nodes_[n.right].bounds, origin,
+                                  inv_direction, max_t, &right_t);
+    if (left_hit && right_hit && left_t < right_t) {
+      stack.push_back({n.right, right_t});
+      stack.push_back({n.left, left_t});
+    } else {
+      if (left_hit) {
+        stack.push_back({n.left, left_t});
+      }
+      if (right_hit) {
+        stack.push_back({n.right, right_t});
+      }
+    }
+  }
+  return hit;
+}
+
+uint32_t Bvh::AllocateNode() {
+  uint32_t node;
+  if (free_ != kNull) {
+    node = free_;
+    free_ = nodes_[node].parent;
+  } else {
+    node = static_cast<uint32_t>(nodes_.size());
+    nodes_.emplace_back();
+  }
+  nodes_[node] = Node();
+  return node;
+}
+
+void Bvh::FreeNode(uint32_t node) {
+  nodes_[node].parent = free_;
+  free_ = node;
+}
+
+void Bvh::RefitAncestors(uint32_t node) {
+  while (node != kNull) {
+    Node &n = nodes_[node];
+    n.bounds = Union(nodes_[n.left].bounds, nodes_[n.right].bounds);
+    node = n.parent;
+  }
+}
+
+void Bvh::RefitSubtree(uint32_t node) {
+  // Flagged nodes in preorder; walking it backwards visits children first.
+  std::vector<uint32_t> order = {node};
+  for (size_t i = 0; i < order.size(); i++) {
+    const Node &n = nodes_[order[i]];
+    for (uint32_t child : {n.left, n.right}) {
+      if (!nodes_[child].leaf() && refit_[child]) {
+        order.push_back(child);
+      }
+    }
+  }
+  for (auto it = order.rbegin(); it != order.rend(); ++it) {
+    Node &n = nodes_[*it];
+    n.bounds = Union(nodes_[n.left].bounds, nodes_[n.right].bounds);
+    refit_[*it] = 0;
+  }
+}
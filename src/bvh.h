@@ -0,0 +1,131 @@
+#ifndef BVH_H_
+#define BVH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "culling.h"
+
+struct Aabb {
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+// World-space bounds of a local box under translation t, rotation q and
+// scale s.
+Aabb TransformAabb(const Aabb& local, const glm::vec3& t, const glm::quat& q,
+                   const glm::vec3& s);
+
+// Dynamic AABB tree. Leaves are handed out as proxies that stay valid until
+// removed, across refits and rebuilds, and each carries a user value that
+// queries report back. Inserts pick the sibling with the lowest SAH cost, so
+// the tree stays reasonable as it grows; moved leaves are refit in place and
+// Rebuild restores full SAH quality once refitting has loosened the tree.
+class Bvh {
+public:
+    static constexpr uint32_t kNull = 0xffffffff;
+
+    // Called with a leaf's user value and a mask of the views it touches.
+    using FrustumFunction =
+        std::function<void(uint32_t user_data, uint8_t mask)>;
+
+    Bvh() = default;
+    ~Bvh() = default;
+
+    uint32_t Insert(const Aabb& bounds, uint32_t user_data);
+    void Remove(uint32_t proxy);
+    // Makes room for leaf_count more leaves and the internal nodes above
+    // them.
+    void Reserve(size_t leaf_count) {
+        nodes_.reserve(nodes_.size() + 2 * leaf_count);
+    }
+
+    // Moves a leaf without touching its ancestors, so jobs may call this
+    // concurrently for distinct proxies. Refit the moved leaves afterwards.
+    void SetBounds(uint32_t proxy, const Aabb& bounds) {
+        nodes_[proxy].bounds = bounds;
+    }
+
+    const Aabb& bounds(uint32_t proxy) const {
+        return nodes_[proxy].bounds;
+    }
+
+    uint32_t user_data(uint32_t proxy) const {
+        return nodes_[proxy].user_data;
+    }
+
+    size_t size() const {
+        return leaf_count_;
+    }
+
+    // Refits every ancestor of the given leaves, splitting the work into
+    // subtrees across the job system.
+    void Refit(const uint32_t* proxies, size_t count);
+
+    // Rebuilds the internal nodes top-down with binned SAH. Proxies survive.
+    void Rebuild();
+
+    // Calls fn for every leaf touching at least one of the views (up to 8),
+    // with bit v of the mask set when it touches views[v]. Subtrees run as
+    // jobs, so fn must be safe to call concurrently for distinct leaves.
+    void QueryFrustums(const Frustum* views, uint32_t view_count,
+                       const FrustumFunction& fn) const;
+
+    // Appends the user value of every leaf overlapping the sphere.
+    void QuerySphere(const glm::vec3& center, float radius,
+                     std::vector<uint32_t>& out) const;
+
+    // Finds the leaf whose box the ray enters first, within max_t. Returns
+    // false on a miss.
+    bool Raycast(const glm::vec3& origin, const glm::vec3& direction,
+                 float max_t, uint32_t* user_data, float* t) const;
+
+private:
+    struct Node {
+        Aabb bounds;
+        // Next free node while on the free list.
+        uint32_t parent = kNull;
+        uint32_t left = kNull;
+        uint32_t right = kNull;
+        uint32_t user_data = 0;
+
+        bool leaf() const {
+            return left == kNull;
+        }
+    };
+
+    uint32_t AllocateNode();
+    void FreeNode(uint32_t node);
+    // Recomputes bounds from node up to the root.
+    void RefitAncestors(uint32_t node);
+    void RefitSubtree(uint32_t node);
+    // A leaf as seen by Rebuild, kept contiguous so partitioning doesn't
+    // chase node indices.
+    struct BuildItem {
+        Aabb bounds;
+        glm::vec3 centroid;
+        uint32_t leaf;
+    };
+
+    // Builds a subtree over items[0, count) out of the count - 1 nodes in
+    // internal and returns its root.
+    uint32_t Build(BuildItem* items, size_t count, const uint32_t* internal);
+    // Partitions items at the cheapest split between bin_count bins along
+    // axis and returns the size of the left half.
+    size_t SplitSah(BuildItem* items, size_t count, int axis, int bin_count,
+                    float origin, float scale);
+
+    std::vector<Node> nodes_;
+    uint32_t root_ = kNull;
+    uint32_t free_ = kNull;
+    size_t leaf_count_ = 0;
+    // Internal nodes with a moved descendant, set and cleared by Refit.
+    std::vector<uint8_t> refit_;
+};
+
+#endif // BVH_H_
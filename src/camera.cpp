@@ -5,6 +5,12 @@
 
 #include "device.h"
 
+namespace {
+
+constexpr float kFieldOfView = glm::pi<float>() / 3.0f;
+
+} // namespace
+
 Camera::Camera() {
     look_at = glm::vec3(0.0f, 0.0f, 0.0f);
     position = glm::vec3(0.0f, 0.0f, -5.0f);
@@ -24,12 +30,17 @@ glm::mat4 Camera::GetViewProj() {
     position = look_at + r * dir_to_camera;
 
     vk::Extent2D viewport = Device::Get()->swapchain_extent();
-    auto proj = glm::perspectiveFov(glm::pi<float>() / 3.0f, (float)viewport.width, (float)viewport.height, 0.2f, 100.0f);
+    auto proj = glm::perspectiveFov(kFieldOfView, (float)viewport.width, (float)viewport.height, 0.2f, 100.0f);
     auto view = glm::lookAt(position, look_at, glm::vec3(0.0f, 1.0f, 0.0f));
     proj[1][1]  *= -1.0f;
     return proj * view;
 }
 
+float Camera::GetPixelScale() {
+    vk::Extent2D viewport = Device::Get()->swapchain_extent();
+    return 0.5f * viewport.height / tan(0.5f * kFieldOfView);
+}
+
 void Camera::RotateBy(float phi, float theta) {
     phi_ += phi;
     theta_ += theta;
@@ -13,6 +13,10 @@ public:
 
     glm::mat4 GetViewProj();
 
+    // Height in pixels of an object one unit tall, one unit in front of the
+    // camera. Divide by distance for the size at that distance.
+    float GetPixelScale();
+
     void RotateBy(float phi, float theta);
 
 private:
@@ -4,6 +4,83 @@
 #include <cstdint>
 #include <cstddef>
 
-constexpr uint32_t kShadowMapSize = 1024;
+// Every light's shadow map is a square tile of one depth atlas, sized each
+// frame from the light's footprint on screen to about
+// kShadowTexelsPerPixel texels per pixel across: a power of two from
+// kMinShadowTile to kMaxShadowTile. A tile only changes size once its
+// footprint asks for kShadowTileHysteresis of a doubling past the nearest
+// size, so it doesn't flicker between two.
+//
+// The atlas and the static shadow cache each take kShadowAtlasSize^2 depth
+// texels: 2 x 16 MB at D32 (2 x 8 MB with --shadow-d16), against 2 x 12 MB
+// for the fixed 1024^2 layer per light this replaced. At 2048 one close
+// light can take twice the old resolution while distant ones shrink to a
+// fraction of it; with all three lights close, tiles halve back down to
+// 1024 each. A 4096 atlas would allow 4096 tiles but cost 2 x 64 MB.
+constexpr uint32_t kShadowAtlasSize = 2048;
+constexpr uint32_t kMinShadowTile = 128;
+constexpr uint32_t kMaxShadowTile = kShadowAtlasSize;
+constexpr float kShadowTexelsPerPixel = 1.0f;
+constexpr float kShadowTileHysteresis = 0.25f;
+
+// Side of each light's layer of EVSM moments, which average its tile's
+// warped depth down to this size.
+constexpr uint32_t kShadowMomentsSize = 1024;
+
+// Widest depth range of the lights' projections. Fitting narrows each
+// light's to Light::shadow_range within it. Mirrored in basic.frag, which
+// scales its depth bias relative to it.
+constexpr float kShadowNear = 0.5f;
+constexpr float kShadowFar = 10.0f;
+
+// Fitted shadow frusta snap outward to a grid of this many cells across
+// the light's full frustum, and their near and far planes to multiples of
+// kShadowDepthStep, so they change (and re-render the static shadow cache)
+// only when the scene does by a good fraction of a cell.
+constexpr uint32_t kShadowFitGrid = 16;
+constexpr float kShadowDepthStep = 0.25f;
+
+// Spot lights fade out over this fraction of their cone angle either side
+// of it. Mirrors kSmoothing in basic.frag.
+constexpr float kSpotSmoothing = 0.1f;
+
+// Exponents EVSM warps linear depth by, positive and negative. The largest
+// for which the squared moments still fit in half floats. Mirrored in
+// basic.frag and evsm_blur.comp.
+constexpr float kEvsmExponent = 5.54f;
+
+// Shadow draws cover every light at once: each visible id carries its
+// light's index above this bit, and the instance below it. Mirrored in
+// shadow.vert and gpu_cull.comp.
+constexpr uint32_t kShadowLayerShift = 28;
+constexpr uint32_t kShadowInstanceMask = (1u << kShadowLayerShift) - 1;
+
+// How many frames the CPU may record ahead of the GPU.
+constexpr uint32_t kDefaultFramesInFlight = 2;
+constexpr uint32_t kMaxFramesInFlight = 3;
+
+// Initial size of each frame's partition of the transient upload ring.
+constexpr size_t kTransientFrameSize = 4 * 1024 * 1024;
+
+// Smallest batch of objects handed to a single job.
+constexpr size_t kInstanceGrain = 1024;
+
+// Frames between full SAH rebuilds of the scene BVH. Refitting in between
+// keeps it correct but lets it loosen as objects move.
+constexpr uint32_t kBvhRebuildInterval = 60;
+
+// Levels of detail per mesh: the mesh as loaded, then simplified levels
+// with about half the triangles of the one before.
+constexpr uint32_t kMaxMeshLods = 5;
+
+// Instances draw the coarsest LOD whose simplification error projects to
+// at most this many pixels. A LOD is only entered once its error is a
+// kLodHysteresis fraction under the limit and only left once it is that
+// far over, so instances near a boundary don't flicker between levels.
+constexpr float kLodErrorPixels = 1.0f;
+constexpr float kLodHysteresis = 0.25f;
+
+// Shadow passes draw this many levels coarser than the camera.
+constexpr uint32_t kShadowLodBias = 1;
 
 #endif CONSTANTS_H_
@@ -0,0 +1,175 @@
+#include "culling.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CULLING_AVX2 1
+#endif
+
+Frustum ExtractFrustum(const glm::mat4 &view_proj) {
+  glm::vec4 row[4];
+  for (int r = 0; r < 4; r++) {
+    row[r] = glm::vec4(view_proj[0][r], view_proj[1][r], view_proj[2][r],
+                       view_proj[3][r]);
+  }
+
+  Frustum frustum;
+  frustum.planes[0] = row[3] + row[0];
+  frustum.planes[1] = row[3] - row[0];
+  frustum.planes[2] = row[3] + row[1];
+  frustum.planes[3] = row[3] - row[1];
+  frustum.planes[4] = row[2];
+  frustum.planes[5] = row[3] - row[2];
+  for (glm::vec4 &plane : frustum.planes) {
+    plane /= glm::length(glm::vec3(plane));
+  }
+  return frustum;
+}
+
+namespace {
+
+uint8_t CullOne(const glm::vec3 &t, const glm::quat &q, const glm::vec3 &s,
+                const glm::vec4 &sphere, const Frustum *views,
+                uint32_t view_count) {
+  glm::vec3 center = t + q * (s * glm::vec3(sphere));
+  float radius = sphere.w * std::max({std::abs(s.x), std::abs(s.y),
+                                      std::abs(s.z)});
+
+  uint8_t mask = 0;
+  for (uint32_t v = 0; v < view_count; v++) {
+    bool inside = true;
+    for (const glm::vec4 &plane : views[v].planes) {
+      inside &= glm::dot(glm::vec3(plane), center) + plane.w >= -radius;
+    }
+    mask |= static_cast<uint8_t>(inside) << v;
+  }
+  return mask;
+}
+
+#if CULLING_AVX2
+
+// a * b + c and a * b - c. Not FMA, which /arch:AVX2 doesn't guarantee.
+__m256 MulAdd(__m256 a, __m256 b, __m256 c) {
+  return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+}
+
+__m256 MulSub(__m256 a, __m256 b, __m256 c) {
+  return _mm256_sub_ps(_mm256_mul_ps(a, b), c);
+}
+
+// Loads eight 4-float rows and returns them as four 8-lane columns.
+void Transpose8x4(const float *r0, const float *r1, const float *r2,
+                  const float *r3, const float *r4, const float *r5,
+                  const float *r6, const float *r7, __m256 &c0, __m256 &c1,
+                  __m256 &c2, __m256 &c3) {
+  __m256 a = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r0)),
+                                  _mm_loadu_ps(r4), 1);
+  __m256 b = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r1)),
+                                  _mm_loadu_ps(r5), 1);
+  __m256 c = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r2)),
+                                  _mm_loadu_ps(r6), 1);
+  __m256 d = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r3)),
+                                  _mm_loadu_ps(r7), 1);
+  __m256 ab_lo = _mm256_unpacklo_ps(a, b), ab_hi = _mm256_unpackhi_ps(a, b);
+  __m256 cd_lo = _mm256_unpacklo_ps(c, d), cd_hi = _mm256_unpackhi_ps(c, d);
+  c0 = _mm256_shuffle_ps(ab_lo, cd_lo, _MM_SHUFFLE(1, 0, 1, 0));
+  c1 = _mm256_shuffle_ps(ab_lo, cd_lo, _MM_SHUFFLE(3, 2, 3, 2));
+  c2 = _mm256_shuffle_ps(ab_hi, cd_hi, _MM_SHUFFLE(1, 0, 1, 0));
+  c3 = _mm256_shuffle_ps(ab_hi, cd_hi, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+__m256 Load8(const glm::vec3 *v, const uint32_t *h, int c) {
+  return _mm256_setr_ps(v[h[0]][c], v[h[1]][c], v[h[2]][c], v[h[3]][c],
+                        v[h[4]][c], v[h[5]][c], v[h[6]][c], v[h[7]][c]);
+}
+
+size_t CullAvx2(const TransformStore &transforms, const uint32_t *handles,
+                const glm::vec4 *local_spheres, size_t count,
+                const Frustum *views, uint32_t view_count, uint8_t *masks) {
+  const glm::vec3 *p = transforms.positions();
+  const glm::quat *q = transforms.rotations();
+  const glm::vec3 *s = transforms.scales();
+  const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 two = _mm256_set1_ps(2.0f);
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    // Hardware gathers are slow on several CPUs, so assemble lanes from
+    // 16-byte loads and transposes instead.
+    const uint32_t *h = handles + i;
+    __m256 qx, qy, qz, qw;
+    Transpose8x4(&q[h[0]].x, &q[h[1]].x, &q[h[2]].x, &q[h[3]].x, &q[h[4]].x,
+                 &q[h[5]].x, &q[h[6]].x, &q[h[7]].x, qx, qy, qz, qw);
+    __m256 bx, by, bz, br;
+    const float *b = &local_spheres[i].x;
+    Transpose8x4(b, b + 4, b + 8, b + 12, b + 16, b + 20, b + 24, b + 28, bx,
+                 by, bz, br);
+    __m256 sx = Load8(s, h, 0), sy = Load8(s, h, 1), sz = Load8(s, h, 2);
+
+    // v = S * c
+    __m256 vx = _mm256_mul_ps(sx, bx);
+    __m256 vy = _mm256_mul_ps(sy, by);
+    __m256 vz = _mm256_mul_ps(sz, bz);
+    __m256 radius = _mm256_mul_ps(
+        br, _mm256_max_ps(_mm256_and_ps(sx, abs_mask),
+                          _mm256_max_ps(_mm256_and_ps(sy, abs_mask),
+                                        _mm256_and_ps(sz, abs_mask))));
+
+    // R * v = v + 2 * cross(u, cross(u, v) + w * v), with u = q.xyz
+    __m256 ax = MulAdd(qw, vx, MulSub(qy, vz, _mm256_mul_ps(qz, vy)));
+    __m256 ay = MulAdd(qw, vy, MulSub(qz, vx, _mm256_mul_ps(qx, vz)));
+    __m256 az = MulAdd(qw, vz, MulSub(qx, vy, _mm256_mul_ps(qy, vx)));
+    __m256 cx = MulSub(qy, az, _mm256_mul_ps(qz, ay));
+    __m256 cy = MulSub(qz, ax, _mm256_mul_ps(qx, az));
+    __m256 cz = MulSub(qx, ay, _mm256_mul_ps(qy, ax));
+    __m256 px = _mm256_add_ps(Load8(p, h, 0), MulAdd(two, cx, vx));
+    __m256 py = _mm256_add_ps(Load8(p, h, 1), MulAdd(two, cy, vy));
+    __m256 pz = _mm256_add_ps(Load8(p, h, 2), MulAdd(two, cz, vz));
+    __m256 neg_radius = _mm256_sub_ps(_mm256_setzero_ps(), radius);
+
+    uint32_t lane_masks[8] = {};
+    for (uint32_t v = 0; v < view_count; v++) {
+      __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+      for (const glm::vec4 &plane : views[v].planes) {
+        __m256 d = MulAdd(
+            _mm256_set1_ps(plane.x), px,
+            MulAdd(_mm256_set1_ps(plane.y), py,
+                            MulAdd(_mm256_set1_ps(plane.z), pz,
+                                            _mm256_set1_ps(plane.w))));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, neg_radius, _CMP_GE_OQ));
+      }
+      uint32_t bits = _mm256_movemask_ps(inside);
+      for (int lane = 0; lane < 8; lane++) {
+        lane_masks[lane] |= ((bits >> lane) & 1) << v;
+      }
+    }
+    for (int lane = 0; lane < 8; lane++) {
+      masks[i + lane] = static_cast<uint8_t>(lane_masks[lane]);
+    }
+  }
+  return i;
+}
+
+#endif // CULLING_AVX2
+
+} // namespace
+
+void CullSpheres(const TransformStore &transforms, const uint32_t *handles,
+                 const glm::vec4 *local_spheres, size_t count,
+                 const Frustum *views, uint32_t view_count, uint8_t *masks) {
+  size_t i = 0;
+#if CULLING_AVX2
+  i = CullAvx2(transforms, handles, local_spheres, count, views, view_count,
+               masks);
+#endif
+  const glm::vec3 *positions = transforms.positions();
+  const glm::quat *rotations = transforms.rotations();
+  const glm::vec3 *scales = transforms.scales();
+  for (; i < count; i++) {
+    uint32_t h = handles[i];
+    masks[i] = CullOne(positions[h], rotations[h], scales[h], local_spheres[i],
+                       views, view_count);
+  }
+}
@@ -0,0 +1,28 @@
+#ifndef CULLING_H_
+#define CULLING_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+#include "transform_store.h"
+
+// Six inward-facing planes (xyz = normal, w = distance). A point p is inside
+// when dot(plane.xyz, p) + plane.w >= 0 for every plane.
+struct Frustum {
+    glm::vec4 planes[6];
+};
+
+// Extracts the clip volume of view_proj, using Vulkan's 0 <= z <= w depth
+// range since that's what the rasterizer clips against.
+Frustum ExtractFrustum(const glm::mat4& view_proj);
+
+// Transforms each instance's object-space bounding sphere (xyz = center,
+// w = radius) by its transform and sets bit v of masks[i] when the result
+// touches views[v]. Supports up to 8 views.
+void CullSpheres(const TransformStore& transforms, const uint32_t* handles,
+                 const glm::vec4* local_spheres, size_t count,
+                 const Frustum* views, uint32_t view_count, uint8_t* masks);
+
+#endif // CULLING_H_
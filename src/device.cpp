@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include <optional>
@@ -60,6 +61,18 @@ namespace {
         }
     }
 
+    const std::vector<const char*> kRequiredDeviceExtensions = {
+        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+    };
+
+    bool HasExtension(const std::vector<vk::ExtensionProperties>& extensions,
+                      const char* name) {
+        return std::any_of(extensions.begin(), extensions.end(),
+                           [&](const vk::ExtensionProperties& extension) {
+                               return std::strcmp(extension.extensionName, name) == 0;
+                           });
+    }
+
 static Device* g_Device = nullptr;
 }
 
@@ -131,7 +144,9 @@ bool Device::IsDeviceSuitable(vk::PhysicalDevice device) {
 
     auto queue_families = device.getQueueFamilyProperties();
     for (size_t i = 0; i < queue_families.size(); i++) {
-        if (queue_families[i].queueFlags & vk::QueueFlagBits::eGraphics) {
+        // The instance scatter pass runs compute on the graphics queue.
+        if ((queue_families[i].queueFlags & vk::QueueFlagBits::eGraphics) &&
+            (queue_families[i].queueFlags & vk::QueueFlagBits::eCompute)) {
             has_graphics = true;
         }
         if (device.getSurfaceSupportKHR((uint32_t)i, surface_)) {
@@ -139,6 +154,15 @@ bool Device::IsDeviceSuitable(vk::PhysicalDevice device) {
         }
     }
 
+    auto extensions = device.enumerateDeviceExtensionProperties();
+    for (const char* required : kRequiredDeviceExtensions) {
+        if (!HasExtension(extensions, required)) {
+            std::cerr << &device.getProperties().deviceName[0] << " lacks "
+                      << required << "." << std::endl;
+            return false;
+        }
+    }
+
     if (device.getSurfaceFormatsKHR(surface_).empty())
         return false;
     if (device.getSurfacePresentModesKHR(surface_).empty())
@@ -165,7 +189,8 @@ void Device::InitLogicalDevice() {
     auto queue_families = physical_device_.getQueueFamilyProperties();
     // Find graphics queue family
     for (size_t i = 0; i < queue_families.size(); i++) {
-        if (queue_families[i].queueFlags & vk::QueueFlagBits::eGraphics) {
+        if ((queue_families[i].queueFlags & vk::QueueFlagBits::eGraphics) &&
+            (queue_families[i].queueFlags & vk::QueueFlagBits::eCompute)) {
             graphics_queue_family_ = (uint32_t)i;
             break;
         }
@@ -189,19 +214,37 @@ void Device::InitLogicalDevice() {
         .setPQueuePriorities(&priority);
     vk::DeviceQueueCreateInfo infos[2] = {graphics_q_create_info, present_q_create_info};
 
-    const std::vector<const char*> required_extensions = {
-        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-    };
-
+    auto supported_features = physical_device_.getFeatures();
     vk::PhysicalDeviceFeatures features = {};
     features.samplerAnisotropy = true;
     features.sampleRateShading = true;
+    // One viewport per light's shadow tile, so all lights render at once.
+    features.multiViewport = supported_features.multiViewport;
+    // GPU culling picks each draw's slice of visible ids with firstInstance.
+    features.drawIndirectFirstInstance =
+        supported_features.drawIndirectFirstInstance;
+    // Lets a run of indirect draws go out as one call.
+    features.multiDrawIndirect = supported_features.multiDrawIndirect;
+    // Counts fragment shader invocations to measure draw ordering.
+    features.pipelineStatisticsQuery =
+        supported_features.pipelineStatisticsQuery;
+    enabled_features_ = features;
+
+    // Shadow passes pick each light's atlas tile with gl_ViewportIndex from
+    // the vertex shader where they can, so all lights render in one pass.
+    std::vector<const char*> enabled_extensions = kRequiredDeviceExtensions;
+    if (HasExtension(physical_device_.enumerateDeviceExtensionProperties(),
+                     VK_EXT_SHADER_VIEWPORT_INDEX_LAYER_EXTENSION_NAME)) {
+        enabled_extensions.push_back(
+            VK_EXT_SHADER_VIEWPORT_INDEX_LAYER_EXTENSION_NAME);
+        shader_viewport_index_layer_ = true;
+    }
 
     vk::DeviceCreateInfo create_info;
     create_info.setPQueueCreateInfos(infos)
         .setQueueCreateInfoCount((graphics_queue_family_ == present_queue_family_) ? 1 : 2)
-        .setEnabledExtensionCount((uint32_t)required_extensions.size())
-        .setPpEnabledExtensionNames(required_extensions.data())
+        .setEnabledExtensionCount((uint32_t)enabled_extensions.size())
+        .setPpEnabledExtensionNames(enabled_extensions.data())
         .setPEnabledFeatures(&features);
     
 
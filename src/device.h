@@ -66,6 +66,17 @@ public:
         return msaa_samples_;
     }
 
+    const vk::PhysicalDeviceFeatures& enabled_features() {
+        return enabled_features_;
+    }
+
+    // Whether VK_EXT_shader_viewport_index_layer is enabled, so vertex
+    // shaders can pick their viewport. Optional; without it, shadows render
+    // one light at a time.
+    bool shader_viewport_index_layer() {
+        return shader_viewport_index_layer_;
+    }
+
     void Present();
 private:
 
@@ -99,6 +110,8 @@ private:
     VmaAllocator allocator_;
 
     vk::SampleCountFlagBits msaa_samples_;
+    vk::PhysicalDeviceFeatures enabled_features_;
+    bool shader_viewport_index_layer_ = false;
 
 };
 
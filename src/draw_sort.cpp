@@ -0,0 +1,111 @@
+#include "draw_sort.h"
+
+#include <algorithm>
+
+#include "job_system.h"
+
+namespace {
+
+constexpr uint32_t kRadixBits = 8;
+constexpr uint32_t kRadixSize = 1u << kRadixBits;
+constexpr uint32_t kRadixPasses = 64 / kRadixBits;
+
+// Keys per sorting job; fewer than this sort on one thread.
+constexpr size_t kSortGrain = 16384;
+constexpr size_t kMaxSortChunks = 64;
+
+} // namespace
+
+void RadixSortDrawKeys(uint64_t *keys, uint32_t *values, size_t count,
+                       DrawSortScratch &scratch) {
+  if (count < 2) {
+    return;
+  }
+  JobSystem *jobs = JobSystem::Get();
+  size_t chunk_count =
+      std::min(std::max<size_t>(count / kSortGrain, 1), kMaxSortChunks);
+  size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+  auto chunk_range = [&](size_t chunk, size_t *begin, size_t *end) {
+    *begin = chunk * chunk_size;
+    *end = std::min(*begin + chunk_size, count);
+  };
+
+  // A byte needs a pass only if some key differs from the first in it.
+  uint64_t chunk_diffs[kMaxSortChunks] = {};
+  jobs->ParallelFor(0, chunk_count, 1, [&](size_t first, size_t last, uint32_t) {
+    for (size_t chunk = first; chunk < last; chunk++) {
+      size_t begin, end;
+      chunk_range(chunk, &begin, &end);
+      uint64_t diff = 0;
+      for (size_t i = begin; i < end; i++) {
+        diff |= keys[i] ^ keys[0];
+      }
+      chunk_diffs[chunk] = diff;
+    }
+  });
+  uint64_t diff = 0;
+  for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+    diff |= chunk_diffs[chunk];
+  }
+
+  scratch.keys.resize(count);
+  scratch.values.resize(count);
+  scratch.counts.resize(chunk_count * kRadixSize);
+  uint64_t *src_keys = keys, *dst_keys = scratch.keys.data();
+  uint32_t *src_values = values, *dst_values = scratch.values.data();
+  uint32_t *counts = scratch.counts.data();
+
+  for (uint32_t pass = 0; pass < kRadixPasses; pass++) {
+    uint32_t shift = pass * kRadixBits;
+    if (((diff >> shift) & (kRadixSize - 1)) == 0) {
+      continue;
+    }
+
+    jobs->ParallelFor(0, chunk_count, 1,
+                      [&](size_t first, size_t last, uint32_t) {
+                        for (size_t chunk = first; chunk < last; chunk++) {
+                          size_t begin, end;
+                          chunk_range(chunk, &begin, &end);
+                          uint32_t *histogram = counts + chunk * kRadixSize;
+                          std::fill(histogram, histogram + kRadixSize, 0);
+                          for (size_t i = begin; i < end; i++) {
+                            histogram[(src_keys[i] >> shift) &
+                                      (kRadixSize - 1)]++;
+                          }
+                        }
+                      });
+
+    // Offsets run digit-major, then chunk, so equal digits keep their order
+    // across chunks and the sort stays stable.
+    uint32_t sum = 0;
+    for (uint32_t digit = 0; digit < kRadixSize; digit++) {
+      for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+        uint32_t n = counts[chunk * kRadixSize + digit];
+        counts[chunk * kRadixSize + digit] = sum;
+        sum += n;
+      }
+    }
+
+    jobs->ParallelFor(0, chunk_count, 1,
+                      [&](size_t first, size_t last, uint32_t) {
+                        for (size_t chunk = first; chunk < last; chunk++) {
+                          size_t begin, end;
+                          chunk_range(chunk, &begin, &end);
+                          uint32_t *offsets = counts + chunk * kRadixSize;
+                          for (size_t i = begin; i < end; i++) {
+                            uint32_t o = offsets[(src_keys[i] >> shift) &
+                                                 (kRadixSize - 1)]++;
+                            dst_keys[o] = src_keys[i];
+                            dst_values[o] = src_values[i];
+                          }
+                        }
+                      });
+    std::swap(src_keys, dst_keys);
+    std::swap(src_values, dst_values);
+  }
+
+  if (src_keys != keys) {
+    std::copy(src_keys, src_keys + count, keys);
+    std::copy(src_values, src_values + count, values);
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef DRAW_SORT_H_
+#define DRAW_SORT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "constants.h"
+#include "render_passes.h"
+
+// Draw sort keys, most significant bits first:
+//   63-62  render pass
+//   61-40  draw bucket. Buckets are kept sorted by pipeline, then material,
+//          then mesh, so the index orders by all three at once.
+//   39-37  mesh LOD
+//   36-13  view depth, quantized to 24 bits
+// Sorting ascending groups draws by state and, within each bucket and LOD,
+// runs front to back.
+constexpr uint32_t kDrawKeyPassShift = 62;
+constexpr uint32_t kDrawKeyBucketShift = 40;
+constexpr uint32_t kDrawKeyBucketBits = 22;
+constexpr uint32_t kDrawKeyLodShift = 37;
+constexpr uint32_t kDrawKeyLodBits = 3;
+constexpr uint32_t kDrawKeyDepthShift = 13;
+constexpr uint32_t kDrawKeyDepthBits = 24;
+static_assert(kMaxMeshLods <= (1u << kDrawKeyLodBits),
+              "Draw keys have too few LOD bits");
+
+// depth is the view-space distance, which may be anything non-negative.
+inline uint64_t MakeDrawKey(RenderPass pass, uint32_t bucket, uint32_t lod,
+                            float depth) {
+    // d / (d + 1) keeps the order and spends most of the precision up close.
+    float unit = depth > 0.0f ? depth / (depth + 1.0f) : 0.0f;
+    uint64_t quantized =
+        static_cast<uint64_t>(unit * ((1u << kDrawKeyDepthBits) - 1));
+    return (uint64_t(pass) << kDrawKeyPassShift) |
+           (uint64_t(bucket) << kDrawKeyBucketShift) |
+           (uint64_t(lod) << kDrawKeyLodShift) |
+           (quantized << kDrawKeyDepthShift);
+}
+
+inline uint32_t DrawKeyBucket(uint64_t key) {
+    return static_cast<uint32_t>(key >> kDrawKeyBucketShift) &
+           ((1u << kDrawKeyBucketBits) - 1);
+}
+
+inline uint32_t DrawKeyLod(uint64_t key) {
+    return static_cast<uint32_t>(key >> kDrawKeyLodShift) &
+           ((1u << kDrawKeyLodBits) - 1);
+}
+
+// Reusable buffers for RadixSortDrawKeys, so steady-state sorts allocate
+// nothing.
+struct DrawSortScratch {
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> values;
+    std::vector<uint32_t> counts;
+};
+
+// Stable LSD radix sort of keys, carrying values along, one byte per pass.
+// Passes over bytes that every key shares are skipped, which drops the
+// unused low bits and, usually, the pass. Each pass histograms and scatters
+// chunks of the input as jobs.
+void RadixSortDrawKeys(uint64_t* keys, uint32_t* values, size_t count,
+                       DrawSortScratch& scratch);
+
+#endif // DRAW_SORT_H_
@@ -0,0 +1,221 @@
+#include "job_system.h"
+
+#include <algorithm>
+
+namespace {
+
+static JobSystem *g_JobSystem = nullptr;
+
+thread_local uint32_t t_worker_index = 0;
+
+constexpr size_t kScratchBlockSize = 256 * 1024;
+
+} // namespace
+
+void *ScratchArena::Allocate(size_t size, size_t alignment) {
+  while (block_ < blocks_.size()) {
+    Block &block = blocks_[block_];
+    uintptr_t base = reinterpret_cast<uintptr_t>(block.data.get());
+    uintptr_t aligned = (base + offset_ + alignment - 1) & ~(alignment - 1);
+    if (aligned + size <= base + block.size) {
+      offset_ = aligned + size - base;
+      return reinterpret_cast<void *>(aligned);
+    }
+    block_++;
+    offset_ = 0;
+  }
+
+  size_t block_size = std::max(kScratchBlockSize, size + alignment);
+  blocks_.push_back(Block{std::make_unique<char[]>(block_size), block_size});
+  block_ = blocks_.size() - 1;
+  offset_ = 0;
+  return Allocate(size, alignment);
+}
+
+void ScratchArena::Reset() {
+  block_ = 0;
+  offset_ = 0;
+}
+
+struct JobSystem::Job {
+  JobFunction fn;
+  // Unfinished dependencies, plus one held by Schedule until it's done wiring.
+  std::atomic<size_t> pending{1};
+  std::atomic<bool> done{false};
+  std::mutex mutex;
+  std::vector<JobHandle> continuations;
+  // Keeps the job alive while it sits in a queue.
+  JobHandle self;
+};
+
+JobSystem::JobSystem(uint32_t worker_count) {
+  g_JobSystem = this;
+
+  if (worker_count == 0) {
+    worker_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (uint32_t i = 0; i < worker_count; i++) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  // Only start threads once every deque exists, since workers steal.
+  for (uint32_t i = 1; i < worker_count; i++) {
+    workers_[i]->thread = std::thread([this, i]() { WorkerLoop(i); });
+  }
+}
+
+JobSystem::~JobSystem() {
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    quit_ = true;
+  }
+  wake_.notify_all();
+  for (auto &worker : workers_) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+  g_JobSystem = nullptr;
+}
+
+JobSystem *JobSystem::Get() { return g_JobSystem; }
+
+uint32_t JobSystem::CurrentWorker() { return t_worker_index; }
+
+JobSystem::JobHandle
+JobSystem::Schedule(JobFunction fn, const std::vector<JobHandle> &dependencies) {
+  auto job = std::make_shared<Job>();
+  job->fn = std::move(fn);
+  job->pending = dependencies.size() + 1;
+
+  for (const JobHandle &dependency : dependencies) {
+    std::lock_guard<std::mutex> lock(dependency->mutex);
+    if (dependency->done) {
+      job->pending--;
+    } else {
+      dependency->continuations.push_back(job);
+    }
+  }
+
+  if (--job->pending == 0) {
+    job->self = job;
+    Enqueue(job.get());
+  }
+  return job;
+}
+
+void JobSystem::Wait(const JobHandle &job) {
+  uint32_t worker = CurrentWorker();
+  while (!job->done) {
+    if (Job *next = Pop(worker)) {
+      Execute(next, worker);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void JobSystem::ParallelFor(size_t begin, size_t end, size_t grain,
+                            const RangeFunction &fn) {
+  if (end <= begin) {
+    return;
+  }
+
+  size_t count = end - begin;
+  // No point making more chunks than a few per worker.
+  grain = std::max({grain, size_t(1), count / (4 * workers_.size())});
+  size_t chunks = (count + grain - 1) / grain;
+  if (chunks == 1) {
+    fn(begin, end, CurrentWorker());
+    return;
+  }
+
+  std::vector<JobHandle> jobs;
+  jobs.reserve(chunks);
+  for (size_t chunk_begin = begin; chunk_begin < end; chunk_begin += grain) {
+    size_t chunk_end = std::min(end, chunk_begin + grain);
+    jobs.push_back(Schedule([&fn, chunk_begin, chunk_end](uint32_t worker) {
+      fn(chunk_begin, chunk_end, worker);
+    }));
+  }
+  for (const JobHandle &job : jobs) {
+    Wait(job);
+  }
+}
+
+void JobSystem::ResetScratch() {
+  for (auto &worker : workers_) {
+    worker->scratch.Reset();
+  }
+}
+
+void JobSystem::WorkerLoop(uint32_t index) {
+  t_worker_index = index;
+
+  while (true) {
+    if (Job *job = Pop(index)) {
+      Execute(job, index);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    wake_.wait(lock, [this]() { return quit_ || queued_ > 0; });
+    if (quit_) {
+      return;
+    }
+  }
+}
+
+void JobSystem::Enqueue(Job *job) {
+  Worker &worker = *workers_[CurrentWorker()];
+  {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.jobs.push_back(job);
+  }
+  {
+    std::lock_guard<std::mutex> lock(sleep_mutex_);
+    queued_++;
+  }
+  wake_.notify_one();
+}
+
+JobSystem::Job *JobSystem::Pop(uint32_t worker) {
+  size_t count = workers_.size();
+  for (size_t i = 0; i < count; i++) {
+    Worker &victim = *workers_[(worker + i) % count];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (victim.jobs.empty()) {
+      continue;
+    }
+
+    Job *job;
+    if (i == 0) {
+      job = victim.jobs.back();
+      victim.jobs.pop_back();
+    } else {
+      job = victim.jobs.front();
+      victim.jobs.pop_front();
+    }
+    queued_--;
+    return job;
+  }
+  return nullptr;
+}
+
+void JobSystem::Execute(Job *job, uint32_t worker) {
+  JobHandle keep_alive = std::move(job->self);
+  job->fn(worker);
+
+  std::vector<JobHandle> continuations;
+  {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->done = true;
+    continuations.swap(job->continuations);
+  }
+  for (JobHandle &continuation : continuations) {
+    if (--continuation->pending == 0) {
+      continuation->self = continuation;
+      Enqueue(continuation.get());
+    }
+  }
+}
@@ -0,0 +1,104 @@
+#ifndef JOB_SYSTEM_H_
+#define JOB_SYSTEM_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Linear allocator for short-lived per-worker memory. Allocations stay valid
+// until Reset(), which keeps the underlying blocks for reuse.
+class ScratchArena {
+public:
+    ScratchArena() = default;
+    ~ScratchArena() = default;
+
+    void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+    template <typename T>
+    T* Allocate(size_t count) {
+        return static_cast<T*>(Allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    void Reset();
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks_;
+    size_t block_ = 0;
+    size_t offset_ = 0;
+};
+
+// Work-stealing thread pool. Worker 0 is the thread that created the pool; it
+// runs jobs while it waits on them. Every other worker owns a deque it pushes
+// to and pops from at the back, and steals from the front of the others'.
+class JobSystem {
+public:
+    struct Job;
+    using JobHandle = std::shared_ptr<Job>;
+    using JobFunction = std::function<void(uint32_t worker)>;
+    using RangeFunction =
+        std::function<void(size_t begin, size_t end, uint32_t worker)>;
+
+    // worker_count of 0 uses the hardware concurrency.
+    explicit JobSystem(uint32_t worker_count = 0);
+    ~JobSystem();
+
+    static JobSystem* Get();
+
+    uint32_t worker_count() {
+        return static_cast<uint32_t>(workers_.size());
+    }
+
+    // Index of the calling thread's worker, for indexing per-worker data.
+    static uint32_t CurrentWorker();
+
+    // Runs fn once every job in dependencies has finished.
+    JobHandle Schedule(JobFunction fn,
+                       const std::vector<JobHandle>& dependencies = {});
+    void Wait(const JobHandle& job);
+
+    // Splits [begin, end) into chunks of at least grain items and runs them
+    // across the pool, returning once all of them are done.
+    void ParallelFor(size_t begin, size_t end, size_t grain,
+                     const RangeFunction& fn);
+
+    ScratchArena& scratch(uint32_t worker) {
+        return workers_[worker]->scratch;
+    }
+
+    // Frees every worker's scratch allocations. Only call between jobs.
+    void ResetScratch();
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Job*> jobs;
+        ScratchArena scratch;
+        std::thread thread;
+    };
+
+    void WorkerLoop(uint32_t index);
+    void Enqueue(Job* job);
+    Job* Pop(uint32_t worker);
+    void Execute(Job* job, uint32_t worker);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    std::atomic<size_t> queued_{0};
+    std::atomic<bool> quit_{false};
+};
+
+#endif  // JOB_SYSTEM_H_
@@ -9,9 +9,10 @@ static Layouts *g_Layouts = nullptr;
 
 vk::DescriptorSetLayout CreateDescriptorSetLayout_Scene() {
   vk::DescriptorSetLayoutBinding ubo_binding;
+  // Scene uniforms are sub-allocated per frame from the transient ring.
   ubo_binding.setBinding(0)
       .setDescriptorCount(1)
-      .setDescriptorType(vk::DescriptorType::eUniformBuffer)
+      .setDescriptorType(vk::DescriptorType::eUniformBufferDynamic)
       .setStageFlags(vk::ShaderStageFlagBits::eVertex |
                      vk::ShaderStageFlagBits::eFragment);
 
@@ -22,10 +23,11 @@ vk::DescriptorSetLayout CreateDescriptorSetLayout_Scene() {
           .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
           .setStageFlags(vk::ShaderStageFlagBits::eFragment);
 
+  // One 2D atlas with a tile per light.
   auto shadow_map_binding =
       vk::DescriptorSetLayoutBinding()
           .setBinding(2)
-          .setDescriptorCount(NUM_LIGHTS)
+          .setDescriptorCount(1)
           .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
           .setStageFlags(vk::ShaderStageFlagBits::eFragment);
 
@@ -36,8 +38,49 @@ vk::DescriptorSetLayout CreateDescriptorSetLayout_Scene() {
           .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
           .setStageFlags(vk::ShaderStageFlagBits::eFragment);
 
-  std::array<vk::DescriptorSetLayoutBinding, 4> bindings = {
-      ubo_binding, environment_map_binding, shadow_map_binding, irradiance_map_binding};
+  // The persistent instance buffer, indexed by instance id.
+  auto instance_binding =
+      vk::DescriptorSetLayoutBinding()
+          .setBinding(4)
+          .setDescriptorCount(1)
+          .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+          .setStageFlags(vk::ShaderStageFlagBits::eVertex);
+
+  // Each instance's bucket and each bucket's position quantization, which
+  // compact vertices are decoded with.
+  auto instance_buckets_binding =
+      vk::DescriptorSetLayoutBinding()
+          .setBinding(5)
+          .setDescriptorCount(1)
+          .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+          .setStageFlags(vk::ShaderStageFlagBits::eVertex);
+  auto quantization_binding =
+      vk::DescriptorSetLayoutBinding()
+          .setBinding(6)
+          .setDescriptorCount(1)
+          .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+          .setStageFlags(vk::ShaderStageFlagBits::eVertex);
+
+  // The shadow maps again, through a comparison sampler, and their EVSM
+  // moments. Which of 2, 7 and 8 basic.frag reads depends on its
+  // ShadowFilter.
+  auto shadow_compare_binding =
+      vk::DescriptorSetLayoutBinding()
+          .setBinding(7)
+          .setDescriptorCount(1)
+          .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+          .setStageFlags(vk::ShaderStageFlagBits::eFragment);
+  auto shadow_moments_binding =
+      vk::DescriptorSetLayoutBinding()
+          .setBinding(8)
+          .setDescriptorCount(1)
+          .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+          .setStageFlags(vk::ShaderStageFlagBits::eFragment);
+
+  std::array<vk::DescriptorSetLayoutBinding, 9> bindings = {
+      ubo_binding, environment_map_binding, shadow_map_binding, irradiance_map_binding,
+      instance_binding, instance_buckets_binding, quantization_binding,
+      shadow_compare_binding, shadow_moments_binding};
 
   vk::DescriptorSetLayoutCreateInfo create_info;
   create_info.setBindingCount(bindings.size()).setPBindings(bindings.data());
@@ -78,6 +121,56 @@ vk::DescriptorSetLayout CreateDescriptorSetLayout_Material() {
   return Device::Get()->device().createDescriptorSetLayout(create_info);
 }
 
+// Delta indices, delta instance data, and the persistent instance buffer.
+vk::DescriptorSetLayout CreateDescriptorSetLayout_InstanceScatter() {
+  std::array<vk::DescriptorSetLayoutBinding, 3> bindings = {};
+  for (uint32_t i = 0; i < bindings.size(); i++) {
+    bindings[i]
+        .setBinding(i)
+        .setDescriptorCount(1)
+        .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+        .setStageFlags(vk::ShaderStageFlagBits::eCompute);
+  }
+
+  auto create_info = vk::DescriptorSetLayoutCreateInfo().setBindings(bindings);
+
+  return Device::Get()->device().createDescriptorSetLayout(create_info);
+}
+
+// Instances, instance buckets, buckets, view planes, draw commands, visible
+// ids and instance LODs.
+vk::DescriptorSetLayout CreateDescriptorSetLayout_GpuCull() {
+  std::array<vk::DescriptorSetLayoutBinding, 7> bindings = {};
+  for (uint32_t i = 0; i < bindings.size(); i++) {
+    bindings[i]
+        .setBinding(i)
+        .setDescriptorCount(1)
+        .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+        .setStageFlags(vk::ShaderStageFlagBits::eCompute);
+  }
+
+  auto create_info = vk::DescriptorSetLayoutCreateInfo().setBindings(bindings);
+
+  return Device::Get()->device().createDescriptorSetLayout(create_info);
+}
+
+// The shadow maps, then the blur's source and destination moments.
+vk::DescriptorSetLayout CreateDescriptorSetLayout_EvsmBlur() {
+  std::array<vk::DescriptorSetLayoutBinding, 3> bindings = {};
+  for (uint32_t i = 0; i < bindings.size(); i++) {
+    bindings[i]
+        .setBinding(i)
+        .setDescriptorCount(1)
+        .setDescriptorType(i == 0 ? vk::DescriptorType::eCombinedImageSampler
+                                  : vk::DescriptorType::eStorageImage)
+        .setStageFlags(vk::ShaderStageFlagBits::eCompute);
+  }
+
+  auto create_info = vk::DescriptorSetLayoutCreateInfo().setBindings(bindings);
+
+  return Device::Get()->device().createDescriptorSetLayout(create_info);
+}
+
 } // namespace
 
 Layouts *Layouts::Get() { return g_Layouts; }
@@ -87,6 +180,9 @@ Layouts::Layouts() {
 
   scene_dsl_ = CreateDescriptorSetLayout_Scene();
   material_dsl_ = CreateDescriptorSetLayout_Material();
+  instance_scatter_dsl_ = CreateDescriptorSetLayout_InstanceScatter();
+  gpu_cull_dsl_ = CreateDescriptorSetLayout_GpuCull();
+  evsm_blur_dsl_ = CreateDescriptorSetLayout_EvsmBlur();
 
   std::array<vk::DescriptorSetLayout, 2> descriptor_set_layouts = {
       scene_dsl_, material_dsl_};
@@ -107,8 +203,16 @@ Layouts::Layouts() {
   general_pipeline_layout_ = Device::Get()->device().createPipelineLayout(
       general_pipeline_layout_info);
 
+  // Shadow passes only read the instance buffer from the scene set.
+  auto depth_only_push_constant_range =
+      vk::PushConstantRange()
+          .setOffset(0)
+          .setSize(sizeof(DepthOnlyPushConstants))
+          .setStageFlags(vk::ShaderStageFlagBits::eVertex);
   auto shadow_pipeline_layout_info =
-      vk::PipelineLayoutCreateInfo().setPushConstantRanges(push_constant_range);
+      vk::PipelineLayoutCreateInfo()
+          .setPushConstantRanges(depth_only_push_constant_range)
+          .setSetLayouts(scene_dsl_);
   shadow_pipeline_layout_ =
       Device::Get()->device().createPipelineLayout(shadow_pipeline_layout_info);
 
@@ -118,13 +222,61 @@ Layouts::Layouts() {
           .setSetLayouts(scene_dsl_);
   sky_pipeline_layout_ =
       Device::Get()->device().createPipelineLayout(sky_pipeline_layout_info);
+
+  auto scatter_push_constant_range =
+      vk::PushConstantRange()
+          .setOffset(0)
+          .setSize(sizeof(uint32_t))
+          .setStageFlags(vk::ShaderStageFlagBits::eCompute);
+  auto instance_scatter_pipeline_layout_info =
+      vk::PipelineLayoutCreateInfo()
+          .setPushConstantRanges(scatter_push_constant_range)
+          .setSetLayouts(instance_scatter_dsl_);
+  instance_scatter_pipeline_layout_ =
+      Device::Get()->device().createPipelineLayout(
+          instance_scatter_pipeline_layout_info);
+
+  // Four counts and flags, then the camera position and pixel scale.
+  auto gpu_cull_push_constant_range =
+      vk::PushConstantRange()
+          .setOffset(0)
+          .setSize(4 * sizeof(uint32_t) + sizeof(glm::vec4))
+          .setStageFlags(vk::ShaderStageFlagBits::eCompute);
+  auto gpu_cull_pipeline_layout_info =
+      vk::PipelineLayoutCreateInfo()
+          .setPushConstantRanges(gpu_cull_push_constant_range)
+          .setSetLayouts(gpu_cull_dsl_);
+  gpu_cull_pipeline_layout_ = Device::Get()->device().createPipelineLayout(
+      gpu_cull_pipeline_layout_info);
+
+  // Each light's atlas tile and shadow range, then whether the blur runs
+  // vertically.
+  auto evsm_blur_push_constant_range =
+      vk::PushConstantRange()
+          .setOffset(0)
+          .setSize(NUM_LIGHTS * (sizeof(glm::vec4) + sizeof(glm::vec2)) +
+                   sizeof(uint32_t))
+          .setStageFlags(vk::ShaderStageFlagBits::eCompute);
+  auto evsm_blur_pipeline_layout_info =
+      vk::PipelineLayoutCreateInfo()
+          .setPushConstantRanges(evsm_blur_push_constant_range)
+          .setSetLayouts(evsm_blur_dsl_);
+  evsm_blur_pipeline_layout_ = Device::Get()->device().createPipelineLayout(
+      evsm_blur_pipeline_layout_info);
 }
 
 Layouts::~Layouts() {
   g_Layouts = nullptr;
   Device::Get()->device().destroyDescriptorSetLayout(material_dsl_);
   Device::Get()->device().destroyDescriptorSetLayout(scene_dsl_);
+  Device::Get()->device().destroyDescriptorSetLayout(instance_scatter_dsl_);
+  Device::Get()->device().destroyDescriptorSetLayout(gpu_cull_dsl_);
+  Device::Get()->device().destroyDescriptorSetLayout(evsm_blur_dsl_);
   Device::Get()->device().destroyPipelineLayout(general_pipeline_layout_);
   Device::Get()->device().destroyPipelineLayout(shadow_pipeline_layout_);
   Device::Get()->device().destroyPipelineLayout(sky_pipeline_layout_);
+  Device::Get()->device().destroyPipelineLayout(
+      instance_scatter_pipeline_layout_);
+  Device::Get()->device().destroyPipelineLayout(gpu_cull_pipeline_layout_);
+  Device::Get()->device().destroyPipelineLayout(evsm_blur_pipeline_layout_);
 }
@@ -22,6 +22,30 @@ public:
         return sky_pipeline_layout_;
     }
 
+    vk::PipelineLayout instance_scatter_pipeline_layout() {
+        return instance_scatter_pipeline_layout_;
+    }
+
+    vk::DescriptorSetLayout instance_scatter_dsl() {
+        return instance_scatter_dsl_;
+    }
+
+    vk::PipelineLayout gpu_cull_pipeline_layout() {
+        return gpu_cull_pipeline_layout_;
+    }
+
+    vk::DescriptorSetLayout gpu_cull_dsl() {
+        return gpu_cull_dsl_;
+    }
+
+    vk::PipelineLayout evsm_blur_pipeline_layout() {
+        return evsm_blur_pipeline_layout_;
+    }
+
+    vk::DescriptorSetLayout evsm_blur_dsl() {
+        return evsm_blur_dsl_;
+    }
+
     vk::DescriptorSetLayout material_dsl() {
         return material_dsl_;
     }
@@ -34,9 +58,15 @@ private:
 
     vk::DescriptorSetLayout material_dsl_;
     vk::DescriptorSetLayout scene_dsl_;
+    vk::DescriptorSetLayout instance_scatter_dsl_;
+    vk::DescriptorSetLayout gpu_cull_dsl_;
+    vk::DescriptorSetLayout evsm_blur_dsl_;
     vk::PipelineLayout general_pipeline_layout_;
     vk::PipelineLayout shadow_pipeline_layout_;
     vk::PipelineLayout sky_pipeline_layout_;
+    vk::PipelineLayout instance_scatter_pipeline_layout_;
+    vk::PipelineLayout gpu_cull_pipeline_layout_;
+    vk::PipelineLayout evsm_blur_pipeline_layout_;
 };
 
 #endif // LAYOUTS_H_
@@ -1,11 +1,108 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
 
 #include "app.h"
+#include "benchmark.h"
 
-int main() {
-    App app;
+namespace {
+
+// Reads all of arg as a decimal count, rejecting anything that overflows
+// size_t. unsigned long is only 32 bits on MSVC, so this parses 64.
+bool ParseCount(const char* arg, size_t* count) {
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long value = std::strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0' || errno == ERANGE ||
+        value > (std::numeric_limits<size_t>::max)()) {
+        return false;
+    }
+    *count = static_cast<size_t>(value);
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    // render [--shadow-d16] [--bench-<name> [count]], in any order.
+    // --shadow-d16 renders shadow depth in 16 bits, for half the memory and
+    // bandwidth at coarser precision.
+    vk::Format shadow_format = vk::Format::eD32Sfloat;
+    const char* bench = nullptr;
+    size_t count = 0;
+    bool has_count = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--shadow-d16") == 0) {
+            shadow_format = vk::Format::eD16Unorm;
+        } else if (!bench && std::strncmp(argv[i], "--bench-", 8) == 0) {
+            bench = argv[i];
+            // Anything after it that isn't a flag must be its count.
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                i++;
+                if (!ParseCount(argv[i], &count)) {
+                    std::cerr << "Expected a count after " << bench
+                              << ", got " << argv[i] << "." << std::endl;
+                    return 1;
+                }
+                has_count = true;
+            }
+        } else {
+            std::cerr << "Unknown option " << argv[i] << "." << std::endl;
+            return 1;
+        }
+    }
+    auto count_or = [&](size_t fallback) {
+        return has_count ? count : fallback;
+    };
+    auto is_bench = [&](const char* name) {
+        return bench && std::strcmp(bench, name) == 0;
+    };
+
+    // render --bench-jobs [satellites]
+    if (is_bench("--bench-jobs")) {
+        RunJobBenchmark(count_or(9001));
+        return 0;
+    }
+    // render --bench-bvh [max satellites]
+    if (is_bench("--bench-bvh")) {
+        RunBvhBenchmark(count_or(100000));
+        return 0;
+    }
+    // render --bench-meshes
+    if (is_bench("--bench-meshes")) {
+        if (has_count) {
+            std::cerr << "--bench-meshes takes no count." << std::endl;
+            return 1;
+        }
+        RunMeshBenchmark();
+        return 0;
+    }
+    // render --bench-hierarchy [children]
+    if (is_bench("--bench-hierarchy")) {
+        RunHierarchyBenchmark(count_or(10000));
+        return 0;
+    }
+    // render --bench-sort [max instances]
+    if (is_bench("--bench-sort")) {
+        RunSortBenchmark(count_or(1000000));
+        return 0;
+    }
+    if (bench && !is_bench("--bench-draws")) {
+        std::cerr << "Unknown option " << bench << "." << std::endl;
+        return 1;
+    }
+
+    App app(shadow_format);
+
+    // render --bench-draws [meshes]
+    if (is_bench("--bench-draws")) {
+        app.RunDrawBenchmark(count_or(256));
+        return 0;
+    }
 
     app.Run();
 
     return 0;
-}
\ No newline at end of file
+}
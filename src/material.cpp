@@ -51,6 +51,57 @@ GetShaderStageCreateInfo(vk::ShaderStageFlagBits stage,
   return create_info;
 }
 
+// Shaders decode vertices according to specialization constant 0 and
+// instances according to constant 1. Constant 2 selects shadow.vert's
+// single-pass shadow atlas path, only built into shadow_atlas.vert.spv, and
+// constant 3 basic.frag's shadow filter.
+struct FormatSpecialization {
+  std::array<uint32_t, 4> formats;
+  std::array<vk::SpecializationMapEntry, 4> entries;
+  vk::SpecializationInfo info;
+
+  FormatSpecialization(VertexFormat vertex_format,
+                       InstanceFormat instance_format,
+                       bool shadow_atlas = false,
+                       ShadowFilter shadow_filter = ShadowFilter::Pcf)
+      : formats{{static_cast<uint32_t>(vertex_format),
+                 static_cast<uint32_t>(instance_format),
+                 static_cast<uint32_t>(shadow_atlas),
+                 static_cast<uint32_t>(shadow_filter)}},
+        entries{{vk::SpecializationMapEntry(0, 0, sizeof(uint32_t)),
+                 vk::SpecializationMapEntry(1, sizeof(uint32_t),
+                                            sizeof(uint32_t)),
+                 vk::SpecializationMapEntry(2, 2 * sizeof(uint32_t),
+                                            sizeof(uint32_t)),
+                 vk::SpecializationMapEntry(3, 3 * sizeof(uint32_t),
+                                            sizeof(uint32_t))}},
+        info(static_cast<uint32_t>(entries.size()), entries.data(),
+             sizeof(formats), formats.data()) {}
+  FormatSpecialization(const FormatSpecialization &) = delete;
+};
+
+// specialization may be null for shaders without specialization constants.
+vk::Pipeline CreateComputePipeline(const std::string &filename,
+                                   vk::PipelineLayout layout,
+                                   const vk::SpecializationInfo *specialization) {
+  auto comp = CreateShaderModule(filename);
+
+  auto stage =
+      GetShaderStageCreateInfo(vk::ShaderStageFlagBits::eCompute, comp);
+  stage.setPSpecializationInfo(specialization);
+
+  auto pipeline_create_info =
+      vk::ComputePipelineCreateInfo().setStage(stage).setLayout(layout);
+  vk::Pipeline res = Device::Get()
+                         ->device()
+                         .createComputePipeline(nullptr, pipeline_create_info)
+                         .value;
+
+  Device::Get()->device().destroyShaderModule(comp);
+
+  return res;
+}
+
 } // namespace
 
 std::weak_ptr<OpaqueMaterial::Pipelines> OpaqueMaterial::s_pipelines_{};
@@ -137,29 +188,69 @@ OpaqueMaterial::~OpaqueMaterial() {
 }
 
 OpaqueMaterial::Pipelines::Pipelines() {
-  InitOpaquePass();
-  InitShadowPass();
+  // The other filters are rarely used, so they wait until they're picked
+  // rather than slow every startup.
+  BuildShadowFilter(ShadowFilter::Pcf);
+  for (uint32_t i = 0; i < kInstanceFormatCount; i++) {
+    InstanceFormat instance_format = static_cast<InstanceFormat>(i);
+    for (RenderPass pass : {RenderPass::Shadow, RenderPass::DepthPrepass}) {
+      InitDepthOnlyPass<Vertex>(instance_format, pass);
+      InitDepthOnlyPass<CompactVertex>(instance_format, pass);
+    }
+  }
+}
+
+void OpaqueMaterial::Pipelines::BuildShadowFilter(ShadowFilter shadow_filter) {
+  bool &built = built_filters_[static_cast<uint32_t>(shadow_filter)];
+  if (built) {
+    return;
+  }
+  built = true;
+  for (uint32_t i = 0; i < kInstanceFormatCount; i++) {
+    InstanceFormat instance_format = static_cast<InstanceFormat>(i);
+    for (bool after_prepass : {false, true}) {
+      InitOpaquePass<Vertex>(instance_format, after_prepass, shadow_filter);
+      InitOpaquePass<CompactVertex>(instance_format, after_prepass,
+                                    shadow_filter);
+    }
+  }
 }
 
 OpaqueMaterial::Pipelines::~Pipelines() {
-  Device::Get()->device().destroyPipeline(opaque_pass);
-  Device::Get()->device().destroyPipeline(shadow_pass);
+  // Filters never built leave null pipelines, which destroy ignores.
+  for (uint32_t v = 0; v < kVertexFormatCount; v++) {
+    for (uint32_t i = 0; i < kInstanceFormatCount; i++) {
+      for (uint32_t f = 0; f < kShadowFilterCount; f++) {
+        Device::Get()->device().destroyPipeline(opaque_pass[f][v][i]);
+        Device::Get()->device().destroyPipeline(opaque_after_prepass[f][v][i]);
+      }
+      Device::Get()->device().destroyPipeline(shadow_pass[v][i]);
+      Device::Get()->device().destroyPipeline(depth_prepass[v][i]);
+    }
+  }
 }
 
-void OpaqueMaterial::Pipelines::InitOpaquePass() {
+template <typename V>
+void OpaqueMaterial::Pipelines::InitOpaquePass(InstanceFormat instance_format,
+                                               bool after_prepass,
+                                               ShadowFilter shadow_filter) {
   auto vert = CreateShaderModule("./basic.vert.spv");
   auto frag = CreateShaderModule("./basic.frag.spv");
 
+  FormatSpecialization specialization(VertexLayout<V>::kFormat,
+                                      instance_format, false, shadow_filter);
   auto vert_stage =
       GetShaderStageCreateInfo(vk::ShaderStageFlagBits::eVertex, vert);
+  vert_stage.setPSpecializationInfo(&specialization.info);
   auto frag_stage =
       GetShaderStageCreateInfo(vk::ShaderStageFlagBits::eFragment, frag);
+  frag_stage.setPSpecializationInfo(&specialization.info);
 
   vk::PipelineShaderStageCreateInfo shader_stages[] = {vert_stage, frag_stage};
 
   vk::PipelineVertexInputStateCreateInfo vertex_input;
-  auto vertex_bindings = GetVertexInputBindingDescriptions();
-  auto vertex_attributes = GetVertexInputAttributeDescriptions();
+  auto vertex_bindings = GetVertexInputBindingDescriptions<V>();
+  auto vertex_attributes = GetVertexInputAttributeDescriptions<V>();
 
   vertex_input
       .setVertexBindingDescriptionCount(
@@ -202,12 +293,17 @@ void OpaqueMaterial::Pipelines::InitOpaquePass() {
     .setMinSampleShading(1.0f)
     .setRasterizationSamples(Device::Get()->msaa_samples());
 
-  auto depth_stencil_state = vk::PipelineDepthStencilStateCreateInfo()
-                                 .setDepthTestEnable(true)
-                                 .setDepthWriteEnable(true)
-                                 .setDepthCompareOp(vk::CompareOp::eLess)
-                                 .setDepthBoundsTestEnable(false)
-                                 .setStencilTestEnable(false);
+  // After a prepass the depth buffer already holds the nearest surface, so
+  // only fragments of that surface pass. basic.vert and shadow.vert declare
+  // gl_Position invariant, which makes their depths match exactly.
+  auto depth_stencil_state =
+      vk::PipelineDepthStencilStateCreateInfo()
+          .setDepthTestEnable(true)
+          .setDepthWriteEnable(!after_prepass)
+          .setDepthCompareOp(after_prepass ? vk::CompareOp::eEqual
+                                           : vk::CompareOp::eLess)
+          .setDepthBoundsTestEnable(false)
+          .setStencilTestEnable(false);
 
   vk::PipelineColorBlendAttachmentState color_blend_attachment;
   color_blend_attachment
@@ -235,29 +331,43 @@ void OpaqueMaterial::Pipelines::InitOpaquePass() {
       .setRenderPass(RenderPasses::Get()->GetRenderPass(RenderPass::Opaque))
       .setSubpass(0);
 
-  opaque_pass = Device::Get()
-                    ->device()
-                    .createGraphicsPipeline(nullptr, create_info)
-                    .value;
+  auto &pipelines =
+      (after_prepass ? opaque_after_prepass
+                     : opaque_pass)[static_cast<uint32_t>(shadow_filter)];
+  pipelines[static_cast<uint32_t>(VertexLayout<V>::kFormat)]
+           [static_cast<uint32_t>(instance_format)] =
+      Device::Get()->device().createGraphicsPipeline(nullptr, create_info).value;
 
   Device::Get()->device().destroyShaderModule(vert);
   Device::Get()->device().destroyShaderModule(frag);
 }
 
-void OpaqueMaterial::Pipelines::InitShadowPass() {
-  auto vert = CreateShaderModule("./shadow.vert.spv");
+template <typename V>
+void OpaqueMaterial::Pipelines::InitDepthOnlyPass(InstanceFormat instance_format,
+                                                  RenderPass pass) {
+  // Shadow passes draw every light's tile of the atlas at once where the
+  // device lets shadow.vert pick viewports, which takes its own build of the
+  // shader. Otherwise they draw a light at a time.
+  bool shadow = pass == RenderPass::Shadow;
+  bool single_pass = shadow && RenderPasses::Get()->single_pass_shadows();
+  auto vert = CreateShaderModule(single_pass ? "./shadow_atlas.vert.spv"
+                                             : "./shadow.vert.spv");
   auto frag = CreateShaderModule("./shadow.frag.spv");
 
+  FormatSpecialization specialization(VertexLayout<V>::kFormat,
+                                      instance_format, single_pass);
   auto vert_stage =
       GetShaderStageCreateInfo(vk::ShaderStageFlagBits::eVertex, vert);
+  vert_stage.setPSpecializationInfo(&specialization.info);
   auto frag_stage =
       GetShaderStageCreateInfo(vk::ShaderStageFlagBits::eFragment, frag);
 
   std::array<vk::PipelineShaderStageCreateInfo, 2> shader_stages = {vert_stage,
                                                                     frag_stage};
 
-  auto vert_bindings = GetVertexInputBindingDescriptions();
-  auto vert_attributes = GetVertexInputAttributeDescriptions();
+  // Depth only needs positions, so read the packed position stream.
+  auto vert_bindings = GetPositionInputBindingDescriptions<V>();
+  auto vert_attributes = GetPositionInputAttributeDescriptions<V>();
 
   auto vertex_input_state =
       vk::PipelineVertexInputStateCreateInfo()
@@ -269,19 +379,33 @@ void OpaqueMaterial::Pipelines::InitShadowPass() {
           .setTopology(vk::PrimitiveTopology::eTriangleList)
           .setPrimitiveRestartEnable(false);
 
+  // The prepass draws into the opaque pass's framebuffer, with its samples
+  // and its color attachment, which it leaves untouched.
+  vk::Extent2D extent = Device::Get()->swapchain_extent();
   auto viewport = vk::Viewport()
-                      .setWidth((float)kShadowMapSize)
-                      .setHeight((float)kShadowMapSize)
+                      .setWidth((float)extent.width)
+                      .setHeight((float)extent.height)
                       .setX(0.0f)
                       .setY(0.0f)
                       .setMinDepth(0.0f)
                       .setMaxDepth(1.0f);
-  auto scissor = vk::Rect2D().setOffset({0, 0}).setExtent(
-      {kShadowMapSize, kShadowMapSize});
+  auto scissor = vk::Rect2D().setOffset({0, 0}).setExtent(extent);
 
   auto viewport_state =
       vk::PipelineViewportStateCreateInfo().setViewports(viewport).setScissors(
           scissor);
+  // Shadow passes get a viewport and scissor over each light's tile, which
+  // move every frame: one per light when drawn at once.
+  std::array<vk::DynamicState, 2> dynamic_states = {
+      vk::DynamicState::eViewport, vk::DynamicState::eScissor};
+  auto dynamic_state =
+      vk::PipelineDynamicStateCreateInfo().setDynamicStates(dynamic_states);
+  if (shadow) {
+    uint32_t viewport_count = single_pass ? NUM_LIGHTS : 1;
+    viewport_state = vk::PipelineViewportStateCreateInfo()
+                         .setViewportCount(viewport_count)
+                         .setScissorCount(viewport_count);
+  }
 
   auto rasterizer_state = vk::PipelineRasterizationStateCreateInfo()
                               .setDepthClampEnable(false)
@@ -295,7 +419,8 @@ void OpaqueMaterial::Pipelines::InitShadowPass() {
   auto multisample_state =
       vk::PipelineMultisampleStateCreateInfo()
           .setSampleShadingEnable(false)
-          .setRasterizationSamples(vk::SampleCountFlagBits::e1);
+          .setRasterizationSamples(shadow ? vk::SampleCountFlagBits::e1
+                                          : Device::Get()->msaa_samples());
 
   auto depth_stencil_state = vk::PipelineDepthStencilStateCreateInfo()
                                  .setDepthTestEnable(true)
@@ -304,6 +429,14 @@ void OpaqueMaterial::Pipelines::InitShadowPass() {
                                  .setDepthBoundsTestEnable(false)
                                  .setStencilTestEnable(false);
 
+  // Shadow passes have no color attachment to describe.
+  auto color_blend_attachment = vk::PipelineColorBlendAttachmentState()
+                                    .setColorWriteMask({})
+                                    .setBlendEnable(false);
+  auto color_blend_state = vk::PipelineColorBlendStateCreateInfo()
+                               .setLogicOpEnable(false)
+                               .setAttachments(color_blend_attachment);
+
   auto pipeline_create_info =
       vk::GraphicsPipelineCreateInfo()
           .setLayout(Layouts::Get()->shadow_pipeline_layout())
@@ -314,12 +447,17 @@ void OpaqueMaterial::Pipelines::InitShadowPass() {
           .setPRasterizationState(&rasterizer_state)
           .setPMultisampleState(&multisample_state)
           .setPDepthStencilState(&depth_stencil_state)
-          .setRenderPass(RenderPasses::Get()->GetRenderPass(RenderPass::Shadow))
+          .setPColorBlendState(shadow ? nullptr : &color_blend_state)
+          .setPDynamicState(shadow ? &dynamic_state : nullptr)
+          .setRenderPass(RenderPasses::Get()->GetRenderPass(pass))
           .setSubpass(0);
-  shadow_pass = Device::Get()
-                    ->device()
-                    .createGraphicsPipeline(nullptr, pipeline_create_info)
-                    .value;
+  auto &pipelines = shadow ? shadow_pass : depth_prepass;
+  pipelines[static_cast<uint32_t>(VertexLayout<V>::kFormat)]
+           [static_cast<uint32_t>(instance_format)] =
+      Device::Get()
+          ->device()
+          .createGraphicsPipeline(nullptr, pipeline_create_info)
+          .value;
 
   Device::Get()->device().destroyShaderModule(vert);
   Device::Get()->device().destroyShaderModule(frag);
@@ -337,23 +475,36 @@ std::shared_ptr<OpaqueMaterial::Pipelines> OpaqueMaterial::GetPipelines() {
   return pipelines;
 }
 
-vk::Pipeline OpaqueMaterial::GetPipelineForRenderPass(RenderPass pass) {
+vk::Pipeline
+OpaqueMaterial::GetPipelineForRenderPass(RenderPass pass, VertexFormat format,
+                                         InstanceFormat instance_format,
+                                         ShadowFilter shadow_filter) {
+  uint32_t v = static_cast<uint32_t>(format);
+  uint32_t i = static_cast<uint32_t>(instance_format);
+  uint32_t f = static_cast<uint32_t>(shadow_filter);
+  if (pass == RenderPass::Opaque || pass == RenderPass::OpaqueAfterPrepass) {
+    pipelines_->BuildShadowFilter(shadow_filter);
+  }
   if (pass == RenderPass::Opaque) {
-    return pipelines_->opaque_pass;
+    return pipelines_->opaque_pass[f][v][i];
   } else if (pass == RenderPass::Shadow) {
-    return pipelines_->shadow_pass;
+    return pipelines_->shadow_pass[v][i];
+  } else if (pass == RenderPass::DepthPrepass) {
+    return pipelines_->depth_prepass[v][i];
+  } else if (pass == RenderPass::OpaqueAfterPrepass) {
+    return pipelines_->opaque_after_prepass[f][v][i];
   }
   return nullptr;
 }
 
 vk::PipelineLayout
 OpaqueMaterial::GetPipelineLayoutForRenderPass(RenderPass pass) {
-  if (pass == RenderPass::Opaque) {
-    return Layouts::Get()->general_pipeline_layout();
-  } else if (pass == RenderPass::Shadow) {
-    return Layouts::Get()->general_pipeline_layout();
+  // Depth-only pipelines are built with the shadow layout, which holds the
+  // scene set alone.
+  if (IsDepthOnlyPass(pass)) {
+    return Layouts::Get()->shadow_pipeline_layout();
   }
-  return nullptr;
+  return Layouts::Get()->general_pipeline_layout();
 }
 
 vk::Pipeline GetSkyPipeline() {
@@ -441,3 +592,23 @@ vk::Pipeline GetSkyPipeline() {
 
   return res;
 }
+
+vk::Pipeline GetInstanceScatterPipeline(InstanceFormat instance_format) {
+  FormatSpecialization specialization(VertexFormat::Full, instance_format);
+  return CreateComputePipeline(
+      "./instance_scatter.comp.spv",
+      Layouts::Get()->instance_scatter_pipeline_layout(), &specialization.info);
+}
+
+vk::Pipeline GetGpuCullPipeline(InstanceFormat instance_format) {
+  FormatSpecialization specialization(VertexFormat::Full, instance_format);
+  return CreateComputePipeline("./gpu_cull.comp.spv",
+                               Layouts::Get()->gpu_cull_pipeline_layout(),
+                               &specialization.info);
+}
+
+vk::Pipeline GetEvsmBlurPipeline() {
+  return CreateComputePipeline("./evsm_blur.comp.spv",
+                               Layouts::Get()->evsm_blur_pipeline_layout(),
+                               nullptr);
+}
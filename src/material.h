@@ -7,16 +7,30 @@
 
 #include "render_passes.h"
 #include "resource_manager.h"
+#include "structures.h"
 #include "texture.h"
 
 class Material {
  public:
   virtual ~Material() = default;
 
-  virtual vk::Pipeline GetPipelineForRenderPass(RenderPass pass) = 0;
+  // Pipelines differ only in how they read vertices and instances of the
+  // given formats and, in shading passes, how they filter shadows.
+  virtual vk::Pipeline GetPipelineForRenderPass(
+      RenderPass pass, VertexFormat format, InstanceFormat instance_format,
+      ShadowFilter shadow_filter) = 0;
   virtual vk::PipelineLayout GetPipelineLayoutForRenderPass(
       RenderPass pass) = 0;
   virtual vk::DescriptorSet GetMaterialDescriptorSetForRenderPass(RenderPass pass) = 0;
+
+  // Order the Renderer registered the material in, which draw buckets sort
+  // by.
+  uint32_t ordinal() const { return ordinal_; }
+
+ private:
+  friend class Renderer;
+
+  uint32_t ordinal_ = 0;
 };
 
 class OpaqueMaterial : public Material {
@@ -24,7 +38,9 @@ class OpaqueMaterial : public Material {
   OpaqueMaterial(const std::string& diffuse_map, const std::string& normal_map, float ior, float roughness, float metalness);
   ~OpaqueMaterial();
 
-  vk::Pipeline GetPipelineForRenderPass(RenderPass pass) override;
+  vk::Pipeline GetPipelineForRenderPass(
+      RenderPass pass, VertexFormat format, InstanceFormat instance_format,
+      ShadowFilter shadow_filter) override;
   vk::PipelineLayout GetPipelineLayoutForRenderPass(RenderPass pass) override;
   vk::DescriptorSet GetMaterialDescriptorSetForRenderPass(RenderPass pass) override {
     return descriptor_set_;
@@ -32,15 +48,32 @@ class OpaqueMaterial : public Material {
 
  private:
   struct Pipelines {
-    vk::Pipeline opaque_pass;
-    vk::Pipeline shadow_pass;
+    // Indexed by VertexFormat, then InstanceFormat. Shading passes come in
+    // one set per ShadowFilter; only the Pcf set is built up front.
+    vk::Pipeline opaque_pass[kShadowFilterCount][kVertexFormatCount]
+                            [kInstanceFormatCount];
+    vk::Pipeline shadow_pass[kVertexFormatCount][kInstanceFormatCount];
+    vk::Pipeline depth_prepass[kVertexFormatCount][kInstanceFormatCount];
+    vk::Pipeline opaque_after_prepass[kShadowFilterCount][kVertexFormatCount]
+                                     [kInstanceFormatCount];
 
     Pipelines();
     ~Pipelines();
 
+    // Builds the shading passes' set for shadow_filter, the first time it
+    // is asked for.
+    void BuildShadowFilter(ShadowFilter shadow_filter);
+
   private:
-    void InitOpaquePass();
-    void InitShadowPass();
+    bool built_filters_[kShadowFilterCount] = {};
+
+    // after_prepass selects the equal-depth, no-write variant.
+    template <typename V>
+    void InitOpaquePass(InstanceFormat instance_format, bool after_prepass,
+                        ShadowFilter shadow_filter);
+    // Shadow or DepthPrepass; both rasterize the position stream only.
+    template <typename V>
+    void InitDepthOnlyPass(InstanceFormat instance_format, RenderPass pass);
   };
   static std::weak_ptr<Pipelines> s_pipelines_;
   static std::shared_ptr<Pipelines> GetPipelines();
@@ -63,5 +96,8 @@ class OpaqueMaterial : public Material {
 };
 
 vk::Pipeline GetSkyPipeline();
+vk::Pipeline GetInstanceScatterPipeline(InstanceFormat instance_format);
+vk::Pipeline GetGpuCullPipeline(InstanceFormat instance_format);
+vk::Pipeline GetEvsmBlurPipeline();
 
 #endif  // MATERIAL_H_
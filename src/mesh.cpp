@@ -1,26 +1,41 @@
 #include "mesh.h"
 
+#include <functional>
+#include <limits>
+#include <unordered_map>
+
 #include <assimp/Importer.hpp>
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
 
+#include "constants.h"
+#include "mesh_pool.h"
+#include "simplify.h"
 #include "structures.h"
 
-Mesh::Mesh() {
-  static Vertex vertices[3] = {
-      {glm::vec3(0.0f, -0.5f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
-       glm::normalize(glm::vec3(0.5f, 1.0f, 0.0f)), glm::vec2(0.0f, 0.0f)},
-      {glm::vec3(0.5f, 0.5f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
-       glm::normalize(glm::vec3(-0.5f, -1.0f, 0.0f)), glm::vec2(1.0f, 0.0f)},
-      {glm::vec3(-0.5f, 0.5f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
-       glm::normalize(glm::vec3(-1.0f, 0.0f, 0.0f)), glm::vec2(0.0f, 1.0f)}};
-  vertex_count_ = 3;
-  vertex_buffer_ = ResourceManager::Get()->CreateDeviceBufferWithData(
-      vk::BufferUsageFlagBits::eVertexBuffer, (const void *)&vertices,
-      sizeof(vertices));
-}
+namespace {
 
-Mesh::Mesh(const std::string &filename) {
+// Levels below this many triangles aren't worth a separate draw.
+constexpr size_t kMinLodTriangles = 16;
+
+// A level that keeps more than this fraction of the previous one's
+// triangles means the simplifier ran out of safe collapses.
+constexpr float kMinLodReduction = 0.8f;
+
+// Half floats hold texcoords within this range to 1/1024 or better; meshes
+// that tile further stay in the full format.
+constexpr float kMaxCompactTexcoord = 4.0f;
+
+struct PositionHash {
+  size_t operator()(const glm::vec3 &p) const {
+    std::hash<float> hash;
+    return hash(p.x) ^ (hash(p.y) * 31) ^ (hash(p.z) * 131);
+  }
+};
+
+} // namespace
+
+std::vector<Vertex> LoadMeshVertices(const std::string &filename) {
   std::vector<Vertex> vertices;
 
   Assimp::Importer importer;
@@ -56,11 +71,138 @@ Mesh::Mesh(const std::string &filename) {
       });
     }
   }
+  return vertices;
+}
 
-  vertex_count_ = vertices.size();
-  vertex_buffer_ = ResourceManager::Get()->CreateDeviceBufferWithData(
-      vk::BufferUsageFlagBits::eVertexBuffer, vertices.data(),
-      sizeof(Vertex) * vertices.size());
+Mesh::Mesh() {
+  IndexedMesh triangle;
+  triangle.vertices = {
+      {glm::vec3(0.0f, -0.5f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+       glm::normalize(glm::vec3(0.5f, 1.0f, 0.0f)), glm::vec2(0.0f, 0.0f)},
+      {glm::vec3(0.5f, 0.5f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+       glm::normalize(glm::vec3(-0.5f, -1.0f, 0.0f)), glm::vec2(1.0f, 0.0f)},
+      {glm::vec3(-0.5f, 0.5f, 0.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+       glm::normalize(glm::vec3(-1.0f, 0.0f, 0.0f)), glm::vec2(0.0f, 1.0f)}};
+  triangle.indices = {0, 1, 2};
+  ComputeBounds(triangle.vertices.data(), triangle.vertices.size());
+  AddLod(triangle, 0.0f);
+}
+
+Mesh::Mesh(const std::string &filename) {
+  std::vector<Vertex> vertices = LoadMeshVertices(filename);
+  ComputeBounds(vertices.data(), vertices.size());
+
+  bool compact = true;
+  for (const Vertex &vertex : vertices) {
+    compact = compact && glm::abs(vertex.texcoord.x) <= kMaxCompactTexcoord &&
+              glm::abs(vertex.texcoord.y) <= kMaxCompactTexcoord;
+  }
+  if (compact) {
+    vertex_format_ = VertexFormat::Compact;
+    position_quantization_.offset = glm::vec4(aabb_min_, 0.0f);
+    position_quantization_.scale = glm::vec4(aabb_max_ - aabb_min_, 0.0f);
+  }
+
+  // Shared corners are merged so each is transformed once per cache hit
+  // rather than once per triangle.
+  IndexedMesh mesh = DeduplicateVertices(vertices.data(), vertices.size());
+  AddLod(mesh, 0.0f);
+  GenerateLods(vertices);
 }
 
 Mesh::~Mesh() {}
+
+void Mesh::ComputeBounds(const Vertex *vertices, size_t count) {
+  aabb_min_ = glm::vec3(std::numeric_limits<float>::max());
+  aabb_max_ = glm::vec3(std::numeric_limits<float>::lowest());
+  for (size_t i = 0; i < count; i++) {
+    aabb_min_ = glm::min(aabb_min_, vertices[i].position);
+    aabb_max_ = glm::max(aabb_max_, vertices[i].position);
+  }
+
+  // Centered on the box, with the farthest vertex setting the radius.
+  glm::vec3 center = 0.5f * (aabb_min_ + aabb_max_);
+  float radius_squared = 0.0f;
+  for (size_t i = 0; i < count; i++) {
+    glm::vec3 offset = vertices[i].position - center;
+    radius_squared = glm::max(radius_squared, glm::dot(offset, offset));
+  }
+  bounding_sphere_ = glm::vec4(center, glm::sqrt(radius_squared));
+}
+
+void Mesh::GenerateLods(const std::vector<Vertex> &vertices) {
+  // The loaded list repeats every corner, so weld by position first to give
+  // the simplifier connected triangles. A welded vertex keeps its first
+  // corner's uv and the average of the normals and tangents meeting there;
+  // coarse levels lose hard edges and uv seams, but they're only drawn too
+  // small for that to show.
+  std::unordered_map<glm::vec3, uint32_t, PositionHash> welded_index;
+  std::vector<glm::vec3> positions;
+  std::vector<Vertex> welded;
+  std::vector<uint32_t> indices;
+  indices.reserve(vertices.size());
+  for (const Vertex &vertex : vertices) {
+    auto inserted = welded_index.emplace(
+        vertex.position, static_cast<uint32_t>(positions.size()));
+    if (inserted.second) {
+      positions.push_back(vertex.position);
+      welded.push_back(Vertex{vertex.position, glm::vec3(0.0f),
+                              glm::vec3(0.0f), vertex.texcoord});
+    }
+    uint32_t index = inserted.first->second;
+    welded[index].normal += vertex.normal;
+    welded[index].tangent += vertex.tangent;
+    indices.push_back(index);
+  }
+  for (Vertex &vertex : welded) {
+    if (glm::dot(vertex.normal, vertex.normal) > 0.0f) {
+      vertex.normal = glm::normalize(vertex.normal);
+    }
+    if (glm::dot(vertex.tangent, vertex.tangent) > 0.0f) {
+      vertex.tangent = glm::normalize(vertex.tangent);
+    }
+  }
+
+  MeshSimplifier simplifier(indices.data(), indices.size(), positions.data(),
+                            positions.size());
+  size_t previous_count = indices.size();
+  while (lods_.size() < kMaxMeshLods) {
+    size_t target = previous_count / 2;
+    if (target < 3 * kMinLodTriangles) {
+      break;
+    }
+    std::vector<uint32_t> lod_indices = simplifier.Simplify(target);
+    if (lod_indices.size() > kMinLodReduction * previous_count) {
+      break;
+    }
+
+    previous_count = lod_indices.size();
+    IndexedMesh lod;
+    lod.vertices = welded;
+    lod.indices = std::move(lod_indices);
+    AddLod(lod, glm::max(simplifier.error(), lods_.back().error));
+  }
+}
+
+void Mesh::AddLod(IndexedMesh &mesh, float error) {
+  OptimizeMesh(mesh);
+
+  MeshPool *pool = MeshPool::Get();
+  Lod lod;
+  if (vertex_format_ == VertexFormat::Compact) {
+    std::vector<CompactVertex> compact;
+    compact.reserve(mesh.vertices.size());
+    for (const Vertex &vertex : mesh.vertices) {
+      compact.push_back(CompressVertex(vertex, position_quantization_));
+    }
+    lod.vertex_offset = static_cast<int32_t>(
+        pool->AddVertices(compact.data(), compact.size()));
+  } else {
+    lod.vertex_offset = static_cast<int32_t>(
+        pool->AddVertices(mesh.vertices.data(), mesh.vertices.size()));
+  }
+  lod.first_index = pool->AddIndices(mesh.indices.data(), mesh.indices.size());
+  lod.index_count = static_cast<uint32_t>(mesh.indices.size());
+  lod.error = error;
+  lods_.push_back(lod);
+}
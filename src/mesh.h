@@ -3,28 +3,96 @@
 
 #include <array>
 #include <string>
+#include <vector>
 
+#include <glm/glm.hpp>
 #include <vulkan/vulkan.hpp>
 
-#include "resource_manager.h"
+#include "mesh_optimizer.h"
+#include "structures.h"
+
+// Reads the first mesh in a file as a triangle list with three vertices per
+// triangle.
+std::vector<Vertex> LoadMeshVertices(const std::string& filename);
 
 class Mesh {
 public:
+    // One level of detail: an indexed triangle list in the MeshPool, drawn
+    // with drawIndexed(index_count, ..., first_index, vertex_offset, ...).
+    struct Lod {
+        uint32_t first_index;
+        uint32_t index_count;
+        int32_t vertex_offset;
+        // Object-space distance the level may stray from the full mesh.
+        float error;
+    };
+
     Mesh();
     Mesh(const std::string& filename);
     ~Mesh();
 
-    vk::Buffer vertex_buffer() {
-        return vertex_buffer_.buffer;
+    // Levels of detail, finest first. LOD 0 is the mesh as loaded, and
+    // errors never decrease along the chain.
+    uint32_t lod_count() {
+        return static_cast<uint32_t>(lods_.size());
+    }
+
+    const Lod& lod(uint32_t index) {
+        return lods_[index];
+    }
+
+    // Object-space bounds, computed at load.
+    const glm::vec3& aabb_min() {
+        return aabb_min_;
+    }
+
+    const glm::vec3& aabb_max() {
+        return aabb_max_;
+    }
+
+    // xyz = center, w = radius.
+    const glm::vec4& bounding_sphere() {
+        return bounding_sphere_;
+    }
+
+    // How the mesh's vertices are stored in the MeshPool. Loaded meshes are
+    // compact unless their texcoords range too far for half floats.
+    VertexFormat vertex_format() {
+        return vertex_format_;
+    }
+
+    // Maps compact positions back into the bounds; identity for full
+    // vertices.
+    const PositionQuantization& position_quantization() {
+        return position_quantization_;
     }
 
-    size_t vertex_count() {
-        return vertex_count_;
+    // Order the Renderer registered the mesh in, which draw buckets sort by.
+    uint32_t ordinal() const {
+        return ordinal_;
     }
 
 private:
-    ResourceManager::Buffer vertex_buffer_;
-    size_t vertex_count_;
+    friend class Renderer;
+
+    void ComputeBounds(const Vertex* vertices, size_t count);
+    // Optimizes mesh for the vertex cache, overdraw and vertex fetch, then
+    // uploads it in vertex_format_ as the next LOD.
+    void AddLod(IndexedMesh& mesh, float error);
+    // Simplifies the loaded triangle list into up to kMaxMeshLods - 1
+    // coarser levels and uploads each one after LOD 0.
+    void GenerateLods(const std::vector<Vertex>& vertices);
+
+    std::vector<Lod> lods_;
+
+    glm::vec3 aabb_min_;
+    glm::vec3 aabb_max_;
+    glm::vec4 bounding_sphere_;
+
+    uint32_t ordinal_ = 0;
+    VertexFormat vertex_format_ = VertexFormat::Full;
+    PositionQuantization position_quantization_ = {glm::vec4(0.0f),
+                                                   glm::vec4(1.0f)};
 };
 
 #endif // MESH_H_
@@ -0,0 +1,326 @@
+#include "mesh_optimizer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+
+namespace {
+
+// Overdraw clusters may cost this much more vertex shading than the
+// cache-optimized order they came from.
+constexpr float kOverdrawThreshold = 1.05f;
+
+// Cluster granularities OptimizeOverdraw tries before giving up.
+constexpr int kOverdrawAttempts = 6;
+
+constexpr uint32_t kNoVertex = 0xffffffff;
+
+struct VertexHash {
+  size_t operator()(const Vertex &v) const {
+    // FNV-1a over the raw bytes, matching the bitwise comparison below.
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&v);
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(Vertex); i++) {
+      hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+  }
+};
+
+struct VertexEqual {
+  bool operator()(const Vertex &a, const Vertex &b) const {
+    return std::memcmp(&a, &b, sizeof(Vertex)) == 0;
+  }
+};
+
+// FIFO cache simulation by timestamp: a vertex is cached while fewer than
+// kVertexCacheSize misses have happened since its own.
+class CacheSimulator {
+public:
+  explicit CacheSimulator(size_t vertex_count)
+      : stamps_(vertex_count, 0), time_(kVertexCacheSize + 1) {}
+
+  // Returns true on a miss.
+  bool Access(uint32_t vertex) {
+    if (time_ - stamps_[vertex] > kVertexCacheSize) {
+      stamps_[vertex] = time_++;
+      return true;
+    }
+    return false;
+  }
+
+  void Flush() { time_ += kVertexCacheSize + 1; }
+
+private:
+  std::vector<size_t> stamps_;
+  size_t time_;
+};
+
+// Cuts a new cluster wherever the cache goes cold on its own, or once the
+// current one's ACMR has dropped to split_acmr. Clusters are simulated from
+// a flushed cache, since after sorting they may follow any other. Returns
+// the first triangle of each cluster, plus triangle_count.
+std::vector<size_t> SplitClusters(const uint32_t *indices,
+                                  size_t triangle_count, size_t vertex_count,
+                                  float split_acmr) {
+  std::vector<size_t> starts;
+  CacheSimulator cache(vertex_count);
+  size_t cluster_start = 0;
+  size_t cluster_misses = 0;
+  for (size_t t = 0; t < triangle_count; t++) {
+    bool split = t == 0 || cluster_misses <= split_acmr * (t - cluster_start);
+    if (split) {
+      cache.Flush();
+    }
+    size_t misses = 0;
+    for (int k = 0; k < 3; k++) {
+      misses += cache.Access(indices[3 * t + k]);
+    }
+    if (split || misses == 3) {
+      starts.push_back(t);
+      cluster_start = t;
+      cluster_misses = 0;
+    }
+    cluster_misses += misses;
+  }
+  starts.push_back(triangle_count);
+  return starts;
+}
+
+// Writes the clusters to out, those facing away from the mesh center and
+// farther out first, since they're the likeliest to occlude the rest.
+void SortClusters(const uint32_t *indices, const std::vector<size_t> &starts,
+                  const Vertex *vertices, uint32_t *out) {
+  // Area-weighted centroid and normal of each cluster and of the mesh.
+  size_t cluster_count = starts.size() - 1;
+  std::vector<glm::vec3> centroids(cluster_count, glm::vec3(0.0f));
+  std::vector<glm::vec3> normals(cluster_count, glm::vec3(0.0f));
+  glm::vec3 mesh_centroid(0.0f);
+  float mesh_area = 0.0f;
+  for (size_t c = 0; c < cluster_count; c++) {
+    float area = 0.0f;
+    for (size_t t = starts[c]; t < starts[c + 1]; t++) {
+      const glm::vec3 &p0 = vertices[indices[3 * t]].position;
+      const glm::vec3 &p1 = vertices[indices[3 * t + 1]].position;
+      const glm::vec3 &p2 = vertices[indices[3 * t + 2]].position;
+      glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+      float triangle_area = glm::length(normal);
+      centroids[c] += triangle_area * (p0 + p1 + p2) / 3.0f;
+      normals[c] += normal;
+      area += triangle_area;
+    }
+    mesh_centroid += centroids[c];
+    mesh_area += area;
+    if (area > 0.0f) {
+      centroids[c] /= area;
+    }
+  }
+  if (mesh_area > 0.0f) {
+    mesh_centroid /= mesh_area;
+  }
+
+  std::vector<float> occlusion(cluster_count, 0.0f);
+  std::vector<uint32_t> order(cluster_count);
+  for (size_t c = 0; c < cluster_count; c++) {
+    float length = glm::length(normals[c]);
+    if (length > 0.0f) {
+      occlusion[c] = glm::dot(centroids[c] - mesh_centroid, normals[c]) / length;
+    }
+    order[c] = static_cast<uint32_t>(c);
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return occlusion[a] > occlusion[b];
+  });
+
+  for (uint32_t c : order) {
+    out = std::copy(indices + 3 * starts[c], indices + 3 * starts[c + 1], out);
+  }
+}
+
+} // namespace
+
+IndexedMesh DeduplicateVertices(const Vertex *vertices, size_t count) {
+  IndexedMesh mesh;
+  mesh.indices.reserve(count);
+  std::unordered_map<Vertex, uint32_t, VertexHash, VertexEqual> unique;
+  unique.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    auto inserted = unique.emplace(
+        vertices[i], static_cast<uint32_t>(mesh.vertices.size()));
+    if (inserted.second) {
+      mesh.vertices.push_back(vertices[i]);
+    }
+    mesh.indices.push_back(inserted.first->second);
+  }
+  return mesh;
+}
+
+void OptimizeVertexCache(uint32_t *indices, size_t index_count,
+                         size_t vertex_count) {
+  size_t triangle_count = index_count / 3;
+
+  // Triangles around each vertex, packed by vertex.
+  std::vector<uint32_t> offsets(vertex_count + 1, 0);
+  for (size_t i = 0; i < 3 * triangle_count; i++) {
+    offsets[indices[i] + 1]++;
+  }
+  for (size_t v = 0; v < vertex_count; v++) {
+    offsets[v + 1] += offsets[v];
+  }
+  std::vector<uint32_t> adjacency(3 * triangle_count);
+  std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+  for (size_t i = 0; i < 3 * triangle_count; i++) {
+    adjacency[fill[indices[i]]++] = static_cast<uint32_t>(i / 3);
+  }
+
+  // Unemitted triangles left around each vertex.
+  std::vector<uint32_t> live(vertex_count);
+  for (size_t v = 0; v < vertex_count; v++) {
+    live[v] = offsets[v + 1] - offsets[v];
+  }
+  std::vector<size_t> cache_time(vertex_count, 0);
+  size_t time = kVertexCacheSize + 1;
+  std::vector<uint8_t> emitted(triangle_count, 0);
+  std::vector<uint32_t> dead_ends;
+  std::vector<uint32_t> candidates;
+  std::vector<uint32_t> out;
+  out.reserve(3 * triangle_count);
+  size_t scan = 0;
+
+  // Falls back on recently touched vertices, then on input order.
+  auto skip_dead_end = [&]() -> uint32_t {
+    while (!dead_ends.empty()) {
+      uint32_t v = dead_ends.back();
+      dead_ends.pop_back();
+      if (live[v] > 0) {
+        return v;
+      }
+    }
+    for (; scan < vertex_count; scan++) {
+      if (live[scan] > 0) {
+        return static_cast<uint32_t>(scan);
+      }
+    }
+    return kNoVertex;
+  };
+
+  uint32_t fan = skip_dead_end();
+  while (fan != kNoVertex) {
+    candidates.clear();
+    for (uint32_t a = offsets[fan]; a < offsets[fan + 1]; a++) {
+      uint32_t t = adjacency[a];
+      if (emitted[t]) {
+        continue;
+      }
+      emitted[t] = 1;
+      for (int k = 0; k < 3; k++) {
+        uint32_t v = indices[3 * t + k];
+        out.push_back(v);
+        dead_ends.push_back(v);
+        candidates.push_back(v);
+        live[v]--;
+        if (time - cache_time[v] > kVertexCacheSize) {
+          cache_time[v] = time++;
+        }
+      }
+    }
+
+    // Prefer the oldest candidate that stays cached through its own fan.
+    uint32_t next = kNoVertex;
+    int64_t best_priority = -1;
+    for (uint32_t v : candidates) {
+      if (live[v] == 0) {
+        continue;
+      }
+      int64_t priority = 0;
+      if (time - cache_time[v] + 2 * live[v] <= kVertexCacheSize) {
+        priority = static_cast<int64_t>(time - cache_time[v]);
+      }
+      if (priority > best_priority) {
+        best_priority = priority;
+        next = v;
+      }
+    }
+    fan = next != kNoVertex ? next : skip_dead_end();
+  }
+
+  std::copy(out.begin(), out.end(), indices);
+}
+
+void OptimizeOverdraw(uint32_t *indices, size_t index_count,
+                      const Vertex *vertices, size_t vertex_count,
+                      float threshold) {
+  size_t triangle_count = index_count / 3;
+  if (triangle_count == 0) {
+    return;
+  }
+  float target_acmr =
+      threshold * ComputeAcmr(indices, index_count, vertex_count);
+
+  // Start with clusters as fine as the target allows, and coarsen them
+  // until the sorted order fits; the last try cuts only where the cache is
+  // cold anyway. If even that loses too much, keep the input order.
+  std::vector<uint32_t> sorted(3 * triangle_count);
+  float split_acmr = target_acmr;
+  for (int attempt = 0; attempt < kOverdrawAttempts; attempt++) {
+    if (attempt == kOverdrawAttempts - 1) {
+      split_acmr = 0.0f;
+    }
+    std::vector<size_t> starts =
+        SplitClusters(indices, triangle_count, vertex_count, split_acmr);
+    SortClusters(indices, starts, vertices, sorted.data());
+    if (ComputeAcmr(sorted.data(), sorted.size(), vertex_count) <=
+        target_acmr) {
+      std::copy(sorted.begin(), sorted.end(), indices);
+      return;
+    }
+    split_acmr *= 0.8f;
+  }
+}
+
+size_t OptimizeVertexFetch(uint32_t *indices, size_t index_count,
+                           Vertex *vertices, size_t vertex_count) {
+  std::vector<uint32_t> remap(vertex_count, kNoVertex);
+  std::vector<Vertex> reordered;
+  reordered.reserve(vertex_count);
+  for (size_t i = 0; i < index_count; i++) {
+    uint32_t &target = remap[indices[i]];
+    if (target == kNoVertex) {
+      target = static_cast<uint32_t>(reordered.size());
+      reordered.push_back(vertices[indices[i]]);
+    }
+    indices[i] = target;
+  }
+  std::copy(reordered.begin(), reordered.end(), vertices);
+  return reordered.size();
+}
+
+float ComputeAcmr(const uint32_t *indices, size_t index_count,
+                  size_t vertex_count, size_t cache_size) {
+  size_t triangle_count = index_count / 3;
+  if (triangle_count == 0) {
+    return 0.0f;
+  }
+  std::vector<size_t> stamps(vertex_count, 0);
+  size_t time = cache_size + 1;
+  size_t misses = 0;
+  for (size_t i = 0; i < 3 * triangle_count; i++) {
+    if (time - stamps[indices[i]] > cache_size) {
+      stamps[indices[i]] = time++;
+      misses++;
+    }
+  }
+  return static_cast<float>(misses) / triangle_count;
+}
+
+void OptimizeMesh(IndexedMesh &mesh) {
+  OptimizeVertexCache(mesh.indices.data(), mesh.indices.size(),
+                      mesh.vertices.size());
+  OptimizeOverdraw(mesh.indices.data(), mesh.indices.size(),
+                   mesh.vertices.data(), mesh.vertices.size(),
+                   kOverdrawThreshold);
+  size_t used = OptimizeVertexFetch(mesh.indices.data(), mesh.indices.size(),
+                                    mesh.vertices.data(), mesh.vertices.size());
+  mesh.vertices.erase(mesh.vertices.begin() + used, mesh.vertices.end());
+}
@@ -0,0 +1,54 @@
+#ifndef MESH_OPTIMIZER_H_
+#define MESH_OPTIMIZER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "structures.h"
+
+// Entries in the simulated post-transform cache. Real hardware varies, but
+// orders tuned for 16 hold up well on both smaller and larger caches.
+constexpr size_t kVertexCacheSize = 16;
+
+// An indexed triangle list.
+struct IndexedMesh {
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+};
+
+// Builds an indexed mesh from a triangle soup by merging vertices whose
+// attributes are bitwise identical.
+IndexedMesh DeduplicateVertices(const Vertex* vertices, size_t count);
+
+// Reorders triangles for the post-transform cache with Tipsify (Sander,
+// Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality and
+// Reduced Overdraw"), which fans around one vertex at a time and moves on
+// to whichever recent vertex will still be in the cache after its own fan.
+void OptimizeVertexCache(uint32_t* indices, size_t index_count,
+                         size_t vertex_count);
+
+// Splits a cache-optimized index list into clusters and sorts them so the
+// ones facing out from the mesh center, which are likely to occlude the
+// rest, draw first. Clusters only break where the cache is already cold or
+// where the ACMR stays within threshold times the input's, so the cache
+// order survives.
+void OptimizeOverdraw(uint32_t* indices, size_t index_count,
+                      const Vertex* vertices, size_t vertex_count,
+                      float threshold);
+
+// Rewrites vertices in order of first use by the index list, dropping the
+// unused ones, so the vertex fetch streams forward. Returns the number of
+// vertices kept.
+size_t OptimizeVertexFetch(uint32_t* indices, size_t index_count,
+                           Vertex* vertices, size_t vertex_count);
+
+// Average vertices transformed per triangle through a FIFO cache of
+// cache_size entries; between 0.5 and 3, lower is better.
+float ComputeAcmr(const uint32_t* indices, size_t index_count,
+                  size_t vertex_count, size_t cache_size = kVertexCacheSize);
+
+// Runs the vertex cache, overdraw and vertex fetch passes in that order.
+void OptimizeMesh(IndexedMesh& mesh);
+
+#endif // MESH_OPTIMIZER_H_
@@ -0,0 +1,70 @@
+#include "mesh_pool.h"
+
+#include <algorithm>
+
+namespace {
+
+static MeshPool *g_MeshPool = nullptr;
+
+constexpr size_t kInitialVertexCapacity = 64 * 1024;
+constexpr size_t kInitialIndexCapacity = 256 * 1024;
+
+} // namespace
+
+MeshPool::MeshPool() { g_MeshPool = this; }
+
+MeshPool::~MeshPool() { g_MeshPool = nullptr; }
+
+MeshPool *MeshPool::Get() { return g_MeshPool; }
+
+uint32_t MeshPool::AddVertices(VertexFormat format, const void *vertices,
+                               size_t stride, const void *positions,
+                               size_t position_stride, size_t count) {
+  Stream &stream = vertices_[static_cast<uint32_t>(format)];
+  if (stream.vertex_capacity == 0) {
+    stream.vertex_capacity = stride * kInitialVertexCapacity;
+    stream.position_capacity = position_stride * kInitialVertexCapacity;
+  }
+  size_t offset = Append(stream.vertices, stream.vertex_bytes,
+                         stream.vertex_capacity,
+                         vk::BufferUsageFlagBits::eVertexBuffer, vertices,
+                         stride * count);
+  Append(stream.positions, stream.position_bytes, stream.position_capacity,
+         vk::BufferUsageFlagBits::eVertexBuffer, positions,
+         position_stride * count);
+  return static_cast<uint32_t>(offset / stride);
+}
+
+uint32_t MeshPool::AddIndices(const uint32_t *indices, size_t count) {
+  if (index_capacity_ == 0) {
+    index_capacity_ = sizeof(uint32_t) * kInitialIndexCapacity;
+  }
+  size_t offset = Append(indices_, index_bytes_, index_capacity_,
+                         vk::BufferUsageFlagBits::eIndexBuffer, indices,
+                         sizeof(uint32_t) * count);
+  return static_cast<uint32_t>(offset / sizeof(uint32_t));
+}
+
+size_t MeshPool::Append(ResourceManager::Buffer &buffer, size_t &used,
+                        size_t &capacity, vk::BufferUsageFlags usage,
+                        const void *data, size_t size) {
+  if (!buffer.buffer || used + size > capacity) {
+    if (buffer.buffer) {
+      capacity = std::max(used + size, 2 * capacity);
+    } else {
+      capacity = std::max(capacity, size);
+    }
+    ResourceManager::Buffer grown = ResourceManager::Get()->CreateDeviceBuffer(
+        usage | vk::BufferUsageFlagBits::eTransferSrc, capacity);
+    if (buffer.buffer) {
+      ResourceManager::Get()->CopyToDeviceBuffer(std::move(buffer), grown,
+                                                 used);
+    }
+    buffer = std::move(grown);
+  }
+
+  size_t offset = used;
+  ResourceManager::Get()->UploadToDeviceBuffer(buffer, offset, data, size);
+  used += size;
+  return offset;
+}
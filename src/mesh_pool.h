@@ -0,0 +1,100 @@
+#ifndef MESH_POOL_H_
+#define MESH_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "resource_manager.h"
+#include "structures.h"
+
+// Device-local vertex buffers, one per VertexFormat, each with a parallel
+// position-only buffer for depth-only passes, and an index buffer shared by
+// every mesh. A pass binds them once per format and meshes differ
+// only by firstIndex and vertexOffset, which lets consecutive draws be merged
+// into one multi-draw-indirect call. Indices are relative to their mesh's
+// first vertex.
+class MeshPool {
+public:
+    MeshPool();
+    ~MeshPool();
+
+    static MeshPool* Get();
+
+    // Uploads vertices into their format's buffer, and their positions into
+    // its position buffer, and returns the index of the first one there.
+    template <typename V>
+    uint32_t AddVertices(const V* vertices, size_t count) {
+        using Position = typename VertexLayout<V>::Position;
+        std::vector<Position> positions;
+        positions.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            positions.push_back(VertexLayout<V>::GetPosition(vertices[i]));
+        }
+        return AddVertices(VertexLayout<V>::kFormat, vertices, sizeof(V),
+                           positions.data(), sizeof(Position), count);
+    }
+
+    // Uploads 32-bit indices and returns the pool index of the first one.
+    uint32_t AddIndices(const uint32_t* indices, size_t count);
+
+    // These may change when the pool grows, so don't hold on to them across
+    // frames.
+    vk::Buffer vertex_buffer(VertexFormat format) {
+        return vertices_[static_cast<uint32_t>(format)].vertices.buffer;
+    }
+
+    vk::Buffer position_buffer(VertexFormat format) {
+        return vertices_[static_cast<uint32_t>(format)].positions.buffer;
+    }
+
+    vk::Buffer index_buffer() {
+        return indices_.buffer;
+    }
+
+    // Bytes of vertex, including position, and index data in the pool,
+    // across every format.
+    size_t vertex_bytes() {
+        size_t bytes = 0;
+        for (const Stream& stream : vertices_) {
+            bytes += stream.vertex_bytes + stream.position_bytes;
+        }
+        return bytes;
+    }
+
+    size_t index_bytes() {
+        return index_bytes_;
+    }
+
+private:
+    uint32_t AddVertices(VertexFormat format, const void* vertices,
+                         size_t stride, const void* positions,
+                         size_t position_stride, size_t count);
+
+    // Appends size bytes to buffer, doubling it first if they don't fit.
+    // Returns the offset they were written at.
+    static size_t Append(ResourceManager::Buffer& buffer, size_t& used,
+                         size_t& capacity, vk::BufferUsageFlags usage,
+                         const void* data, size_t size);
+
+    // One format's vertices and their positions, which always hold the same
+    // number of elements.
+    struct Stream {
+        ResourceManager::Buffer vertices;
+        size_t vertex_bytes = 0;
+        size_t vertex_capacity = 0;
+        ResourceManager::Buffer positions;
+        size_t position_bytes = 0;
+        size_t position_capacity = 0;
+    };
+
+    // Indexed by VertexFormat.
+    Stream vertices_[kVertexFormatCount];
+    ResourceManager::Buffer indices_;
+    size_t index_bytes_ = 0;
+    size_t index_capacity_ = 0;
+};
+
+#endif // MESH_POOL_H_
@@ -6,12 +6,24 @@
 
 #include "material.h"
 #include "mesh.h"
+#include "slot_map.h"
 #include "structures.h"
+#include "transform_store.h"
+
+struct DrawBucket;
+
+// Objects live in the renderer's SlotMap and are named by handle; an Object*
+// is only good until the next object is added or removed.
+using ObjectHandle = SlotHandle;
 
 class Object {
 public:
-    Object(Material* material, Mesh* mesh): material_(material), mesh_(mesh) {}
-    ~Object() {};
+    // transform is a handle allocated from transforms, which the renderer
+    // frees when the object is removed.
+    Object(Material* material, Mesh* mesh, TransformStore* transforms,
+           uint32_t transform)
+        : material_(material), mesh_(mesh), transforms_(transforms),
+          transform_(transform) {}
 
     InstanceData GetInstanceData();
 
@@ -23,25 +35,48 @@ public:
         return mesh_;
     }
 
+    // Static objects never move, so their shadows are cached; see
+    // Renderer::SetObjectStatic.
+    bool is_static() {
+        return static_;
+    }
+
+    // Handle into the renderer's TransformStore. The mutators below flag the
+    // transform dirty so only changed instances get re-uploaded.
+    uint32_t transform() {
+        return transform_;
+    }
+
     glm::vec3& scale() {
-        return scale_;
+        transforms_->MarkDirty(transform_);
+        return transforms_->scale(transform_);
     }
 
     glm::vec3& position() {
-        return position_;
+        transforms_->MarkDirty(transform_);
+        return transforms_->position(transform_);
     }
 
     glm::quat& rotation() {
-        return rotation_;
+        transforms_->MarkDirty(transform_);
+        return transforms_->rotation(transform_);
     }
 
 private:
+    friend class Renderer;
+
     Material* material_;
     Mesh* mesh_;
+    bool static_ = false;
+
+    TransformStore* transforms_;
+    uint32_t transform_;
 
-    glm::vec3 scale_ = glm::vec3(1.0f);
-    glm::quat rotation_ = glm::quat(glm::vec3(0.0f));
-    glm::vec3 position_ = glm::vec3(0.0f);
+    // Owned by the renderer: which draw bucket this object lives in, and where.
+    DrawBucket* bucket_ = nullptr;
+    uint32_t bucket_slot_ = 0;
+    // Leaf in the renderer's BVH.
+    uint32_t bvh_proxy_ = 0;
 };
 
 #endif // OBJECT_H_
@@ -56,8 +56,9 @@ vk::RenderPass CreateOpaqueRenderPass() {
     vk::SubpassDependency dependency;
     dependency.setSrcSubpass(VK_SUBPASS_EXTERNAL)
         .setDstSubpass(0)
-        .setSrcStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests)
-        .setSrcAccessMask({})
+        // Previous frames in flight share the color and depth attachments.
+        .setSrcStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eLateFragmentTests)
+        .setSrcAccessMask(vk::AccessFlagBits::eDepthStencilAttachmentWrite)
         .setDstStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests)
         .setDstAccessMask(vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite);
 
@@ -73,15 +74,17 @@ vk::RenderPass CreateOpaqueRenderPass() {
     return device->device().createRenderPass(create_info);
 }
 
-vk::RenderPass CreateShadowRenderPass() {
+// With load set, the pass draws over depth that was just copied into the
+// shadow map instead of clearing it.
+vk::RenderPass CreateShadowRenderPass(vk::Format format, bool load) {
     auto depth_attachment = vk::AttachmentDescription()
-        .setFormat(vk::Format::eD32Sfloat)
+        .setFormat(format)
         .setSamples(vk::SampleCountFlagBits::e1)
-        .setLoadOp(vk::AttachmentLoadOp::eClear)
+        .setLoadOp(load ? vk::AttachmentLoadOp::eLoad : vk::AttachmentLoadOp::eClear)
         .setStoreOp(vk::AttachmentStoreOp::eStore)
         .setStencilLoadOp(vk::AttachmentLoadOp::eDontCare)
         .setStencilStoreOp(vk::AttachmentStoreOp::eDontCare)
-        .setInitialLayout(vk::ImageLayout::eUndefined)
+        .setInitialLayout(load ? vk::ImageLayout::eTransferDstOptimal : vk::ImageLayout::eUndefined)
         .setFinalLayout(vk::ImageLayout::eShaderReadOnlyOptimal);
     auto depth_attachment_ref = vk::AttachmentReference()
         .setAttachment(0)
@@ -91,13 +94,20 @@ vk::RenderPass CreateShadowRenderPass() {
         .setPipelineBindPoint(vk::PipelineBindPoint::eGraphics)
         .setPDepthStencilAttachment(&depth_attachment_ref);
 
+    // The previous frame in flight may still be sampling this shadow map.
     auto start_dependency = vk::SubpassDependency()
         .setSrcSubpass(VK_SUBPASS_EXTERNAL)
         .setDstSubpass(0)
-        .setSrcStageMask(vk::PipelineStageFlagBits::eEarlyFragmentTests)
+        .setSrcStageMask(vk::PipelineStageFlagBits::eFragmentShader | vk::PipelineStageFlagBits::eLateFragmentTests)
         .setDstStageMask(vk::PipelineStageFlagBits::eEarlyFragmentTests)
-        .setSrcAccessMask({})
+        .setSrcAccessMask(vk::AccessFlagBits::eDepthStencilAttachmentWrite)
         .setDstAccessMask(vk::AccessFlagBits::eDepthStencilAttachmentRead | vk::AccessFlagBits::eDepthStencilAttachmentWrite);
+    // Or, when loading, the copy that filled it.
+    if (load) {
+        start_dependency
+            .setSrcStageMask(vk::PipelineStageFlagBits::eTransfer)
+            .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite);
+    }
 
     // This dependency transitions to using the depth buffer as a sampled texture.
     auto end_dependency = vk::SubpassDependency()
@@ -121,11 +131,15 @@ static RenderPasses* g_RenderPasses = nullptr;
 
 }
 
-RenderPasses::RenderPasses() {
+RenderPasses::RenderPasses(vk::Format shadow_format)
+    : shadow_format_(shadow_format),
+      single_pass_shadows_(Device::Get()->shader_viewport_index_layer() &&
+                           Device::Get()->enabled_features().multiViewport) {
     g_RenderPasses = this;
 
     opaque_pass_ = CreateOpaqueRenderPass();
-    shadow_pass_ = CreateShadowRenderPass();
+    shadow_pass_ = CreateShadowRenderPass(shadow_format, false);
+    shadow_load_pass_ = CreateShadowRenderPass(shadow_format, true);
 }
 
 RenderPasses::~RenderPasses() {
@@ -133,6 +147,7 @@ RenderPasses::~RenderPasses() {
 
     Device::Get()->device().destroyRenderPass(opaque_pass_);
     Device::Get()->device().destroyRenderPass(shadow_pass_);
+    Device::Get()->device().destroyRenderPass(shadow_load_pass_);
 }
 
 RenderPasses* RenderPasses::Get() {
@@ -140,7 +155,8 @@ RenderPasses* RenderPasses::Get() {
 }
 
 vk::RenderPass RenderPasses::GetRenderPass(RenderPass pass) {
-    if (pass == RenderPass::Opaque) {
+    if (pass == RenderPass::Opaque || pass == RenderPass::DepthPrepass ||
+        pass == RenderPass::OpaqueAfterPrepass) {
         return opaque_pass_;
     } else if (pass == RenderPass::Shadow) {
         return shadow_pass_;
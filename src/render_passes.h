@@ -6,20 +6,55 @@
 enum class RenderPass {
     Shadow,
     Opaque,
+    // Depth-only draws that fill the opaque pass's depth buffer ahead of
+    // shading. They run in the opaque render pass's subpass.
+    DepthPrepass,
+    // Opaque shading over a prepassed depth buffer: depth tests for equality
+    // and is never written, so each sample is shaded once.
+    OpaqueAfterPrepass,
 };
 
+// Depth-only passes read just the position stream and bind no material
+// descriptors.
+inline bool IsDepthOnlyPass(RenderPass pass) {
+    return pass == RenderPass::Shadow || pass == RenderPass::DepthPrepass;
+}
+
 class RenderPasses {
 public:
-    RenderPasses();
+    // Shadow passes render depth in shadow_format.
+    explicit RenderPasses(vk::Format shadow_format = vk::Format::eD32Sfloat);
     ~RenderPasses();
 
     static RenderPasses* Get();
 
     vk::RenderPass GetRenderPass(RenderPass pass);
 
+    // The shadow pass, but drawing over the shadow map's contents, which
+    // must be in the transfer destination layout, rather than clearing it.
+    // Compatible with the shadow pass's pipelines.
+    vk::RenderPass shadow_load_pass() {
+        return shadow_load_pass_;
+    }
+
+    vk::Format shadow_format() {
+        return shadow_format_;
+    }
+
+    // Whether shadow pipelines draw every light at once, each picking its
+    // tile's viewport in shadow.vert. Needs multiViewport and
+    // VK_EXT_shader_viewport_index_layer; otherwise the Renderer draws one
+    // light at a time through that light's viewport.
+    bool single_pass_shadows() {
+        return single_pass_shadows_;
+    }
+
 private:
+    vk::Format shadow_format_;
+    bool single_pass_shadows_;
     vk::RenderPass opaque_pass_;
     vk::RenderPass shadow_pass_;
+    vk::RenderPass shadow_load_pass_;
 };
 
 #endif  // RENDER_PASSES_H_
@@ -1,26 +1,66 @@
 #include "renderer.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <tuple>
+
+#include <glm/ext/matrix_clip_space.hpp>
+#include <glm/gtc/constants.hpp>
 
 #include "constants.h"
+#include "culling.h"
+#include "job_system.h"
 
 // Some Windows header file defines these >:(
 #undef min
 #undef max
 
-Renderer::Renderer() {
-  render_passes_ = std::make_unique<RenderPasses>();
+namespace {
+
+constexpr float kInfinity = std::numeric_limits<float>::infinity();
+
+// Bounds of x / z over the box around a sphere at (x, z) of radius r, which
+// must lie wholly in front of the light (z > r).
+glm::vec2 ProjectedSpan(float x, float z, float r) {
+  return glm::vec2((x - r) / (x - r < 0.0f ? z - r : z + r),
+                   (x + r) / (x + r > 0.0f ? z - r : z + r));
+}
+
+// Cell of a Z-order index, x from its even bits and y from its odd ones.
+glm::uvec2 MortonCell(uint32_t index) {
+  glm::uvec2 cell(0);
+  for (uint32_t bit = 0; bit < 16; bit++) {
+    cell.x |= ((index >> (2 * bit)) & 1u) << bit;
+    cell.y |= ((index >> (2 * bit + 1)) & 1u) << bit;
+  }
+  return cell;
+}
+
+} // namespace
+
+Renderer::Renderer(uint32_t frames_in_flight, vk::Format shadow_format) {
+  render_passes_ = std::make_unique<RenderPasses>(shadow_format);
   layouts_ = std::make_unique<Layouts>();
 
+  frames_.resize(std::clamp(frames_in_flight, 1u, kMaxFramesInFlight));
+
   InitCommandPool();
   InitCommandBuffers();
   resource_manager_ = std::make_unique<ResourceManager>(transfer_buffer_);
+  resource_manager_->InitTransientRing(kTransientFrameSize,
+                                       static_cast<uint32_t>(frames_.size()));
+  mesh_pool_ = std::make_unique<MeshPool>();
   InitColorBuffer();
   InitDepthBuffer();
   InitFramebuffers();
   InitShadowMaps();
-  InitSyncResources();
+  InitFrames();
 
   scene_environment_map_ = std::make_unique<Texture>(
       "../../../assets/quattro_canti_4k.hdr", Texture::Usage::HDRI);
@@ -56,6 +96,11 @@ Renderer::Renderer() {
   InitSceneDescriptors();
 
   sky_pipeline_ = GetSkyPipeline();
+  for (uint32_t i = 0; i < kInstanceFormatCount; i++) {
+    instance_scatter_pipelines_[i] =
+        GetInstanceScatterPipeline(static_cast<InstanceFormat>(i));
+    gpu_cull_pipelines_[i] = GetGpuCullPipeline(static_cast<InstanceFormat>(i));
+  }
 }
 
 Renderer::~Renderer() {
@@ -63,21 +108,36 @@ Renderer::~Renderer() {
   d.waitIdle();
 
   d.destroyPipeline(sky_pipeline_);
-  d.destroyDescriptorPool(scene_descriptor_pool_);
-  for (auto &shadow_map : shadow_maps_) {
-    d.destroySampler(shadow_map.sampler);
-    d.destroyFramebuffer(shadow_map.framebuffer);
-    d.destroyImageView(shadow_map.image_view);
+  for (uint32_t i = 0; i < kInstanceFormatCount; i++) {
+    d.destroyPipeline(instance_scatter_pipelines_[i]);
+    d.destroyPipeline(gpu_cull_pipelines_[i]);
   }
+  d.destroyDescriptorPool(scene_descriptor_pool_);
+  shadow_moments_.reset();
+  d.destroySampler(shadow_compare_sampler_);
+  d.destroySampler(shadow_map_.sampler);
+  d.destroyFramebuffer(shadow_map_.framebuffer);
+  d.destroyImageView(shadow_map_.image_view);
+  d.destroyFramebuffer(static_shadow_map_.framebuffer);
+  d.destroyImageView(static_shadow_map_.image_view);
   for (auto framebuffer : swapchain_framebuffers_) {
     d.destroyFramebuffer(framebuffer);
   }
   d.destroyImageView(depth_buffer_view_);
   d.destroyImageView(color_buffer_view_);
   d.destroyCommandPool(command_pool_);
-  d.destroySemaphore(sync_resources_.image_available);
-  d.destroySemaphore(sync_resources_.render_finished);
-  d.destroyFence(sync_resources_.in_flight);
+  for (auto &frame : frames_) {
+    d.destroyCommandPool(frame.command_pool);
+    d.destroySemaphore(frame.image_available);
+    d.destroySemaphore(frame.render_finished);
+    d.destroyFence(frame.in_flight);
+    if (frame.statistics) {
+      d.destroyQueryPool(frame.statistics);
+    }
+    if (frame.timestamps) {
+      d.destroyQueryPool(frame.timestamps);
+    }
+  }
 }
 
 void Renderer::InitFramebuffers() {
@@ -103,17 +163,52 @@ void Renderer::InitFramebuffers() {
   }
 }
 
-void Renderer::InitSyncResources() {
+void Renderer::InitFrames() {
+  vk::Device d = Device::Get()->device();
   vk::SemaphoreCreateInfo semaphore_create_info;
   vk::FenceCreateInfo fence_create_info;
   fence_create_info.setFlags(vk::FenceCreateFlagBits::eSignaled);
+  vk::PhysicalDeviceLimits limits =
+      Device::Get()->physical_device().getProperties().limits;
+  if (limits.timestampComputeAndGraphics) {
+    timestamp_period_ = limits.timestampPeriod;
+  }
+
+  for (auto &frame : frames_) {
+    auto pool_info =
+        vk::CommandPoolCreateInfo()
+            .setQueueFamilyIndex(Device::Get()->graphics_queue_family())
+            .setFlags(vk::CommandPoolCreateFlagBits::eTransient);
+    frame.command_pool = d.createCommandPool(pool_info);
+
+    auto alloc_info = vk::CommandBufferAllocateInfo()
+                          .setCommandPool(frame.command_pool)
+                          .setCommandBufferCount(1)
+                          .setLevel(vk::CommandBufferLevel::ePrimary);
+    frame.command_buffer = d.allocateCommandBuffers(alloc_info)[0];
+
+    frame.image_available = d.createSemaphore(semaphore_create_info);
+    frame.render_finished = d.createSemaphore(semaphore_create_info);
+    frame.in_flight = d.createFence(fence_create_info);
+
+    if (Device::Get()->enabled_features().pipelineStatisticsQuery) {
+      frame.statistics = d.createQueryPool(
+          vk::QueryPoolCreateInfo()
+              .setQueryType(vk::QueryType::ePipelineStatistics)
+              .setQueryCount(1)
+              .setPipelineStatistics(
+                  vk::QueryPipelineStatisticFlagBits::
+                      eFragmentShaderInvocations));
+    }
+    if (limits.timestampComputeAndGraphics) {
+      frame.timestamps = d.createQueryPool(
+          vk::QueryPoolCreateInfo()
+              .setQueryType(vk::QueryType::eTimestamp)
+              .setQueryCount(4));
+    }
+  }
 
-  sync_resources_.image_available =
-      Device::Get()->device().createSemaphore(semaphore_create_info);
-  sync_resources_.render_finished =
-      Device::Get()->device().createSemaphore(semaphore_create_info);
-  sync_resources_.in_flight =
-      Device::Get()->device().createFence(fence_create_info);
+  images_in_flight_.resize(Device::Get()->swapchain_images().size(), nullptr);
 }
 
 void Renderer::InitDepthBuffer() {
@@ -166,19 +261,21 @@ void Renderer::InitColorBuffer() {
 }
 
 void Renderer::InitShadowMaps() {
-  for (int i = 0; i < NUM_LIGHTS; i++) {
-    vk::Format format = vk::Format::eD32Sfloat;
-    shadow_maps_[i].image = resource_manager_->CreateImageUninitialized(
-        vk::ImageUsageFlagBits::eDepthStencilAttachment |
-            vk::ImageUsageFlagBits::eSampled,
-        format, kShadowMapSize, kShadowMapSize);
-
+  vk::Format format = render_passes_->shadow_format();
+  auto init_atlas = [&](ShadowMap &shadow_map, vk::ImageUsageFlags usage) {
+    shadow_map.image = resource_manager_->CreateImageUninitialized(
+        vk::ImageUsageFlagBits::eDepthStencilAttachment | usage, format,
+        kShadowAtlasSize, kShadowAtlasSize, 1, vk::SampleCountFlagBits::e1,
+        1);
+
+    // The shadow pass renders through and basic.frag samples the same view
+    // of the whole atlas; the vertex shader picks each triangle's tile.
     auto view_create_info =
         vk::ImageViewCreateInfo()
             .setViewType(vk::ImageViewType::e2D)
             .setFormat(format)
             .setComponents({})
-            .setImage(shadow_maps_[i].image.image)
+            .setImage(shadow_map.image.image)
             .setSubresourceRange(
                 vk::ImageSubresourceRange()
                     .setAspectMask(vk::ImageAspectFlagBits::eDepth)
@@ -186,32 +283,55 @@ void Renderer::InitShadowMaps() {
                     .setBaseMipLevel(0)
                     .setLayerCount(1)
                     .setLevelCount(1));
-    shadow_maps_[i].image_view =
+    shadow_map.image_view =
         Device::Get()->device().createImageView(view_create_info);
 
+    // Framebuffers are compatible with both shadow render passes.
     auto framebuffer_info =
         vk::FramebufferCreateInfo()
-            .setAttachments(shadow_maps_[i].image_view)
+            .setAttachments(shadow_map.image_view)
             .setRenderPass(render_passes_->GetRenderPass(RenderPass::Shadow))
             .setLayers(1)
-            .setWidth(kShadowMapSize)
-            .setHeight(kShadowMapSize);
-    shadow_maps_[i].framebuffer =
+            .setWidth(kShadowAtlasSize)
+            .setHeight(kShadowAtlasSize);
+    shadow_map.framebuffer =
         Device::Get()->device().createFramebuffer(framebuffer_info);
-
-    auto sampler_info =
-        vk::SamplerCreateInfo()
-            .setAddressModeU(vk::SamplerAddressMode::eClampToBorder)
-            .setAddressModeV(vk::SamplerAddressMode::eClampToBorder)
-            .setBorderColor(vk::BorderColor::eFloatOpaqueWhite)
-            .setMagFilter(vk::Filter::eNearest)
-            .setMinFilter(vk::Filter::eNearest)
-            .setMipmapMode(vk::SamplerMipmapMode::eNearest)
-            .setCompareEnable(false)
-            .setAnisotropyEnable(false);
-    shadow_maps_[i].sampler =
-        Device::Get()->device().createSampler(sampler_info);
-  }
+  };
+  init_atlas(shadow_map_, vk::ImageUsageFlagBits::eSampled |
+                              vk::ImageUsageFlagBits::eTransferDst);
+  init_atlas(static_shadow_map_, vk::ImageUsageFlagBits::eTransferSrc);
+
+  auto sampler_info =
+      vk::SamplerCreateInfo()
+          .setAddressModeU(vk::SamplerAddressMode::eClampToBorder)
+          .setAddressModeV(vk::SamplerAddressMode::eClampToBorder)
+          .setBorderColor(vk::BorderColor::eFloatOpaqueWhite)
+          .setMagFilter(vk::Filter::eNearest)
+          .setMinFilter(vk::Filter::eNearest)
+          .setMipmapMode(vk::SamplerMipmapMode::eNearest)
+          .setCompareEnable(false)
+          .setAnisotropyEnable(false);
+  shadow_map_.sampler = Device::Get()->device().createSampler(sampler_info);
+
+  // Comparison lookups filter their 2x2 results bilinearly, where the
+  // device can filter the depth format at all.
+  bool filter_linear =
+      static_cast<bool>(Device::Get()
+                            ->physical_device()
+                            .getFormatProperties(format)
+                            .optimalTilingFeatures &
+                        vk::FormatFeatureFlagBits::eSampledImageFilterLinear);
+  vk::Filter compare_filter =
+      filter_linear ? vk::Filter::eLinear : vk::Filter::eNearest;
+  sampler_info.setMagFilter(compare_filter)
+      .setMinFilter(compare_filter)
+      .setCompareEnable(true)
+      .setCompareOp(vk::CompareOp::eLessOrEqual);
+  shadow_compare_sampler_ =
+      Device::Get()->device().createSampler(sampler_info);
+
+  shadow_moments_ = std::make_unique<ShadowMoments>(shadow_map_.image_view,
+                                                    shadow_map_.sampler);
 }
 
 void Renderer::InitCommandPool() {
@@ -226,100 +346,240 @@ void Renderer::InitCommandPool() {
 void Renderer::InitCommandBuffers() {
   vk::CommandBufferAllocateInfo alloc_info;
   alloc_info.setCommandPool(command_pool_)
-      .setCommandBufferCount(2)
+      .setCommandBufferCount(1)
       .setLevel(vk::CommandBufferLevel::ePrimary);
 
-  vk::CommandBuffer buffers[2] = {nullptr, nullptr};
-  if (Device::Get()->device().allocateCommandBuffers(&alloc_info, buffers) !=
-      vk::Result::eSuccess)
+  if (Device::Get()->device().allocateCommandBuffers(
+          &alloc_info, &transfer_buffer_) != vk::Result::eSuccess)
     throw "Error allocating command buffers.";
-
-  render_buffer_ = buffers[0];
-  transfer_buffer_ = buffers[1];
 }
 
 void Renderer::InitSceneDescriptors() {
   auto ubo_size = vk::DescriptorPoolSize().setDescriptorCount(1).setType(
-      vk::DescriptorType::eUniformBuffer);
+      vk::DescriptorType::eUniformBufferDynamic);
+  // The environment and irradiance maps, and the shadow maps three ways.
   auto sampler_size = vk::DescriptorPoolSize()
-                          .setDescriptorCount(1 + NUM_LIGHTS)
+                          .setDescriptorCount(5)
                           .setType(vk::DescriptorType::eCombinedImageSampler);
 
-  std::array<vk::DescriptorPoolSize, 2> sizes = {ubo_size, sampler_size};
+  // The scene set's instance, instance bucket and quantization buffers, plus
+  // the instance scatter set's three and the GPU cull set's seven.
+  auto storage_size = vk::DescriptorPoolSize().setDescriptorCount(13).setType(
+      vk::DescriptorType::eStorageBuffer);
+
+  // Each frame in flight gets its own sets.
+  uint32_t frame_count = static_cast<uint32_t>(frames_.size());
+  ubo_size.descriptorCount *= frame_count;
+  sampler_size.descriptorCount *= frame_count;
+  storage_size.descriptorCount *= frame_count;
+
+  std::array<vk::DescriptorPoolSize, 3> sizes = {ubo_size, sampler_size,
+                                                 storage_size};
   auto pool_info = vk::DescriptorPoolCreateInfo()
                        .setPoolSizeCount(static_cast<uint32_t>(sizes.size()))
                        .setPPoolSizes(sizes.data())
-                       .setMaxSets(1);
+                       .setMaxSets(3 * frame_count);
   scene_descriptor_pool_ =
       Device::Get()->device().createDescriptorPool(pool_info);
 
-  vk::DescriptorSetLayout layout = layouts_->scene_dsl();
-
-  auto alloc_info = vk::DescriptorSetAllocateInfo()
-                        .setDescriptorPool(scene_descriptor_pool_)
-                        .setDescriptorSetCount(1)
-                        .setPSetLayouts(&layout);
-  scene_descriptors_ =
-      Device::Get()->device().allocateDescriptorSets(alloc_info)[0];
+  std::array<vk::DescriptorSetLayout, 3> layouts = {
+      layouts_->scene_dsl(), layouts_->instance_scatter_dsl(),
+      layouts_->gpu_cull_dsl()};
+
+  for (auto &frame : frames_) {
+    auto alloc_info = vk::DescriptorSetAllocateInfo()
+                          .setDescriptorPool(scene_descriptor_pool_)
+                          .setSetLayouts(layouts);
+    auto sets = Device::Get()->device().allocateDescriptorSets(alloc_info);
+    frame.scene_descriptors = sets[0];
+    frame.instance_scatter_descriptors = sets[1];
+    frame.gpu_cull_descriptors = sets[2];
+  }
 }
 
 void Renderer::Render() {
-  if (Device::Get()->device().waitForFences(
-          {sync_resources_.in_flight}, true,
-          std::numeric_limits<uint64_t>::max()) != vk::Result::eSuccess)
+  vk::Device d = Device::Get()->device();
+  Frame &frame = frames_[frame_index_];
+
+  if (d.waitForFences({frame.in_flight}, true,
+                      std::numeric_limits<uint64_t>::max()) !=
+      vk::Result::eSuccess)
     throw "Error waiting for fences.";
-  Device::Get()->device().resetFences({sync_resources_.in_flight});
+  // Everything this frame last used is now free to reuse or release.
+  resource_manager_->BeginFrame(frame_index_);
+  if (frame.statistics_pending) {
+    uint64_t invocations = 0;
+    if (d.getQueryPoolResults(frame.statistics, 0, 1, sizeof(invocations),
+                              &invocations, sizeof(invocations),
+                              vk::QueryResultFlagBits::e64) ==
+        vk::Result::eSuccess) {
+      fragment_invocations_ = invocations;
+    }
+    frame.statistics_pending = false;
+  }
+  if (frame.timestamps_pending) {
+    uint64_t timestamps[4] = {};
+    if (d.getQueryPoolResults(frame.timestamps, 0, 4, sizeof(timestamps),
+                              timestamps, sizeof(uint64_t),
+                              vk::QueryResultFlagBits::e64) ==
+        vk::Result::eSuccess) {
+      opaque_pass_gpu_ms_ =
+          (timestamps[1] - timestamps[0]) * timestamp_period_ * 1e-6;
+      shadow_gpu_ms_ =
+          (timestamps[3] - timestamps[2]) * timestamp_period_ * 1e-6;
+    }
+    frame.timestamps_pending = false;
+  }
+  render_buffer_ = frame.command_buffer;
+  scene_descriptors_ = frame.scene_descriptors;
+  instance_scatter_descriptors_ = frame.instance_scatter_descriptors;
+  gpu_cull_descriptors_ = frame.gpu_cull_descriptors;
 
   resource_manager_->WaitForTransfers();
 
-  UpdateSceneDescriptors();
-
-  render_buffer_.reset({});
+  d.resetCommandPool(frame.command_pool, {});
 
-  vk::ResultValue<uint32_t> acquire_res =
-      Device::Get()->device().acquireNextImageKHR(
-          Device::Get()->swapchain(), std::numeric_limits<uint64_t>::max(),
-          sync_resources_.image_available, nullptr);
+  vk::ResultValue<uint32_t> acquire_res = d.acquireNextImageKHR(
+      Device::Get()->swapchain(), std::numeric_limits<uint64_t>::max(),
+      frame.image_available, nullptr);
   if (acquire_res.result != vk::Result::eSuccess) {
     throw "Failed to acquire next swap image.";
   }
   uint32_t image_idx = acquire_res.value;
 
+  // The image may still be in use by an older frame than this one.
+  if (images_in_flight_[image_idx] &&
+      d.waitForFences({images_in_flight_[image_idx]}, true,
+                      std::numeric_limits<uint64_t>::max()) !=
+          vk::Result::eSuccess)
+    throw "Error waiting for fences.";
+  images_in_flight_[image_idx] = frame.in_flight;
+  d.resetFences({frame.in_flight});
+
   vk::CommandBufferBeginInfo begin_info;
   render_buffer_.begin(begin_info);
 
-  // Update instance data.
-  instance_data_.clear();
-  instance_data_.reserve(objects_.size());
-  for (auto &material : materials_) {
-    for (auto &mesh : meshes_) {
-      for (auto &object : objects_) {
-        if (object->material() == material.get() &&
-            object->mesh() == mesh.get()) {
-          instance_data_.push_back(object->GetInstanceData());
-        }
-      }
+  // Both read this frame's dirty transforms, and UpdateInstances clears them.
+  hierarchy_.Update(transforms_);
+  UpdateBvh();
+  UpdateInstances();
+  UpdateInstanceDescriptors();
+
+  // Culling fits the lights' projections, so the scene uniforms wait for it.
+  UpdateLights();
+  if (gpu_culling_ || !shadow_fitting_) {
+    for (uint32_t i = 0; i < NUM_LIGHTS; i++) {
+      SetShadowProjection(i, light_bounds_[i],
+                          glm::vec2(kShadowNear, kShadowFar));
     }
+    shadow_lights_ = (1u << NUM_LIGHTS) - 1;
+    AssignShadowTiles();
+  }
+  glm::mat4 camera_view_proj = camera_.GetViewProj();
+  if (gpu_culling_) {
+    CullInstancesOnGpu(camera_view_proj);
+  } else {
+    CullInstances(camera_view_proj);
   }
-  instance_data_buffer_ = resource_manager_->CreateHostBufferWithData(
-      vk::BufferUsageFlagBits::eVertexBuffer, instance_data_.data(),
-      sizeof(InstanceData) * instance_data_.size());
+  UpdateSceneDescriptors();
 
-  // Begin shadow pass
-  for (int i = 0; i < NUM_LIGHTS; i++) {
+  draw_calls_ = 0;
+  draw_record_ms_ = 0.0;
+
+  if (frame.statistics) {
+    render_buffer_.resetQueryPool(frame.statistics, 0, 1);
+  }
+  if (frame.timestamps) {
+    render_buffer_.resetQueryPool(frame.timestamps, 0, 4);
+    render_buffer_.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe,
+                                  frame.timestamps, 2);
+  }
+
+  // With no light reaching anything in view, last frame's shadow maps can
+  // stand. The first frame still draws them, since they start out in no
+  // layout the opaque pass can read.
+  if (shadow_lights_ != 0 || !shadow_moments_->built()) {
+    // Begin shadow pass. One pass renders every light's tile; shadow.vert
+    // reads each light's matrix from the scene uniforms and picks its
+    // viewport.
     auto shadow_pass_begin_info =
         vk::RenderPassBeginInfo()
             .setRenderPass(render_passes_->GetRenderPass(RenderPass::Shadow))
-            .setFramebuffer(shadow_maps_[i].framebuffer)
-            .setRenderArea({{0, 0}, {kShadowMapSize, kShadowMapSize}})
+            .setFramebuffer(shadow_map_.framebuffer)
+            .setRenderArea(ShadowTileBounds())
             .setClearValues(vk::ClearValue().setDepthStencil(
                 vk::ClearDepthStencilValue(1.0f, 0)));
+    size_t dynamic_begin = 0;
+    if (shadow_caching_) {
+      if (static_shadows_dirty_) {
+        RenderStaticShadows();
+      }
+      dynamic_begin = StaticBucketCount();
+
+      // Start each tile from the static casters' depth and draw the rest
+      // over it.
+      auto layers = vk::ImageSubresourceLayers()
+                        .setAspectMask(vk::ImageAspectFlagBits::eDepth)
+                        .setMipLevel(0)
+                        .setBaseArrayLayer(0)
+                        .setLayerCount(1);
+      // The previous frame's shading must be done reading the shadow map.
+      auto to_transfer =
+          vk::ImageMemoryBarrier()
+              .setImage(shadow_map_.image.image)
+              .setOldLayout(vk::ImageLayout::eUndefined)
+              .setNewLayout(vk::ImageLayout::eTransferDstOptimal)
+              .setSrcAccessMask({})
+              .setDstAccessMask(vk::AccessFlagBits::eTransferWrite)
+              .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+              .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+              .setSubresourceRange(vk::ImageSubresourceRange()
+                                       .setAspectMask(layers.aspectMask)
+                                       .setBaseMipLevel(0)
+                                       .setLevelCount(1)
+                                       .setBaseArrayLayer(0)
+                                       .setLayerCount(1));
+      render_buffer_.pipelineBarrier(
+          vk::PipelineStageFlagBits::eFragmentShader |
+              vk::PipelineStageFlagBits::eLateFragmentTests,
+          vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, to_transfer);
+      std::vector<vk::ImageCopy> copies;
+      for (const vk::Rect2D &tile : shadow_tiles_) {
+        if (tile.extent.width == 0) {
+          continue;
+        }
+        vk::Offset3D offset(tile.offset.x, tile.offset.y, 0);
+        copies.push_back(
+            vk::ImageCopy()
+                .setSrcSubresource(layers)
+                .setSrcOffset(offset)
+                .setDstSubresource(layers)
+                .setDstOffset(offset)
+                .setExtent({tile.extent.width, tile.extent.height, 1}));
+      }
+      if (!copies.empty()) {
+        render_buffer_.copyImage(static_shadow_map_.image.image,
+                                 vk::ImageLayout::eTransferSrcOptimal,
+                                 shadow_map_.image.image,
+                                 vk::ImageLayout::eTransferDstOptimal, copies);
+      }
+      shadow_pass_begin_info.setRenderPass(render_passes_->shadow_load_pass());
+    }
     render_buffer_.beginRenderPass(shadow_pass_begin_info,
                                    vk::SubpassContents::eInline);
-
-    Draw(RenderPass::Shadow, lights_[i].world2light);
+    DrawShadowCasters(dynamic_begin, buckets_.size());
 
     render_buffer_.endRenderPass();
+
+    // The moments' descriptor must name a readable image from the first frame
+    // on, whichever filter is in use.
+    if (shadow_filter_ == ShadowFilter::Evsm || !shadow_moments_->built()) {
+      shadow_moments_->Build(render_buffer_, lights_);
+    }
+  }
+  if (frame.timestamps) {
+    render_buffer_.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe,
+                                  frame.timestamps, 3);
   }
 
   // Begin opaque pass
@@ -336,34 +596,60 @@ void Renderer::Render() {
   std::array<vk::ClearValue, 2> clear_values = {clear_color, clear_depth};
   opaque_begin_info.setClearValues(clear_values);
 
+  if (frame.timestamps) {
+    render_buffer_.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe,
+                                  frame.timestamps, 0);
+  }
   render_buffer_.beginRenderPass(opaque_begin_info,
                                  vk::SubpassContents::eInline);
 
+  // The prepass reuses the camera's culled and sorted draws, so it runs
+  // front to back too.
+  if (depth_prepass_) {
+    Draw(RenderPass::DepthPrepass, camera_view_proj, kCameraList, 0,
+         buckets_.size());
+  }
+
   // Draw normal objects
-  Draw(RenderPass::Opaque, camera_.GetViewProj());
+  if (frame.statistics) {
+    render_buffer_.beginQuery(frame.statistics, 0, {});
+  }
+  Draw(depth_prepass_ ? RenderPass::OpaqueAfterPrepass : RenderPass::Opaque,
+       camera_view_proj, kCameraList, 0, buckets_.size());
+  if (frame.statistics) {
+    render_buffer_.endQuery(frame.statistics, 0);
+    frame.statistics_pending = true;
+  }
 
   // Draw sky
   PushConstants push_constants;
-  push_constants.view_proj = glm::inverse(camera_.GetViewProj());
+  push_constants.view_proj = glm::inverse(camera_view_proj);
   render_buffer_.bindPipeline(vk::PipelineBindPoint::eGraphics, sky_pipeline_);
   render_buffer_.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
                                     layouts_->sky_pipeline_layout(), 0,
-                                    scene_descriptors_, {});
+                                    scene_descriptors_, scene_uniform_offset_);
   render_buffer_.pushConstants(
       layouts_->sky_pipeline_layout(), vk::ShaderStageFlagBits::eVertex, 0,
       static_cast<uint32_t>(sizeof(PushConstants)), &push_constants);
   render_buffer_.draw(6, 1, 0, 0);
 
   render_buffer_.endRenderPass();
+  if (frame.timestamps) {
+    render_buffer_.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe,
+                                  frame.timestamps, 1);
+    frame.timestamps_pending = true;
+  }
 
   render_buffer_.end();
 
+  resource_manager_->FlushTransient();
+
   // Submit render work
   vk::SubmitInfo submit_info;
-  vk::Semaphore wait_semaphores[] = {sync_resources_.image_available};
+  vk::Semaphore wait_semaphores[] = {frame.image_available};
   vk::PipelineStageFlags wait_stages[] = {
       vk::PipelineStageFlagBits::eColorAttachmentOutput};
-  vk::Semaphore signal_semaphores[] = {sync_resources_.render_finished};
+  vk::Semaphore signal_semaphores[] = {frame.render_finished};
   submit_info.setCommandBufferCount(1)
       .setPCommandBuffers(&render_buffer_)
       .setWaitSemaphoreCount(1)
@@ -372,8 +658,7 @@ void Renderer::Render() {
       .setSignalSemaphoreCount(1)
       .setPSignalSemaphores(signal_semaphores);
 
-  Device::Get()->graphics_queue().submit(submit_info,
-                                         sync_resources_.in_flight);
+  Device::Get()->graphics_queue().submit(submit_info, frame.in_flight);
 
   // Present!
   vk::PresentInfoKHR present_info;
@@ -386,55 +671,1226 @@ void Renderer::Render() {
   if (Device::Get()->present_queue().presentKHR(present_info) !=
       vk::Result::eSuccess)
     throw "Error on present.";
+
+  frame_index_ = (frame_index_ + 1) % static_cast<uint32_t>(frames_.size());
+}
+
+void Renderer::RenderStaticShadows() {
+  // Earlier frames' copies out of the cache must finish before it is
+  // overwritten.
+  render_buffer_.pipelineBarrier(
+      vk::PipelineStageFlagBits::eTransfer,
+      vk::PipelineStageFlagBits::eEarlyFragmentTests |
+          vk::PipelineStageFlagBits::eLateFragmentTests,
+      {}, {}, {}, {});
+
+  auto begin_info =
+      vk::RenderPassBeginInfo()
+          .setRenderPass(render_passes_->GetRenderPass(RenderPass::Shadow))
+          .setFramebuffer(static_shadow_map_.framebuffer)
+          .setRenderArea(ShadowTileBounds())
+          .setClearValues(vk::ClearValue().setDepthStencil(
+              vk::ClearDepthStencilValue(1.0f, 0)));
+  render_buffer_.beginRenderPass(begin_info, vk::SubpassContents::eInline);
+  DrawShadowCasters(0, StaticBucketCount());
+  render_buffer_.endRenderPass();
+
+  // The pass leaves it ready for sampling; it is only ever copied from.
+  auto to_transfer =
+      vk::ImageMemoryBarrier()
+          .setImage(static_shadow_map_.image.image)
+          .setOldLayout(vk::ImageLayout::eShaderReadOnlyOptimal)
+          .setNewLayout(vk::ImageLayout::eTransferSrcOptimal)
+          .setSrcAccessMask(vk::AccessFlagBits::eDepthStencilAttachmentWrite)
+          .setDstAccessMask(vk::AccessFlagBits::eTransferRead)
+          .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+          .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+          .setSubresourceRange(
+              vk::ImageSubresourceRange()
+                  .setAspectMask(vk::ImageAspectFlagBits::eDepth)
+                  .setBaseMipLevel(0)
+                  .setLevelCount(1)
+                  .setBaseArrayLayer(0)
+                  .setLayerCount(1));
+  render_buffer_.pipelineBarrier(
+      vk::PipelineStageFlagBits::eFragmentShader |
+          vk::PipelineStageFlagBits::eLateFragmentTests,
+      vk::PipelineStageFlagBits::eTransfer, {}, {}, {}, to_transfer);
+
+  static_shadows_dirty_ = false;
+  static_shadow_renders_++;
 }
 
-void Renderer::Draw(RenderPass pass, glm::mat4 view_proj) {
+void Renderer::DrawShadowCasters(size_t bucket_begin, size_t bucket_end) {
+  // Lights without a tile draw nothing, but their viewports must still be
+  // valid; the empty scissor clips anything that reaches them.
+  auto tile_viewport = [](const vk::Rect2D &tile) {
+    return vk::Viewport(
+        static_cast<float>(tile.offset.x), static_cast<float>(tile.offset.y),
+        static_cast<float>(std::max(tile.extent.width, 1u)),
+        static_cast<float>(std::max(tile.extent.height, 1u)), 0.0f, 1.0f);
+  };
+  if (render_passes_->single_pass_shadows()) {
+    std::array<vk::Viewport, NUM_LIGHTS> viewports;
+    for (uint32_t i = 0; i < NUM_LIGHTS; i++) {
+      viewports[i] = tile_viewport(shadow_tiles_[i]);
+    }
+    render_buffer_.setViewport(0, viewports);
+    render_buffer_.setScissor(0, shadow_tiles_);
+    Draw(RenderPass::Shadow, glm::mat4(1.0f), kShadowList, bucket_begin,
+         bucket_end);
+    return;
+  }
+
+  // One light at a time, each through its tile's viewport. Lights share the
+  // shadow list, so each draws all of it and shadow.vert drops the other
+  // lights' ids.
+  for (uint32_t i = 0; i < NUM_LIGHTS; i++) {
+    const vk::Rect2D &tile = shadow_tiles_[i];
+    if (tile.extent.width == 0) {
+      continue;
+    }
+    render_buffer_.setViewport(0, tile_viewport(tile));
+    render_buffer_.setScissor(0, tile);
+    Draw(RenderPass::Shadow, lights_[i].world2light, kShadowList,
+         bucket_begin, bucket_end, i);
+  }
+}
+
+vk::Rect2D Renderer::ShadowTileBounds() {
+  glm::uvec2 lower(kShadowAtlasSize), upper(0);
+  for (const vk::Rect2D &tile : shadow_tiles_) {
+    if (tile.extent.width == 0) {
+      continue;
+    }
+    glm::uvec2 offset(tile.offset.x, tile.offset.y);
+    lower = glm::min(lower, offset);
+    upper = glm::max(upper, offset + glm::uvec2(tile.extent.width,
+                                                tile.extent.height));
+  }
+  if (upper.x == 0) {
+    return vk::Rect2D({0, 0}, {kShadowAtlasSize, kShadowAtlasSize});
+  }
+  return vk::Rect2D(
+      {static_cast<int32_t>(lower.x), static_cast<int32_t>(lower.y)},
+      {upper.x - lower.x, upper.y - lower.y});
+}
+
+void Renderer::Draw(RenderPass pass, glm::mat4 view_proj, uint32_t list,
+                    size_t bucket_begin, size_t bucket_end, uint32_t light) {
+  size_t count = instance_transforms_.size();
+  if (count == 0 || bucket_begin == bucket_end) {
+    return;
+  }
+  auto record_start = std::chrono::high_resolution_clock::now();
+
   PushConstants push_constants;
   push_constants.view_proj = view_proj;
 
-  uint32_t instance_offset = 0;
+  // Depth-only passes only need the scene set, for the instance buffer and
+  // the lights.
+  if (IsDepthOnlyPass(pass)) {
+    render_buffer_.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                                      layouts_->shadow_pipeline_layout(), 0,
+                                      scene_descriptors_, scene_uniform_offset_);
+  }
+
+  // Every mesh lives in the pool and every id list in one buffer, so the ids
+  // and indices are bound once, vertices once per format, and draws pick
+  // their slice with firstIndex, vertexOffset and firstInstance.
+  vk::Buffer ids_buffer =
+      gpu_culling_ ? gpu_visible_ids_buffer_.buffer : visible_ids_.buffer;
+  vk::DeviceSize ids_offset = gpu_culling_ ? 0 : visible_ids_.offset;
+  render_buffer_.bindVertexBuffers(1, ids_buffer, ids_offset);
+  render_buffer_.bindIndexBuffer(mesh_pool_->index_buffer(), 0,
+                                 vk::IndexType::eUint32);
+
+  // Each bucket owns kMaxMeshLods consecutive ranges and commands.
+  size_t list_units = buckets_.size() * kMaxMeshLods;
+  const VisibleRange *ranges = visible_ranges_.data() + list * list_units;
+  uint32_t first_id = list_first_id(list);
+
+  bool indirect = gpu_culling_ || multi_draw_indirect_;
+  bool multi_draw = multi_draw_indirect_ &&
+                    Device::Get()->enabled_features().multiDrawIndirect;
+  vk::Buffer commands =
+      gpu_culling_ ? draw_commands_buffer_.buffer : draw_commands_.buffer;
+  vk::DeviceSize command_offset =
+      (gpu_culling_ ? 0 : draw_commands_.offset) +
+      sizeof(vk::DrawIndexedIndirectCommand) * list * list_units;
+  const uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand);
+
+  // Indirect draws batch up buckets [run_begin, run_end) until the next
+  // pipeline or descriptor change. A multi-draw covers unused LOD slots
+  // too, which hold empty commands, rather than split the run around them.
+  size_t run_begin = bucket_begin;
+  auto flush = [&](size_t run_end) {
+    if (!indirect || run_end == run_begin) {
+      return;
+    }
+    if (multi_draw) {
+      render_buffer_.drawIndexedIndirect(
+          commands, command_offset + stride * kMaxMeshLods * run_begin,
+          static_cast<uint32_t>(kMaxMeshLods * (run_end - run_begin)),
+          stride);
+      draw_calls_++;
+    } else {
+      for (size_t b = run_begin; b < run_end; b++) {
+        for (uint32_t lod = 0; lod < buckets_[b]->mesh->lod_count(); lod++) {
+          render_buffer_.drawIndexedIndirect(
+              commands, command_offset + stride * (b * kMaxMeshLods + lod), 1,
+              stride);
+          draw_calls_++;
+        }
+      }
+    }
+    run_begin = run_end;
+  };
+
+  Material *material = nullptr;
   vk::Pipeline pipeline = nullptr;
-  for (auto &material : materials_) {
-    vk::Pipeline new_pipeline = material->GetPipelineForRenderPass(pass);
-    vk::PipelineLayout layout = material->GetPipelineLayoutForRenderPass(pass);
-    vk::DescriptorSet material_descriptors =
-        material->GetMaterialDescriptorSetForRenderPass(pass);
+  bool vertices_bound = false;
+  VertexFormat vertex_format = VertexFormat::Full;
+  for (size_t b = bucket_begin; b < bucket_end; b++) {
+    const DrawBucket *bucket = buckets_[b].get();
+    const VisibleRange *lod_ranges = ranges + b * kMaxMeshLods;
+    if (!indirect &&
+        std::all_of(lod_ranges, lod_ranges + kMaxMeshLods,
+                    [](const VisibleRange &range) { return range.count == 0; })) {
+      continue;
+    }
+
+    vk::PipelineLayout layout =
+        bucket->material->GetPipelineLayoutForRenderPass(pass);
+    VertexFormat new_vertex_format = bucket->mesh->vertex_format();
+    vk::Pipeline new_pipeline =
+        bucket->material->GetPipelineForRenderPass(pass, new_vertex_format,
+                                                   instance_format_,
+                                                   shadow_filter_);
+
+    // Depth-only passes bind no material descriptors, so only their
+    // pipelines can end a run.
+    bool material_changed =
+        material != bucket->material && !IsDepthOnlyPass(pass);
+    if (material_changed || pipeline != new_pipeline) {
+      flush(b);
+    }
+
+    if (material != bucket->material) {
+      material = bucket->material;
+
+      if (!IsDepthOnlyPass(pass)) {
+        vk::DescriptorSet material_descriptors =
+            material->GetMaterialDescriptorSetForRenderPass(pass);
+        render_buffer_.bindDescriptorSets(
+            vk::PipelineBindPoint::eGraphics, layout, 0,
+            {scene_descriptors_, material_descriptors},
+            scene_uniform_offset_);
+      }
+    }
 
-    // Shadow pass only uses push constants and instance data.
-    if (pass != RenderPass::Shadow) {
-      render_buffer_.bindDescriptorSets(
-          vk::PipelineBindPoint::eGraphics, layout, 0,
-          {scene_descriptors_, material_descriptors}, {});
+    // Formats have their own pipelines, so this never splits a run.
+    // Depth-only pipelines read positions only.
+    if (!vertices_bound || vertex_format != new_vertex_format) {
+      vertices_bound = true;
+      vertex_format = new_vertex_format;
+      vk::Buffer vertex_buffer =
+          IsDepthOnlyPass(pass)
+              ? mesh_pool_->position_buffer(vertex_format)
+              : mesh_pool_->vertex_buffer(vertex_format);
+      render_buffer_.bindVertexBuffers(0, vertex_buffer, {0});
     }
 
     if (pipeline != new_pipeline) {
       pipeline = new_pipeline;
       render_buffer_.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
-      render_buffer_.pushConstants(layout, vk::ShaderStageFlagBits::eVertex, 0,
-                                   sizeof(PushConstants), &push_constants);
+      if (IsDepthOnlyPass(pass)) {
+        DepthOnlyPushConstants depth_push_constants = {view_proj, light};
+        render_buffer_.pushConstants(layout, vk::ShaderStageFlagBits::eVertex,
+                                     0, sizeof(DepthOnlyPushConstants),
+                                     &depth_push_constants);
+      } else {
+        render_buffer_.pushConstants(layout, vk::ShaderStageFlagBits::eVertex,
+                                     0, sizeof(PushConstants), &push_constants);
+      }
     }
 
-    for (auto &mesh : meshes_) {
-      uint32_t num_instances = 0;
-      for (auto &object : objects_) {
-        if (object->material() == material.get() &&
-            object->mesh() == mesh.get()) {
-          num_instances += 1;
+    if (!indirect) {
+      for (uint32_t lod = 0; lod < bucket->mesh->lod_count(); lod++) {
+        if (lod_ranges[lod].count == 0) {
+          continue;
         }
+        const Mesh::Lod &mesh_lod = bucket->mesh->lod(lod);
+        render_buffer_.drawIndexed(mesh_lod.index_count, lod_ranges[lod].count,
+                                   mesh_lod.first_index, mesh_lod.vertex_offset,
+                                   first_id + lod_ranges[lod].first);
+        draw_calls_++;
       }
+    }
+  }
+  flush(bucket_end);
+
+  std::chrono::duration<double, std::milli> record_time =
+      std::chrono::high_resolution_clock::now() - record_start;
+  draw_record_ms_ += record_time.count();
+}
+
+void Renderer::UpdateInstances() {
+  if (instance_layout_dirty_ || instance_capacity_ < objects_.size()) {
+    RebuildInstances();
+    return;
+  }
+
+  const uint32_t *dirty = transforms_.dirty_handles();
+  size_t dirty_count = transforms_.dirty_count();
+  instances_rewritten_ = static_cast<uint32_t>(dirty_count);
+  if (dirty_count == 0) {
+    return;
+  }
+
+  // Compose straight into the ring so the upload needs no extra copy.
+  size_t stride = InstanceSize(instance_format_);
+  size_t index_size = sizeof(uint32_t) * dirty_count;
+  size_t data_size = stride * dirty_count;
+  auto indices = resource_manager_->AllocateTransient(index_size);
+  auto data = resource_manager_->AllocateTransient(data_size);
+  uint32_t *index_out = static_cast<uint32_t *>(indices.data);
+  char *data_out = static_cast<char *>(data.data);
+  JobSystem::Get()->ParallelFor(
+      0, dirty_count, kInstanceGrain,
+      [&](size_t begin, size_t end, uint32_t) {
+        WriteInstances(dirty + begin, end - begin, data_out + stride * begin);
+        for (size_t i = begin; i < end; i++) {
+          index_out[i] = dirty[i] < instance_index_.size()
+                             ? instance_index_[dirty[i]]
+                             : UINT32_MAX;
+        }
+      });
+  transforms_.ClearDirty();
+
+  std::array<vk::DescriptorBufferInfo, 3> buffer_infos = {
+      vk::DescriptorBufferInfo(indices.buffer, indices.offset, index_size),
+      vk::DescriptorBufferInfo(data.buffer, data.offset, data_size),
+      vk::DescriptorBufferInfo(instance_data_buffer_.buffer, 0, VK_WHOLE_SIZE),
+  };
+  auto write = vk::WriteDescriptorSet()
+                   .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+                   .setDstSet(instance_scatter_descriptors_)
+                   .setDstBinding(0)
+                   .setDstArrayElement(0)
+                   .setBufferInfo(buffer_infos);
+  Device::Get()->device().updateDescriptorSets({write}, {});
+
+  // Earlier frames may still be reading or writing instances on the GPU.
+  auto before = vk::MemoryBarrier()
+                    .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite |
+                                      vk::AccessFlagBits::eTransferWrite)
+                    .setDstAccessMask(vk::AccessFlagBits::eShaderWrite);
+  render_buffer_.pipelineBarrier(vk::PipelineStageFlagBits::eVertexShader |
+                                     vk::PipelineStageFlagBits::eComputeShader |
+                                     vk::PipelineStageFlagBits::eTransfer,
+                                 vk::PipelineStageFlagBits::eComputeShader, {},
+                                 before, {}, {});
+
+  uint32_t count = static_cast<uint32_t>(dirty_count);
+  render_buffer_.bindPipeline(vk::PipelineBindPoint::eCompute,
+                              instance_scatter_pipelines_[static_cast<uint32_t>(
+                                  instance_format_)]);
+  render_buffer_.bindDescriptorSets(
+      vk::PipelineBindPoint::eCompute,
+      layouts_->instance_scatter_pipeline_layout(), 0,
+      instance_scatter_descriptors_, {});
+  render_buffer_.pushConstants(layouts_->instance_scatter_pipeline_layout(),
+                               vk::ShaderStageFlagBits::eCompute, 0,
+                               sizeof(uint32_t), &count);
+  render_buffer_.dispatch((count + 63) / 64, 1, 1);
+
+  auto barrier = vk::BufferMemoryBarrier()
+                     .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite)
+                     .setDstAccessMask(vk::AccessFlagBits::eShaderRead)
+                     .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                     .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+                     .setBuffer(instance_data_buffer_.buffer)
+                     .setOffset(0)
+                     .setSize(VK_WHOLE_SIZE);
+  render_buffer_.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                 vk::PipelineStageFlagBits::eVertexShader |
+                                     vk::PipelineStageFlagBits::eComputeShader,
+                                 {}, {}, barrier, {});
+}
+
+void Renderer::RebuildInstances() {
+  instance_transforms_.clear();
+  instance_buckets_.clear();
+  instance_index_.assign(transforms_.size(), UINT32_MAX);
+  for (size_t b = 0; b < buckets_.size(); b++) {
+    DrawBucket &bucket = *buckets_[b];
+    bucket.instance_offset = static_cast<uint32_t>(instance_transforms_.size());
+    for (uint32_t handle : bucket.transforms) {
+      instance_index_[handle] =
+          static_cast<uint32_t>(instance_transforms_.size());
+      instance_transforms_.push_back(handle);
+      instance_buckets_.push_back(static_cast<uint32_t>(b));
+    }
+  }
+  instance_lods_.assign(instance_transforms_.size(), 0);
+  transforms_.ClearDirty();
+  instance_layout_dirty_ = false;
+  instances_rewritten_ = static_cast<uint32_t>(instance_transforms_.size());
+
+  size_t count = instance_transforms_.size();
+  if (count == 0) {
+    return;
+  }
+
+  if (instance_capacity_ < count) {
+    instance_capacity_ = std::max(count, 2 * instance_capacity_);
+    if (instance_data_buffer_.buffer) {
+      resource_manager_->ReleaseAfterFrame(std::move(instance_data_buffer_));
+    }
+    instance_data_buffer_ = resource_manager_->CreateDeviceBuffer(
+        vk::BufferUsageFlagBits::eStorageBuffer,
+        InstanceSize(instance_format_) * instance_capacity_);
+  }
+
+  size_t stride = InstanceSize(instance_format_);
+  size_t size = stride * count;
+  auto upload = resource_manager_->AllocateTransient(size);
+  char *out = static_cast<char *>(upload.data);
+  JobSystem::Get()->ParallelFor(
+      0, count, kInstanceGrain, [&](size_t begin, size_t end, uint32_t) {
+        WriteInstances(instance_transforms_.data() + begin, end - begin,
+                       out + stride * begin);
+      });
+
+  auto before = vk::MemoryBarrier()
+                    .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite |
+                                      vk::AccessFlagBits::eTransferWrite)
+                    .setDstAccessMask(vk::AccessFlagBits::eTransferWrite);
+  render_buffer_.pipelineBarrier(vk::PipelineStageFlagBits::eVertexShader |
+                                     vk::PipelineStageFlagBits::eComputeShader |
+                                     vk::PipelineStageFlagBits::eTransfer,
+                                 vk::PipelineStageFlagBits::eTransfer, {},
+                                 before, {}, {});
+  render_buffer_.copyBuffer(upload.buffer, instance_data_buffer_.buffer,
+                            {vk::BufferCopy(upload.offset, 0, size)});
+
+  // GPU culling inputs: each instance's bucket, and each bucket's bounds
+  // and LOD errors. Vertex shaders read the former too, along with each
+  // bucket's position quantization.
+  size_t instance_buckets_size = sizeof(uint32_t) * count;
+  size_t gpu_buckets_size = sizeof(GpuCullBucket) * buckets_.size();
+  size_t quantization_size = sizeof(PositionQuantization) * buckets_.size();
+  auto instance_buckets =
+      resource_manager_->AllocateTransient(instance_buckets_size);
+  auto gpu_buckets = resource_manager_->AllocateTransient(gpu_buckets_size);
+  auto quantization = resource_manager_->AllocateTransient(quantization_size);
+  std::copy(instance_buckets_.begin(), instance_buckets_.end(),
+            static_cast<uint32_t *>(instance_buckets.data));
+  GpuCullBucket *gpu_bucket_out = static_cast<GpuCullBucket *>(gpu_buckets.data);
+  PositionQuantization *quantization_out =
+      static_cast<PositionQuantization *>(quantization.data);
+  for (size_t b = 0; b < buckets_.size(); b++) {
+    const DrawBucket &bucket = *buckets_[b];
+    quantization_out[b] = bucket.mesh->position_quantization();
+    GpuCullBucket &out = gpu_bucket_out[b];
+    out = {};
+    out.sphere = bucket.mesh->bounding_sphere();
+    out.first_instance = bucket.instance_offset;
+    out.instance_count = static_cast<uint32_t>(bucket.transforms.size());
+    out.lod_count = bucket.mesh->lod_count();
+    for (uint32_t lod = 0; lod < out.lod_count; lod++) {
+      out.lod_errors[lod] = bucket.mesh->lod(lod).error;
+    }
+  }
+
+  EnsureDeviceBuffer(instance_buckets_buffer_,
+                     vk::BufferUsageFlagBits::eStorageBuffer,
+                     instance_buckets_size);
+  EnsureDeviceBuffer(gpu_cull_buckets_buffer_,
+                     vk::BufferUsageFlagBits::eStorageBuffer, gpu_buckets_size);
+  EnsureDeviceBuffer(bucket_quantization_buffer_,
+                     vk::BufferUsageFlagBits::eStorageBuffer,
+                     quantization_size);
+  EnsureDeviceBuffer(gpu_instance_lods_buffer_,
+                     vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eTransferDst,
+                     sizeof(uint32_t) * count);
+  EnsureDeviceBuffer(gpu_visible_ids_buffer_,
+                     vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eVertexBuffer,
+                     sizeof(uint32_t) * kViewCount * kMaxMeshLods * count);
+  EnsureDeviceBuffer(draw_commands_buffer_,
+                     vk::BufferUsageFlagBits::eStorageBuffer |
+                         vk::BufferUsageFlagBits::eIndirectBuffer,
+                     sizeof(vk::DrawIndexedIndirectCommand) * kListCount *
+                         buckets_.size() * kMaxMeshLods);
+  // Instances moved between slots, so start every one at full detail.
+  render_buffer_.fillBuffer(gpu_instance_lods_buffer_.buffer, 0,
+                            VK_WHOLE_SIZE, 0);
+  render_buffer_.copyBuffer(
+      instance_buckets.buffer, instance_buckets_buffer_.buffer,
+      {vk::BufferCopy(instance_buckets.offset, 0, instance_buckets_size)});
+  render_buffer_.copyBuffer(
+      gpu_buckets.buffer, gpu_cull_buckets_buffer_.buffer,
+      {vk::BufferCopy(gpu_buckets.offset, 0, gpu_buckets_size)});
+  render_buffer_.copyBuffer(
+      quantization.buffer, bucket_quantization_buffer_.buffer,
+      {vk::BufferCopy(quantization.offset, 0, quantization_size)});
+
+  auto barrier = vk::MemoryBarrier()
+                     .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+                     .setDstAccessMask(vk::AccessFlagBits::eShaderRead |
+                                       vk::AccessFlagBits::eShaderWrite);
+  render_buffer_.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                 vk::PipelineStageFlagBits::eVertexShader |
+                                     vk::PipelineStageFlagBits::eComputeShader,
+                                 {}, barrier, {}, {});
+}
+
+void Renderer::WriteInstances(const uint32_t *handles, size_t count,
+                              void *out) {
+  if (instance_format_ == InstanceFormat::Trs) {
+    GatherInstanceTrs(transforms_, handles, count,
+                      static_cast<InstanceTrs *>(out));
+  } else {
+    ComposeInstanceData(transforms_, handles, count,
+                        static_cast<InstanceData *>(out));
+  }
+}
+
+void Renderer::set_instance_format(InstanceFormat format) {
+  if (instance_format_ == format) {
+    return;
+  }
+  instance_format_ = format;
+  // The buffer is sized in instances of the old format.
+  instance_capacity_ = 0;
+  instance_layout_dirty_ = true;
+}
+
+void Renderer::EnsureDeviceBuffer(ResourceManager::Buffer &buffer,
+                                  vk::BufferUsageFlags usage, size_t size) {
+  if (buffer.buffer && buffer.size >= size) {
+    return;
+  }
+
+  size_t capacity = size;
+  if (buffer.buffer) {
+    capacity = std::max(size, 2 * buffer.size);
+    resource_manager_->ReleaseAfterFrame(std::move(buffer));
+  }
+  buffer = resource_manager_->CreateDeviceBuffer(usage, capacity);
+}
+
+void Renderer::set_gpu_culling(bool enabled) {
+  gpu_culling_ =
+      enabled && Device::Get()->enabled_features().drawIndirectFirstInstance;
+}
+
+void Renderer::set_multi_draw_indirect(bool enabled) {
+  multi_draw_indirect_ =
+      enabled && Device::Get()->enabled_features().drawIndirectFirstInstance;
+}
+
+void Renderer::UpdateInstanceDescriptors() {
+  // Rebuilds may have replaced the buffer since this frame's set was written.
+  if (!instance_data_buffer_.buffer) {
+    return;
+  }
+
+  std::array<vk::DescriptorBufferInfo, 3> buffer_infos = {
+      vk::DescriptorBufferInfo(instance_data_buffer_.buffer, 0, VK_WHOLE_SIZE),
+      vk::DescriptorBufferInfo(instance_buckets_buffer_.buffer, 0,
+                               VK_WHOLE_SIZE),
+      vk::DescriptorBufferInfo(bucket_quantization_buffer_.buffer, 0,
+                               VK_WHOLE_SIZE),
+  };
+  auto write = vk::WriteDescriptorSet()
+                   .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+                   .setDstSet(scene_descriptors_)
+                   .setDstBinding(4)
+                   .setDstArrayElement(0)
+                   .setBufferInfo(buffer_infos);
+  Device::Get()->device().updateDescriptorSets({write}, {});
+}
+
+void Renderer::CullInstances(const glm::mat4 &camera_view_proj) {
+  std::array<Frustum, kViewCount> views;
+  for (uint32_t i = 0; i < NUM_LIGHTS; i++) {
+    views[i] = ExtractFrustum(light_bounds_[i]);
+  }
+  views[kCameraView] = ExtractFrustum(camera_view_proj);
+
+  size_t count = instance_transforms_.size();
+  size_t list_units = buckets_.size() * kMaxMeshLods;
+  instance_visibility_.resize(count);
+  visible_ranges_.resize(kListCount * list_units);
+  visible_instances_ = 0;
+  triangles_ = 0;
+  if (count == 0) {
+    return;
+  }
 
-      if (num_instances == 0) {
+  std::fill(instance_visibility_.begin(), instance_visibility_.end(), 0);
+  bvh_.QueryFrustums(views.data(), kViewCount,
+                     [&](uint32_t handle, uint8_t mask) {
+                       instance_visibility_[instance_index_[handle]] = mask;
+                     });
+  if (shadow_fitting_) {
+    FitShadowFrusta();
+    AssignShadowTiles();
+  }
+  SelectLods();
+
+  JobSystem *jobs = JobSystem::Get();
+  visible_ids_ =
+      resource_manager_->AllocateTransient(sizeof(uint32_t) * kViewCount * count);
+  uint32_t *ids = static_cast<uint32_t *>(visible_ids_.data);
+  vk::DrawIndexedIndirectCommand *command_out = nullptr;
+  if (multi_draw_indirect_) {
+    draw_commands_ = resource_manager_->AllocateTransient(
+        sizeof(vk::DrawIndexedIndirectCommand) * kListCount * list_units);
+    command_out =
+        static_cast<vk::DrawIndexedIndirectCommand *>(draw_commands_.data);
+  }
+  auto write_commands = [&](uint32_t list, size_t b) {
+    if (!command_out) {
+      return;
+    }
+    Mesh *mesh = buckets_[b]->mesh;
+    size_t unit = list * list_units + b * kMaxMeshLods;
+    const VisibleRange *ranges = &visible_ranges_[unit];
+    for (uint32_t lod = 0; lod < mesh->lod_count(); lod++) {
+      const Mesh::Lod &mesh_lod = mesh->lod(lod);
+      command_out[unit + lod] = vk::DrawIndexedIndirectCommand(
+          mesh_lod.index_count, ranges[lod].count, mesh_lod.first_index,
+          mesh_lod.vertex_offset, list_first_id(list) + ranges[lod].first);
+    }
+    std::fill(command_out + unit + mesh->lod_count(),
+              command_out + unit + kMaxMeshLods,
+              vk::DrawIndexedIndirectCommand(0, 0, 0, 0, 0));
+  };
+
+  // Gathers a bucket's survivors into the slots it owns in list: one per
+  // instance in the camera list, one per instance and light in the shadow
+  // list. Each LOD's survivors are counted, then scattered into one run.
+  const uint8_t light_bits = static_cast<uint8_t>((1u << NUM_LIGHTS) - 1);
+  // A clean shadow cache already holds the static casters.
+  bool skip_static = shadow_caching_ && !static_shadows_dirty_;
+  auto gather_bucket = [&](uint32_t list, size_t b) {
+    const DrawBucket &bucket = *buckets_[b];
+    bool shadow = list == kShadowList;
+    if (shadow && skip_static && bucket.static_caster) {
+      std::fill_n(&visible_ranges_[list * list_units + b * kMaxMeshLods],
+                  kMaxMeshLods, VisibleRange{0, 0});
+      write_commands(list, b);
+      return;
+    }
+    uint8_t view_bits =
+        shadow ? light_bits : static_cast<uint8_t>(1u << kCameraView);
+    uint32_t lod_bias = shadow && mesh_lods_ ? kShadowLodBias : 0;
+    uint32_t last_lod = bucket.mesh->lod_count() - 1;
+    uint32_t instance_end =
+        bucket.instance_offset + static_cast<uint32_t>(bucket.transforms.size());
+    uint32_t cursor = shadow ? NUM_LIGHTS * bucket.instance_offset
+                             : bucket.instance_offset;
+    uint32_t *out = ids + list_first_id(list);
+
+    std::array<uint32_t, kMaxMeshLods> lod_cursor = {};
+    for (uint32_t i = bucket.instance_offset; i < instance_end; i++) {
+      uint32_t lod = std::min(instance_lods_[i] + lod_bias, last_lod);
+      lod_cursor[lod] += static_cast<uint32_t>(
+          std::bitset<8>(instance_visibility_[i] & view_bits).count());
+    }
+    VisibleRange *ranges = &visible_ranges_[list * list_units + b * kMaxMeshLods];
+    for (uint32_t lod = 0; lod < kMaxMeshLods; lod++) {
+      ranges[lod] = {cursor, lod_cursor[lod]};
+      lod_cursor[lod] = cursor;
+      cursor += ranges[lod].count;
+    }
+    for (uint32_t i = bucket.instance_offset; i < instance_end; i++) {
+      uint8_t visible = instance_visibility_[i] & view_bits;
+      if (!visible) {
+        continue;
+      }
+      uint32_t lod = std::min(instance_lods_[i] + lod_bias, last_lod);
+      if (!shadow) {
+        out[lod_cursor[lod]++] = i;
         continue;
       }
+      for (uint32_t light = 0; light < NUM_LIGHTS; light++) {
+        if (visible & (1u << light)) {
+          out[lod_cursor[lod]++] = i | (light << kShadowLayerShift);
+        }
+      }
+    }
+    write_commands(list, b);
+  };
+
+  // Buckets own fixed slices of both lists, so they gather independently.
+  // With sorting, the camera's list is built below from draw keys instead.
+  jobs->ParallelFor(0, buckets_.size(), 1,
+                    [&](size_t begin, size_t end, uint32_t) {
+                      for (size_t b = begin; b < end; b++) {
+                        gather_bucket(kShadowList, b);
+                        if (!sort_draws_) {
+                          gather_bucket(kCameraList, b);
+                        }
+                      }
+                    });
+
+  if (sort_draws_) {
+    SortVisibleInstances(kCameraView, camera_view_proj,
+                         ids + list_first_id(kCameraList),
+                         &visible_ranges_[kCameraList * list_units]);
+    for (size_t b = 0; b < buckets_.size(); b++) {
+      write_commands(kCameraList, b);
+    }
+  }
+
+  for (uint32_t list = 0; list < kListCount; list++) {
+    for (size_t b = 0; b < buckets_.size(); b++) {
+      Mesh *mesh = buckets_[b]->mesh;
+      const VisibleRange *ranges =
+          &visible_ranges_[list * list_units + b * kMaxMeshLods];
+      for (uint32_t lod = 0; lod < mesh->lod_count(); lod++) {
+        triangles_ +=
+            uint64_t(ranges[lod].count) * (mesh->lod(lod).index_count / 3);
+      }
+    }
+  }
+  for (size_t unit = 0; unit < list_units; unit++) {
+    visible_instances_ += visible_ranges_[kCameraList * list_units + unit].count;
+  }
+}
+
+void Renderer::SortVisibleInstances(uint32_t view, const glm::mat4 &view_proj,
+                                    uint32_t *out, VisibleRange *ranges) {
+  size_t count = instance_transforms_.size();
+  uint8_t bit = static_cast<uint8_t>(1u << view);
+  uint32_t lod_bias = view == kCameraView || !mesh_lods_ ? 0 : kShadowLodBias;
+  RenderPass pass = view == kCameraView ? RenderPass::Opaque : RenderPass::Shadow;
+
+  sort_ids_.clear();
+  for (uint32_t i = 0; i < count; i++) {
+    if (instance_visibility_[i] & bit) {
+      sort_ids_.push_back(i);
+    }
+  }
+  size_t visible = sort_ids_.size();
+  sort_keys_.resize(visible);
+
+  // Clip w is the view-space depth.
+  glm::vec4 depth_row(view_proj[0][3], view_proj[1][3], view_proj[2][3],
+                      view_proj[3][3]);
+  const glm::vec3 *positions = transforms_.positions();
+  JobSystem::Get()->ParallelFor(
+      0, visible, kInstanceGrain, [&](size_t begin, size_t end, uint32_t) {
+        for (size_t k = begin; k < end; k++) {
+          uint32_t i = sort_ids_[k];
+          uint32_t bucket = instance_buckets_[i];
+          uint32_t last_lod = buckets_[bucket]->mesh->lod_count() - 1;
+          uint32_t lod = std::min(instance_lods_[i] + lod_bias, last_lod);
+          float depth = glm::dot(
+              depth_row, glm::vec4(positions[instance_transforms_[i]], 1.0f));
+          sort_keys_[k] = MakeDrawKey(pass, bucket, lod, depth);
+        }
+      });
+  RadixSortDrawKeys(sort_keys_.data(), sort_ids_.data(), visible,
+                    sort_scratch_);
+
+  // Keys group by bucket, then LOD, so each range is one run.
+  std::fill(ranges, ranges + buckets_.size() * kMaxMeshLods,
+            VisibleRange{0, 0});
+  for (size_t k = 0; k < visible; k++) {
+    VisibleRange &range = ranges[DrawKeyBucket(sort_keys_[k]) * kMaxMeshLods +
+                                 DrawKeyLod(sort_keys_[k])];
+    if (range.count++ == 0) {
+      range.first = static_cast<uint32_t>(k);
+    }
+    out[k] = sort_ids_[k];
+  }
+}
+
+void Renderer::SelectLods() {
+  size_t count = instance_transforms_.size();
+  if (!mesh_lods_) {
+    std::fill(instance_lods_.begin(), instance_lods_.end(), 0);
+    return;
+  }
+
+  glm::vec3 eye = camera_.position;
+  float pixel_scale = camera_.GetPixelScale();
+  const float enter_pixels = kLodErrorPixels * (1.0f - kLodHysteresis);
+  const float leave_pixels = kLodErrorPixels * (1.0f + kLodHysteresis);
+  const glm::vec3 *positions = transforms_.positions();
+  const glm::quat *rotations = transforms_.rotations();
+  const glm::vec3 *scales = transforms_.scales();
+
+  JobSystem::Get()->ParallelFor(
+      0, count, kInstanceGrain, [&](size_t begin, size_t end, uint32_t) {
+        for (size_t i = begin; i < end; i++) {
+          Mesh *mesh = buckets_[instance_buckets_[i]]->mesh;
+          uint32_t handle = instance_transforms_[i];
+          glm::vec4 sphere = mesh->bounding_sphere();
+          glm::vec3 scale = glm::abs(scales[handle]);
+          float max_scale = glm::max(scale.x, glm::max(scale.y, scale.z));
+          glm::vec3 center =
+              positions[handle] +
+              rotations[handle] * (scales[handle] * glm::vec3(sphere));
+
+          // Measured to the near side of the bounds, so no part of the
+          // object sees a larger error than the one estimated.
+          float distance = glm::length(center - eye) - sphere.w * max_scale;
+          if (distance <= 0.0f) {
+            instance_lods_[i] = 0;
+            continue;
+          }
+          float units_to_pixels = pixel_scale * max_scale / distance;
+
+          // The coarsest LODs this instance may enter and may stay at.
+          uint32_t enter = 0, stay = 0;
+          for (uint32_t lod = 1; lod < mesh->lod_count(); lod++) {
+            float pixels = mesh->lod(lod).error * units_to_pixels;
+            enter = pixels <= enter_pixels ? lod : enter;
+            stay = pixels <= leave_pixels ? lod : stay;
+          }
+          instance_lods_[i] = static_cast<uint8_t>(
+              glm::clamp<uint32_t>(instance_lods_[i], enter, stay));
+        }
+      });
+}
+
+void Renderer::CullInstancesOnGpu(const glm::mat4 &camera_view_proj) {
+  size_t count = instance_transforms_.size();
+  visible_instances_ = 0;
+  if (count == 0) {
+    return;
+  }
+  uint32_t bucket_count = static_cast<uint32_t>(buckets_.size());
+
+  auto views = resource_manager_->AllocateTransient(sizeof(Frustum) * kViewCount);
+  Frustum *view_out = static_cast<Frustum *>(views.data);
+  for (uint32_t i = 0; i < NUM_LIGHTS; i++) {
+    view_out[i] = ExtractFrustum(light_bounds_[i]);
+  }
+  view_out[kCameraView] = ExtractFrustum(camera_view_proj);
+
+  // Every command starts out empty; the cull pass counts instances in.
+  // Each (list, LOD) pair gets its own run of ids, bucket by bucket, with
+  // NUM_LIGHTS slots per instance in the shadow list and one in the
+  // camera's.
+  size_t commands_size = sizeof(vk::DrawIndexedIndirectCommand) * kListCount *
+                         bucket_count * kMaxMeshLods;
+  auto commands = resource_manager_->AllocateTransient(commands_size);
+  vk::DrawIndexedIndirectCommand *command_out =
+      static_cast<vk::DrawIndexedIndirectCommand *>(commands.data);
+  const uint32_t camera_first_id =
+      static_cast<uint32_t>(NUM_LIGHTS * kMaxMeshLods * count);
+  for (uint32_t list = 0; list < kListCount; list++) {
+    for (uint32_t b = 0; b < bucket_count; b++) {
+      const DrawBucket &bucket = *buckets_[b];
+      for (uint32_t lod = 0; lod < kMaxMeshLods; lod++) {
+        vk::DrawIndexedIndirectCommand command(0, 0, 0, 0, 0);
+        if (lod < bucket.mesh->lod_count()) {
+          const Mesh::Lod &mesh_lod = bucket.mesh->lod(lod);
+          uint32_t first_id = static_cast<uint32_t>(lod * count) +
+                              bucket.instance_offset;
+          command = vk::DrawIndexedIndirectCommand(
+              mesh_lod.index_count, 0, mesh_lod.first_index,
+              mesh_lod.vertex_offset,
+              list == kShadowList ? NUM_LIGHTS * first_id
+                                  : camera_first_id + first_id);
+        }
+        command_out[(list * bucket_count + b) * kMaxMeshLods + lod] = command;
+      }
+    }
+  }
+
+  // Earlier frames may still be drawing from the commands and ids.
+  auto before = vk::MemoryBarrier().setDstAccessMask(
+      vk::AccessFlagBits::eTransferWrite | vk::AccessFlagBits::eShaderWrite);
+  render_buffer_.pipelineBarrier(vk::PipelineStageFlagBits::eDrawIndirect |
+                                     vk::PipelineStageFlagBits::eVertexInput,
+                                 vk::PipelineStageFlagBits::eTransfer |
+                                     vk::PipelineStageFlagBits::eComputeShader,
+                                 {}, before, {}, {});
+  render_buffer_.copyBuffer(commands.buffer, draw_commands_buffer_.buffer,
+                            {vk::BufferCopy(commands.offset, 0, commands_size)});
+  auto reset = vk::MemoryBarrier()
+                   .setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
+                   .setDstAccessMask(vk::AccessFlagBits::eShaderRead |
+                                     vk::AccessFlagBits::eShaderWrite);
+  render_buffer_.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                 vk::PipelineStageFlagBits::eComputeShader, {},
+                                 reset, {}, {});
+
+  std::array<vk::DescriptorBufferInfo, 7> buffer_infos = {
+      vk::DescriptorBufferInfo(instance_data_buffer_.buffer, 0, VK_WHOLE_SIZE),
+      vk::DescriptorBufferInfo(instance_buckets_buffer_.buffer, 0,
+                               VK_WHOLE_SIZE),
+      vk::DescriptorBufferInfo(gpu_cull_buckets_buffer_.buffer, 0,
+                               VK_WHOLE_SIZE),
+      vk::DescriptorBufferInfo(views.buffer, views.offset,
+                               sizeof(Frustum) * kViewCount),
+      vk::DescriptorBufferInfo(draw_commands_buffer_.buffer, 0, VK_WHOLE_SIZE),
+      vk::DescriptorBufferInfo(gpu_visible_ids_buffer_.buffer, 0,
+                               VK_WHOLE_SIZE),
+      vk::DescriptorBufferInfo(gpu_instance_lods_buffer_.buffer, 0,
+                               VK_WHOLE_SIZE),
+  };
+  auto write = vk::WriteDescriptorSet()
+                   .setDescriptorType(vk::DescriptorType::eStorageBuffer)
+                   .setDstSet(gpu_cull_descriptors_)
+                   .setDstBinding(0)
+                   .setDstArrayElement(0)
+                   .setBufferInfo(buffer_infos);
+  Device::Get()->device().updateDescriptorSets({write}, {});
+
+  GpuCullParams params;
+  params.instance_count = static_cast<uint32_t>(count);
+  params.bucket_count = bucket_count;
+  params.shadow_lod_bias = mesh_lods_ ? kShadowLodBias : 0;
+  params.lods_enabled = mesh_lods_;
+  params.camera = glm::vec4(camera_.position, camera_.GetPixelScale());
+  render_buffer_.bindPipeline(vk::PipelineBindPoint::eCompute,
+                              gpu_cull_pipelines_[static_cast<uint32_t>(
+                                  instance_format_)]);
+  render_buffer_.bindDescriptorSets(vk::PipelineBindPoint::eCompute,
+                                    layouts_->gpu_cull_pipeline_layout(), 0,
+                                    gpu_cull_descriptors_, {});
+  render_buffer_.pushConstants(layouts_->gpu_cull_pipeline_layout(),
+                               vk::ShaderStageFlagBits::eCompute, 0,
+                               sizeof(params), &params);
+  render_buffer_.dispatch(static_cast<uint32_t>((count + 63) / 64), 1, 1);
+
+  auto after = vk::MemoryBarrier()
+                   .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite)
+                   .setDstAccessMask(vk::AccessFlagBits::eIndirectCommandRead |
+                                     vk::AccessFlagBits::eVertexAttributeRead);
+  render_buffer_.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                                 vk::PipelineStageFlagBits::eDrawIndirect |
+                                     vk::PipelineStageFlagBits::eVertexInput,
+                                 {}, after, {}, {});
+}
+
+void Renderer::UpdateLights() {
+  // A light that moved invalidates its tile of the static shadow cache.
+  if (dirty_lights_) {
+    static_shadows_dirty_ = true;
+  }
+  for (uint32_t i = 0; i < NUM_LIGHTS; i++) {
+    if (!(dirty_lights_ & (1u << i))) {
+      continue;
+    }
+    light_views_[i] = glm::lookAt(
+        lights_[i].position,
+        lights_[i].position + glm::vec3(lights_[i].direction_angle),
+        glm::vec3(0.0f, 1.0f, 0.0f));
+    glm::mat4 proj = glm::perspectiveFovZO(2.0f * lights_[i].direction_angle.w,
+                                           1.0f, 1.0f, kShadowNear, kShadowFar);
+    proj[1][1] *= -1.0f;
+    light_bounds_[i] = proj * light_views_[i];
+    // Until fitting narrows it.
+    lights_[i].world2light = light_bounds_[i];
+    lights_[i].shadow_range = glm::vec2(kShadowNear, kShadowFar);
+  }
+  dirty_lights_ = 0;
+}
+
+void Renderer::SetShadowProjection(uint32_t light, const glm::mat4 &view_proj,
+                                   const glm::vec2 &range) {
+  Light &l = lights_[light];
+  if (l.world2light != view_proj || l.shadow_range != range) {
+    l.world2light = view_proj;
+    l.shadow_range = range;
+    static_shadows_dirty_ = true;
+  }
+}
+
+void Renderer::FitShadowFrusta() {
+  size_t count = instance_transforms_.size();
+  const uint8_t camera_bit = static_cast<uint8_t>(1u << kCameraView);
+
+  // Cosine and sine of the cone each light reaches anything in, smoothing
+  // included, and the half-width of its full frustum at unit depth.
+  glm::vec2 cones[NUM_LIGHTS];
+  float half_widths[NUM_LIGHTS];
+  for (uint32_t l = 0; l < NUM_LIGHTS; l++) {
+    float angle = lights_[l].direction_angle.w;
+    float reach =
+        std::min(angle * (1.0f + kSpotSmoothing), glm::half_pi<float>());
+    cones[l] = glm::vec2(std::cos(reach), std::sin(reach));
+    half_widths[l] = std::tan(angle);
+  }
+
+  const glm::vec3 *positions = transforms_.positions();
+  const glm::quat *rotations = transforms_.rotations();
+  const glm::vec3 *scales = transforms_.scales();
+  // Instance i's bounding sphere in light l's view: x and y across the
+  // light, z the depth along it, w the radius.
+  auto light_sphere = [&](uint32_t i, uint32_t l) {
+    glm::vec4 sphere = buckets_[instance_buckets_[i]]->mesh->bounding_sphere();
+    uint32_t handle = instance_transforms_[i];
+    glm::vec3 scale = glm::abs(scales[handle]);
+    float max_scale = glm::max(scale.x, glm::max(scale.y, scale.z));
+    glm::vec3 center = positions[handle] +
+                       rotations[handle] * (scales[handle] * glm::vec3(sphere));
+    glm::vec4 view = light_views_[l] * glm::vec4(center, 1.0f);
+    return glm::vec4(view.x, view.y, -view.z, sphere.w * max_scale);
+  };
+  // Conservative: measures to the cone's surface as if it ran on behind
+  // the light.
+  auto in_cone = [&](const glm::vec4 &s, uint32_t l) {
+    float across = glm::length(glm::vec2(s));
+    return across * cones[l].x - s.z * cones[l].y <= s.w;
+  };
+
+  // What each chunk of instances saw of each light: the bounds of its
+  // receivers' x / z and y / z, their farthest depth, and the nearest
+  // caster left after culling to those.
+  struct Extents {
+    bool receivers = false;
+    glm::vec4 bounds = glm::vec4(kInfinity, kInfinity, -kInfinity, -kInfinity);
+    float farthest = 0.0f;
+    float nearest = kInfinity;
+  };
+  constexpr size_t kMaxFitChunks = 64;
+  size_t chunk_count =
+      std::min(std::max<size_t>(count / kInstanceGrain, 1), kMaxFitChunks);
+  size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+  std::array<std::array<Extents, NUM_LIGHTS>, kMaxFitChunks> extents;
+  JobSystem *jobs = JobSystem::Get();
+
+  // Receivers are whatever the camera sees inside a light's cone.
+  jobs->ParallelFor(0, chunk_count, 1, [&](size_t first, size_t last, uint32_t) {
+    for (size_t chunk = first; chunk < last; chunk++) {
+      size_t end = std::min((chunk + 1) * chunk_size, count);
+      for (size_t i = chunk * chunk_size; i < end; i++) {
+        uint8_t mask = instance_visibility_[i];
+        if (!(mask & camera_bit)) {
+          continue;
+        }
+        for (uint32_t l = 0; l < NUM_LIGHTS; l++) {
+          if (!(mask & (1u << l))) {
+            continue;
+          }
+          glm::vec4 s = light_sphere(static_cast<uint32_t>(i), l);
+          if (!in_cone(s, l)) {
+            continue;
+          }
+          Extents &e = extents[chunk][l];
+          e.receivers = true;
+          e.farthest = std::max(e.farthest, s.z + s.w);
+          if (s.z <= s.w) {
+            e.bounds = glm::vec4(-kInfinity, -kInfinity, kInfinity, kInfinity);
+            continue;
+          }
+          glm::vec2 x = ProjectedSpan(s.x, s.z, s.w);
+          glm::vec2 y = ProjectedSpan(s.y, s.z, s.w);
+          e.bounds.x = std::min(e.bounds.x, x.x);
+          e.bounds.y = std::min(e.bounds.y, y.x);
+          e.bounds.z = std::max(e.bounds.z, x.y);
+          e.bounds.w = std::max(e.bounds.w, y.y);
+        }
+      }
+    }
+  });
+
+  // Snap each light's receivers outward to its grid, within its frustum.
+  uint32_t lit = 0;
+  glm::vec4 bounds[NUM_LIGHTS];
+  float far_planes[NUM_LIGHTS];
+  for (uint32_t l = 0; l < NUM_LIGHTS; l++) {
+    Extents merged;
+    for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+      const Extents &e = extents[chunk][l];
+      merged.receivers |= e.receivers;
+      merged.bounds.x = std::min(merged.bounds.x, e.bounds.x);
+      merged.bounds.y = std::min(merged.bounds.y, e.bounds.y);
+      merged.bounds.z = std::max(merged.bounds.z, e.bounds.z);
+      merged.bounds.w = std::max(merged.bounds.w, e.bounds.w);
+      merged.farthest = std::max(merged.farthest, e.farthest);
+    }
+    if (!merged.receivers) {
+      continue;
+    }
+    lit |= 1u << l;
+    float w = half_widths[l];
+    float cell = 2.0f * w / kShadowFitGrid;
+    glm::vec4 b = glm::clamp(merged.bounds, -w, w);
+    glm::vec2 low = glm::floor((glm::vec2(b) + w) / cell) * cell - w;
+    glm::vec2 high = glm::ceil((glm::vec2(b.z, b.w) + w) / cell) * cell - w;
+    bounds[l] = glm::vec4(low, glm::max(high, low + cell));
+    far_planes[l] = glm::clamp(
+        std::ceil(merged.farthest / kShadowDepthStep) * kShadowDepthStep,
+        kShadowNear + kShadowDepthStep, kShadowFar);
+  }
+
+  // Casters must touch some ray from the light to a receiver: inside the
+  // cone and the fitted bounds, and not wholly past the farthest receiver.
+  jobs->ParallelFor(0, chunk_count, 1, [&](size_t first, size_t last, uint32_t) {
+    for (size_t chunk = first; chunk < last; chunk++) {
+      size_t end = std::min((chunk + 1) * chunk_size, count);
+      for (size_t i = chunk * chunk_size; i < end; i++) {
+        uint8_t mask = instance_visibility_[i];
+        for (uint32_t l = 0; l < NUM_LIGHTS; l++) {
+          uint8_t bit = static_cast<uint8_t>(1u << l);
+          if (!(mask & bit)) {
+            continue;
+          }
+          bool keep = false;
+          if (lit & bit) {
+            glm::vec4 s = light_sphere(static_cast<uint32_t>(i), l);
+            keep = in_cone(s, l) && s.z - s.w <= far_planes[l];
+            if (keep && s.z > s.w) {
+              glm::vec2 x = ProjectedSpan(s.x, s.z, s.w);
+              glm::vec2 y = ProjectedSpan(s.y, s.z, s.w);
+              keep = x.x <= bounds[l].z && x.y >= bounds[l].x &&
+                     y.x <= bounds[l].w && y.y >= bounds[l].y;
+            }
+            if (keep) {
+              Extents &e = extents[chunk][l];
+              e.nearest = std::min(e.nearest, s.z - s.w);
+            }
+          }
+          if (!keep) {
+            mask &= ~bit;
+          }
+        }
+        instance_visibility_[i] = mask;
+      }
+    }
+  });
+
+  for (uint32_t l = 0; l < NUM_LIGHTS; l++) {
+    // A light that reaches nothing in view keeps its last projection, and
+    // gives up its tile until it does again.
+    if (!(lit & (1u << l))) {
+      continue;
+    }
+    float nearest = kInfinity;
+    for (size_t chunk = 0; chunk < chunk_count; chunk++) {
+      nearest = std::min(nearest, extents[chunk][l].nearest);
+    }
+    glm::vec2 range(std::floor(nearest / kShadowDepthStep) * kShadowDepthStep,
+                    far_planes[l]);
+    range.x = glm::clamp(range.x, kShadowNear, range.y - kShadowDepthStep);
+
+    const glm::vec4 &b = bounds[l];
+    glm::mat4 proj = glm::frustumZO(b.x * range.x, b.z * range.x,
+                                    b.y * range.x, b.w * range.x, range.x,
+                                    range.y);
+    // Flips y, off-center term included.
+    proj[1][1] *= -1.0f;
+    proj[2][1] *= -1.0f;
+    SetShadowProjection(l, proj * light_views_[l], range);
+  }
+
+  // While a light reached nothing, cache re-renders left its casters out.
+  if (lit & ~shadow_lights_) {
+    static_shadows_dirty_ = true;
+  }
+  shadow_lights_ = lit;
+}
+
+void Renderer::AssignShadowTiles() {
+  const int max_level =
+      static_cast<int>(std::log2(kMaxShadowTile / kMinShadowTile));
+  vk::Extent2D screen = Device::Get()->swapchain_extent();
+  float screen_pixels = static_cast<float>(screen.width) * screen.height;
+  float pixel_scale = camera_.GetPixelScale();
+
+  // Each drawn light's tile level: its side is kMinShadowTile << level.
+  std::array<int, NUM_LIGHTS> levels;
+  for (uint32_t i = 0; i < NUM_LIGHTS; i++) {
+    levels[i] = -1;
+    if (!(shadow_lights_ & (1u << i))) {
+      continue;
+    }
+    // The cone's footprint is bounded by the smallest sphere around it,
+    // which past 45 degrees is centered on its base.
+    const Light &light = lights_[i];
+    float angle = light.direction_angle.w;
+    float length = light.shadow_range.y;
+    float along, radius;
+    if (angle < glm::quarter_pi<float>()) {
+      along = radius = length / (2.0f * std::cos(angle) * std::cos(angle));
+    } else {
+      along = length;
+      radius = length * std::tan(angle);
+    }
+    glm::vec3 center =
+        light.position + glm::vec3(light.direction_angle) * along;
+    float distance = glm::length(center - camera_.position);
+    float coverage = screen_pixels;
+    if (distance > radius) {
+      float pixels = pixel_scale * radius /
+                     std::sqrt(distance * distance - radius * radius);
+      coverage = std::min(glm::pi<float>() * pixels * pixels, screen_pixels);
+    }
+    float side = std::sqrt(coverage) * kShadowTexelsPerPixel;
+    float level = std::log2(std::max(side, 1.0f) / kMinShadowTile);
+
+    // Hold the current size until the footprint is well past halfway to
+    // the next.
+    uint32_t current = shadow_tiles_[i].extent.width;
+    if (current != 0) {
+      int current_level = static_cast<int>(std::log2(current / kMinShadowTile));
+      if (std::abs(level - current_level) <= 0.5f + kShadowTileHysteresis) {
+        level = static_cast<float>(current_level);
+      }
+    }
+    levels[i] = std::clamp(static_cast<int>(std::round(level)), 0, max_level);
+  }
 
-      render_buffer_.bindVertexBuffers(
-          0, {mesh->vertex_buffer(), instance_data_buffer_.buffer},
-          {0, instance_offset * sizeof(InstanceData)});
-      render_buffer_.draw(static_cast<uint32_t>(mesh->vertex_count()),
-                          num_instances, 0, 0);
+  // Halve the largest tiles until they all fit the atlas, in
+  // kMinShadowTile cells.
+  auto area = [&]() {
+    uint64_t sum = 0;
+    for (int level : levels) {
+      if (level >= 0) {
+        sum += uint64_t(1) << (2 * level);
+      }
+    }
+    return sum;
+  };
+  const uint64_t atlas_cells = kShadowAtlasSize / kMinShadowTile;
+  const uint64_t atlas_area = atlas_cells * atlas_cells;
+  while (area() > atlas_area) {
+    (*std::max_element(levels.begin(), levels.end()))--;
+  }
 
-      instance_offset += num_instances;
+  // Largest first, each tile takes the next run of kMinShadowTile cells in
+  // Z-order. Every run then starts aligned to its own size, so the tiles
+  // pack without gaps or overlap.
+  std::array<uint32_t, NUM_LIGHTS> order;
+  for (uint32_t i = 0; i < NUM_LIGHTS; i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return levels[a] != levels[b] ? levels[a] > levels[b] : a < b;
+  });
+  uint32_t next_cell = 0;
+  for (uint32_t i : order) {
+    vk::Rect2D tile({0, 0}, {0, 0});
+    if (levels[i] >= 0) {
+      glm::uvec2 cell = MortonCell(next_cell) * kMinShadowTile;
+      uint32_t side = kMinShadowTile << levels[i];
+      tile = vk::Rect2D(
+          {static_cast<int32_t>(cell.x), static_cast<int32_t>(cell.y)},
+          {side, side});
+      next_cell += 1u << (2 * levels[i]);
+    }
+    if (tile != shadow_tiles_[i]) {
+      shadow_tiles_[i] = tile;
+      static_shadows_dirty_ = true;
     }
+    lights_[i].shadow_tile =
+        glm::vec4(tile.offset.x, tile.offset.y, tile.extent.width,
+                  tile.extent.height) /
+        static_cast<float>(kShadowAtlasSize);
   }
 }
 
@@ -442,33 +1898,21 @@ void Renderer::UpdateSceneDescriptors() {
   SceneUniforms data;
   data.camera_position = camera_.position;
   for (int i = 0; i < NUM_LIGHTS; i++) {
-    glm::mat4 view =
-        glm::lookAt(lights_[i].position,
-                    lights_[i].position + glm::vec3(lights_[i].direction_angle),
-                    glm::vec3(0.0f, 1.0f, 0.0f));
-    glm::mat4 proj = glm::perspectiveFov(2.0f * lights_[i].direction_angle.w,
-                                         1.0f, 1.0f, 0.5f, 10.0f);
-    proj[1][1] *= -1.0f;
-    lights_[i].world2light = proj * view;
-
     data.lights[i] = lights_[i];
   }
 
-  if (scene_uniform_buffer_.buffer) {
-    resource_manager_->UpdateHostBufferData(scene_uniform_buffer_, &data,
-                                            sizeof(SceneUniforms));
-  } else {
-    scene_uniform_buffer_ = resource_manager_->CreateHostBufferWithData(
-        vk::BufferUsageFlagBits::eUniformBuffer, &data, sizeof(SceneUniforms));
-  }
+  auto uniforms =
+      resource_manager_->AllocateTransientWithData(&data, sizeof(SceneUniforms));
+  scene_uniform_offset_ = static_cast<uint32_t>(uniforms.offset);
 
   auto buffer_info = vk::DescriptorBufferInfo()
-                         .setBuffer(scene_uniform_buffer_.buffer)
+                         .setBuffer(uniforms.buffer)
                          .setOffset(0)
-                         .setRange(scene_uniform_buffer_.size);
+                         .setRange(sizeof(SceneUniforms));
   auto ubo_write = vk::WriteDescriptorSet()
                        .setDescriptorCount(1)
-                       .setDescriptorType(vk::DescriptorType::eUniformBuffer)
+                       .setDescriptorType(
+                           vk::DescriptorType::eUniformBufferDynamic)
                        .setDstSet(scene_descriptors_)
                        .setDstBinding(0)
                        .setDstArrayElement(0)
@@ -500,29 +1944,57 @@ void Renderer::UpdateSceneDescriptors() {
           .setDstArrayElement(0)
           .setPImageInfo(&irr_info);
 
-  std::array<vk::DescriptorImageInfo, NUM_LIGHTS> shadow_map_infos = {};
-  for (int i = 0; i < NUM_LIGHTS; i++) {
-    shadow_map_infos[i] =
-        vk::DescriptorImageInfo()
-            .setImageLayout(vk::ImageLayout::eShaderReadOnlyOptimal)
-            .setImageView(shadow_maps_[i].image_view)
-            .setSampler(shadow_maps_[i].sampler);
-  }
+  auto shadow_map_info =
+      vk::DescriptorImageInfo()
+          .setImageLayout(vk::ImageLayout::eShaderReadOnlyOptimal)
+          .setImageView(shadow_map_.image_view)
+          .setSampler(shadow_map_.sampler);
   auto shadow_maps_write =
       vk::WriteDescriptorSet()
-          .setDescriptorCount(NUM_LIGHTS)
+          .setDescriptorCount(1)
           .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
           .setDstSet(scene_descriptors_)
           .setDstBinding(2)
           .setDstArrayElement(0)
-          .setImageInfo(shadow_map_infos);
+          .setPImageInfo(&shadow_map_info);
+
+  auto shadow_compare_info =
+      vk::DescriptorImageInfo()
+          .setImageLayout(vk::ImageLayout::eShaderReadOnlyOptimal)
+          .setImageView(shadow_map_.image_view)
+          .setSampler(shadow_compare_sampler_);
+  auto shadow_compare_write =
+      vk::WriteDescriptorSet()
+          .setDescriptorCount(1)
+          .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+          .setDstSet(scene_descriptors_)
+          .setDstBinding(7)
+          .setDstArrayElement(0)
+          .setPImageInfo(&shadow_compare_info);
+
+  auto shadow_moments_info =
+      vk::DescriptorImageInfo()
+          .setImageLayout(vk::ImageLayout::eShaderReadOnlyOptimal)
+          .setImageView(shadow_moments_->image_view())
+          .setSampler(shadow_moments_->sampler());
+  auto shadow_moments_write =
+      vk::WriteDescriptorSet()
+          .setDescriptorCount(1)
+          .setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+          .setDstSet(scene_descriptors_)
+          .setDstBinding(8)
+          .setDstArrayElement(0)
+          .setPImageInfo(&shadow_moments_info);
 
   Device::Get()->device().updateDescriptorSets(
-      {ubo_write, env_write, shadow_maps_write, irr_write}, {});
+      {ubo_write, env_write, shadow_maps_write, irr_write,
+       shadow_compare_write, shadow_moments_write},
+      {});
 }
 
 Material *Renderer::AddMaterial(std::unique_ptr<Material> material) {
   Material *res = material.get();
+  res->ordinal_ = static_cast<uint32_t>(materials_.size());
   materials_.emplace_back(std::move(material));
   return res;
 }
@@ -530,13 +2002,229 @@ Material *Renderer::AddMaterial(std::unique_ptr<Material> material) {
 Mesh *Renderer::AddMesh(const std::string &mesh) {
   std::unique_ptr<Mesh> m = std::make_unique<Mesh>(mesh);
   Mesh *res = m.get();
+  res->ordinal_ = static_cast<uint32_t>(meshes_.size());
   meshes_.emplace_back(std::move(m));
   return res;
 }
 
-Object *Renderer::AddObject(Mesh *mesh, Material *material) {
-  std::unique_ptr<Object> o = std::make_unique<Object>(material, mesh);
-  Object *res = o.get();
-  objects_.emplace_back(std::move(o));
-  return res;
+ObjectHandle Renderer::AddObject(Mesh *mesh, Material *material) {
+  return AddObjects(1, mesh, material)[0];
+}
+
+std::vector<ObjectHandle> Renderer::AddObjects(size_t count, Mesh *mesh,
+                                               Material *material) {
+  if (count == 0) {
+    return {};
+  }
+  objects_.Reserve(count);
+  transforms_.Reserve(count);
+  bvh_.Reserve(count);
+  DrawBucket *bucket = FindOrCreateBucket(material, mesh, false);
+  bucket->objects.reserve(bucket->objects.size() + count);
+  bucket->transforms.reserve(bucket->transforms.size() + count);
+
+  std::vector<ObjectHandle> handles(count);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t transform = transforms_.Allocate();
+    handles[i] = objects_.Insert(material, mesh, &transforms_, transform);
+    AddToBucket(handles[i], bucket);
+
+    if (transform_objects_.size() <= transform) {
+      transform_objects_.resize(transforms_.size());
+    }
+    transform_objects_[transform] = handles[i];
+    objects_.Get(handles[i])->bvh_proxy_ =
+        bvh_.Insert(ObjectBounds(transform), transform);
+  }
+  // New objects are usually placed right after this, so rebuild once they
+  // have been.
+  bvh_frames_since_rebuild_ = kBvhRebuildInterval;
+  return handles;
+}
+
+void Renderer::RemoveObject(ObjectHandle handle) {
+  Object *object = objects_.Get(handle);
+  if (!object) {
+    throw "Object has already been removed.";
+  }
+  RemoveFromBucket(handle);
+  bvh_.Remove(object->bvh_proxy_);
+  transform_objects_[object->transform_] = ObjectHandle();
+  hierarchy_.Remove(object->transform_, transforms_);
+  transforms_.Free(object->transform_);
+  objects_.Remove(handle);
+}
+
+ObjectHandle Renderer::Pick(const glm::vec2 &ndc) {
+  glm::mat4 clip2world = glm::inverse(camera_.GetViewProj());
+  glm::vec4 near = clip2world * glm::vec4(ndc, 0.0f, 1.0f);
+  glm::vec4 far = clip2world * glm::vec4(ndc, 1.0f, 1.0f);
+  glm::vec3 origin = glm::vec3(near) / near.w;
+  glm::vec3 direction = glm::vec3(far) / far.w - origin;
+
+  // With an unnormalized direction, t runs from the near to the far plane.
+  uint32_t handle;
+  float t;
+  if (!bvh_.Raycast(origin, direction, 1.0f, &handle, &t)) {
+    return ObjectHandle();
+  }
+  return transform_objects_[handle];
+}
+
+void Renderer::ObjectsInSphere(const glm::vec3 &center, float radius,
+                               std::vector<ObjectHandle> &out) {
+  std::vector<uint32_t> handles;
+  bvh_.QuerySphere(center, radius, handles);
+  for (uint32_t handle : handles) {
+    out.push_back(transform_objects_[handle]);
+  }
+}
+
+Aabb Renderer::ObjectBounds(uint32_t handle) {
+  Mesh *mesh = objects_.Get(transform_objects_[handle])->mesh_;
+  return TransformAabb({mesh->aabb_min(), mesh->aabb_max()},
+                       transforms_.position(handle), transforms_.rotation(handle),
+                       transforms_.scale(handle));
+}
+
+void Renderer::UpdateBvh() {
+  const uint32_t *dirty = transforms_.dirty_handles();
+  size_t dirty_count = transforms_.dirty_count();
+
+  // Freed handles can linger in the dirty list, and transforms that only
+  // parent others have no object at all.
+  bvh_moved_.resize(dirty_count);
+  std::atomic<bool> static_moved(false);
+  JobSystem::Get()->ParallelFor(
+      0, dirty_count, kInstanceGrain, [&](size_t begin, size_t end, uint32_t) {
+        for (size_t i = begin; i < end; i++) {
+          uint32_t handle = dirty[i];
+          Object *object = handle < transform_objects_.size()
+                               ? objects_.Get(transform_objects_[handle])
+                               : nullptr;
+          if (!object) {
+            bvh_moved_[i] = Bvh::kNull;
+            continue;
+          }
+          bvh_.SetBounds(object->bvh_proxy_, ObjectBounds(handle));
+          bvh_moved_[i] = object->bvh_proxy_;
+          if (object->static_) {
+            static_moved.store(true, std::memory_order_relaxed);
+          }
+        }
+      });
+  if (static_moved.load(std::memory_order_relaxed)) {
+    static_shadows_dirty_ = true;
+  }
+
+  if (++bvh_frames_since_rebuild_ >= kBvhRebuildInterval) {
+    bvh_.Rebuild();
+    bvh_frames_since_rebuild_ = 0;
+    return;
+  }
+  bvh_moved_.erase(
+      std::remove(bvh_moved_.begin(), bvh_moved_.end(), Bvh::kNull),
+      bvh_moved_.end());
+  bvh_.Refit(bvh_moved_.data(), bvh_moved_.size());
+}
+
+void Renderer::SetObjectMaterial(ObjectHandle handle, Material *material) {
+  Object *object = objects_.Get(handle);
+  if (!object || object->material_ == material) {
+    return;
+  }
+  RemoveFromBucket(handle);
+  object->material_ = material;
+  AddToBucket(handle);
+}
+
+void Renderer::SetObjectStatic(ObjectHandle handle, bool is_static) {
+  Object *object = objects_.Get(handle);
+  if (!object || object->static_ == is_static) {
+    return;
+  }
+  RemoveFromBucket(handle);
+  object->static_ = is_static;
+  AddToBucket(handle);
+}
+
+DrawBucket *Renderer::FindOrCreateBucket(Material *material, Mesh *mesh,
+                                         bool static_caster) {
+  // Static buckets come first, so shadow passes can draw either kind as one
+  // range. Then the vertex format, which picks the pipeline, then material
+  // and mesh in registration order.
+  auto bucket_key = [](Material *m, Mesh *me, bool s) {
+    return std::make_tuple(!s, static_cast<uint32_t>(me->vertex_format()),
+                           m->ordinal(), me->ordinal());
+  };
+  auto key = bucket_key(material, mesh, static_caster);
+  auto it = std::lower_bound(
+      buckets_.begin(), buckets_.end(), key,
+      [&](const std::unique_ptr<DrawBucket> &bucket, const auto &k) {
+        return bucket_key(bucket->material, bucket->mesh,
+                          bucket->static_caster) < k;
+      });
+  if (it != buckets_.end() && (*it)->material == material &&
+      (*it)->mesh == mesh && (*it)->static_caster == static_caster) {
+    return it->get();
+  }
+
+  auto bucket = std::make_unique<DrawBucket>();
+  bucket->material = material;
+  bucket->mesh = mesh;
+  bucket->static_caster = static_caster;
+  return buckets_.insert(it, std::move(bucket))->get();
+}
+
+void Renderer::AddToBucket(ObjectHandle handle) {
+  Object *object = objects_.Get(handle);
+  AddToBucket(handle, FindOrCreateBucket(object->material_, object->mesh_,
+                                         object->static_));
+}
+
+void Renderer::AddToBucket(ObjectHandle handle, DrawBucket *bucket) {
+  Object *object = objects_.Get(handle);
+  object->bucket_ = bucket;
+  object->bucket_slot_ = static_cast<uint32_t>(bucket->objects.size());
+  bucket->objects.push_back(handle);
+  bucket->transforms.push_back(object->transform_);
+  instance_layout_dirty_ = true;
+  if (bucket->static_caster) {
+    static_shadows_dirty_ = true;
+  }
+}
+
+size_t Renderer::StaticBucketCount() {
+  return std::partition_point(buckets_.begin(), buckets_.end(),
+                              [](const std::unique_ptr<DrawBucket> &bucket) {
+                                return bucket->static_caster;
+                              }) -
+         buckets_.begin();
+}
+
+void Renderer::RemoveFromBucket(ObjectHandle handle) {
+  Object *object = objects_.Get(handle);
+  DrawBucket *bucket = object->bucket_;
+  if (!bucket) {
+    return;
+  }
+
+  // Swap-remove, keeping the moved object's slot up to date.
+  Object *last = objects_.Get(bucket->objects.back());
+  bucket->objects[object->bucket_slot_] = bucket->objects.back();
+  bucket->transforms[object->bucket_slot_] = last->transform_;
+  last->bucket_slot_ = object->bucket_slot_;
+  bucket->objects.pop_back();
+  bucket->transforms.pop_back();
+  object->bucket_ = nullptr;
+  instance_layout_dirty_ = true;
+  if (bucket->static_caster) {
+    static_shadows_dirty_ = true;
+  }
+
+  if (bucket->objects.empty()) {
+    buckets_.erase(std::find_if(
+        buckets_.begin(), buckets_.end(),
+        [bucket](const auto &b) { return b.get() == bucket; }));
+  }
 }
@@ -1,45 +1,373 @@
 #ifndef RENDERER_H_
 #define RENDERER_H_
 
+#include <array>
+#include <bitset>
 #include <memory>
 #include <vector>
 
 #include <vulkan/vulkan.hpp>
 
+#include "bvh.h"
 #include "camera.h"
+#include "constants.h"
 #include "device.h"
+#include "draw_sort.h"
 #include "layouts.h"
 #include "material.h"
 #include "mesh.h"
+#include "mesh_pool.h"
 #include "object.h"
 #include "render_passes.h"
 #include "resource_manager.h"
+#include "shadow_moments.h"
+#include "slot_map.h"
 #include "structures.h"
 #include "texture.h"
+#include "transform_hierarchy.h"
+#include "transform_store.h"
+
+// All objects sharing a (material, mesh) pair. Each bucket is drawn with a
+// single instanced draw whose instances start at instance_offset.
+struct DrawBucket {
+    Material* material;
+    Mesh* mesh;
+    // Whether the bucket holds static objects, which cast cached shadows.
+    bool static_caster = false;
+    std::vector<ObjectHandle> objects;
+    // Transform handles of objects, kept parallel for the instance build.
+    std::vector<uint32_t> transforms;
+    uint32_t instance_offset = 0;
+};
 
 class Renderer {
 public:
-    Renderer();
+    // frames_in_flight is clamped to [1, kMaxFramesInFlight]. shadow_format
+    // is the shadow atlas's depth format: eD32Sfloat, or eD16Unorm for half
+    // the memory and bandwidth at coarser depth precision.
+    explicit Renderer(uint32_t frames_in_flight = kDefaultFramesInFlight,
+                      vk::Format shadow_format = vk::Format::eD32Sfloat);
     ~Renderer();
 
     Camera& camera() {
         return camera_;
     }
 
+    TransformStore& transforms() {
+        return transforms_;
+    }
+
+    // Parent/child links between transforms, resolved at the start of each
+    // frame.
+    TransformHierarchy& hierarchy() {
+        return hierarchy_;
+    }
+
     Material* AddMaterial(std::unique_ptr<Material> material);
     Mesh* AddMesh(const std::string& mesh);
-    Object* AddObject(Mesh* mesh, Material* material);
+    ObjectHandle AddObject(Mesh* mesh, Material* material);
+    // Adds count objects sharing a mesh and material, growing every
+    // per-object array once rather than per object.
+    std::vector<ObjectHandle> AddObjects(size_t count, Mesh* mesh,
+                                         Material* material);
+    // Throws if handle names an object that has already been removed.
+    void RemoveObject(ObjectHandle handle);
+    void SetObjectMaterial(ObjectHandle handle, Material* material);
+    // Static objects are drawn into a cached shadow atlas that each frame
+    // starts from, so only dynamic objects are redrawn into the shadow
+    // maps. Moving a static object is allowed but re-renders the cache.
+    void SetObjectStatic(ObjectHandle handle, bool is_static);
+
+    // The object named by handle, or nullptr if it has been removed. The
+    // pointer is only good until the next object is added or removed.
+    Object* object(ObjectHandle handle) {
+        return objects_.Get(handle);
+    }
+
+    size_t object_count() const {
+        return objects_.size();
+    }
+
+    // The object whose bounds are hit first by the camera ray through ndc,
+    // in [-1, 1] with y down, or a null handle. Bounds are as of the last
+    // frame.
+    ObjectHandle Pick(const glm::vec2& ndc);
+    // Appends every object whose bounds overlap the sphere.
+    void ObjectsInSphere(const glm::vec3& center, float radius,
+                         std::vector<ObjectHandle>& out);
+
+    // A spot light. Marks it dirty, so its world2light and the cached
+    // static shadows are recomputed for the next frame.
+    Light& light(uint32_t i) {
+        dirty_lights_ |= 1u << i;
+        return lights_[i];
+    }
 
     void Render();
+
+    // Number of instances re-uploaded during the last frame.
+    uint32_t instances_rewritten() {
+        return instances_rewritten_;
+    }
+
+    // Number of instances inside the camera frustum during the last frame.
+    // Only counted when culling on the CPU.
+    uint32_t visible_instances() {
+        return visible_instances_;
+    }
+
+    // Culls and compacts instances in a compute pass, drawing each bucket
+    // with drawIndexedIndirect, so per-frame CPU work no longer scales with
+    // the object count. Stays off if the device lacks
+    // drawIndirectFirstInstance.
+    bool gpu_culling() {
+        return gpu_culling_;
+    }
+
+    void set_gpu_culling(bool enabled);
+
+    // Records each pass as drawIndexedIndirect calls over commands in one
+    // buffer, merging every run of buckets that shares a pipeline and
+    // material into a single call when the device has multiDrawIndirect.
+    // GPU culling draws indirectly either way, one bucket per call unless
+    // this is on. Stays off if the device lacks drawIndirectFirstInstance.
+    bool multi_draw_indirect() {
+        return multi_draw_indirect_;
+    }
+
+    void set_multi_draw_indirect(bool enabled);
+
+    // Draws each instance with the coarsest mesh LOD its distance allows,
+    // and shadow passes kShadowLodBias levels coarser still. When off,
+    // every pass draws full-detail meshes.
+    bool mesh_lods() {
+        return mesh_lods_;
+    }
+
+    void set_mesh_lods(bool enabled) {
+        mesh_lods_ = enabled;
+        // Shadow LODs change with it.
+        static_shadows_dirty_ = true;
+    }
+
+    // How instance transforms are uploaded and stored: composed matrices,
+    // or TRS that the shaders expand, which uploads 40 rather than 100
+    // bytes per instance and skips the CPU matrix work. Switching rebuilds
+    // the instance buffer.
+    InstanceFormat instance_format() {
+        return instance_format_;
+    }
+
+    void set_instance_format(InstanceFormat format);
+
+    // Triangles submitted during the last frame, across every pass. Only
+    // counted when culling on the CPU.
+    uint64_t triangles() {
+        return triangles_;
+    }
+
+    // Draw calls recorded during the last frame, across every pass.
+    uint32_t draw_calls() {
+        return draw_calls_;
+    }
+
+    // CPU time spent recording the last frame's draws, in milliseconds.
+    double draw_record_ms() {
+        return draw_record_ms_;
+    }
+
+    // Sorts the camera's visible instances by packed draw key, so each
+    // bucket and LOD draws front to back and early depth testing rejects
+    // more of basic.frag. Only applies when culling on the CPU.
+    bool sort_draws() {
+        return sort_draws_;
+    }
+
+    void set_sort_draws(bool enabled) {
+        sort_draws_ = enabled;
+    }
+
+    // Fragment shader invocations in the opaque pass's object draws, as of
+    // the most recent frame the GPU has finished. Zero if the device lacks
+    // pipelineStatisticsQuery.
+    uint64_t fragment_invocations() {
+        return fragment_invocations_;
+    }
+
+    // Lays down the camera's depth with a position-only pass before
+    // shading, so basic.frag runs only for the visible surface at each
+    // sample. It costs a second trip through the vertices, so whether it
+    // pays depends on the scene's overdraw; compare opaque_pass_gpu_ms().
+    bool depth_prepass() {
+        return depth_prepass_;
+    }
+
+    void set_depth_prepass(bool enabled) {
+        depth_prepass_ = enabled;
+    }
+
+    // Renders static casters into a cached shadow atlas only when a light
+    // or a static object changes, and otherwise starts each frame's shadow
+    // maps from a copy of it and draws only dynamic casters.
+    bool shadow_caching() {
+        return shadow_caching_;
+    }
+
+    void set_shadow_caching(bool enabled) {
+        shadow_caching_ = enabled;
+    }
+
+    // Times the cached static shadow atlas has been rendered.
+    uint32_t static_shadow_renders() {
+        return static_shadow_renders_;
+    }
+
+    // How basic.frag filters shadows. Evsm adds a blur and mip-map pass over
+    // the shadow maps each frame; compare shadow_gpu_ms() and
+    // opaque_pass_gpu_ms() between filters.
+    ShadowFilter shadow_filter() {
+        return shadow_filter_;
+    }
+
+    void set_shadow_filter(ShadowFilter filter) {
+        shadow_filter_ = filter;
+    }
+
+    // GPU time of the opaque render pass, prepass and sky included, in
+    // milliseconds, as of the most recent frame the GPU has finished. Zero
+    // if the device can't timestamp graphics queues.
+    double opaque_pass_gpu_ms() {
+        return opaque_pass_gpu_ms_;
+    }
+
+    // Likewise for the shadow work: the cache copy and any static
+    // re-render, the shadow pass, and the EVSM prefilter.
+    double shadow_gpu_ms() {
+        return shadow_gpu_ms_;
+    }
+
+    // Narrows each light's shadow frustum to the receivers the camera can
+    // see inside its cone, and its depth range to those receivers and the
+    // casters in front of them, culling every other caster from its tile.
+    // Lights that reach nothing in view draw no casters, and when none do
+    // the shadow pass is skipped. Only applies when culling on the CPU.
+    bool shadow_fitting() {
+        return shadow_fitting_;
+    }
+
+    void set_shadow_fitting(bool enabled) {
+        shadow_fitting_ = enabled;
+    }
+
+    // Side in texels of light's tile of the shadow atlas, picked from its
+    // cone's footprint on screen; zero while it draws no shadow.
+    uint32_t shadow_tile_size(uint32_t light) {
+        return shadow_tiles_[light].extent.width;
+    }
+
+    // Lights whose shadow tile was drawn during the last frame.
+    uint32_t shadow_lights_drawn() {
+        return static_cast<uint32_t>(
+            std::bitset<NUM_LIGHTS>(shadow_lights_).count());
+    }
 private:
+    // Views instances are culled against: one per light, then the camera.
+    static constexpr uint32_t kCameraView = NUM_LIGHTS;
+    static constexpr uint32_t kViewCount = NUM_LIGHTS + 1;
 
-    void Draw(RenderPass pass, glm::mat4 view_proj);
+    // Id lists the views' survivors are drawn from. Every light shares the
+    // shadow list, whose ids carry their light's index, so each bucket and
+    // LOD draws once for all of them.
+    static constexpr uint32_t kShadowList = 0;
+    static constexpr uint32_t kCameraList = 1;
+    static constexpr uint32_t kListCount = 2;
+    static_assert(NUM_LIGHTS <= (1u << (32 - kShadowLayerShift)),
+                  "Shadow ids have too few light bits");
 
-    struct SyncResources {
+    // A bucket's visible instances at one LOD in one id list.
+    struct VisibleRange {
+        uint32_t first;
+        uint32_t count;
+    };
+
+    // Mirrors Bucket in gpu_cull.comp.
+    struct GpuCullBucket {
+        glm::vec4 sphere;
+        uint32_t first_instance;
+        uint32_t instance_count;
+        uint32_t lod_count;
+        uint32_t padding;
+        float lod_errors[8];
+    };
+    static_assert(kMaxMeshLods <= 8, "GpuCullBucket::lod_errors is too small");
+
+    // Mirrors Params in gpu_cull.comp.
+    struct GpuCullParams {
+        uint32_t instance_count;
+        uint32_t bucket_count;
+        uint32_t shadow_lod_bias;
+        uint32_t lods_enabled;
+        // xyz = camera position, w = Camera::GetPixelScale().
+        glm::vec4 camera;
+    };
+
+    // Draws buckets [bucket_begin, bucket_end) from list. Depth-only passes
+    // push light for shadow.vert, which drawing one light at a time keeps
+    // only that light's ids.
+    void Draw(RenderPass pass, glm::mat4 view_proj, uint32_t list,
+              size_t bucket_begin, size_t bucket_end, uint32_t light = 0);
+    // Draws the static casters into static_shadow_map_.
+    void RenderStaticShadows();
+
+    // Recomputes dirty lights' views and full shadow frusta.
+    void UpdateLights();
+    // Fits each light's world2light to the camera's view, clearing the
+    // light bits of instance_visibility_ for casters it no longer needs.
+    void FitShadowFrusta();
+    // Points light's shadow map at view_proj over range, marking the static
+    // shadow cache dirty if that changes it.
+    void SetShadowProjection(uint32_t light, const glm::mat4& view_proj,
+                             const glm::vec2& range);
+    // Sizes each drawn light's tile from its footprint on screen and packs
+    // the tiles into the atlas, marking the static shadow cache dirty if
+    // any moves.
+    void AssignShadowTiles();
+    // Draws buckets [bucket_begin, bucket_end) of the shadow list into each
+    // light's tile: in one draw per bucket through per-light viewports, or
+    // light by light where the device can't pick viewports per vertex.
+    void DrawShadowCasters(size_t bucket_begin, size_t bucket_end);
+    // The smallest rectangle around every tile, or the whole atlas if
+    // there are none.
+    vk::Rect2D ShadowTileBounds();
+
+    DrawBucket* FindOrCreateBucket(Material* material, Mesh* mesh,
+                                   bool static_caster);
+    // Static buckets sort first; this is where the dynamic ones start.
+    size_t StaticBucketCount();
+    void AddToBucket(ObjectHandle handle);
+    // Adds handle to bucket, which must be the one its object belongs in.
+    void AddToBucket(ObjectHandle handle, DrawBucket* bucket);
+    void RemoveFromBucket(ObjectHandle handle);
+
+    // Per-frame resources. None of these may be touched again until the
+    // frame's in_flight fence has signaled.
+    struct Frame {
+        vk::CommandPool command_pool;
+        vk::CommandBuffer command_buffer;
         vk::Semaphore image_available;
         vk::Semaphore render_finished;
         vk::Fence in_flight;
-    } sync_resources_;
+        vk::DescriptorSet scene_descriptors;
+        vk::DescriptorSet instance_scatter_descriptors;
+        vk::DescriptorSet gpu_cull_descriptors;
+        // Counts the frame's opaque fragment shader invocations.
+        vk::QueryPool statistics;
+        bool statistics_pending = false;
+        // Timestamps around the frame's opaque render pass, then around its
+        // shadow work.
+        vk::QueryPool timestamps;
+        bool timestamps_pending = false;
+    };
 
     struct ShadowMap {
         ResourceManager::Image image;
@@ -51,7 +379,7 @@ private:
     void InitCommandBuffers();
     void InitCommandPool();
     void InitFramebuffers();
-    void InitSyncResources();
+    void InitFrames();
 
     void InitDepthBuffer();
     void InitColorBuffer();
@@ -61,14 +389,57 @@ private:
 
     void UpdateSceneDescriptors();
 
+    // World bounds of the object owning a transform handle.
+    Aabb ObjectBounds(uint32_t handle);
+    // Refits the BVH around moved objects, rebuilding it periodically.
+    void UpdateBvh();
+
+    void UpdateInstances();
+    void RebuildInstances();
+    // Writes the instances of count transform handles to out in
+    // instance_format_.
+    void WriteInstances(const uint32_t* handles, size_t count, void* out);
+    void UpdateInstanceDescriptors();
+    // Picks each instance's camera LOD from its distance, within the
+    // hysteresis band around the LOD it drew last frame.
+    void SelectLods();
+    void CullInstances(const glm::mat4& camera_view_proj);
+    // Writes view's visible ids to out ordered by draw key, and its ranges.
+    void SortVisibleInstances(uint32_t view, const glm::mat4& view_proj,
+                              uint32_t* out, VisibleRange* ranges);
+    void CullInstancesOnGpu(const glm::mat4& camera_view_proj);
+
+    // Offset of list's first slot in visible_ids_, when culling on the CPU.
+    uint32_t list_first_id(uint32_t list) {
+        return list == kShadowList
+                   ? 0
+                   : static_cast<uint32_t>(NUM_LIGHTS *
+                                           instance_transforms_.size());
+    }
+
+    // Grows buffer to at least size bytes, retiring the old one.
+    void EnsureDeviceBuffer(ResourceManager::Buffer& buffer,
+                            vk::BufferUsageFlags usage, size_t size);
+
+    std::vector<Frame> frames_;
+    uint32_t frame_index_ = 0;
+    // Fence of the frame last rendered to each swapchain image.
+    std::vector<vk::Fence> images_in_flight_;
+
     vk::CommandPool command_pool_;
-    vk::CommandBuffer render_buffer_;
     vk::CommandBuffer transfer_buffer_;
+    // The current frame's command buffer and descriptor sets, set at the top
+    // of Render().
+    vk::CommandBuffer render_buffer_;
+    vk::DescriptorSet scene_descriptors_;
+    vk::DescriptorSet instance_scatter_descriptors_;
+    vk::DescriptorSet gpu_cull_descriptors_;
 
     std::vector<vk::Framebuffer> swapchain_framebuffers_;
     std::unique_ptr<RenderPasses> render_passes_;
     std::unique_ptr<Layouts> layouts_;
     std::unique_ptr<ResourceManager> resource_manager_;
+    std::unique_ptr<MeshPool> mesh_pool_;
 
     ResourceManager::Image depth_buffer_image_;
     vk::ImageView depth_buffer_view_;
@@ -78,17 +449,119 @@ private:
 
     std::vector<std::unique_ptr<Material>> materials_;
     std::vector<std::unique_ptr<Mesh>> meshes_;
-    std::vector<std::unique_ptr<Object>> objects_;
+    TransformStore transforms_;
+    TransformHierarchy hierarchy_;
+    SlotMap<Object> objects_;
+    // Every object's world bounds, keyed by transform handle, which also
+    // indexes transform_objects_. CPU culling and scene queries go through
+    // this rather than the flat object list.
+    Bvh bvh_;
+    std::vector<ObjectHandle> transform_objects_;
+    std::vector<uint32_t> bvh_moved_;
+    uint32_t bvh_frames_since_rebuild_ = 0;
+    // Sorted by pipeline (the mesh's vertex format), then material, then
+    // mesh, so pipeline and descriptor binds group up. Draw sort keys use
+    // the index as their state bits.
+    std::vector<std::unique_ptr<DrawBucket>> buckets_;
     Light lights_[NUM_LIGHTS];
 
-    ShadowMap shadow_maps_[NUM_LIGHTS];
+    // Bit i is set while lights_[i].world2light is stale.
+    uint32_t dirty_lights_ = (1u << NUM_LIGHTS) - 1;
+    // Each light's view, and its projection over the whole cone and
+    // kShadowNear to kShadowFar, which casters are culled against before
+    // fitting.
+    glm::mat4 light_views_[NUM_LIGHTS];
+    glm::mat4 light_bounds_[NUM_LIGHTS];
+    // Bit i is set when light i's tile is drawn this frame.
+    uint32_t shadow_lights_ = (1u << NUM_LIGHTS) - 1;
+    bool shadow_fitting_ = true;
+    // Each light's tile of the atlas in texels, empty for lights not drawn.
+    // Light::shadow_tile holds the same in atlas UVs.
+    std::array<vk::Rect2D, NUM_LIGHTS> shadow_tiles_ = {};
+
+    // One tile per light, all rendered in a single pass.
+    ShadowMap shadow_map_;
+    // Static casters' depth, in the same tiles, kept in the transfer
+    // source layout between renders. Copied into shadow_map_ each frame.
+    ShadowMap static_shadow_map_;
+    bool static_shadows_dirty_ = true;
+    bool shadow_caching_ = true;
+    uint32_t static_shadow_renders_ = 0;
+    ShadowFilter shadow_filter_ = ShadowFilter::Pcf;
+    // Samples shadow_map_ for ShadowFilter::Hardware.
+    vk::Sampler shadow_compare_sampler_;
+    std::unique_ptr<ShadowMoments> shadow_moments_;
 
-    std::vector<InstanceData> instance_data_;
+    // Device-local instance data, laid out bucket by bucket. Rebuilt in full
+    // when bucket membership changes; otherwise only dirty transforms are
+    // uploaded and scattered into place by a compute pass.
     ResourceManager::Buffer instance_data_buffer_;
+    size_t instance_capacity_ = 0;
+    InstanceFormat instance_format_ = InstanceFormat::Trs;
+    bool instance_layout_dirty_ = true;
+    // Instance index of each transform handle, and its inverse.
+    std::vector<uint32_t> instance_index_;
+    std::vector<uint32_t> instance_transforms_;
+    // Bucket index of each instance.
+    std::vector<uint32_t> instance_buckets_;
+    uint32_t instances_rewritten_ = 0;
+
+    // Per-frame culling results. Bit v of instance_visibility_ is set when
+    // an instance is inside view v. visible_ids_ holds the shadow list, with
+    // NUM_LIGHTS slots per instance, then the camera list, with one; see
+    // list_first_id. Each bucket owns the slots of its instances in both,
+    // LOD by LOD, and
+    // visible_ranges_[(list * buckets_.size() + bucket) * kMaxMeshLods + lod]
+    // locates each run relative to its list.
+    std::vector<uint8_t> instance_visibility_;
+    std::vector<VisibleRange> visible_ranges_;
+    ResourceManager::TransientAllocation visible_ids_;
+    uint32_t visible_instances_ = 0;
+    bool sort_draws_ = true;
+    std::vector<uint64_t> sort_keys_;
+    std::vector<uint32_t> sort_ids_;
+    DrawSortScratch sort_scratch_;
+    uint64_t fragment_invocations_ = 0;
+    bool depth_prepass_ = false;
+    // Nanoseconds per timestamp tick.
+    float timestamp_period_ = 0.0f;
+    double opaque_pass_gpu_ms_ = 0.0;
+    double shadow_gpu_ms_ = 0.0;
+
+    // Each instance's camera LOD, kept across frames for hysteresis and
+    // reset when the instance layout is rebuilt.
+    bool mesh_lods_ = true;
+    std::vector<uint8_t> instance_lods_;
+    uint64_t triangles_ = 0;
+
+    // With multi_draw_indirect_, the CPU path also writes one draw command
+    // per (view, bucket, LOD) here, in the same order as
+    // draw_commands_buffer_. Slots past a mesh's last LOD draw nothing.
+    bool multi_draw_indirect_ = false;
+    ResourceManager::TransientAllocation draw_commands_;
+    uint32_t draw_calls_ = 0;
+    double draw_record_ms_ = 0.0;
+
+    // GPU culling inputs, uploaded when the instance layout is rebuilt, and
+    // outputs. Draw commands are laid out like the CPU path's, but each
+    // selects its own slice of the id buffer with first_instance, since
+    // instances are appended to it concurrently. The GPU keeps its own
+    // per-instance LODs for hysteresis.
+    bool gpu_culling_ = false;
+    ResourceManager::Buffer instance_buckets_buffer_;
+    ResourceManager::Buffer gpu_cull_buckets_buffer_;
+    // PositionQuantization of each bucket's mesh, for compact vertices.
+    ResourceManager::Buffer bucket_quantization_buffer_;
+    ResourceManager::Buffer gpu_instance_lods_buffer_;
+    ResourceManager::Buffer gpu_visible_ids_buffer_;
+    ResourceManager::Buffer draw_commands_buffer_;
+    // Indexed by InstanceFormat, like instance_scatter_pipelines_.
+    vk::Pipeline gpu_cull_pipelines_[kInstanceFormatCount];
+
+    vk::Pipeline instance_scatter_pipelines_[kInstanceFormatCount];
 
     vk::DescriptorPool scene_descriptor_pool_;
-    vk::DescriptorSet scene_descriptors_;
-    ResourceManager::Buffer scene_uniform_buffer_;
+    uint32_t scene_uniform_offset_ = 0;
     std::unique_ptr<Texture> scene_environment_map_;
     std::unique_ptr<Texture> scene_irradiance_map_;
 
@@ -1,5 +1,6 @@
 #include "resource_manager.h"
 
+#include <algorithm>
 #include <iostream>
 
 #include "device.h"
@@ -77,11 +78,7 @@ ResourceManager::CreateHostBufferWithData(vk::BufferUsageFlags usage,
 }
 
 ResourceManager::Buffer
-ResourceManager::CreateDeviceBufferWithData(vk::BufferUsageFlags usage,
-                                            const void *data, size_t size) {
-  Buffer staging_buffer = CreateHostBufferWithData(
-      vk::BufferUsageFlagBits::eTransferSrc, data, size);
-
+ResourceManager::CreateDeviceBuffer(vk::BufferUsageFlags usage, size_t size) {
   vk::BufferCreateInfo buffer_create_info;
   buffer_create_info.setUsage(usage | vk::BufferUsageFlagBits::eTransferDst)
       .setSize(size)
@@ -102,7 +99,16 @@ ResourceManager::CreateDeviceBufferWithData(vk::BufferUsageFlags usage,
   vk::MemoryPropertyFlags flags =
       memory_properties_.memoryTypes[allocation_info.memoryType].propertyFlags;
 
-  Buffer result(buffer, allocation, size, flags);
+  return Buffer(buffer, allocation, size, flags);
+}
+
+ResourceManager::Buffer
+ResourceManager::CreateDeviceBufferWithData(vk::BufferUsageFlags usage,
+                                            const void *data, size_t size) {
+  Buffer staging_buffer = CreateHostBufferWithData(
+      vk::BufferUsageFlagBits::eTransferSrc, data, size);
+
+  Buffer result = CreateDeviceBuffer(usage, size);
 
   transfer_commands_.copyBuffer(staging_buffer.buffer, result.buffer,
                                 {vk::BufferCopy(0, 0, size)});
@@ -114,12 +120,13 @@ ResourceManager::CreateDeviceBufferWithData(vk::BufferUsageFlags usage,
 ResourceManager::Image
 ResourceManager::CreateImageUninitialized(vk::ImageUsageFlags usage,
                                           vk::Format format, uint32_t width,
-                                          uint32_t height, uint32_t mip_levels, vk::SampleCountFlagBits sample_count) {
+                                          uint32_t height, uint32_t mip_levels, vk::SampleCountFlagBits sample_count,
+                                          uint32_t array_layers) {
   auto image_create_info = vk::ImageCreateInfo()
                                .setImageType(vk::ImageType::e2D)
                                .setExtent(vk::Extent3D(width, height, 1))
                                .setMipLevels(mip_levels)
-                               .setArrayLayers(1)
+                               .setArrayLayers(array_layers)
                                .setFormat(format)
                                .setTiling(vk::ImageTiling::eOptimal)
                                .setInitialLayout(vk::ImageLayout::eUndefined)
@@ -200,6 +207,33 @@ void ResourceManager::UpdateHostBufferData(Buffer &buffer, const void *data,
   vmaUnmapMemory(Device::Get()->allocator(), buffer.allocation);
 }
 
+void ResourceManager::UploadToDeviceBuffer(Buffer &buffer, size_t offset,
+                                           const void *data, size_t size) {
+  Buffer staging_buffer = CreateHostBufferWithData(
+      vk::BufferUsageFlagBits::eTransferSrc, data, size);
+
+  transfer_commands_.copyBuffer(staging_buffer.buffer, buffer.buffer,
+                                {vk::BufferCopy(0, offset, size)});
+
+  staging_buffers_.emplace_back(std::move(staging_buffer));
+}
+
+void ResourceManager::CopyToDeviceBuffer(Buffer &&src, Buffer &dst,
+                                         size_t size) {
+  // src may still be the target of uploads recorded earlier in this batch.
+  transfer_commands_.pipelineBarrier(
+      vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer,
+      {},
+      {vk::MemoryBarrier(vk::AccessFlagBits::eTransferWrite,
+                         vk::AccessFlagBits::eTransferRead)},
+      {}, {});
+  transfer_commands_.copyBuffer(src.buffer, dst.buffer,
+                                {vk::BufferCopy(0, 0, size)});
+
+  // WaitForTransfers idles the device before freeing these.
+  staging_buffers_.emplace_back(std::move(src));
+}
+
 void ResourceManager::WaitForTransfers() {
   if (staging_buffers_.empty()) {
     return;
@@ -221,6 +255,103 @@ void ResourceManager::WaitForTransfers() {
   transfer_commands_.begin(begin_info);
 }
 
+void ResourceManager::InitTransientRing(size_t frame_size,
+                                        uint32_t frame_count) {
+  auto limits = Device::Get()->physical_device().getProperties().limits;
+  transient_alignment_ = std::max<size_t>(
+      {16, limits.minUniformBufferOffsetAlignment,
+       limits.minStorageBufferOffsetAlignment, limits.nonCoherentAtomSize});
+
+  ring_.clear();
+  ring_.resize(frame_count);
+  for (auto &partition : ring_) {
+    partition.buffer = CreateTransientBuffer(frame_size, &partition.mapping);
+  }
+  ring_frame_ = 0;
+}
+
+void ResourceManager::BeginFrame(uint32_t frame_index) {
+  ring_frame_ = frame_index;
+  RingPartition &partition = ring_[ring_frame_];
+  partition.head = 0;
+  partition.retired.clear();
+}
+
+ResourceManager::TransientAllocation
+ResourceManager::AllocateTransient(size_t size) {
+  RingPartition &partition = ring_[ring_frame_];
+  size_t offset = (partition.head + transient_alignment_ - 1) &
+                  ~(transient_alignment_ - 1);
+
+  if (offset + size > partition.buffer.size) {
+    // Outgrew this partition. Keep the old buffer alive until the frame
+    // retires, and carry on in one big enough for the rest of the frame.
+    FlushTransient();
+    size_t new_size = std::max(2 * partition.buffer.size, 2 * size);
+    partition.retired.emplace_back(std::move(partition.buffer));
+    partition.buffer = CreateTransientBuffer(new_size, &partition.mapping);
+    offset = 0;
+  }
+
+  partition.head = offset + size;
+  return TransientAllocation{partition.buffer.buffer, offset,
+                             static_cast<char *>(partition.mapping) + offset};
+}
+
+ResourceManager::TransientAllocation
+ResourceManager::AllocateTransientWithData(const void *data, size_t size) {
+  TransientAllocation allocation = AllocateTransient(size);
+  memcpy(allocation.data, data, size);
+  return allocation;
+}
+
+void ResourceManager::FlushTransient() {
+  RingPartition &partition = ring_[ring_frame_];
+  if (!(partition.buffer.flags & vk::MemoryPropertyFlagBits::eHostCoherent) &&
+      partition.head > 0) {
+    vmaFlushAllocation(Device::Get()->allocator(), partition.buffer.allocation,
+                       0, partition.head);
+  }
+}
+
+void ResourceManager::ReleaseAfterFrame(Buffer &&buffer) {
+  ring_[ring_frame_].retired.emplace_back(std::move(buffer));
+}
+
+ResourceManager::Buffer
+ResourceManager::CreateTransientBuffer(size_t size, void **mapping) {
+  vk::BufferCreateInfo buffer_create_info;
+  buffer_create_info
+      .setUsage(vk::BufferUsageFlagBits::eVertexBuffer |
+                vk::BufferUsageFlagBits::eIndexBuffer |
+                vk::BufferUsageFlagBits::eUniformBuffer |
+                vk::BufferUsageFlagBits::eStorageBuffer |
+                vk::BufferUsageFlagBits::eIndirectBuffer |
+                vk::BufferUsageFlagBits::eTransferSrc)
+      .setSize(size)
+      .setSharingMode(vk::SharingMode::eExclusive);
+
+  VmaAllocationCreateInfo alloc_info = {};
+  alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
+  alloc_info.flags = VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                     VMA_ALLOCATION_CREATE_MAPPED_BIT;
+
+  VkBuffer buffer;
+  VmaAllocation allocation;
+  VmaAllocationInfo allocation_info;
+  if (vmaCreateBuffer(Device::Get()->allocator(),
+                      &(const VkBufferCreateInfo &)buffer_create_info,
+                      &alloc_info, &buffer, &allocation,
+                      &allocation_info) != VK_SUCCESS) {
+    throw "Failed to create transient buffer.";
+  }
+  vk::MemoryPropertyFlags flags =
+      memory_properties_.memoryTypes[allocation_info.memoryType].propertyFlags;
+
+  *mapping = allocation_info.pMappedData;
+  return Buffer(buffer, allocation, size, flags);
+}
+
 void ResourceManager::TransitionImageLayout(vk::Image image,
                                             vk::ImageLayout before,
                                             vk::ImageLayout after,
@@ -66,6 +66,14 @@ public:
     }
   };
 
+  // A sub-allocation from the transient ring. Valid until the frame that
+  // allocated it comes around again.
+  struct TransientAllocation {
+    vk::Buffer buffer;
+    vk::DeviceSize offset;
+    void *data;
+  };
+
   ResourceManager(vk::CommandBuffer transfer_commands);
   ~ResourceManager();
 
@@ -73,13 +81,15 @@ public:
 
   Buffer CreateHostBufferWithData(vk::BufferUsageFlags usage, const void *data,
                                   size_t size);
+  Buffer CreateDeviceBuffer(vk::BufferUsageFlags usage, size_t size);
   Buffer CreateDeviceBufferWithData(vk::BufferUsageFlags usage,
                                     const void *data, size_t size);
 
   Image CreateImageUninitialized(
       vk::ImageUsageFlags usage, vk::Format format, uint32_t width,
       uint32_t height, uint32_t mip_levels = 1,
-      vk::SampleCountFlagBits sample_count = vk::SampleCountFlagBits::e1);
+      vk::SampleCountFlagBits sample_count = vk::SampleCountFlagBits::e1,
+      uint32_t array_layers = 1);
   Image CreateImageFromData(vk::ImageUsageFlags usage, vk::Format format,
                             uint32_t width, uint32_t height,
                             uint32_t mip_levels, const void *data, size_t size);
@@ -87,16 +97,48 @@ public:
                              vk::ImageLayout after, uint32_t mip_levels);
 
   void UpdateHostBufferData(Buffer &buffer, const void *data, size_t size);
+  // Both record onto the transfer commands, so the results land at the next
+  // WaitForTransfers. CopyToDeviceBuffer destroys src once the copy is done.
+  void UploadToDeviceBuffer(Buffer &buffer, size_t offset, const void *data,
+                            size_t size);
+  void CopyToDeviceBuffer(Buffer &&src, Buffer &dst, size_t size);
 
   void WaitForTransfers();
 
+  // Persistently mapped upload memory, partitioned per frame in flight. Each
+  // partition is a linear allocator that is reset by BeginFrame, which must
+  // only be called once the GPU is done with that frame's previous use.
+  void InitTransientRing(size_t frame_size, uint32_t frame_count);
+  void BeginFrame(uint32_t frame_index);
+  TransientAllocation AllocateTransient(size_t size);
+  TransientAllocation AllocateTransientWithData(const void *data, size_t size);
+  // Makes this frame's transient writes visible to the device.
+  void FlushTransient();
+  // Destroys the buffer once the current frame's fence has signaled.
+  void ReleaseAfterFrame(Buffer &&buffer);
+
 private:
+  struct RingPartition {
+    Buffer buffer;
+    void *mapping = nullptr;
+    size_t head = 0;
+    // Buffers to destroy once the frame retires: outgrown ring buffers that
+    // earlier allocations still point into, and ReleaseAfterFrame requests.
+    std::vector<Buffer> retired;
+  };
+
+  Buffer CreateTransientBuffer(size_t size, void **mapping);
+
   void GenerateMipmaps(vk::Image image, int32_t width, int32_t height,
                        uint32_t mip_levels);
 
   vk::PhysicalDeviceMemoryProperties memory_properties_;
   vk::CommandBuffer transfer_commands_;
   std::vector<Buffer> staging_buffers_;
+
+  std::vector<RingPartition> ring_;
+  uint32_t ring_frame_ = 0;
+  size_t transient_alignment_ = 16;
 };
 
 #endif // RESOURCE_MANAGER_H_
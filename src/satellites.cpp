@@ -0,0 +1,113 @@
+#include "satellites.h"
+
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SATELLITES_AVX2 1
+#endif
+
+void SatelliteIntegrator::Add(TransformStore &transforms, uint32_t handle) {
+  const glm::vec3 &position = transforms.position(handle);
+  const glm::quat &rotation = transforms.rotation(handle);
+  handles_.push_back(handle);
+  x_.push_back(position.x);
+  z_.push_back(position.z);
+  qx_.push_back(rotation.x);
+  qy_.push_back(rotation.y);
+  qz_.push_back(rotation.z);
+  qw_.push_back(rotation.w);
+}
+
+void SatelliteIntegrator::BeginStep(float dt) {
+  dt_ = dt;
+  for (uint32_t i = 0; i < kSpinCount + 8; i++) {
+    float half_angle = 0.5f * dt * (i % kSpinCount);
+    spin_y_[i] = std::sin(half_angle);
+    spin_w_[i] = std::cos(half_angle);
+  }
+}
+
+void SatelliteIntegrator::Step(TransformStore &transforms, size_t begin,
+                               size_t end) {
+  float *x = x_.data(), *z = z_.data();
+  float *qx = qx_.data(), *qy = qy_.data(), *qz = qz_.data(),
+        *qw = qw_.data();
+  const uint32_t *handles = handles_.data();
+
+  size_t i = begin;
+#if SATELLITES_AVX2
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 half_dt = _mm256_set1_ps(0.5f * dt_);
+  for (; i + 8 <= end; i += 8) {
+    // velocity = 0.5 * (z, 0, -x) / (1 + |velocity|^2)
+    __m256 px = _mm256_loadu_ps(x + i);
+    __m256 pz = _mm256_loadu_ps(z + i);
+    __m256 r2 = _mm256_add_ps(_mm256_mul_ps(px, px), _mm256_mul_ps(pz, pz));
+    __m256 s = _mm256_div_ps(half_dt, _mm256_add_ps(one, r2));
+    __m256 nx = _mm256_add_ps(px, _mm256_mul_ps(pz, s));
+    __m256 nz = _mm256_sub_ps(pz, _mm256_mul_ps(px, s));
+    _mm256_storeu_ps(x + i, nx);
+    _mm256_storeu_ps(z + i, nz);
+
+    // q * (0, sy, 0, sw)
+    uint32_t spin = (i + spin_offset_) % kSpinCount;
+    __m256 sy = _mm256_loadu_ps(spin_y_ + spin);
+    __m256 sw = _mm256_loadu_ps(spin_w_ + spin);
+    __m256 ax = _mm256_loadu_ps(qx + i);
+    __m256 ay = _mm256_loadu_ps(qy + i);
+    __m256 az = _mm256_loadu_ps(qz + i);
+    __m256 aw = _mm256_loadu_ps(qw + i);
+    __m256 bx = _mm256_sub_ps(_mm256_mul_ps(ax, sw), _mm256_mul_ps(az, sy));
+    __m256 by = _mm256_add_ps(_mm256_mul_ps(aw, sy), _mm256_mul_ps(ay, sw));
+    __m256 bz = _mm256_add_ps(_mm256_mul_ps(ax, sy), _mm256_mul_ps(az, sw));
+    __m256 bw = _mm256_sub_ps(_mm256_mul_ps(aw, sw), _mm256_mul_ps(ay, sy));
+    _mm256_storeu_ps(qx + i, bx);
+    _mm256_storeu_ps(qy + i, by);
+    _mm256_storeu_ps(qz + i, bz);
+    _mm256_storeu_ps(qw + i, bw);
+
+    // Transpose back to one (x, y, z, w) quaternion per satellite.
+    for (int half = 0; half < 2; half++) {
+      __m128 q0 = half ? _mm256_extractf128_ps(bx, 1) : _mm256_castps256_ps128(bx);
+      __m128 q1 = half ? _mm256_extractf128_ps(by, 1) : _mm256_castps256_ps128(by);
+      __m128 q2 = half ? _mm256_extractf128_ps(bz, 1) : _mm256_castps256_ps128(bz);
+      __m128 q3 = half ? _mm256_extractf128_ps(bw, 1) : _mm256_castps256_ps128(bw);
+      _MM_TRANSPOSE4_PS(q0, q1, q2, q3);
+      const uint32_t *h = handles + i + 4 * half;
+      _mm_storeu_ps(&transforms.rotation(h[0]).x, q0);
+      _mm_storeu_ps(&transforms.rotation(h[1]).x, q1);
+      _mm_storeu_ps(&transforms.rotation(h[2]).x, q2);
+      _mm_storeu_ps(&transforms.rotation(h[3]).x, q3);
+    }
+    for (size_t k = i; k < i + 8; k++) {
+      glm::vec3 &position = transforms.position(handles[k]);
+      position.x = x[k];
+      position.z = z[k];
+    }
+  }
+#endif
+  for (; i < end; i++) {
+    float r2 = x[i] * x[i] + z[i] * z[i];
+    float s = 0.5f * dt_ / (1.0f + r2);
+    float nx = x[i] + z[i] * s;
+    float nz = z[i] - x[i] * s;
+    x[i] = nx;
+    z[i] = nz;
+
+    uint32_t spin = (i + spin_offset_) % kSpinCount;
+    float sy = spin_y_[spin], sw = spin_w_[spin];
+    float ax = qx[i], ay = qy[i], az = qz[i], aw = qw[i];
+    qx[i] = ax * sw - az * sy;
+    qy[i] = aw * sy + ay * sw;
+    qz[i] = ax * sy + az * sw;
+    qw[i] = aw * sw - ay * sy;
+
+    glm::vec3 &position = transforms.position(handles[i]);
+    position.x = x[i];
+    position.z = z[i];
+    transforms.rotation(handles[i]) = glm::quat(qw[i], qx[i], qy[i], qz[i]);
+  }
+
+  transforms.MarkDirty(handles + begin, end - begin);
+}
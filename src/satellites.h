@@ -0,0 +1,50 @@
+#ifndef SATELLITES_H_
+#define SATELLITES_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "transform_store.h"
+
+// Integrates orbiting satellites from packed structure-of-arrays state, eight
+// at a time with AVX2. The integrator owns the position and rotation of every
+// satellite added to it and writes them back to the TransformStore in bulk.
+class SatelliteIntegrator {
+public:
+    // Satellite k spins about y at ((k + spin_offset) % 9) radians per second.
+    explicit SatelliteIntegrator(uint32_t spin_offset = 0)
+        : spin_offset_(spin_offset) {}
+    ~SatelliteIntegrator() = default;
+
+    void Add(TransformStore& transforms, uint32_t handle);
+
+    size_t size() const {
+        return handles_.size();
+    }
+
+    // Builds this frame's spin quaternions. Call once before stepping.
+    void BeginStep(float dt);
+
+    // Advances satellites [begin, end) by the dt given to BeginStep, then
+    // writes them to transforms and flags them dirty. Disjoint ranges may be
+    // stepped concurrently.
+    void Step(TransformStore& transforms, size_t begin, size_t end);
+
+private:
+    static constexpr uint32_t kSpinCount = 9;
+
+    uint32_t spin_offset_;
+    float dt_ = 0.0f;
+    // y and w of each spin quaternion (x and z are zero), repeated past
+    // kSpinCount so any eight consecutive satellites read one contiguous run.
+    float spin_y_[kSpinCount + 8] = {};
+    float spin_w_[kSpinCount + 8] = {};
+
+    std::vector<uint32_t> handles_;
+    // Satellites orbit in their own plane, so y never changes.
+    std::vector<float> x_, z_;
+    std::vector<float> qx_, qy_, qz_, qw_;
+};
+
+#endif // SATELLITES_H_
@@ -1,20 +1,146 @@
 #version 450
+// Built twice: as shadow.vert.spv, and with SHADOW_VIEWPORT_INDEX defined as
+// shadow_atlas.vert.spv for devices with VK_EXT_shader_viewport_index_layer.
+#ifdef SHADOW_VIEWPORT_INDEX
+#extension GL_ARB_shader_viewport_layer_array : require
+#endif
 
-// Push Constants (view data)
+#define NUM_LIGHTS 3
+
+struct Light {
+    mat4 world2light;
+    vec4 direction_angle;
+    vec3 intensity;
+    vec3 position;
+    vec2 shadow_range;
+    vec4 shadow_tile;
+};
+
+layout (set=0, binding=0) uniform Scene {
+    vec3 camera_position;
+    Light lights[NUM_LIGHTS];
+} scene;
+
+// Push Constants (view data). Mirrors DepthOnlyPushConstants.
 layout(push_constant) uniform View {
     mat4 view_proj;
+    uint light;
 } view;
 
-// Vertex data
+// Shadow ids carry their light's index in the bits above
+// SHADOW_LAYER_SHIFT, which mirrors kShadowLayerShift. With SHADOW_ATLAS,
+// every light draws at once, transforming by its world2light instead of
+// view_proj into its viewport, which covers its tile. Otherwise the pass
+// draws view.light alone and drops every other light's ids. The depth
+// prepass draws plain ids, which read as light 0.
+layout(constant_id = 2) const bool SHADOW_ATLAS = false;
+#define SHADOW_LAYER_SHIFT 28
+#define SHADOW_INSTANCE_MASK ((1u << SHADOW_LAYER_SHIFT) - 1u)
+
+// How vertices are encoded; mirrors VertexFormat.
+layout(constant_id = 0) const uint VERTEX_FORMAT = 0;
+#define VERTEX_FORMAT_COMPACT 1
+
+// Only the position stream is bound. Compact positions are unorm16 within
+// the mesh bounds.
 layout(location = 0) in vec3 in_position;
-layout(location = 1) in vec3 in_normal;
-layout(location = 2) in vec3 in_tangent;
-layout(location = 3) in vec2 in_texcoord;
 
-// Instance data
-layout(location = 4) in mat4 in_obj2world;
-layout(location = 8) in mat3 in_obj2world_normal;
+// Instance data, fetched by the instance-rate id of each visible instance.
+// InstanceData is a tightly packed mat4 + mat3, i.e. 25 floats; InstanceTrs
+// is a position, scale and rotation quaternion, i.e. 10 floats.
+layout(constant_id = 1) const uint INSTANCE_FORMAT = 0;
+#define INSTANCE_FORMAT_TRS 1
+#define INSTANCE_FLOATS 25
+#define INSTANCE_TRS_FLOATS 10
+
+layout(std430, set=0, binding=4) readonly buffer Instances {
+    float instances[];
+};
+
+layout(location = 4) in uint in_instance;
+
+// Each instance's bucket, and the box each bucket's mesh is quantized to.
+struct PositionQuantization {
+    vec4 offset;
+    vec4 scale;
+};
+
+layout(std430, set=0, binding=5) readonly buffer InstanceBuckets {
+    uint instance_buckets[];
+};
+
+layout(std430, set=0, binding=6) readonly buffer BucketQuantization {
+    PositionQuantization quantization[];
+};
+
+vec3 DecodePosition(uint instance) {
+    if (VERTEX_FORMAT != VERTEX_FORMAT_COMPACT) {
+        return in_position;
+    }
+    PositionQuantization q = quantization[instance_buckets[instance]];
+    return q.offset.xyz + q.scale.xyz * in_position;
+}
+
+mat4 InstanceObj2World(uint base) {
+    return mat4(
+        instances[base + 0], instances[base + 1], instances[base + 2], instances[base + 3],
+        instances[base + 4], instances[base + 5], instances[base + 6], instances[base + 7],
+        instances[base + 8], instances[base + 9], instances[base + 10], instances[base + 11],
+        instances[base + 12], instances[base + 13], instances[base + 14], instances[base + 15]);
+}
+
+// Rotation matrix of a unit quaternion (x, y, z, w).
+mat3 QuatToMat3(vec4 q) {
+    float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+    return mat3(
+        1.0 - 2.0 * (yy + zz), 2.0 * (xy + wz), 2.0 * (xz - wy),
+        2.0 * (xy - wz), 1.0 - 2.0 * (xx + zz), 2.0 * (yz + wx),
+        2.0 * (xz + wy), 2.0 * (yz - wx), 1.0 - 2.0 * (xx + yy));
+}
+
+// Columns of R * S, and the translation, of an InstanceTrs.
+void InstanceTrsColumns(uint base, out mat3 rotation_scale, out vec3 scale,
+                        out vec3 translation) {
+    translation = vec3(instances[base + 0], instances[base + 1], instances[base + 2]);
+    scale = vec3(instances[base + 3], instances[base + 4], instances[base + 5]);
+    vec4 q = vec4(instances[base + 6], instances[base + 7], instances[base + 8], instances[base + 9]);
+    mat3 r = QuatToMat3(q);
+    rotation_scale = mat3(r[0] * scale.x, r[1] * scale.y, r[2] * scale.z);
+}
+
+mat4 LoadObj2World(uint id) {
+    if (INSTANCE_FORMAT == INSTANCE_FORMAT_TRS) {
+        mat3 rotation_scale;
+        vec3 scale, translation;
+        InstanceTrsColumns(id * INSTANCE_TRS_FLOATS, rotation_scale, scale,
+                           translation);
+        return mat4(vec4(rotation_scale[0], 0.0), vec4(rotation_scale[1], 0.0),
+                    vec4(rotation_scale[2], 0.0), vec4(translation, 1.0));
+    }
+    return InstanceObj2World(id * INSTANCE_FLOATS);
+}
+
+// Matches basic.vert's gl_Position exactly for the depth prepass.
+invariant gl_Position;
 
 void main() {
-    gl_Position = view.view_proj * (in_obj2world * vec4(in_position, 1.0));
+    uint instance = in_instance & SHADOW_INSTANCE_MASK;
+    uint light = in_instance >> SHADOW_LAYER_SHIFT;
+    mat4 view_proj = view.view_proj;
+    if (SHADOW_ATLAS) {
+        view_proj = scene.lights[light].world2light;
+#ifdef SHADOW_VIEWPORT_INDEX
+        gl_ViewportIndex = int(light);
+#endif
+    } else if (light != view.light) {
+        // Every vertex of the instance lands on one point, so its triangles
+        // have no area and rasterize nothing.
+        gl_Position = vec4(0.0, 0.0, 0.0, 1.0);
+        return;
+    }
+
+    mat4 obj2world = LoadObj2World(instance);
+    gl_Position = view_proj * (obj2world * vec4(DecodePosition(instance), 1.0));
 }
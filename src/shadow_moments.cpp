@@ -0,0 +1,273 @@
+#include "shadow_moments.h"
+
+#include <array>
+#include <cmath>
+
+#include "constants.h"
+#include "device.h"
+#include "layouts.h"
+#include "material.h"
+#include "structures.h"
+
+namespace {
+
+constexpr vk::Format kMomentsFormat = vk::Format::eR16G16B16A16Sfloat;
+// evsm_blur.comp's workgroups are 8x8 texels of one layer.
+constexpr uint32_t kBlurGroupSize = 8;
+
+vk::ImageView CreateArrayView(vk::Image image, uint32_t mip_levels) {
+  auto create_info =
+      vk::ImageViewCreateInfo()
+          .setViewType(vk::ImageViewType::e2DArray)
+          .setFormat(kMomentsFormat)
+          .setComponents({})
+          .setImage(image)
+          .setSubresourceRange(
+              vk::ImageSubresourceRange()
+                  .setAspectMask(vk::ImageAspectFlagBits::eColor)
+                  .setBaseArrayLayer(0)
+                  .setBaseMipLevel(0)
+                  .setLayerCount(NUM_LIGHTS)
+                  .setLevelCount(mip_levels));
+  return Device::Get()->device().createImageView(create_info);
+}
+
+vk::ImageSubresourceRange MipRange(uint32_t base_level, uint32_t level_count) {
+  return vk::ImageSubresourceRange()
+      .setAspectMask(vk::ImageAspectFlagBits::eColor)
+      .setBaseMipLevel(base_level)
+      .setLevelCount(level_count)
+      .setBaseArrayLayer(0)
+      .setLayerCount(NUM_LIGHTS);
+}
+
+vk::ImageMemoryBarrier LayoutBarrier(vk::Image image,
+                                     vk::ImageSubresourceRange range,
+                                     vk::ImageLayout old_layout,
+                                     vk::ImageLayout new_layout,
+                                     vk::AccessFlags src_access,
+                                     vk::AccessFlags dst_access) {
+  return vk::ImageMemoryBarrier()
+      .setImage(image)
+      .setOldLayout(old_layout)
+      .setNewLayout(new_layout)
+      .setSrcAccessMask(src_access)
+      .setDstAccessMask(dst_access)
+      .setSrcQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+      .setDstQueueFamilyIndex(VK_QUEUE_FAMILY_IGNORED)
+      .setSubresourceRange(range);
+}
+
+} // namespace
+
+ShadowMoments::ShadowMoments(vk::ImageView shadow_atlas,
+                             vk::Sampler depth_sampler) {
+  vk::Device d = Device::Get()->device();
+  mip_levels_ =
+      static_cast<uint32_t>(std::floor(std::log2(kShadowMomentsSize))) + 1;
+
+  ResourceManager *resource_manager = ResourceManager::Get();
+  image_ = resource_manager->CreateImageUninitialized(
+      vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eSampled |
+          vk::ImageUsageFlagBits::eTransferSrc |
+          vk::ImageUsageFlagBits::eTransferDst,
+      kMomentsFormat, kShadowMomentsSize, kShadowMomentsSize, mip_levels_,
+      vk::SampleCountFlagBits::e1, NUM_LIGHTS);
+  image_view_ = CreateArrayView(image_.image, mip_levels_);
+  storage_view_ = CreateArrayView(image_.image, 1);
+
+  scratch_ = resource_manager->CreateImageUninitialized(
+      vk::ImageUsageFlagBits::eStorage, kMomentsFormat, kShadowMomentsSize,
+      kShadowMomentsSize, 1, vk::SampleCountFlagBits::e1, NUM_LIGHTS);
+  scratch_view_ = CreateArrayView(scratch_.image, 1);
+
+  auto sampler_info =
+      vk::SamplerCreateInfo()
+          .setAddressModeU(vk::SamplerAddressMode::eClampToEdge)
+          .setAddressModeV(vk::SamplerAddressMode::eClampToEdge)
+          .setMagFilter(vk::Filter::eLinear)
+          .setMinFilter(vk::Filter::eLinear)
+          .setMipmapMode(vk::SamplerMipmapMode::eLinear)
+          .setMinLod(0.0f)
+          .setMaxLod(static_cast<float>(mip_levels_))
+          .setCompareEnable(false)
+          .setAnisotropyEnable(false);
+  sampler_ = d.createSampler(sampler_info);
+
+  std::array<vk::DescriptorPoolSize, 2> pool_sizes = {
+      vk::DescriptorPoolSize()
+          .setType(vk::DescriptorType::eCombinedImageSampler)
+          .setDescriptorCount(2),
+      vk::DescriptorPoolSize()
+          .setType(vk::DescriptorType::eStorageImage)
+          .setDescriptorCount(4),
+  };
+  auto pool_info =
+      vk::DescriptorPoolCreateInfo().setPoolSizes(pool_sizes).setMaxSets(2);
+  descriptor_pool_ = d.createDescriptorPool(pool_info);
+
+  std::array<vk::DescriptorSetLayout, 2> layouts = {
+      Layouts::Get()->evsm_blur_dsl(), Layouts::Get()->evsm_blur_dsl()};
+  auto alloc_info = vk::DescriptorSetAllocateInfo()
+                        .setDescriptorPool(descriptor_pool_)
+                        .setSetLayouts(layouts);
+  auto sets = d.allocateDescriptorSets(alloc_info);
+  horizontal_descriptors_ = sets[0];
+  vertical_descriptors_ = sets[1];
+
+  // Both passes bind both storage images, so the unread source of the
+  // horizontal pass is just mip 0.
+  auto depth_info =
+      vk::DescriptorImageInfo()
+          .setImageLayout(vk::ImageLayout::eShaderReadOnlyOptimal)
+          .setImageView(shadow_atlas)
+          .setSampler(depth_sampler);
+  auto moments_info = vk::DescriptorImageInfo()
+                          .setImageLayout(vk::ImageLayout::eGeneral)
+                          .setImageView(storage_view_);
+  auto scratch_info = vk::DescriptorImageInfo()
+                          .setImageLayout(vk::ImageLayout::eGeneral)
+                          .setImageView(scratch_view_);
+  auto write = [](vk::DescriptorSet set, uint32_t binding,
+                  const vk::DescriptorImageInfo &info) {
+    return vk::WriteDescriptorSet()
+        .setDescriptorType(binding == 0
+                               ? vk::DescriptorType::eCombinedImageSampler
+                               : vk::DescriptorType::eStorageImage)
+        .setDstSet(set)
+        .setDstBinding(binding)
+        .setDstArrayElement(0)
+        .setImageInfo(info);
+  };
+  std::array<vk::WriteDescriptorSet, 6> writes = {
+      write(horizontal_descriptors_, 0, depth_info),
+      write(horizontal_descriptors_, 1, moments_info),
+      write(horizontal_descriptors_, 2, scratch_info),
+      write(vertical_descriptors_, 0, depth_info),
+      write(vertical_descriptors_, 1, scratch_info),
+      write(vertical_descriptors_, 2, moments_info),
+  };
+  d.updateDescriptorSets(writes, {});
+
+  blur_pipeline_ = GetEvsmBlurPipeline();
+}
+
+ShadowMoments::~ShadowMoments() {
+  vk::Device d = Device::Get()->device();
+  d.destroyPipeline(blur_pipeline_);
+  d.destroyDescriptorPool(descriptor_pool_);
+  d.destroySampler(sampler_);
+  d.destroyImageView(image_view_);
+  d.destroyImageView(storage_view_);
+  d.destroyImageView(scratch_view_);
+}
+
+void ShadowMoments::Build(vk::CommandBuffer commands, const Light *lights) {
+  // The shadow pass's depth writes must land before the blur reads them,
+  // and earlier frames' reads of both images must finish before they are
+  // overwritten. Their old contents are never needed.
+  auto depth_written =
+      vk::MemoryBarrier()
+          .setSrcAccessMask(vk::AccessFlagBits::eDepthStencilAttachmentWrite)
+          .setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+  std::array<vk::ImageMemoryBarrier, 2> to_general = {
+      LayoutBarrier(image_.image, MipRange(0, mip_levels_),
+                    vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral, {},
+                    vk::AccessFlagBits::eShaderRead |
+                        vk::AccessFlagBits::eShaderWrite),
+      LayoutBarrier(scratch_.image, MipRange(0, 1),
+                    vk::ImageLayout::eUndefined, vk::ImageLayout::eGeneral, {},
+                    vk::AccessFlagBits::eShaderRead |
+                        vk::AccessFlagBits::eShaderWrite),
+  };
+  commands.pipelineBarrier(vk::PipelineStageFlagBits::eLateFragmentTests |
+                               vk::PipelineStageFlagBits::eFragmentShader |
+                               vk::PipelineStageFlagBits::eComputeShader |
+                               vk::PipelineStageFlagBits::eTransfer,
+                           vk::PipelineStageFlagBits::eComputeShader, {},
+                           depth_written, {}, to_general);
+
+  uint32_t groups =
+      (kShadowMomentsSize + kBlurGroupSize - 1) / kBlurGroupSize;
+  commands.bindPipeline(vk::PipelineBindPoint::eCompute, blur_pipeline_);
+  vk::PipelineLayout layout = Layouts::Get()->evsm_blur_pipeline_layout();
+  BlurParams params;
+  for (uint32_t i = 0; i < NUM_LIGHTS; i++) {
+    params.tiles[i] = lights[i].shadow_tile * float(kShadowAtlasSize);
+    params.shadow_ranges[i] = lights[i].shadow_range;
+  }
+  for (uint32_t vertical = 0; vertical < 2; vertical++) {
+    params.vertical = vertical;
+    if (vertical) {
+      auto scratch_written =
+          vk::MemoryBarrier()
+              .setSrcAccessMask(vk::AccessFlagBits::eShaderWrite)
+              .setDstAccessMask(vk::AccessFlagBits::eShaderRead);
+      commands.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                               vk::PipelineStageFlagBits::eComputeShader, {},
+                               scratch_written, {}, {});
+    }
+    commands.bindDescriptorSets(
+        vk::PipelineBindPoint::eCompute, layout, 0,
+        vertical ? vertical_descriptors_ : horizontal_descriptors_, {});
+    commands.pushConstants(layout, vk::ShaderStageFlagBits::eCompute, 0,
+                           sizeof(params), &params);
+    commands.dispatch(groups, groups, NUM_LIGHTS);
+  }
+
+  // Downsample each level into the next, every layer at once.
+  std::array<vk::ImageMemoryBarrier, 2> to_transfer = {
+      LayoutBarrier(image_.image, MipRange(0, 1), vk::ImageLayout::eGeneral,
+                    vk::ImageLayout::eTransferSrcOptimal,
+                    vk::AccessFlagBits::eShaderWrite,
+                    vk::AccessFlagBits::eTransferRead),
+      LayoutBarrier(image_.image, MipRange(1, mip_levels_ - 1),
+                    vk::ImageLayout::eGeneral,
+                    vk::ImageLayout::eTransferDstOptimal, {},
+                    vk::AccessFlagBits::eTransferWrite),
+  };
+  commands.pipelineBarrier(vk::PipelineStageFlagBits::eComputeShader,
+                           vk::PipelineStageFlagBits::eTransfer, {}, {}, {},
+                           to_transfer);
+  int32_t level_size = static_cast<int32_t>(kShadowMomentsSize);
+  for (uint32_t level = 1; level < mip_levels_; level++) {
+    int32_t next_size = level_size > 1 ? level_size / 2 : 1;
+    auto layers = [](uint32_t mip_level) {
+      return vk::ImageSubresourceLayers()
+          .setAspectMask(vk::ImageAspectFlagBits::eColor)
+          .setMipLevel(mip_level)
+          .setBaseArrayLayer(0)
+          .setLayerCount(NUM_LIGHTS);
+    };
+    auto blit =
+        vk::ImageBlit()
+            .setSrcSubresource(layers(level - 1))
+            .setSrcOffsets({vk::Offset3D{0, 0, 0},
+                            vk::Offset3D{level_size, level_size, 1}})
+            .setDstSubresource(layers(level))
+            .setDstOffsets({vk::Offset3D{0, 0, 0},
+                            vk::Offset3D{next_size, next_size, 1}});
+    commands.blitImage(image_.image, vk::ImageLayout::eTransferSrcOptimal,
+                       image_.image, vk::ImageLayout::eTransferDstOptimal,
+                       blit, vk::Filter::eLinear);
+
+    auto level_written = LayoutBarrier(
+        image_.image, MipRange(level, 1), vk::ImageLayout::eTransferDstOptimal,
+        vk::ImageLayout::eTransferSrcOptimal, vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eTransferRead);
+    commands.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                             vk::PipelineStageFlagBits::eTransfer, {}, {}, {},
+                             level_written);
+    level_size = next_size;
+  }
+
+  auto to_shader = LayoutBarrier(
+      image_.image, MipRange(0, mip_levels_),
+      vk::ImageLayout::eTransferSrcOptimal,
+      vk::ImageLayout::eShaderReadOnlyOptimal,
+      vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eShaderRead);
+  commands.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                           vk::PipelineStageFlagBits::eFragmentShader, {}, {},
+                           {}, to_shader);
+  built_ = true;
+}
@@ -0,0 +1,74 @@
+#ifndef SHADOW_MOMENTS_H_
+#define SHADOW_MOMENTS_H_
+
+#include <cstdint>
+
+#include <vulkan/vulkan.hpp>
+
+#include "resource_manager.h"
+#include "structures.h"
+
+// Exponential variance shadow map moments of every light's tile of the
+// shadow atlas, averaged into one kShadowMomentsSize layer per light, for
+// ShadowFilter::Evsm. Unlike depth, moments can be filtered linearly, so
+// Build blurs them once per frame with a separable compute pass and
+// mip-maps them, and basic.frag then needs a single trilinear lookup per
+// light instead of a PCF kernel.
+//
+// Each texel holds exp(c d), its square, -exp(-c d) and its square for the
+// linear depth d in [-1, 1] and c = kEvsmExponent, as half floats.
+class ShadowMoments {
+public:
+    // shadow_atlas is the atlas's depth view, sampled through depth_sampler.
+    ShadowMoments(vk::ImageView shadow_atlas, vk::Sampler depth_sampler);
+    ~ShadowMoments();
+
+    // Records the rebuild of every layer from lights' tiles of the atlas,
+    // which must have just been rendered with lights' projections and be in
+    // the shader read-only layout. Leaves the moments in that layout too,
+    // for the fragment stage.
+    void Build(vk::CommandBuffer commands, const Light* lights);
+
+    // Whether Build has been recorded yet. Until then the moments are in no
+    // layout a descriptor may promise.
+    bool built() {
+        return built_;
+    }
+
+    // Every mip level, as one array layer per light.
+    vk::ImageView image_view() {
+        return image_view_;
+    }
+
+    // Trilinear and clamped to the edge.
+    vk::Sampler sampler() {
+        return sampler_;
+    }
+
+private:
+    // evsm_blur.comp's push constants.
+    struct BlurParams {
+        glm::vec4 tiles[NUM_LIGHTS];
+        glm::vec2 shadow_ranges[NUM_LIGHTS];
+        uint32_t vertical;
+    };
+
+    uint32_t mip_levels_;
+    ResourceManager::Image image_;
+    vk::ImageView image_view_;
+    // Mip 0 only, for the blur to write.
+    vk::ImageView storage_view_;
+    vk::Sampler sampler_;
+    // Holds the horizontal pass's result.
+    ResourceManager::Image scratch_;
+    vk::ImageView scratch_view_;
+
+    vk::DescriptorPool descriptor_pool_;
+    // Depth to scratch, then scratch to mip 0.
+    vk::DescriptorSet horizontal_descriptors_;
+    vk::DescriptorSet vertical_descriptors_;
+    vk::Pipeline blur_pipeline_;
+    bool built_ = false;
+};
+
+#endif // SHADOW_MOMENTS_H_
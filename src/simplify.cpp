@@ -0,0 +1,248 @@
+#include "simplify.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace {
+
+// Open borders get a plane perpendicular to their triangle, weighted well
+// above the surface planes so holes and silhouettes don't erode.
+constexpr double kBorderWeight = 10.0;
+
+// Collapses may tilt a triangle, but not past roughly 75 degrees, which
+// keeps slivers from folding over their neighbors.
+constexpr double kMinNormalCosine = 0.25;
+
+uint64_t EdgeKey(uint32_t a, uint32_t b) {
+  return a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a;
+}
+
+glm::dvec3 TriangleNormal(const glm::vec3 &p0, const glm::vec3 &p1,
+                          const glm::vec3 &p2) {
+  return glm::cross(glm::dvec3(p1) - glm::dvec3(p0),
+                    glm::dvec3(p2) - glm::dvec3(p0));
+}
+
+} // namespace
+
+MeshSimplifier::MeshSimplifier(const uint32_t *indices, size_t index_count,
+                               const glm::vec3 *positions, size_t vertex_count)
+    : positions_(positions), quadrics_(vertex_count, Quadric{}),
+      vertex_triangles_(vertex_count), versions_(vertex_count, 0),
+      collapsed_(vertex_count, 0) {
+  for (size_t i = 0; i + 3 <= index_count; i += 3) {
+    uint32_t a = indices[i], b = indices[i + 1], c = indices[i + 2];
+    if (a == b || b == c || c == a) {
+      continue;
+    }
+    triangles_.insert(triangles_.end(), {a, b, c});
+  }
+  size_t triangle_count = triangles_.size() / 3;
+  live_triangles_.assign(triangle_count, 1);
+  live_triangle_count_ = triangle_count;
+
+  std::unordered_map<uint64_t, uint32_t> edge_uses;
+  edge_uses.reserve(3 * triangle_count);
+  for (size_t t = 0; t < triangle_count; t++) {
+    const uint32_t *tri = &triangles_[3 * t];
+    glm::dvec3 normal = TriangleNormal(positions_[tri[0]], positions_[tri[1]],
+                                       positions_[tri[2]]);
+    double length = glm::length(normal);
+    if (length > 0.0) {
+      normal /= length;
+      double d = -glm::dot(normal, glm::dvec3(positions_[tri[0]]));
+      for (int k = 0; k < 3; k++) {
+        AddPlane(quadrics_[tri[k]], normal, d, 0.5 * length);
+      }
+    }
+    for (int k = 0; k < 3; k++) {
+      vertex_triangles_[tri[k]].push_back(static_cast<uint32_t>(t));
+      edge_uses[EdgeKey(tri[k], tri[(k + 1) % 3])]++;
+    }
+  }
+
+  for (size_t t = 0; t < triangle_count; t++) {
+    const uint32_t *tri = &triangles_[3 * t];
+    glm::dvec3 normal = TriangleNormal(positions_[tri[0]], positions_[tri[1]],
+                                       positions_[tri[2]]);
+    for (int k = 0; k < 3; k++) {
+      uint32_t a = tri[k], b = tri[(k + 1) % 3];
+      if (edge_uses[EdgeKey(a, b)] != 1) {
+        continue;
+      }
+      glm::dvec3 edge = glm::dvec3(positions_[b]) - glm::dvec3(positions_[a]);
+      glm::dvec3 border = glm::cross(edge, normal);
+      double length = glm::length(border);
+      if (length == 0.0) {
+        continue;
+      }
+      border /= length;
+      double d = -glm::dot(border, glm::dvec3(positions_[a]));
+      double weight = kBorderWeight * glm::dot(edge, edge);
+      AddPlane(quadrics_[a], border, d, weight);
+      AddPlane(quadrics_[b], border, d, weight);
+    }
+  }
+
+  for (const auto &edge : edge_uses) {
+    uint32_t a = static_cast<uint32_t>(edge.first >> 32);
+    uint32_t b = static_cast<uint32_t>(edge.first);
+    Push(a, b);
+    Push(b, a);
+  }
+}
+
+std::vector<uint32_t> MeshSimplifier::Simplify(size_t target_index_count) {
+  while (3 * live_triangle_count_ > target_index_count && !heap_.empty()) {
+    std::pop_heap(heap_.begin(), heap_.end());
+    Collapse collapse = heap_.back();
+    heap_.pop_back();
+
+    if (collapsed_[collapse.from] || collapsed_[collapse.to] ||
+        versions_[collapse.from] != collapse.from_version ||
+        versions_[collapse.to] != collapse.to_version) {
+      continue;
+    }
+    if (!PreservesOrientation(collapse.from, collapse.to)) {
+      continue;
+    }
+    Apply(collapse.from, collapse.to);
+    max_cost_ = std::max(max_cost_, collapse.cost);
+  }
+
+  std::vector<uint32_t> indices;
+  indices.reserve(3 * live_triangle_count_);
+  for (size_t t = 0; t < live_triangles_.size(); t++) {
+    if (live_triangles_[t]) {
+      indices.insert(indices.end(), &triangles_[3 * t], &triangles_[3 * t + 3]);
+    }
+  }
+  return indices;
+}
+
+float MeshSimplifier::error() const {
+  return static_cast<float>(glm::sqrt(max_cost_));
+}
+
+void MeshSimplifier::AddPlane(Quadric &q, const glm::dvec3 &n, double d,
+                              double weight) {
+  q.a2 += weight * n.x * n.x;
+  q.ab += weight * n.x * n.y;
+  q.ac += weight * n.x * n.z;
+  q.ad += weight * n.x * d;
+  q.b2 += weight * n.y * n.y;
+  q.bc += weight * n.y * n.z;
+  q.bd += weight * n.y * d;
+  q.c2 += weight * n.z * n.z;
+  q.cd += weight * n.z * d;
+  q.d2 += weight * d * d;
+  q.weight += weight;
+}
+
+void MeshSimplifier::Add(Quadric &q, const Quadric &other) {
+  q.a2 += other.a2;
+  q.ab += other.ab;
+  q.ac += other.ac;
+  q.ad += other.ad;
+  q.b2 += other.b2;
+  q.bc += other.bc;
+  q.bd += other.bd;
+  q.c2 += other.c2;
+  q.cd += other.cd;
+  q.d2 += other.d2;
+  q.weight += other.weight;
+}
+
+double MeshSimplifier::Evaluate(const Quadric &q, const glm::vec3 &p) {
+  double x = p.x, y = p.y, z = p.z;
+  double error = q.a2 * x * x + 2.0 * q.ab * x * y + 2.0 * q.ac * x * z +
+                 2.0 * q.ad * x + q.b2 * y * y + 2.0 * q.bc * y * z +
+                 2.0 * q.bd * y + q.c2 * z * z + 2.0 * q.cd * z + q.d2;
+  // Normalized by weight, this is a mean squared distance to the planes.
+  return q.weight > 0.0 ? std::max(error, 0.0) / q.weight : 0.0;
+}
+
+void MeshSimplifier::Push(uint32_t from, uint32_t to) {
+  Quadric q = quadrics_[from];
+  Add(q, quadrics_[to]);
+  heap_.push_back(
+      Collapse{Evaluate(q, positions_[to]), from, to, versions_[from],
+               versions_[to]});
+  std::push_heap(heap_.begin(), heap_.end());
+}
+
+bool MeshSimplifier::PreservesOrientation(uint32_t from, uint32_t to) const {
+  for (uint32_t t : vertex_triangles_[from]) {
+    if (!live_triangles_[t]) {
+      continue;
+    }
+    const uint32_t *tri = &triangles_[3 * t];
+    if (tri[0] == to || tri[1] == to || tri[2] == to) {
+      continue;
+    }
+
+    glm::vec3 p[3] = {positions_[tri[0]], positions_[tri[1]],
+                      positions_[tri[2]]};
+    glm::dvec3 before = TriangleNormal(p[0], p[1], p[2]);
+    for (int k = 0; k < 3; k++) {
+      if (tri[k] == from) {
+        p[k] = positions_[to];
+      }
+    }
+    glm::dvec3 after = TriangleNormal(p[0], p[1], p[2]);
+    if (glm::dot(before, after) <=
+        kMinNormalCosine * glm::length(before) * glm::length(after)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void MeshSimplifier::Apply(uint32_t from, uint32_t to) {
+  Add(quadrics_[to], quadrics_[from]);
+  collapsed_[from] = 1;
+  versions_[to]++;
+
+  std::vector<uint32_t> &to_triangles = vertex_triangles_[to];
+  for (uint32_t t : vertex_triangles_[from]) {
+    if (!live_triangles_[t]) {
+      continue;
+    }
+    uint32_t *tri = &triangles_[3 * t];
+    if (tri[0] == to || tri[1] == to || tri[2] == to) {
+      live_triangles_[t] = 0;
+      live_triangle_count_--;
+      continue;
+    }
+    for (int k = 0; k < 3; k++) {
+      if (tri[k] == from) {
+        tri[k] = to;
+      }
+    }
+    to_triangles.push_back(t);
+  }
+  std::vector<uint32_t>().swap(vertex_triangles_[from]);
+
+  // Drop dead entries, then requeue every edge out of the merged vertex,
+  // since its quadric changed.
+  to_triangles.erase(std::remove_if(to_triangles.begin(), to_triangles.end(),
+                                    [this](uint32_t t) {
+                                      return !live_triangles_[t];
+                                    }),
+                     to_triangles.end());
+  std::vector<uint32_t> neighbors;
+  for (uint32_t t : to_triangles) {
+    for (int k = 0; k < 3; k++) {
+      if (triangles_[3 * t + k] != to) {
+        neighbors.push_back(triangles_[3 * t + k]);
+      }
+    }
+  }
+  std::sort(neighbors.begin(), neighbors.end());
+  neighbors.erase(std::unique(neighbors.begin(), neighbors.end()),
+                  neighbors.end());
+  for (uint32_t neighbor : neighbors) {
+    Push(to, neighbor);
+    Push(neighbor, to);
+  }
+}
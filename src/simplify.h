@@ -0,0 +1,83 @@
+#ifndef SIMPLIFY_H_
+#define SIMPLIFY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Edge-collapse simplification driven by quadric error metrics (Garland and
+// Heckbert). Each vertex accumulates the planes of the triangles around it,
+// and the edge whose collapse strays least from those planes goes first.
+// Vertices only ever collapse onto a neighbor, never to a new point, so the
+// output indexes the input vertex array and keeps its attributes.
+//
+// Simplify may be called repeatedly with shrinking targets to produce a LOD
+// chain; quadrics carry over, so each level's error is measured against the
+// original surface rather than the level before.
+class MeshSimplifier {
+public:
+    // indices is a triangle list into positions. Vertices should be welded
+    // by position beforehand, since edges only connect through shared
+    // indices.
+    MeshSimplifier(const uint32_t* indices, size_t index_count,
+                   const glm::vec3* positions, size_t vertex_count);
+    ~MeshSimplifier() = default;
+
+    // Collapses edges until at most target_index_count indices are left or
+    // every remaining collapse would flip a triangle. Returns the indices
+    // of the surviving triangles.
+    std::vector<uint32_t> Simplify(size_t target_index_count);
+
+    // Root-mean-square distance to the original planes of the worst
+    // collapse so far, in the units of the input positions.
+    float error() const;
+
+private:
+    // Symmetric 4x4 plane quadric, upper triangle only, plus the total
+    // weight of the planes summed into it.
+    struct Quadric {
+        double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+        double weight;
+    };
+
+    struct Collapse {
+        double cost;
+        uint32_t from;
+        uint32_t to;
+        // Versions of both ends when queued; stale once either changes.
+        uint32_t from_version;
+        uint32_t to_version;
+
+        bool operator<(const Collapse& other) const {
+            return cost > other.cost;
+        }
+    };
+
+    static void AddPlane(Quadric& q, const glm::dvec3& normal, double d,
+                         double weight);
+    static void Add(Quadric& q, const Quadric& other);
+    static double Evaluate(const Quadric& q, const glm::vec3& p);
+
+    void Push(uint32_t from, uint32_t to);
+    // True if moving from onto to keeps every surviving triangle around
+    // from facing the way it did.
+    bool PreservesOrientation(uint32_t from, uint32_t to) const;
+    void Apply(uint32_t from, uint32_t to);
+
+    const glm::vec3* positions_;
+    std::vector<uint32_t> triangles_;
+    std::vector<uint8_t> live_triangles_;
+    size_t live_triangle_count_ = 0;
+    std::vector<Quadric> quadrics_;
+    // Triangles touching each vertex. Entries go stale as triangles die or
+    // lose the vertex, and are skipped when read.
+    std::vector<std::vector<uint32_t>> vertex_triangles_;
+    std::vector<uint32_t> versions_;
+    std::vector<uint8_t> collapsed_;
+    std::vector<Collapse> heap_;
+    double max_cost_ = 0.0;
+};
+
+#endif // SIMPLIFY_H_
@@ -7,6 +7,8 @@ struct Light {
     vec4 direction_angle;
     vec3 intensity;
     vec3 position;
+    vec2 shadow_range;
+    vec4 shadow_tile;
 };
 
 layout (set=0, binding=0) uniform Scene {
@@ -0,0 +1,136 @@
+#ifndef SLOT_MAP_H_
+#define SLOT_MAP_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Names a value in a SlotMap. The generation tells a handle to a removed
+// value apart from one to whatever was later stored in the same slot.
+struct SlotHandle {
+    static constexpr uint32_t kNull = 0xffffffff;
+
+    uint32_t slot = kNull;
+    uint32_t generation = 0;
+
+    bool operator==(const SlotHandle& other) const {
+        return slot == other.slot && generation == other.generation;
+    }
+
+    bool operator!=(const SlotHandle& other) const {
+        return !(*this == other);
+    }
+};
+
+// Generational slot map. Values are kept densely packed in one array, so
+// iterating them streams through memory; handles go through a slot table
+// that tracks where each value currently lives. Removal swaps the last value
+// into the hole, so it is O(1) and never leaves gaps, and freed slots are
+// reused without growing either array.
+//
+// Pointers and dense indices are invalidated by Insert and Remove; handles
+// stay valid until their own value is removed, after which Get returns null.
+template <typename T>
+class SlotMap {
+public:
+    SlotMap() = default;
+    ~SlotMap() = default;
+
+    // Makes room for count more values, so inserting them allocates nothing.
+    void Reserve(size_t count) {
+        values_.reserve(values_.size() + count);
+        value_slots_.reserve(values_.size() + count);
+        if (count > free_slots_.size()) {
+            slots_.reserve(slots_.size() + count - free_slots_.size());
+        }
+    }
+
+    template <typename... Args>
+    SlotHandle Insert(Args&&... args) {
+        uint32_t slot;
+        if (!free_slots_.empty()) {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+        } else {
+            slot = static_cast<uint32_t>(slots_.size());
+            slots_.push_back(Slot{});
+        }
+        slots_[slot].dense = static_cast<uint32_t>(values_.size());
+        values_.emplace_back(std::forward<Args>(args)...);
+        value_slots_.push_back(slot);
+        return SlotHandle{slot, slots_[slot].generation};
+    }
+
+    // Returns false if handle is stale.
+    bool Remove(SlotHandle handle) {
+        if (!Contains(handle)) {
+            return false;
+        }
+        Slot& slot = slots_[handle.slot];
+        uint32_t last = static_cast<uint32_t>(values_.size() - 1);
+        if (slot.dense != last) {
+            values_[slot.dense] = std::move(values_[last]);
+            value_slots_[slot.dense] = value_slots_[last];
+            slots_[value_slots_[last]].dense = slot.dense;
+        }
+        values_.pop_back();
+        value_slots_.pop_back();
+        slot.dense = SlotHandle::kNull;
+        slot.generation++;
+        free_slots_.push_back(handle.slot);
+        return true;
+    }
+
+    bool Contains(SlotHandle handle) const {
+        return handle.slot < slots_.size() &&
+               slots_[handle.slot].generation == handle.generation &&
+               slots_[handle.slot].dense != SlotHandle::kNull;
+    }
+
+    // The value named by handle, or nullptr if it has been removed.
+    T* Get(SlotHandle handle) {
+        return Contains(handle) ? &values_[slots_[handle.slot].dense] : nullptr;
+    }
+
+    const T* Get(SlotHandle handle) const {
+        return Contains(handle) ? &values_[slots_[handle.slot].dense] : nullptr;
+    }
+
+    // Handle of the value at dense index i.
+    SlotHandle handle(size_t i) const {
+        uint32_t slot = value_slots_[i];
+        return SlotHandle{slot, slots_[slot].generation};
+    }
+
+    size_t size() const {
+        return values_.size();
+    }
+
+    T& operator[](size_t i) {
+        return values_[i];
+    }
+
+    T* begin() {
+        return values_.data();
+    }
+
+    T* end() {
+        return values_.data() + values_.size();
+    }
+
+private:
+    struct Slot {
+        // Index into values_, or kNull while the slot is free.
+        uint32_t dense = SlotHandle::kNull;
+        uint32_t generation = 0;
+    };
+
+    std::vector<T> values_;
+    // Slot of each value, parallel to values_.
+    std::vector<uint32_t> value_slots_;
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> free_slots_;
+};
+
+#endif // SLOT_MAP_H_
@@ -1,59 +1,60 @@
 #include "structures.h"
 
-std::array<vk::VertexInputBindingDescription, 2>
-GetVertexInputBindingDescriptions() {
-  vk::VertexInputBindingDescription vertex_description;
-  vertex_description.setBinding(0)
-      .setStride(sizeof(Vertex))
-      .setInputRate(vk::VertexInputRate::eVertex);
+#include <glm/packing.hpp>
 
-  auto instance_description = vk::VertexInputBindingDescription()
-    .setBinding(1)
-    .setStride(sizeof(InstanceData))
-    .setInputRate(vk::VertexInputRate::eInstance);
+namespace {
 
-  return {vertex_description, instance_description};
+// Folds the lower hemisphere of the octahedron over the upper one, so a unit
+// vector maps to the [-1, 1] square and back without a seam at the equator.
+glm::vec2 EncodeOctahedral(glm::vec3 v) {
+  float length = glm::abs(v.x) + glm::abs(v.y) + glm::abs(v.z);
+  if (length == 0.0f) {
+    return glm::vec2(0.0f);
+  }
+  v /= length;
+  glm::vec2 e(v.x, v.y);
+  if (v.z < 0.0f) {
+    glm::vec2 sign(e.x >= 0.0f ? 1.0f : -1.0f, e.y >= 0.0f ? 1.0f : -1.0f);
+    e = (1.0f - glm::abs(glm::vec2(e.y, e.x))) * sign;
+  }
+  return e;
 }
 
-std::array<vk::VertexInputAttributeDescription, 11>
-GetVertexInputAttributeDescriptions() {
-  std::array<vk::VertexInputAttributeDescription, 11> result = {};
-  result[0]
-      .setBinding(0)
-      .setLocation(0)
-      .setOffset(offsetof(Vertex, position))
-      .setFormat(vk::Format::eR32G32B32Sfloat);
-  result[1]
-      .setBinding(0)
-      .setLocation(1)
-      .setOffset(offsetof(Vertex, normal))
-      .setFormat(vk::Format::eR32G32B32Sfloat);
-  result[2]
-      .setBinding(0)
-      .setLocation(2)
-      .setOffset(offsetof(Vertex, tangent))
-      .setFormat(vk::Format::eR32G32B32Sfloat);
-  result[3]
-      .setBinding(0)
-      .setLocation(3)
-      .setOffset(offsetof(Vertex, texcoord))
-      .setFormat(vk::Format::eR32G32Sfloat);
-  // mat4 (obj2world)
-  for (uint32_t i = 0; i < 4; i++) {
-      result[i+4]
-        .setBinding(1)
-        .setLocation(i+4)
-        .setOffset(sizeof(glm::vec4) * i)
-        .setFormat(vk::Format::eR32G32B32A32Sfloat);
-  }
-  // mat3 obj2world_normal
-  for (uint32_t i = 0; i < 3; i++) {
-      result[i+8]
-        .setBinding(1)
-        .setLocation(i+8)
-        .setOffset(sizeof(glm::vec4) * 4 + sizeof(glm::vec3) * i)
-        .setFormat(vk::Format::eR32G32B32Sfloat);
+glm::vec3 DecodeOctahedral(glm::vec2 e) {
+  glm::vec3 v(e.x, e.y, 1.0f - glm::abs(e.x) - glm::abs(e.y));
+  float t = glm::max(-v.z, 0.0f);
+  v.x += v.x >= 0.0f ? -t : t;
+  v.y += v.y >= 0.0f ? -t : t;
+  return glm::normalize(v);
+}
+
+} // namespace
+
+CompactVertex CompressVertex(const Vertex &vertex,
+                             const PositionQuantization &quantization) {
+  CompactVertex result;
+  for (int i = 0; i < 3; i++) {
+    float scale = quantization.scale[i];
+    float t = scale > 0.0f
+                  ? (vertex.position[i] - quantization.offset[i]) / scale
+                  : 0.0f;
+    result.position[i] =
+        static_cast<uint16_t>(glm::round(glm::clamp(t, 0.0f, 1.0f) * 65535.0f));
   }
-  
+  result.position[3] = 0;
+  result.normal = glm::packSnorm2x16(EncodeOctahedral(vertex.normal));
+  result.tangent = glm::packSnorm2x16(EncodeOctahedral(vertex.tangent));
+  result.texcoord = glm::packHalf2x16(vertex.texcoord);
   return result;
 }
+
+Vertex DecompressVertex(const CompactVertex &vertex,
+                        const PositionQuantization &quantization) {
+  glm::vec3 position =
+      glm::vec3(quantization.offset) +
+      glm::vec3(quantization.scale) * (glm::vec3(vertex.position) / 65535.0f);
+  return Vertex{position,
+                DecodeOctahedral(glm::unpackSnorm2x16(vertex.normal)),
+                DecodeOctahedral(glm::unpackSnorm2x16(vertex.tangent)),
+                glm::unpackHalf2x16(vertex.texcoord)};
+}
@@ -2,10 +2,24 @@
 #define STRUCTURES_H_
 
 #include <array>
+#include <cstddef>
+#include <cstdint>
 
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/type_precision.hpp>
 #include <vulkan/vulkan.hpp>
 
+// How a mesh's vertices are encoded in the MeshPool. Shaders read it as
+// specialization constant 0, so the values are shared with them.
+enum class VertexFormat : uint32_t {
+  // Vertex: 44 bytes of fp32.
+  Full = 0,
+  // CompactVertex: 20 bytes of quantized attributes.
+  Compact = 1,
+};
+constexpr uint32_t kVertexFormatCount = 2;
+
 struct Vertex {
   Vertex(glm::vec3 pos, glm::vec3 norm, glm::vec3 tan, glm::vec2 uv)
       : position(pos), normal(norm), tangent(tan), texcoord(uv) {}
@@ -18,13 +32,186 @@ struct Vertex {
   glm::vec2 texcoord;
 };
 
+// Maps compact positions, in [0, 1] along each axis, back into the mesh
+// bounds: position = offset + scale * stored. Mirrored in the vertex
+// shaders, which look it up per bucket.
+struct PositionQuantization {
+  glm::vec4 offset;
+  glm::vec4 scale;
+};
+
+// Position as unorm16 within the mesh bounds (w is padding), normal and
+// tangent as octahedral snorm16 pairs, and texcoord as half floats.
+struct CompactVertex {
+  glm::u16vec4 position;
+  uint32_t normal;
+  uint32_t tangent;
+  uint32_t texcoord;
+};
+static_assert(sizeof(CompactVertex) == 20, "CompactVertex must stay packed");
+
+CompactVertex CompressVertex(const Vertex& vertex,
+                             const PositionQuantization& quantization);
+Vertex DecompressVertex(const CompactVertex& vertex,
+                        const PositionQuantization& quantization);
+
+// One vertex attribute as the shaders see it. Every format feeds the same
+// four locations; only the encoding and offsets change.
+struct VertexAttribute {
+  uint32_t location;
+  vk::Format format;
+  uint32_t offset;
+};
+
+// Compile-time description of a vertex type, specialized per format. Each
+// format also has a tightly packed position stream, indexed like its
+// vertices, for passes that only need positions.
+template <typename V> struct VertexLayout;
+
+template <> struct VertexLayout<Vertex> {
+  static constexpr VertexFormat kFormat = VertexFormat::Full;
+  static constexpr size_t kAttributeCount = 4;
+  static constexpr std::array<VertexAttribute, kAttributeCount> Attributes() {
+    return {{
+        {0, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, position)},
+        {1, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, normal)},
+        {2, vk::Format::eR32G32B32Sfloat, offsetof(Vertex, tangent)},
+        {3, vk::Format::eR32G32Sfloat, offsetof(Vertex, texcoord)},
+    }};
+  }
+
+  using Position = glm::vec3;
+  static constexpr vk::Format kPositionFormat = vk::Format::eR32G32B32Sfloat;
+  static Position GetPosition(const Vertex& vertex) {
+    return vertex.position;
+  }
+};
+
+template <> struct VertexLayout<CompactVertex> {
+  static constexpr VertexFormat kFormat = VertexFormat::Compact;
+  static constexpr size_t kAttributeCount = 4;
+  static constexpr std::array<VertexAttribute, kAttributeCount> Attributes() {
+    return {{
+        {0, vk::Format::eR16G16B16A16Unorm, offsetof(CompactVertex, position)},
+        {1, vk::Format::eR16G16Snorm, offsetof(CompactVertex, normal)},
+        {2, vk::Format::eR16G16Snorm, offsetof(CompactVertex, tangent)},
+        {3, vk::Format::eR16G16Sfloat, offsetof(CompactVertex, texcoord)},
+    }};
+  }
+
+  using Position = glm::u16vec4;
+  static constexpr vk::Format kPositionFormat = vk::Format::eR16G16B16A16Unorm;
+  static Position GetPosition(const CompactVertex& vertex) {
+    return vertex.position;
+  }
+};
+
+// How per-instance transforms are laid out in the instance buffer. Shaders
+// read it as specialization constant 1, so the values are shared with them.
+enum class InstanceFormat : uint32_t {
+  // InstanceData: 100 bytes, composed on the CPU.
+  Matrices = 0,
+  // InstanceTrs: 40 bytes, expanded into matrices by the shaders.
+  Trs = 1,
+};
+constexpr uint32_t kInstanceFormatCount = 2;
+
 struct InstanceData {
     glm::mat4 obj2world;
     glm::mat3 obj2world_normal;
 };
 
-std::array<vk::VertexInputBindingDescription, 2> GetVertexInputBindingDescriptions();
-std::array<vk::VertexInputAttributeDescription, 11> GetVertexInputAttributeDescriptions();
+// Translation, non-uniform scale and rotation (x, y, z, w), tightly packed.
+struct InstanceTrs {
+    glm::vec3 position;
+    glm::vec3 scale;
+    glm::quat rotation;
+};
+static_assert(sizeof(InstanceTrs) == 40, "InstanceTrs must stay packed");
+
+constexpr size_t InstanceSize(InstanceFormat format) {
+  return format == InstanceFormat::Trs ? sizeof(InstanceTrs)
+                                       : sizeof(InstanceData);
+}
+
+// How basic.frag filters the shadow maps. Shaders read it as specialization
+// constant 3, so the values are shared with them.
+enum class ShadowFilter : uint32_t {
+  // 5x5 manual PCF: 25 nearest depth fetches and compares per light.
+  Pcf = 0,
+  // 8 Poisson taps through a comparison sampler, each a bilinear PCF
+  // lookup where the device can filter the depth format.
+  Hardware = 1,
+  // Exponential variance shadow maps: depth is warped into moments that
+  // are blurred and mip-mapped once per frame, then one trilinear lookup.
+  Evsm = 2,
+};
+constexpr uint32_t kShadowFilterCount = 3;
+
+// Binding 0 streams vertices of type V, and binding 1 the instance-rate ids
+// of visible instances; shaders fetch their transforms from a storage
+// buffer.
+template <typename V>
+std::array<vk::VertexInputBindingDescription, 2>
+GetVertexInputBindingDescriptions() {
+  return {vk::VertexInputBindingDescription(0, sizeof(V),
+                                            vk::VertexInputRate::eVertex),
+          vk::VertexInputBindingDescription(1, sizeof(uint32_t),
+                                            vk::VertexInputRate::eInstance)};
+}
+
+// V's attributes on binding 0, then the uint instance id at location 4.
+template <typename V>
+std::array<vk::VertexInputAttributeDescription,
+           VertexLayout<V>::kAttributeCount + 1>
+GetVertexInputAttributeDescriptions() {
+  std::array<vk::VertexInputAttributeDescription,
+             VertexLayout<V>::kAttributeCount + 1>
+      result = {};
+  auto attributes = VertexLayout<V>::Attributes();
+  for (size_t i = 0; i < attributes.size(); i++) {
+    result[i]
+        .setBinding(0)
+        .setLocation(attributes[i].location)
+        .setOffset(attributes[i].offset)
+        .setFormat(attributes[i].format);
+  }
+  result[attributes.size()]
+      .setBinding(1)
+      .setLocation(static_cast<uint32_t>(attributes.size()))
+      .setOffset(0)
+      .setFormat(vk::Format::eR32Uint);
+  return result;
+}
+
+// Like the above, but binding 0 streams V's positions only.
+template <typename V>
+std::array<vk::VertexInputBindingDescription, 2>
+GetPositionInputBindingDescriptions() {
+  return {vk::VertexInputBindingDescription(
+              0, sizeof(typename VertexLayout<V>::Position),
+              vk::VertexInputRate::eVertex),
+          vk::VertexInputBindingDescription(1, sizeof(uint32_t),
+                                            vk::VertexInputRate::eInstance)};
+}
+
+// The position at location 0 and the instance id at location 4.
+template <typename V>
+std::array<vk::VertexInputAttributeDescription, 2>
+GetPositionInputAttributeDescriptions() {
+  std::array<vk::VertexInputAttributeDescription, 2> result = {};
+  result[0]
+      .setBinding(0)
+      .setLocation(0)
+      .setOffset(0)
+      .setFormat(VertexLayout<V>::kPositionFormat);
+  result[1]
+      .setBinding(1)
+      .setLocation(static_cast<uint32_t>(VertexLayout<V>::kAttributeCount))
+      .setOffset(0)
+      .setFormat(vk::Format::eR32Uint);
+  return result;
+}
 
 #define NUM_LIGHTS 3
 
@@ -33,6 +220,13 @@ struct Light {
     alignas(16) glm::vec4 direction_angle;
     alignas(16) glm::vec3 intensity;
     alignas(16) glm::vec3 position;
+    // Near and far distances of world2light's depth range, which shadow
+    // frustum fitting narrows to the casters and receivers in view.
+    alignas(16) glm::vec2 shadow_range;
+    // Where the light's shadow map sits in the atlas, as fractions of it:
+    // xy = offset, zw = size. A zero size means it has no tile and casts
+    // no shadows this frame.
+    alignas(16) glm::vec4 shadow_tile;
 };
 
 struct SceneUniforms {
@@ -44,4 +238,12 @@ struct PushConstants {
     glm::mat4 view_proj;
 };
 
+// Depth-only passes also name the light a one-light-at-a-time shadow draw
+// keeps the ids of. The prepass's ids all read as light 0. Mirrors View in
+// shadow.vert.
+struct DepthOnlyPushConstants {
+    glm::mat4 view_proj;
+    uint32_t light;
+};
+
 #endif  // STRUCTURES_H_
@@ -0,0 +1,266 @@
+#include "transform_hierarchy.h"
+
+#include <algorithm>
+
+#include "constants.h"
+#include "job_system.h"
+
+void TransformHierarchy::Attach(uint32_t child, uint32_t parent,
+                                TransformStore &store) {
+  Attach(&child, 1, parent, store);
+}
+
+void TransformHierarchy::Attach(const uint32_t *children, size_t count,
+                                uint32_t parent, TransformStore &store) {
+  parents_of_.resize(store.size(), kNull);
+  std::vector<uint8_t> fresh(store.size(), 0);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t child = children[i];
+    for (uint32_t p = parent; p != kNull; p = parents_of_[p]) {
+      if (p == child) {
+        throw "Can't attach a transform under its own descendant.";
+      }
+    }
+    parents_of_[child] = parent;
+    fresh[child] = 1;
+  }
+  Rebuild(store, fresh);
+}
+
+void TransformHierarchy::Detach(uint32_t handle, TransformStore &store) {
+  if (parent(handle) == kNull) {
+    return;
+  }
+  parents_of_[handle] = kNull;
+  Rebuild(store, {});
+}
+
+void TransformHierarchy::Remove(uint32_t handle, TransformStore &store) {
+  if (!contains(handle)) {
+    return;
+  }
+  parents_of_[handle] = kNull;
+  std::replace(parents_of_.begin(), parents_of_.end(), handle, kNull);
+  Rebuild(store, {});
+}
+
+uint32_t TransformHierarchy::MarkDirty(uint32_t handle) {
+  uint32_t node = node_of_[handle];
+  if (!dirty_[node]) {
+    dirty_[node] = 1;
+    dirty_nodes_.push_back(node);
+  }
+  return node;
+}
+
+void TransformHierarchy::Rebuild(TransformStore &store,
+                                 const std::vector<uint8_t> &fresh) {
+  uint32_t handle_count = static_cast<uint32_t>(store.size());
+  parents_of_.resize(handle_count, kNull);
+
+  // Children of each handle, grouped by parent with a counting sort.
+  std::vector<uint32_t> child_start(handle_count + 1, 0);
+  for (uint32_t h = 0; h < handle_count; h++) {
+    if (parents_of_[h] != kNull) {
+      child_start[parents_of_[h] + 1]++;
+    }
+  }
+  for (uint32_t h = 0; h < handle_count; h++) {
+    child_start[h + 1] += child_start[h];
+  }
+  std::vector<uint32_t> children(child_start[handle_count]);
+  std::vector<uint32_t> cursor(child_start.begin(), child_start.end() - 1);
+  for (uint32_t h = 0; h < handle_count; h++) {
+    if (parents_of_[h] != kNull) {
+      children[cursor[parents_of_[h]]++] = h;
+    }
+  }
+
+  std::vector<uint32_t> old_node_of = std::move(node_of_);
+  std::vector<glm::vec3> old_positions = std::move(local_positions_);
+  std::vector<glm::quat> old_rotations = std::move(local_rotations_);
+  std::vector<glm::vec3> old_scales = std::move(local_scales_);
+  node_of_.assign(handle_count, kNull);
+  handles_.clear();
+  parents_.clear();
+  local_positions_.clear();
+  local_rotations_.clear();
+  local_scales_.clear();
+
+  std::vector<uint32_t> stack;
+  for (uint32_t root = 0; root < handle_count; root++) {
+    if (parents_of_[root] != kNull ||
+        child_start[root + 1] == child_start[root]) {
+      continue;
+    }
+    stack.push_back(root);
+    while (!stack.empty()) {
+      uint32_t h = stack.back();
+      stack.pop_back();
+      uint32_t node = static_cast<uint32_t>(handles_.size());
+      node_of_[h] = node;
+      handles_.push_back(h);
+      parents_.push_back(parents_of_[h] == kNull ? kNull
+                                                 : node_of_[parents_of_[h]]);
+
+      uint32_t old = h < old_node_of.size() ? old_node_of[h] : kNull;
+      bool keep = old != kNull && !(h < fresh.size() && fresh[h]);
+      local_positions_.push_back(keep ? old_positions[old]
+                                      : store.position(h));
+      local_rotations_.push_back(keep ? old_rotations[old]
+                                      : store.rotation(h));
+      local_scales_.push_back(keep ? old_scales[old] : store.scale(h));
+
+      // Reversed, so the first child comes off the stack first.
+      for (uint32_t c = child_start[h + 1]; c > child_start[h]; c--) {
+        stack.push_back(children[c - 1]);
+      }
+    }
+  }
+
+  // Preorder puts each subtree right after its root, so a subtree ends
+  // where its last descendant does.
+  uint32_t node_count = static_cast<uint32_t>(handles_.size());
+  ends_.resize(node_count);
+  for (uint32_t n = 0; n < node_count; n++) {
+    ends_[n] = n + 1;
+  }
+  for (uint32_t n = node_count; n-- > 0;) {
+    if (parents_[n] != kNull) {
+      ends_[parents_[n]] = std::max(ends_[parents_[n]], ends_[n]);
+    }
+  }
+
+  world_positions_.resize(node_count);
+  world_rotations_.resize(node_count);
+  world_scales_.resize(node_count);
+
+  // Every cached world transform is stale now, so flag each tree.
+  dirty_.assign(node_count, 0);
+  dirty_nodes_.clear();
+  for (uint32_t n = 0; n < node_count; n++) {
+    if (parents_[n] == kNull) {
+      dirty_[n] = 1;
+      dirty_nodes_.push_back(n);
+    }
+  }
+}
+
+void TransformHierarchy::Update(TransformStore &store) {
+  nodes_updated_ = 0;
+  if (handles_.empty()) {
+    return;
+  }
+
+  // Roots are moved through the store, by the app or the integrator.
+  const uint32_t *moved = store.dirty_handles();
+  size_t moved_count = store.dirty_count();
+  for (size_t i = 0; i < moved_count; i++) {
+    uint32_t handle = moved[i];
+    if (handle >= node_of_.size() || node_of_[handle] == kNull) {
+      continue;
+    }
+    uint32_t node = node_of_[handle];
+    if (parents_[node] == kNull && !dirty_[node]) {
+      dirty_[node] = 1;
+      dirty_nodes_.push_back(node);
+    }
+  }
+  if (dirty_nodes_.empty()) {
+    return;
+  }
+
+  // Every dirty node takes its whole subtree with it. Sorted, a node
+  // inside the previous run is already covered.
+  std::sort(dirty_nodes_.begin(), dirty_nodes_.end());
+  ranges_.clear();
+  uint32_t covered = 0;
+  for (uint32_t node : dirty_nodes_) {
+    dirty_[node] = 0;
+    if (node < covered) {
+      continue;
+    }
+    ranges_.push_back(Range{node, ends_[node]});
+    covered = ends_[node];
+  }
+  dirty_nodes_.clear();
+
+  // A subtree too big for one job is split below its root: the root is
+  // updated here, and its children's subtrees, which only depend on it,
+  // become ranges of their own, with small siblings grouped together.
+  for (size_t k = 0; k < ranges_.size(); k++) {
+    Range range = ranges_[k];
+    if (range.end - range.begin <= kInstanceGrain ||
+        range.end != ends_[range.begin]) {
+      continue;
+    }
+    UpdateNode(range.begin, store);
+    nodes_updated_++;
+    ranges_[k] = Range{range.begin, range.begin};
+
+    Range group{range.begin + 1, range.begin + 1};
+    for (uint32_t c = range.begin + 1; c < range.end; c = ends_[c]) {
+      if (group.end > group.begin &&
+          ends_[c] - group.begin > kInstanceGrain) {
+        ranges_.push_back(group);
+        group.begin = c;
+      }
+      group.end = ends_[c];
+    }
+    ranges_.push_back(group);
+  }
+
+  // Pack consecutive small ranges into batches of about one grain each.
+  batches_.clear();
+  batches_.push_back(0);
+  uint32_t batch_size = 0;
+  for (size_t k = 0; k < ranges_.size(); k++) {
+    batch_size += ranges_[k].end - ranges_[k].begin;
+    if (batch_size >= kInstanceGrain) {
+      batches_.push_back(static_cast<uint32_t>(k + 1));
+      nodes_updated_ += batch_size;
+      batch_size = 0;
+    }
+  }
+  if (batch_size > 0) {
+    batches_.push_back(static_cast<uint32_t>(ranges_.size()));
+    nodes_updated_ += batch_size;
+  }
+
+  JobSystem::Get()->ParallelFor(
+      0, batches_.size() - 1, 1, [&](size_t begin, size_t end, uint32_t) {
+        for (size_t b = begin; b < end; b++) {
+          for (uint32_t k = batches_[b]; k < batches_[b + 1]; k++) {
+            for (uint32_t n = ranges_[k].begin; n < ranges_[k].end; n++) {
+              UpdateNode(n, store);
+            }
+          }
+        }
+      });
+}
+
+void TransformHierarchy::UpdateNode(uint32_t node, TransformStore &store) {
+  uint32_t handle = handles_[node];
+  uint32_t parent = parents_[node];
+  if (parent == kNull) {
+    world_positions_[node] = store.position(handle);
+    world_rotations_[node] = store.rotation(handle);
+    world_scales_[node] = store.scale(handle);
+    return;
+  }
+
+  const glm::quat &q = world_rotations_[parent];
+  const glm::vec3 &s = world_scales_[parent];
+  glm::vec3 position =
+      world_positions_[parent] + q * (s * local_positions_[node]);
+  glm::quat rotation = q * local_rotations_[node];
+  glm::vec3 scale = s * local_scales_[node];
+  world_positions_[node] = position;
+  world_rotations_[node] = rotation;
+  world_scales_[node] = scale;
+
+  store.position(handle) = position;
+  store.rotation(handle) = rotation;
+  store.scale(handle) = scale;
+  store.MarkDirty(handle);
+}
@@ -0,0 +1,128 @@
+#ifndef TRANSFORM_HIERARCHY_H_
+#define TRANSFORM_HIERARCHY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "transform_store.h"
+
+// Parent/child links between TransformStore handles. Attached transforms
+// get their TRS from their parent's world transform and a local TRS kept
+// here; Update writes the resulting world TRS back to the store, so the
+// instance build and the BVH never see the hierarchy.
+//
+// Nodes are stored in depth-first order, so every subtree is one contiguous
+// run that starts with its root and each node comes after its parent. A
+// dirty node's subtree is recomputed in a single forward pass over its run,
+// and untouched runs are never visited. Tree roots are ordinary transforms
+// moved by whoever owns them; the hierarchy notices through the store's
+// dirty list.
+//
+// Composition is TRS-by-TRS: rotations and scales multiply and positions go
+// through the parent's full transform. That is exact for parents with
+// uniform scale; under non-uniform parent scale the shear a matrix product
+// would produce is dropped, as the instance formats can't carry it anyway.
+class TransformHierarchy {
+public:
+    static constexpr uint32_t kNull = 0xffffffff;
+
+    TransformHierarchy() = default;
+    ~TransformHierarchy() = default;
+
+    // Parents child to parent. The child's TRS in the store at the time of
+    // the call becomes its local transform relative to parent. Throws if
+    // parent is child or one of its descendants.
+    void Attach(uint32_t child, uint32_t parent, TransformStore& store);
+    // Attaches count children at once, reordering the arrays only once.
+    void Attach(const uint32_t* children, size_t count, uint32_t parent,
+                TransformStore& store);
+
+    // Makes handle a root again. It keeps its last world transform.
+    void Detach(uint32_t handle, TransformStore& store);
+
+    // Drops handle from the hierarchy before it is freed. Its children
+    // become roots and keep their last world transforms.
+    void Remove(uint32_t handle, TransformStore& store);
+
+    uint32_t parent(uint32_t handle) const {
+        return handle < parents_of_.size() ? parents_of_[handle] : kNull;
+    }
+
+    bool contains(uint32_t handle) const {
+        return handle < node_of_.size() && node_of_[handle] != kNull;
+    }
+
+    size_t size() const {
+        return handles_.size();
+    }
+
+    // The local transform of an attached handle. These flag its subtree for
+    // the next Update and must not be called from jobs.
+    glm::vec3& local_position(uint32_t handle) {
+        return local_positions_[MarkDirty(handle)];
+    }
+
+    glm::quat& local_rotation(uint32_t handle) {
+        return local_rotations_[MarkDirty(handle)];
+    }
+
+    glm::vec3& local_scale(uint32_t handle) {
+        return local_scales_[MarkDirty(handle)];
+    }
+
+    // Recomputes the world transforms of every subtree whose root moved in
+    // the store or whose local transforms changed, writes them to the store
+    // and flags them dirty there. Call once per frame before the store's
+    // dirty list is consumed. Large subtrees are split among their
+    // children and the pieces run as jobs.
+    void Update(TransformStore& store);
+
+    // Nodes recomputed by the last Update.
+    size_t nodes_updated() const {
+        return nodes_updated_;
+    }
+
+private:
+    // A run of nodes whose parents are all either earlier in the run or
+    // already up to date.
+    struct Range {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    uint32_t MarkDirty(uint32_t handle);
+    // Recomputes the depth-first order from parents_of_. Nodes in fresh get
+    // their local transform from the store; the rest keep theirs.
+    void Rebuild(TransformStore& store, const std::vector<uint8_t>& fresh);
+    void UpdateNode(uint32_t node, TransformStore& store);
+
+    // Indexed by store handle.
+    std::vector<uint32_t> parents_of_;
+    std::vector<uint32_t> node_of_;
+
+    // Indexed by node, in depth-first order.
+    std::vector<uint32_t> handles_;
+    std::vector<uint32_t> parents_;
+    // One past the last node of each node's subtree.
+    std::vector<uint32_t> ends_;
+    std::vector<glm::vec3> local_positions_;
+    std::vector<glm::quat> local_rotations_;
+    std::vector<glm::vec3> local_scales_;
+    // Cached world transforms, read by children.
+    std::vector<glm::vec3> world_positions_;
+    std::vector<glm::quat> world_rotations_;
+    std::vector<glm::vec3> world_scales_;
+    std::vector<uint8_t> dirty_;
+    std::vector<uint32_t> dirty_nodes_;
+
+    std::vector<Range> ranges_;
+    // Ranges [batches_[i], batches_[i + 1]) form one job.
+    std::vector<uint32_t> batches_;
+    size_t nodes_updated_ = 0;
+};
+
+#endif // TRANSFORM_HIERARCHY_H_
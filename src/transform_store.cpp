@@ -0,0 +1,306 @@
+#include "transform_store.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TRANSFORM_STORE_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TRANSFORM_STORE_SSE 1
+#endif
+
+uint32_t TransformStore::Allocate() {
+  uint32_t handle;
+  if (!free_handles_.empty()) {
+    handle = free_handles_.back();
+    free_handles_.pop_back();
+  } else {
+    handle = static_cast<uint32_t>(positions_.size());
+    positions_.emplace_back();
+    rotations_.emplace_back();
+    scales_.emplace_back();
+    dirty_.push_back(0);
+    dirty_handles_.push_back(0);
+  }
+
+  positions_[handle] = glm::vec3(0.0f);
+  rotations_[handle] = glm::quat(glm::vec3(0.0f));
+  scales_[handle] = glm::vec3(1.0f);
+  MarkDirty(handle);
+  return handle;
+}
+
+void TransformStore::Free(uint32_t handle) { free_handles_.push_back(handle); }
+
+void TransformStore::Reserve(size_t count) {
+  if (count <= free_handles_.size()) {
+    return;
+  }
+  size_t capacity = positions_.size() + count - free_handles_.size();
+  positions_.reserve(capacity);
+  rotations_.reserve(capacity);
+  scales_.reserve(capacity);
+  dirty_.reserve(capacity);
+  dirty_handles_.reserve(capacity);
+  free_handles_.reserve(capacity);
+}
+
+void TransformStore::MarkDirty(const uint32_t *handles, size_t count) {
+  size_t clean = 0;
+  for (size_t i = 0; i < count; i++) {
+    clean += !dirty_[handles[i]];
+  }
+  if (clean == 0) {
+    return;
+  }
+
+  size_t slot = dirty_count_.fetch_add(clean, std::memory_order_relaxed);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t handle = handles[i];
+    if (!dirty_[handle]) {
+      dirty_[handle] = 1;
+      dirty_handles_[slot++] = handle;
+    }
+  }
+}
+
+void TransformStore::ClearDirty() {
+  size_t count = dirty_count();
+  for (size_t i = 0; i < count; i++) {
+    dirty_[dirty_handles_[i]] = 0;
+  }
+  dirty_count_ = 0;
+}
+
+namespace {
+
+void ComposeOne(const glm::vec3 &t, const glm::quat &q, const glm::vec3 &s,
+                InstanceData *out) {
+  float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+  float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+  float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+  glm::vec3 r0(1.0f - 2.0f * (yy + zz), 2.0f * (xy + wz), 2.0f * (xz - wy));
+  glm::vec3 r1(2.0f * (xy - wz), 1.0f - 2.0f * (xx + zz), 2.0f * (yz + wx));
+  glm::vec3 r2(2.0f * (xz + wy), 2.0f * (yz - wx), 1.0f - 2.0f * (xx + yy));
+
+  out->obj2world[0] = glm::vec4(r0 * s.x, 0.0f);
+  out->obj2world[1] = glm::vec4(r1 * s.y, 0.0f);
+  out->obj2world[2] = glm::vec4(r2 * s.z, 0.0f);
+  out->obj2world[3] = glm::vec4(t, 1.0f);
+  out->obj2world_normal[0] = r0 / s.x;
+  out->obj2world_normal[1] = r1 / s.y;
+  out->obj2world_normal[2] = r2 / s.z;
+}
+
+#if TRANSFORM_STORE_SSE
+
+// Lane-width agnostic TRS math. m receives the columns of R * S and n the
+// columns of R * S^-1, each as [column][row] with one object per lane.
+template <typename S>
+void ComposeLanes(typename S::V qx, typename S::V qy, typename S::V qz,
+                  typename S::V qw, const typename S::V s[3],
+                  typename S::V m[3][3], typename S::V n[3][3]) {
+  using V = typename S::V;
+  const V one = S::set1(1.0f);
+  const V two = S::set1(2.0f);
+
+  V xx = S::mul(qx, qx), yy = S::mul(qy, qy), zz = S::mul(qz, qz);
+  V xy = S::mul(qx, qy), xz = S::mul(qx, qz), yz = S::mul(qy, qz);
+  V wx = S::mul(qw, qx), wy = S::mul(qw, qy), wz = S::mul(qw, qz);
+
+  V r[3][3];
+  r[0][0] = S::sub(one, S::mul(two, S::add(yy, zz)));
+  r[0][1] = S::mul(two, S::add(xy, wz));
+  r[0][2] = S::mul(two, S::sub(xz, wy));
+  r[1][0] = S::mul(two, S::sub(xy, wz));
+  r[1][1] = S::sub(one, S::mul(two, S::add(xx, zz)));
+  r[1][2] = S::mul(two, S::add(yz, wx));
+  r[2][0] = S::mul(two, S::add(xz, wy));
+  r[2][1] = S::mul(two, S::sub(yz, wx));
+  r[2][2] = S::sub(one, S::mul(two, S::add(xx, yy)));
+
+  for (int c = 0; c < 3; c++) {
+    V inv_s = S::div(one, s[c]);
+    for (int k = 0; k < 3; k++) {
+      m[c][k] = S::mul(r[c][k], s[c]);
+      n[c][k] = S::mul(r[c][k], inv_s);
+    }
+  }
+}
+
+struct Sse {
+  using V = __m128;
+  static V add(V a, V b) { return _mm_add_ps(a, b); }
+  static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+  static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+  static V div(V a, V b) { return _mm_div_ps(a, b); }
+  static V set1(float f) { return _mm_set1_ps(f); }
+};
+
+void Store3(float *dst, __m128 v) {
+  _mm_store_sd(reinterpret_cast<double *>(dst), _mm_castps_pd(v));
+  _mm_store_ss(dst + 2, _mm_movehl_ps(v, v));
+}
+
+// Transposes four objects' worth of lanes back into InstanceData structs.
+void Store4(const __m128 m[3][3], const __m128 n[3][3], const __m128 t[3],
+            InstanceData *out) {
+  const __m128 zero = _mm_setzero_ps();
+  for (int c = 0; c < 3; c++) {
+    __m128 a = m[c][0], b = m[c][1], d = m[c][2], e = zero;
+    _MM_TRANSPOSE4_PS(a, b, d, e);
+    _mm_storeu_ps(&out[0].obj2world[c][0], a);
+    _mm_storeu_ps(&out[1].obj2world[c][0], b);
+    _mm_storeu_ps(&out[2].obj2world[c][0], d);
+    _mm_storeu_ps(&out[3].obj2world[c][0], e);
+  }
+  {
+    __m128 a = t[0], b = t[1], d = t[2], e = _mm_set1_ps(1.0f);
+    _MM_TRANSPOSE4_PS(a, b, d, e);
+    _mm_storeu_ps(&out[0].obj2world[3][0], a);
+    _mm_storeu_ps(&out[1].obj2world[3][0], b);
+    _mm_storeu_ps(&out[2].obj2world[3][0], d);
+    _mm_storeu_ps(&out[3].obj2world[3][0], e);
+  }
+  for (int c = 0; c < 3; c++) {
+    __m128 a = n[c][0], b = n[c][1], d = n[c][2], e = zero;
+    _MM_TRANSPOSE4_PS(a, b, d, e);
+    Store3(&out[0].obj2world_normal[c][0], a);
+    Store3(&out[1].obj2world_normal[c][0], b);
+    Store3(&out[2].obj2world_normal[c][0], d);
+    Store3(&out[3].obj2world_normal[c][0], e);
+  }
+}
+
+#endif // TRANSFORM_STORE_SSE
+
+#if TRANSFORM_STORE_AVX2
+
+struct Avx {
+  using V = __m256;
+  static V add(V a, V b) { return _mm256_add_ps(a, b); }
+  static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+  static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+  static V div(V a, V b) { return _mm256_div_ps(a, b); }
+  static V set1(float f) { return _mm256_set1_ps(f); }
+};
+
+// Loads eight 4-float rows and returns them as four 8-lane columns, like
+// culling.cpp's CullAvx2: hardware gathers are slow on several CPUs, so
+// lanes are assembled from 16-byte loads and transposes instead.
+void Transpose8x4(const float *r0, const float *r1, const float *r2,
+                  const float *r3, const float *r4, const float *r5,
+                  const float *r6, const float *r7, __m256 &c0, __m256 &c1,
+                  __m256 &c2, __m256 &c3) {
+  __m256 a = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r0)),
+                                  _mm_loadu_ps(r4), 1);
+  __m256 b = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r1)),
+                                  _mm_loadu_ps(r5), 1);
+  __m256 c = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r2)),
+                                  _mm_loadu_ps(r6), 1);
+  __m256 d = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(r3)),
+                                  _mm_loadu_ps(r7), 1);
+  __m256 ab_lo = _mm256_unpacklo_ps(a, b), ab_hi = _mm256_unpackhi_ps(a, b);
+  __m256 cd_lo = _mm256_unpacklo_ps(c, d), cd_hi = _mm256_unpackhi_ps(c, d);
+  c0 = _mm256_shuffle_ps(ab_lo, cd_lo, _MM_SHUFFLE(1, 0, 1, 0));
+  c1 = _mm256_shuffle_ps(ab_lo, cd_lo, _MM_SHUFFLE(3, 2, 3, 2));
+  c2 = _mm256_shuffle_ps(ab_hi, cd_hi, _MM_SHUFFLE(1, 0, 1, 0));
+  c3 = _mm256_shuffle_ps(ab_hi, cd_hi, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+__m256 Load8(const glm::vec3 *v, const uint32_t *h, int c) {
+  return _mm256_setr_ps(v[h[0]][c], v[h[1]][c], v[h[2]][c], v[h[3]][c],
+                        v[h[4]][c], v[h[5]][c], v[h[6]][c], v[h[7]][c]);
+}
+
+size_t ComposeAvx2(const TransformStore &store, const uint32_t *handles,
+                   size_t count, InstanceData *out) {
+  const glm::vec3 *p = store.positions();
+  const glm::quat *q = store.rotations();
+  const glm::vec3 *s = store.scales();
+
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const uint32_t *h = handles + i;
+    __m256 qx, qy, qz, qw;
+    Transpose8x4(&q[h[0]].x, &q[h[1]].x, &q[h[2]].x, &q[h[3]].x, &q[h[4]].x,
+                 &q[h[5]].x, &q[h[6]].x, &q[h[7]].x, qx, qy, qz, qw);
+    __m256 scale[3] = {Load8(s, h, 0), Load8(s, h, 1), Load8(s, h, 2)};
+    __m256 t[3] = {Load8(p, h, 0), Load8(p, h, 1), Load8(p, h, 2)};
+
+    __m256 m[3][3], n[3][3];
+    ComposeLanes<Avx>(qx, qy, qz, qw, scale, m, n);
+
+    __m128 lo_m[3][3], hi_m[3][3], lo_n[3][3], hi_n[3][3], lo_t[3], hi_t[3];
+    for (int c = 0; c < 3; c++) {
+      for (int k = 0; k < 3; k++) {
+        lo_m[c][k] = _mm256_castps256_ps128(m[c][k]);
+        hi_m[c][k] = _mm256_extractf128_ps(m[c][k], 1);
+        lo_n[c][k] = _mm256_castps256_ps128(n[c][k]);
+        hi_n[c][k] = _mm256_extractf128_ps(n[c][k], 1);
+      }
+      lo_t[c] = _mm256_castps256_ps128(t[c]);
+      hi_t[c] = _mm256_extractf128_ps(t[c], 1);
+    }
+    Store4(lo_m, lo_n, lo_t, out + i);
+    Store4(hi_m, hi_n, hi_t, out + i + 4);
+  }
+  return i;
+}
+
+#endif // TRANSFORM_STORE_AVX2
+
+} // namespace
+
+void ComposeInstanceData(const TransformStore &store, const uint32_t *handles,
+                         size_t count, InstanceData *out) {
+  const glm::vec3 *positions = store.positions();
+  const glm::quat *rotations = store.rotations();
+  const glm::vec3 *scales = store.scales();
+
+  size_t i = 0;
+#if TRANSFORM_STORE_AVX2
+  i = ComposeAvx2(store, handles, count, out);
+#endif
+#if TRANSFORM_STORE_SSE
+  for (; i + 4 <= count; i += 4) {
+    const uint32_t *h = handles + i;
+    __m128 qx = _mm_loadu_ps(&rotations[h[0]].x);
+    __m128 qy = _mm_loadu_ps(&rotations[h[1]].x);
+    __m128 qz = _mm_loadu_ps(&rotations[h[2]].x);
+    __m128 qw = _mm_loadu_ps(&rotations[h[3]].x);
+    _MM_TRANSPOSE4_PS(qx, qy, qz, qw);
+
+    __m128 s[3], t[3];
+    for (int c = 0; c < 3; c++) {
+      s[c] = _mm_set_ps(scales[h[3]][c], scales[h[2]][c], scales[h[1]][c],
+                        scales[h[0]][c]);
+      t[c] = _mm_set_ps(positions[h[3]][c], positions[h[2]][c],
+                        positions[h[1]][c], positions[h[0]][c]);
+    }
+
+    __m128 m[3][3], n[3][3];
+    ComposeLanes<Sse>(qx, qy, qz, qw, s, m, n);
+    Store4(m, n, t, out + i);
+  }
+#endif
+  for (; i < count; i++) {
+    uint32_t h = handles[i];
+    ComposeOne(positions[h], rotations[h], scales[h], out + i);
+  }
+}
+
+void GatherInstanceTrs(const TransformStore &store, const uint32_t *handles,
+                       size_t count, InstanceTrs *out) {
+  const glm::vec3 *positions = store.positions();
+  const glm::quat *rotations = store.rotations();
+  const glm::vec3 *scales = store.scales();
+  for (size_t i = 0; i < count; i++) {
+    uint32_t h = handles[i];
+    out[i].position = positions[h];
+    out[i].scale = scales[h];
+    out[i].rotation = rotations[h];
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef TRANSFORM_STORE_H_
+#define TRANSFORM_STORE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "structures.h"
+
+// Structure-of-arrays storage for object transforms. Each object owns a
+// handle into the position, rotation and scale arrays, so the per-frame
+// instance build streams through contiguous memory instead of chasing one
+// heap allocation per object.
+class TransformStore {
+public:
+    TransformStore() = default;
+    ~TransformStore() = default;
+
+    uint32_t Allocate();
+    void Free(uint32_t handle);
+    // Makes room for count more handles, so allocating them reallocates
+    // none of the arrays.
+    void Reserve(size_t count);
+
+    glm::vec3& position(uint32_t handle) {
+        return positions_[handle];
+    }
+
+    glm::quat& rotation(uint32_t handle) {
+        return rotations_[handle];
+    }
+
+    glm::vec3& scale(uint32_t handle) {
+        return scales_[handle];
+    }
+
+    size_t size() const {
+        return positions_.size();
+    }
+
+    // Flags a transform as changed since the last instance upload. Jobs may
+    // call this concurrently as long as no two touch the same handle.
+    void MarkDirty(uint32_t handle) {
+        if (!dirty_[handle]) {
+            dirty_[handle] = 1;
+            dirty_handles_[dirty_count_.fetch_add(
+                1, std::memory_order_relaxed)] = handle;
+        }
+    }
+
+    // Bulk MarkDirty that reserves space in the dirty list once.
+    void MarkDirty(const uint32_t* handles, size_t count);
+
+    const uint32_t* dirty_handles() const {
+        return dirty_handles_.data();
+    }
+
+    size_t dirty_count() const {
+        return dirty_count_.load(std::memory_order_relaxed);
+    }
+
+    void ClearDirty();
+
+    const glm::vec3* positions() const {
+        return positions_.data();
+    }
+
+    const glm::quat* rotations() const {
+        return rotations_.data();
+    }
+
+    const glm::vec3* scales() const {
+        return scales_.data();
+    }
+
+private:
+    std::vector<glm::vec3> positions_;
+    std::vector<glm::quat> rotations_;
+    std::vector<glm::vec3> scales_;
+    std::vector<uint8_t> dirty_;
+    // Sized to hold every handle so MarkDirty never reallocates.
+    std::vector<uint32_t> dirty_handles_;
+    std::atomic<size_t> dirty_count_{0};
+    std::vector<uint32_t> free_handles_;
+};
+
+// Composes obj2world = T * R * S for each handle and writes it to out[i].
+// The normal matrix is derived analytically as R * S^-1, which equals the
+// inverse-transpose of the upper 3x3 for unit rotations.
+void ComposeInstanceData(const TransformStore& store, const uint32_t* handles,
+                         size_t count, InstanceData* out);
+
+// Copies each handle's TRS to out[i]; the shaders build the matrices.
+void GatherInstanceTrs(const TransformStore& store, const uint32_t* handles,
+                       size_t count, InstanceTrs* out);
+
+#endif  // TRANSFORM_STORE_H_